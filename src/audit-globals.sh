@@ -33,7 +33,9 @@ sed '
   /^crypt bctx$/d
   /^crypt crypto_initialized$/d
   /^crypt crypto_errs_initialized$/d
+  /^dnscache the_dns_cache$/d
   /^main allow_kq$/d
+  /^main config_file$/d
   /^main daemon_mode$/d
   /^main handle_signal_cb(int, short, void\*)::got_sigint$/d
   /^main pidfile_name$/d
@@ -41,6 +43,8 @@ sed '
   /^main the_event_base$/d
   /^network listeners$/d
   /^rng rng$/d
+  /^steg\/http_resp date_cache$/d
+  /^steg\/http_resp resp_templates$/d
   /^subprocess-unix already_waited$/d
   /^util log_dest$/d
   /^util log_min_sev$/d
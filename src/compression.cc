@@ -70,6 +70,20 @@ compress(const uint8_t *source, size_t slen,
   return strm.total_out;
 }
 
+size_t
+compress_bound(size_t slen, compression_format fmt)
+{
+  log_assert(fmt == c_format_zlib || fmt == c_format_gzip);
+
+  // compressBound() allows for the 6 bytes of zlib header and trailer;
+  // a gzip header and trailer take 18 bytes (we never emit the optional
+  // fields).
+  size_t bound = compressBound(slen);
+  if (fmt == c_format_gzip)
+    bound += 18 - 6;
+  return bound;
+}
+
 ssize_t
 decompress(const uint8_t *source, size_t slen, uint8_t *dest, size_t dlen)
 {
@@ -92,8 +106,13 @@ decompress(const uint8_t *source, size_t slen, uint8_t *dest, size_t dlen)
 
   ret = inflate(&strm, Z_FINISH);
   if (ret == Z_BUF_ERROR) {
+    // Either the output is full, or the input ran out before the end
+    // of the compressed data; only the first calls for more space.
+    bool full = strm.avail_out == 0;
+    if (!full)
+      log_warn("decompression failure: input truncated");
     inflateEnd(&strm);
-    return -2; // need more space
+    return full ? -2 : -1;
   }
   if (ret != Z_STREAM_END) {
     log_warn("decompression failure: %s", strm.msg);
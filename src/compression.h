@@ -22,12 +22,21 @@ ssize_t compress(const uint8_t *source, size_t slen,
                  uint8_t *dest, size_t dlen,
                  compression_format fmt);
 
+/**
+ * Return an upper bound on the size of the output of compress() for
+ * SLEN bytes of input in format FMT.  A destination buffer of this
+ * size is always large enough.
+ */
+size_t compress_bound(size_t slen, compression_format fmt);
+
 /**
  * Decompress SLEN bytes of data from the buffer at SOURCE into the
  * buffer at DEST.  There are DLEN bytes of available space at the
  * destination.  Automatically detects the compression format in use.
  *
- * Returns the amount of data actually written to DEST, or -1 on error.
+ * Returns the amount of data actually written to DEST; -2 if DEST is
+ * too small to hold it all; or -1 on any other error, including
+ * SOURCE ending before the compressed data does.
  */
 ssize_t decompress(const uint8_t *source, size_t slen,
                    uint8_t *dest, size_t dlen);
@@ -10,14 +10,58 @@
 
 #include <tr1/unordered_set>
 
+#include <time.h>
+
 #include <event2/event.h>
 #include <event2/buffer.h>
 
 using std::tr1::unordered_set;
 
 static void close_cleanup_cb(evutil_socket_t, short, void *);
+static void timer_wheel_cb(evutil_socket_t, short, void *);
+
+/* The timer wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+   slots each.  A slot at level L covers 64^L ticks, so the four
+   levels between them reach about 46 hours ahead; timers further out
+   than that sit in the top level until they come into range.  Timers
+   at level 0 are run when their slot comes up; those at higher levels
+   are moved down a level (cascaded) when theirs does. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
 
 namespace {
+struct timer_wheel
+{
+  conn_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  /** Bitmaps of the non-empty slots at each level. */
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  /** All timers due at or before this tick have been run. */
+  uint64_t now;
+  /** Tick for which 'tick' is scheduled; meaningless if not pending. */
+  uint64_t wakeup;
+  /** Most recent reading of the clock, in milliseconds; the clock is
+      not allowed to run backward. */
+  uint64_t last_ms;
+  size_t count;
+  /** Where the time comes from; see conn_set_clock. */
+  uint64_t (*source)(void);
+
+  struct event_base *base;
+  /** The one libevent timer that drives the wheel. */
+  struct event *tick;
+
+  timer_wheel(struct event_base *evbase);
+  ~timer_wheel();
+
+  uint64_t clock();
+  void insert(conn_timer *t);
+  void remove(conn_timer *t);
+  void cascade(unsigned int level, unsigned int slot);
+  void run(uint64_t target);
+  void schedule();
+};
+
 struct conn_global_state
 {
   /** All active connections.  */
@@ -55,6 +99,9 @@ struct conn_global_state
       the last one (of either) is closed. */
   bool shutting_down;
 
+  /** Deadlines for all connections and circuits. */
+  timer_wheel timers;
+
   conn_global_state(struct event_base *evbase);
   ~conn_global_state();
 };
@@ -63,7 +110,8 @@ conn_global_state::conn_global_state(struct event_base *evbase)
   : the_event_base(evbase),
     close_cleanup(0),
     last_conn_serial(0), last_ckt_serial(0),
-    shutting_down(false)
+    shutting_down(false),
+    timers(evbase)
 {
   close_cleanup = evtimer_new(evbase, close_cleanup_cb, this);
   log_assert(close_cleanup);
@@ -82,8 +130,200 @@ conn_global_state::~conn_global_state()
   event_free(close_cleanup);
 }
 
+/* Milliseconds by the monotonic clock.  Without one, fall back on
+   the system clock; clock() at least keeps that from running
+   backward, but timers stall if it is set back, and fire early if it
+   is set forward. */
+static uint64_t
+monotonic_ms(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+  struct timeval tv;
+  evutil_gettimeofday(&tv, 0);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+timer_wheel::timer_wheel(struct event_base *evbase)
+  : now(0), wakeup(0), last_ms(0), count(0), source(monotonic_ms),
+    base(evbase)
+{
+  memset(slots, 0, sizeof slots);
+  memset(occupied, 0, sizeof occupied);
+  tick = evtimer_new(evbase, timer_wheel_cb, this);
+  log_assert(tick);
+  now = clock();
+}
+
+timer_wheel::~timer_wheel()
+{
+  // Leave any timers still armed looking disarmed, so that they can
+  // be destroyed safely later.
+  for (unsigned int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+    for (unsigned int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+      for (conn_timer *t = slots[l][i]; t; t = t->next)
+        t->pprev = 0;
+  event_free(tick);
+}
+
+/* The current time, in ticks. */
+uint64_t
+timer_wheel::clock()
+{
+  uint64_t ms = source();
+  if (ms < last_ms)
+    ms = last_ms;
+  last_ms = ms;
+  return ms / CONN_TIMER_TICK_MS;
+}
+
+void
+timer_wheel::insert(conn_timer *t)
+{
+  // Only a timer being cascaded can be due in the current tick; it
+  // goes into the level-0 slot that is about to be run.
+  log_assert(t->expires >= now);
+
+  uint64_t delta = t->expires - now;
+  uint64_t when = t->expires;
+  unsigned int level = 0;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))
+    level++;
+  if (delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+    when = now + ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+  unsigned int slot =
+    (when >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  conn_timer **head = &slots[level][slot];
+
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  t->where = level * TIMER_WHEEL_SLOTS + slot;
+  occupied[level] |= (uint64_t)1 << slot;
+  count++;
+}
+
+void
+timer_wheel::remove(conn_timer *t)
+{
+  log_assert(t->pprev);
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+  count--;
+
+  unsigned int level = t->where / TIMER_WHEEL_SLOTS;
+  unsigned int slot = t->where % TIMER_WHEEL_SLOTS;
+  if (!slots[level][slot])
+    occupied[level] &= ~((uint64_t)1 << slot);
+}
+
+void
+timer_wheel::cascade(unsigned int level, unsigned int slot)
+{
+  while (conn_timer *t = slots[level][slot]) {
+    remove(t);
+    insert(t);
+  }
+}
+
+/* Run everything due up to and including tick TARGET. */
+void
+timer_wheel::run(uint64_t target)
+{
+  while (now < target) {
+    if (count == 0) {
+      now = target;
+      break;
+    }
+
+    // With nothing at level 0, skip straight to the next cascade.
+    if (!occupied[0]) {
+      uint64_t next = ((now >> TIMER_WHEEL_BITS) + 1) << TIMER_WHEEL_BITS;
+      if (next > target) {
+        now = target;
+        break;
+      }
+      now = next - 1;
+    }
+
+    now++;
+    for (unsigned int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+      if (now & (((uint64_t)1 << (TIMER_WHEEL_BITS * l)) - 1))
+        break;
+      cascade(l, (now >> (TIMER_WHEEL_BITS * l)) & (TIMER_WHEEL_SLOTS - 1));
+    }
+
+    // A callback may arm or disarm any timer, including others in
+    // this slot; anything it arms goes into a later slot.
+    conn_timer **head = &slots[0][now & (TIMER_WHEEL_SLOTS - 1)];
+    while (conn_timer *t = *head) {
+      remove(t);
+      t->cb(t->arg);
+    }
+  }
+}
+
+/* Set the libevent timer for the next tick at which there is anything
+   to do: the next occupied slot at level 0, or the next cascade of a
+   higher level with anything in it. */
+void
+timer_wheel::schedule()
+{
+  if (count == 0) {
+    evtimer_del(tick);
+    return;
+  }
+
+  uint64_t next = UINT64_MAX;
+  if (occupied[0]) {
+    unsigned int from = (now + 1) & (TIMER_WHEEL_SLOTS - 1);
+    uint64_t rot = (occupied[0] >> from) |
+      (from ? occupied[0] << (TIMER_WHEEL_SLOTS - from) : 0);
+    next = now + 1 + __builtin_ctzll(rot);
+  }
+  for (unsigned int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+    if (!occupied[l])
+      continue;
+    unsigned int shift = TIMER_WHEEL_BITS * l;
+    uint64_t b = ((now >> shift) + 1) << shift;
+    if (b < next)
+      next = b;
+  }
+
+  if (wakeup == next && evtimer_pending(tick, 0))
+    return;
+
+  uint64_t cur = clock();
+  uint64_t ms = next > cur ? (next - cur) * CONN_TIMER_TICK_MS : 0;
+  struct timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  wakeup = next;
+  evtimer_add(tick, &tv);
+}
+
 } // anonymous namespace
 
+static void
+timer_wheel_cb(evutil_socket_t, short, void *arg)
+{
+  timer_wheel *w = (timer_wheel *)arg;
+  w->run(w->clock());
+  w->schedule();
+}
+
 static void
 close_cleanup_cb(evutil_socket_t, short, void *arg)
 {
@@ -121,12 +361,76 @@ close_cleanup_cb(evutil_socket_t, short, void *arg)
 
 static conn_global_state *cgs;
 
+/* Timers. */
+
+conn_timer::~conn_timer()
+{
+  disarm();
+}
+
+void
+conn_timer::arm(unsigned long milliseconds)
+{
+  timer_wheel &w = cgs->timers;
+
+  log_assert(cb);
+  if (pprev)
+    w.remove(this);
+  else if (w.count == 0)
+    // Nothing has been keeping the wheel's idea of the time current.
+    w.now = w.clock();
+
+  // One more tick than the delay rounds up to, because the current
+  // tick may be nearly over.
+  uint64_t ticks = (milliseconds + CONN_TIMER_TICK_MS - 1) / CONN_TIMER_TICK_MS;
+  expires = w.clock() + ticks + 1;
+  if (expires <= w.now)
+    expires = w.now + 1;
+  w.insert(this);
+
+  if (!evtimer_pending(w.tick, 0) || expires < w.wakeup)
+    w.schedule();
+}
+
+void
+conn_timer::disarm()
+{
+  if (pprev)
+    cgs->timers.remove(this);
+}
+
 void
 conn_global_init(struct event_base *evbase)
 {
   cgs = new conn_global_state(evbase);
 }
 
+uint64_t
+conn_clock_ms(void)
+{
+  cgs->timers.clock();
+  return cgs->timers.last_ms;
+}
+
+void
+conn_set_clock(uint64_t (*fn)(void))
+{
+  timer_wheel &w = cgs->timers;
+  w.source = fn ? fn : monotonic_ms;
+  // Readings from different clocks have nothing to do with each other.
+  w.last_ms = 0;
+  w.now = w.clock();
+  log_assert(w.count == 0);
+}
+
+void
+conn_run_timers(void)
+{
+  timer_wheel &w = cgs->timers;
+  w.run(w.clock());
+  w.schedule();
+}
+
 void
 conn_start_shutdown(int barbaric)
 {
@@ -246,7 +550,7 @@ conn_send_eof(conn_t *dest)
    that can only send data in small chunks. */
 
 static void
-flush_timer_cb(evutil_socket_t, short, void *arg)
+flush_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_debug(ckt, "flush timer expired, %lu bytes available",
@@ -260,7 +564,7 @@ flush_timer_cb(evutil_socket_t, short, void *arg)
    connections. */
 
 static void
-axe_timer_cb(evutil_socket_t, short, void *arg)
+axe_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_warn(ckt, "timeout waiting for new connections");
@@ -294,10 +598,6 @@ circuit_t::~circuit_t()
     free((void *)this->up_peer);
   if (this->socks_state)
     socks_state_free(this->socks_state);
-  if (this->flush_timer)
-    event_free(this->flush_timer);
-  if (this->axe_timer)
-    event_free(this->axe_timer);
 }
 
 void
@@ -308,10 +608,8 @@ circuit_t::close()
 
   if (this->up_buffer)
     bufferevent_disable(this->up_buffer, EV_READ|EV_WRITE);
-  if (this->flush_timer)
-    event_del(this->flush_timer);
-  if (this->axe_timer)
-    event_del(this->axe_timer);
+  this->flush_timer.disarm();
+  this->axe_timer.disarm();
 
   bool need_event =
     cgs->closed_connections.empty() && cgs->closed_circuits.empty();
@@ -360,6 +658,12 @@ circuit_send_eof(circuit_t *ckt)
 {
   ckt->pending_read_eof = true;
   if (ckt->socks_state) {
+    if (socks_state_get_status(ckt->socks_state) == ST_SENT_REPLY) {
+      /* The client was told it was connected before it was; pass
+         the EOF along once it is. */
+      log_debug(ckt, "holding EOF till connection");
+      return;
+    }
     log_debug(ckt, "EOF during SOCKS phase");
     ckt->close();
   } else if (ckt->send_eof()) {
@@ -395,21 +699,14 @@ circuit_arm_flush_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "flush within %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->flush_timer)
-    ckt->flush_timer = evtimer_new(ckt->cfg()->base, flush_timer_cb, ckt);
-
-  evtimer_add(ckt->flush_timer, &tv);
+  ckt->flush_timer.set(flush_timer_cb, ckt);
+  ckt->flush_timer.arm(milliseconds);
 }
 
 void
 circuit_disarm_flush_timer(circuit_t *ckt)
 {
-  if (ckt->flush_timer)
-    evtimer_del(ckt->flush_timer);
+  ckt->flush_timer.disarm();
 }
 
 void
@@ -417,19 +714,12 @@ circuit_arm_axe_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "axe after %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->axe_timer)
-    ckt->axe_timer = evtimer_new(ckt->cfg()->base, axe_timer_cb, ckt);
-
-  evtimer_add(ckt->axe_timer, &tv);
+  ckt->axe_timer.set(axe_timer_cb, ckt);
+  ckt->axe_timer.arm(milliseconds);
 }
 
 void
 circuit_disarm_axe_timer(circuit_t *ckt)
 {
-  if (ckt->axe_timer)
-    evtimer_del(ckt->axe_timer);
+  ckt->axe_timer.disarm();
 }
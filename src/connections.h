@@ -8,6 +8,54 @@
 
 #include <event2/bufferevent.h>
 
+/** A deadline for a connection or circuit.
+
+    There can be a great many connections and circuits, each with one
+    or more timers that are re-armed every time it sends something,
+    so rather than giving each timer its own libevent event, they are
+    all kept in a hierarchical timer wheel driven by a single libevent
+    timer.  Arming and disarming a timer is constant-time.  The wheel
+    has a resolution of CONN_TIMER_TICK_MS: a timer fires no earlier
+    than asked for, and at most two ticks later.
+
+    Deadlines are kept by the monotonic clock (see conn_clock_ms), so
+    they are not disturbed when the system clock is set.
+
+    A timer must not be armed before conn_global_init has been called.
+    Destroying an armed timer disarms it. */
+
+#define CONN_TIMER_TICK_MS 10
+
+struct conn_timer
+{
+  conn_timer *next;
+  conn_timer **pprev;
+  uint64_t expires;
+  void (*cb)(void *);
+  void *arg;
+  unsigned int where;
+
+  conn_timer() : next(0), pprev(0), expires(0), cb(0), arg(0), where(0) {}
+  ~conn_timer();
+
+  /** Set the function to call, with ARG, when the timer fires. */
+  void set(void (*fn)(void *), void *fnarg) { cb = fn; arg = fnarg; }
+
+  /** Arrange for the callback to be called in MILLISECONDS,
+      replacing any earlier deadline. */
+  void arm(unsigned long milliseconds);
+
+  /** Cancel the deadline, if any. */
+  void disarm();
+
+  /** True if the timer is armed and has not yet fired. */
+  bool pending() const { return pprev != 0; }
+
+private:
+  conn_timer(const conn_timer&) DELETE_METHOD;
+  conn_timer& operator=(const conn_timer&) DELETE_METHOD;
+};
+
 /** This struct defines the state of one downstream socket-level
     connection.  Each protocol must define a subclass of this
     structure; see protocol.h for helper macros.
@@ -102,6 +150,11 @@ struct conn_t {
       transmitted on this connection, you need to make up some data
       and send it.  */
   virtual void transmit_soon(unsigned long timeout) = 0;
+
+  /** Transmit on this connection now, taking whatever data is waiting
+      on the circuit, or making some up if there is none.  Does nothing
+      if the connection is closing or may not transmit any more. */
+  virtual void transmit_now() = 0;
 };
 
 /** Prepare global connection-related state.  Succeeds or crashes.  */
@@ -122,6 +175,26 @@ conn_t *conn_create(config_t *cfg, size_t index, struct bufferevent *buf,
 /** Report the number of currently-open connections. */
 size_t conn_count(void);
 
+/** The current time in milliseconds, from an arbitrary starting
+    point, by the clock that drives conn_timers.  It is monotonic: it
+    never runs backward, and does not jump when the system clock is
+    set.  Only differences between readings are meaningful.  Where the
+    system provides it (as Linux does) reading it costs no system
+    call, so it is the clock to use for pacing. */
+uint64_t conn_clock_ms(void);
+
+/** For tests: drive conn_timers and conn_clock_ms from FN, which
+    returns milliseconds and must not run backward, instead of the
+    monotonic clock; NULL puts the monotonic clock back.  No timer may
+    be armed when the clock is changed.  The event
+    loop only runs timers when it expects them to be due by the real
+    clock, so tests that set a clock call conn_run_timers themselves
+    after moving it forward. */
+void conn_set_clock(uint64_t (*fn)(void));
+
+/** Run every conn_timer that is due. */
+void conn_run_timers(void);
+
 void conn_send_eof(conn_t *conn);
 void conn_do_flush(conn_t *conn);
 
@@ -138,8 +211,8 @@ void conn_do_flush(conn_t *conn);
  */
 
 struct circuit_t {
-  struct event       *flush_timer;
-  struct event       *axe_timer;
+  conn_timer          flush_timer;
+  conn_timer          axe_timer;
   struct bufferevent *up_buffer;
   const char         *up_peer;
   socks_state_t      *socks_state;
@@ -152,9 +225,7 @@ struct circuit_t {
   bool                pending_write_eof : 1;
 
   circuit_t()
-    : flush_timer(0)
-    , axe_timer(0)
-    , up_buffer(0)
+    : up_buffer(0)
     , up_peer(0)
     , socks_state(0)
     , serial(0)
@@ -0,0 +1,298 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "connections.h"
+#include "dnscache.h"
+
+#include <vector>
+
+#include <netinet/in.h>
+
+#include <event2/dns.h>
+
+using std::vector;
+
+struct dns_cache_entry
+{
+  dns_cache *cache;
+  char *name;
+  vector<struct sockaddr_storage> addrs;
+  size_t next;                    // where to start the next lookup
+  struct evdns_request *pending;
+  conn_timer refresh;
+  bool used : 1;                  // looked up since the last resolution
+  bool want_ipv6 : 1;             // the pending resolution is for AAAA
+
+  dns_cache_entry(dns_cache *c, const char *host)
+    : cache(c), name(xstrdup(host)), next(0), pending(0),
+      used(false), want_ipv6(false) {}
+  ~dns_cache_entry() { free(name); }
+};
+
+static socklen_t
+sockaddr_len(const struct sockaddr_storage &ss)
+{
+  return ss.ss_family == AF_INET6
+    ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void
+set_port(struct sockaddr_storage &ss, int port)
+{
+  if (ss.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&ss)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)&ss)->sin_port = htons(port);
+}
+
+static bool
+same_host(const struct sockaddr_storage &ss, const struct sockaddr *sa)
+{
+  if (ss.ss_family != sa->sa_family)
+    return false;
+  if (sa->sa_family == AF_INET6)
+    return !memcmp(&((const struct sockaddr_in6 *)&ss)->sin6_addr,
+                   &((const struct sockaddr_in6 *)sa)->sin6_addr,
+                   sizeof(struct in6_addr));
+  return !memcmp(&((const struct sockaddr_in *)&ss)->sin_addr,
+                 &((const struct sockaddr_in *)sa)->sin_addr,
+                 sizeof(struct in_addr));
+}
+
+static bool
+parse_numeric(const char *host, struct sockaddr_storage *ss)
+{
+  memset(ss, 0, sizeof *ss);
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+  if (evutil_inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    return true;
+  }
+  if (evutil_inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    return true;
+  }
+  return false;
+}
+
+dns_cache::dns_cache(struct evdns_base *base, unsigned long min_ttl)
+  : dns(base), min_ttl_ms(min_ttl),
+    hits(0), misses(0), resolutions(0), failures(0)
+{
+}
+
+dns_cache::~dns_cache()
+{
+  for (table::iterator i = entries.begin(); i != entries.end(); i++)
+    delete i->second;
+}
+
+/* Return the entry for HOST, creating it and starting its first
+   resolution if there is none, or NULL if the cache is full. */
+dns_cache_entry *
+dns_cache::find(const char *host)
+{
+  table::iterator i = entries.find(host);
+  if (i != entries.end())
+    return i->second;
+
+  if (entries.size() >= DNS_CACHE_MAX_ENTRIES) {
+    log_debug("dns: cache full, not caching %s", host);
+    return 0;
+  }
+
+  dns_cache_entry *e = new dns_cache_entry(this, host);
+  e->refresh.set(refresh_cb, e);
+  entries[host] = e;
+  resolve(e);
+  return e;
+}
+
+void
+dns_cache::resolve(dns_cache_entry *e)
+{
+  log_assert(!e->pending);
+  log_debug("dns: resolving %s", e->name);
+
+  e->used = false;
+  e->want_ipv6 = false;
+  resolutions++;
+  e->pending = evdns_base_resolve_ipv4(dns, e->name, 0, resolved_cb, e);
+  if (!e->pending) {
+    log_info("dns: cannot start resolving %s", e->name);
+    failures++;
+    e->refresh.arm(DNS_CACHE_RETRY_MS);
+  }
+}
+
+void
+dns_cache::resolved_cb(int result, char type, int count, int ttl,
+                       void *addresses, void *arg)
+{
+  dns_cache_entry *e = (dns_cache_entry *)arg;
+  e->cache->resolved(e, result, type, count, ttl, addresses);
+}
+
+void
+dns_cache::resolved(dns_cache_entry *e, int result, char type, int count,
+                    int ttl, void *addresses)
+{
+  e->pending = 0;
+
+  if (result == DNS_ERR_NONE && count > 0 &&
+      (type == DNS_IPv4_A || type == DNS_IPv6_AAAA)) {
+    vector<struct sockaddr_storage> addrs(count);
+    for (int i = 0; i < count; i++) {
+      struct sockaddr_storage &ss = addrs[i];
+      memset(&ss, 0, sizeof ss);
+      if (type == DNS_IPv4_A) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, (uint8_t *)addresses + i * 4, 4);
+      } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, (uint8_t *)addresses + i * 16, 16);
+      }
+    }
+    e->addrs.swap(addrs);
+    e->next = 0;
+
+    unsigned long ttl_ms = ttl > 0 ? (unsigned long)ttl * 1000 : 0;
+    if (ttl_ms < min_ttl_ms)
+      ttl_ms = min_ttl_ms;
+    if (ttl_ms > DNS_CACHE_MAX_TTL_MS)
+      ttl_ms = DNS_CACHE_MAX_TTL_MS;
+    log_debug("dns: %s has %d address%s, ttl %lu ms", e->name, count,
+              count == 1 ? "" : "es", ttl_ms);
+    e->refresh.arm(ttl_ms - ttl_ms / 4);
+    return;
+  }
+
+  // A name may have only IPv6 addresses.
+  if (!e->want_ipv6 && result != DNS_ERR_CANCEL) {
+    e->want_ipv6 = true;
+    e->pending = evdns_base_resolve_ipv6(dns, e->name, 0, resolved_cb, e);
+    if (e->pending)
+      return;
+  }
+
+  failures++;
+  log_info("dns: cannot resolve %s: %s%s", e->name,
+           result == DNS_ERR_NONE ? "no addresses"
+           : evdns_err_to_string(result),
+           e->addrs.empty() ? "" : " (keeping old addresses)");
+  e->refresh.arm(DNS_CACHE_RETRY_MS);
+}
+
+void
+dns_cache::refresh_cb(void *arg)
+{
+  dns_cache_entry *e = (dns_cache_entry *)arg;
+  dns_cache *c = e->cache;
+
+  if (!e->used) {
+    log_debug("dns: dropping %s", e->name);
+    c->entries.erase(e->name);
+    delete e;
+    return;
+  }
+  c->resolve(e);
+}
+
+bool
+dns_cache::get(const char *host, int port, int af,
+               struct sockaddr_storage *ss, socklen_t *len)
+{
+  if (parse_numeric(host, ss)) {
+    set_port(*ss, port);
+    *len = sockaddr_len(*ss);
+    return true;
+  }
+
+  dns_cache_entry *e = find(host);
+  if (e) {
+    size_t n = e->addrs.size();
+    e->used = true;
+    for (size_t i = 0; i < n; i++) {
+      const struct sockaddr_storage &a = e->addrs[(e->next + i) % n];
+      if (af != AF_UNSPEC && a.ss_family != af)
+        continue;
+      e->next = (e->next + i + 1) % n;
+      *ss = a;
+      set_port(*ss, port);
+      *len = sockaddr_len(*ss);
+      hits++;
+      return true;
+    }
+  }
+  misses++;
+  return false;
+}
+
+struct evutil_addrinfo *
+dns_cache::refresh(const char *host, const struct evutil_addrinfo *current)
+{
+  log_assert(current);
+
+  dns_cache_entry *e = find(host);
+  if (!e)
+    return 0;
+  e->used = true;
+  if (e->addrs.empty())
+    return 0;
+
+  for (const struct evutil_addrinfo *ai = current; ai; ai = ai->ai_next)
+    for (size_t i = 0; i < e->addrs.size(); i++)
+      if (same_host(e->addrs[i], ai->ai_addr))
+        return 0;
+
+  const struct sockaddr_storage &a = e->addrs[e->next % e->addrs.size()];
+  char abuf[INET6_ADDRSTRLEN], pbuf[8];
+  if (!evutil_inet_ntop(a.ss_family, a.ss_family == AF_INET6
+                        ? (const void *)&((struct sockaddr_in6 *)&a)->sin6_addr
+                        : (const void *)&((struct sockaddr_in *)&a)->sin_addr,
+                        abuf, sizeof abuf))
+    return 0;
+  xsnprintf(pbuf, sizeof pbuf, "%u",
+            ntohs(current->ai_addr->sa_family == AF_INET6
+                  ? ((struct sockaddr_in6 *)current->ai_addr)->sin6_port
+                  : ((struct sockaddr_in *)current->ai_addr)->sin_port));
+
+  struct evutil_addrinfo hints, *ai = 0;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_NUMERICHOST | EVUTIL_AI_NUMERICSERV;
+  if (evutil_getaddrinfo(abuf, pbuf, &hints, &ai)) {
+    log_warn("dns: cannot make an address for %s: %s", host, abuf);
+    return 0;
+  }
+  log_info("dns: %s now resolves to %s", host, abuf);
+  return ai;
+}
+
+static dns_cache *the_dns_cache = NULL;
+
+dns_cache *
+get_dns_cache(void)
+{
+  return the_dns_cache;
+}
+
+void
+init_dns_cache(struct evdns_base *dns)
+{
+  log_assert(!the_dns_cache);
+  the_dns_cache = new dns_cache(dns);
+}
+
+void
+free_dns_cache(void)
+{
+  delete the_dns_cache;
+  the_dns_cache = NULL;
+}
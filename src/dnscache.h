@@ -0,0 +1,95 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <string>
+#include <tr1/unordered_map>
+
+/** A cache of host name resolutions, shared by everything that
+    connects to hosts by name: chop's target addresses, and SOCKS
+    destinations.
+
+    Lookups never wait for the network.  If a name has an address in
+    the cache, it is returned (rotating among the name's addresses);
+    if not, a resolution is started in the background and the lookup
+    fails, so the caller can fall back on resolving the name itself.
+    Once a name has been resolved, the cache resolves it again when
+    three quarters of its TTL have passed, as long as it has been
+    looked up since the last resolution; names that are not looked up
+    in that time are dropped.  If a resolution fails, the addresses
+    from the last one that succeeded go on being used, and it is
+    retried every DNS_CACHE_RETRY_MS.
+
+    Only the DNS is consulted, via evdns, since nothing else gives a
+    TTL; lookups of names that are only in the hosts file always fail.
+    Numeric addresses are parsed and never cached.
+
+    Resolutions are timed with conn_timers, so the cache must not be
+    used before conn_global_init has been called.  Pending resolutions
+    are abandoned, not cancelled, when the cache is deleted, so it
+    must be deleted only after the event loop has stopped, and before
+    its evdns_base is freed (without failing requests). */
+
+#define DNS_CACHE_MIN_TTL_MS (5 * 1000)
+#define DNS_CACHE_MAX_TTL_MS (60 * 60 * 1000)
+#define DNS_CACHE_RETRY_MS (10 * 1000)
+#define DNS_CACHE_MAX_ENTRIES 1024
+
+struct dns_cache_entry;
+
+class dns_cache
+{
+  typedef std::tr1::unordered_map<std::string, dns_cache_entry *> table;
+
+  struct evdns_base *dns;
+  unsigned long min_ttl_ms;
+  table entries;
+
+  dns_cache_entry *find(const char *host);
+  void resolve(dns_cache_entry *e);
+  void resolved(dns_cache_entry *e, int result, char type, int count,
+                int ttl, void *addresses);
+  static void resolved_cb(int result, char type, int count, int ttl,
+                          void *addresses, void *arg);
+  static void refresh_cb(void *arg);
+
+public:
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long resolutions;
+  unsigned long failures;
+
+  /** Resolve names using DNS.  TTLs shorter than MIN_TTL_MS are
+      treated as if they were that long. */
+  dns_cache(struct evdns_base *dns,
+            unsigned long min_ttl_ms = DNS_CACHE_MIN_TTL_MS);
+  ~dns_cache();
+
+  /** The number of names in the cache. */
+  size_t size() const { return entries.size(); }
+
+  /** Look up HOST.  If it is a numeric address, or has an address in
+      the cache (of family AF, unless that is AF_UNSPEC), write that
+      address, with port PORT, to *SS and its length to *LEN, and
+      return true.  Otherwise return false. */
+  bool get(const char *host, int port, int af,
+           struct sockaddr_storage *ss, socklen_t *len);
+
+  /** Look up HOST, whose addresses were last known to be CURRENT.
+      If the cache has addresses for it, none of which are in CURRENT,
+      return a new list holding one of them, with the same port as
+      CURRENT's first address, for the caller to free with
+      evutil_freeaddrinfo.  Otherwise return NULL. */
+  struct evutil_addrinfo *refresh(const char *host,
+                                  const struct evutil_addrinfo *current);
+};
+
+/** The cache shared by the whole program, or NULL if there is none. */
+dns_cache *get_dns_cache(void);
+void init_dns_cache(struct evdns_base *dns);
+void free_dns_cache(void);
+
+#endif
@@ -0,0 +1,33 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Convert the embed steg module's text trace file to the binary form
+   it can map straight into memory.  Must be run on a machine of the
+   same byte order as the ones that will use the output.
+
+   Usage: embed_compile [INPUT [OUTPUT]]
+   (defaults traces/embed.txt and traces/embed.bin) */
+
+#include "util.h"
+#include "steg/embed_trace.h"
+
+int
+main(int argc, char **argv)
+{
+  const char *in = argc > 1 ? argv[1] : "traces/embed.txt";
+  const char *out = argc > 2 ? argv[2] : "traces/embed.bin";
+  embed_traces traces;
+
+  if (argc > 3) {
+    fprintf(stderr, "usage: %s [input [output]]\n", argv[0]);
+    return 2;
+  }
+  log_set_method(LOG_METHOD_STDERR, 0);
+  if (traces.load_text(in) || traces.save(out))
+    return 1;
+
+  printf("%s: %u traces, %u packets\n", out, traces.num_traces,
+         traces.num_pkts);
+  return 0;
+}
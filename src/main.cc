@@ -7,6 +7,7 @@
 
 #include "connections.h"
 #include "crypt.h"
+#include "dnscache.h"
 #include "listener.h"
 #include "protocol.h"
 #include "steg.h"
@@ -15,14 +16,19 @@
 #include <vector>
 #include <string>
 
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #ifdef _WIN32
 #include <process.h>
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/socket.h>
 #ifdef HAVE_EXECINFO_H
 #include <execinfo.h>
 #endif
@@ -38,6 +44,7 @@ static bool allow_kq = false;
 static bool daemon_mode = false;
 static string pidfile_name;
 static string registration_helper;
+static string config_file;
 
 /**
    Puts stegotorus's networking subsystem on "closing time" mode. This
@@ -63,6 +70,227 @@ start_shutdown(int barbaric, const char *label)
   conn_start_shutdown(barbaric); /* possibly break existing connections */
 }
 
+/**
+   Creates a configuration from each run of WORDS (a NULL-terminated
+   list, starting with a protocol name) that begins with a recognized
+   protocol name, up to but not including the next recognized
+   protocol name, and appends them to CONFIGS.  Returns false, after
+   logging why, if any of them cannot be created.
+*/
+static bool
+create_configs(const char *const *begin, vector<config_t *> &configs)
+{
+  const char *const *end;
+
+  log_assert(*begin && config_is_supported(*begin));
+  do {
+    end = begin+1;
+    while (*end && !config_is_supported(*end))
+      end++;
+    if (log_do_debug()) {
+      string joined = *begin;
+      const char *const *p;
+      for (p = begin+1; p < end; p++) {
+        joined += " ";
+        joined += *p;
+      }
+      log_debug("configuration %lu: %s",
+                (unsigned long)configs.size()+1, joined.c_str());
+    }
+    if (end == begin+1) {
+      log_warn("no arguments for configuration %lu",
+               (unsigned long)configs.size()+1);
+      return false;
+    }
+    config_t *cfg = config_create(end - begin, begin);
+    if (!cfg)
+      return false; /* diagnostic already issued */
+    configs.push_back(cfg);
+    begin = end;
+  } while (*begin);
+  return true;
+}
+
+/**
+   Reads protocol configurations from FNAME, which holds the same
+   words as would follow the generic options on the command line,
+   separated by any white space; '#' starts a comment, which runs to
+   the end of the line.  Appends them to CONFIGS, or returns false
+   after logging why (deleting any it has made).
+*/
+static bool
+read_config_file(const string &fname, vector<config_t *> &configs)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    log_warn("cannot open config file '%s': %s", fname.c_str(),
+             strerror(errno));
+    return false;
+  }
+
+  vector<string> words;
+  string word;
+  bool comment = false;
+  int c;
+  while ((c = getc(f)) != EOF) {
+    if (c == '\n')
+      comment = false;
+    if (comment)
+      continue;
+    if (c == '#' || isspace(c)) {
+      comment = comment || c == '#';
+      if (!word.empty())
+        words.push_back(word);
+      word.clear();
+    } else {
+      word += (char)c;
+    }
+  }
+  if (!word.empty())
+    words.push_back(word);
+  if (ferror(f)) {
+    log_warn("error reading config file '%s': %s", fname.c_str(),
+             strerror(errno));
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  if (words.empty() || !config_is_supported(words[0].c_str())) {
+    log_warn("config file '%s' does not start with a protocol name",
+             fname.c_str());
+    return false;
+  }
+
+  vector<const char *> argv;
+  for (vector<string>::iterator i = words.begin(); i != words.end(); i++)
+    argv.push_back(i->c_str());
+  argv.push_back(NULL);
+
+  size_t had = configs.size();
+  if (create_configs(&argv[0], configs))
+    return true;
+  for (size_t i = had; i < configs.size(); i++)
+    delete configs[i];
+  configs.resize(had);
+  return false;
+}
+
+namespace {
+  /* A configuration reload in progress (see reload_config_cb). */
+  struct reload_state
+  {
+    vector<config_t *> *configs; // the running configurations
+    vector<config_t *> fresh;    // built from the file by the worker
+    bool ok;                     // the file was read successfully
+    bool busy;                   // a reload has been started
+    evutil_socket_t wake[2];     // the worker writes to [1] when done
+    struct event *done;          // reads [0] and runs reload_done_cb
+#ifdef HAVE_PTHREAD
+    bool threaded;
+    pthread_t thread;
+#endif
+  };
+}
+
+/* Build the fresh configurations, then tell the event loop they are
+   ready.  Nothing this does touches state the event loop uses, other
+   than the log. */
+static void *
+reload_worker(void *arg)
+{
+  reload_state *rs = (reload_state *)arg;
+  rs->ok = read_config_file(config_file, rs->fresh);
+  if (send(rs->wake[1], "", 1, 0) != 1)
+    log_abort("reload: cannot wake the event loop");
+  return 0;
+}
+
+/* Back on the event loop: if every fresh configuration can be taken
+   over by the running configuration it replaces (see
+   config_t::can_reload), have them do so.  Otherwise nothing
+   changes. */
+static void
+reload_done_cb(evutil_socket_t fd, short, void *arg)
+{
+  reload_state *rs = (reload_state *)arg;
+  vector<config_t *> &configs = *rs->configs;
+  vector<config_t *> &fresh = rs->fresh;
+  bool ok = rs->ok;
+  char c;
+
+  if (recv(fd, &c, 1, 0) != 1)
+    return;
+#ifdef HAVE_PTHREAD
+  if (rs->threaded)
+    pthread_join(rs->thread, 0);
+#endif
+
+  if (ok && fresh.size() != configs.size()) {
+    log_warn("cannot add or remove configurations while running");
+    ok = false;
+  }
+  for (size_t i = 0; ok && i < fresh.size(); i++) {
+    if (strcmp(fresh[i]->name(), configs[i]->name())) {
+      log_warn("configuration %lu: cannot change protocol while running",
+               (unsigned long)i+1);
+      ok = false;
+    } else {
+      ok = configs[i]->can_reload(fresh[i]);
+    }
+  }
+
+  for (size_t i = 0; i < fresh.size(); i++) {
+    if (ok)
+      configs[i]->reload(fresh[i]);
+    delete fresh[i];
+  }
+  fresh.clear();
+  rs->busy = false;
+
+  if (ok)
+    log_info("configuration reloaded");
+  else
+    log_warn("'%s' not reloaded; the old configuration stays in effect",
+             config_file.c_str());
+}
+
+/**
+   This is called on SIGHUP when there is a config file.  It builds a
+   fresh set of configurations from the file and, if every one of
+   them can be taken over by the running configuration it replaces,
+   has them do so; connections made from then on use the new
+   settings, and existing ones are left alone.  Listeners stay as
+   they are, so the protocols and addresses must be the same as
+   before.
+
+   Reading the file means reading and indexing steg corpora and
+   resolving addresses, which can take seconds, so it is done on a
+   worker thread while the event loop carries on; the protocol and
+   steg modules are not thread-safe, so the switch-over itself is
+   done back on the loop, in reload_done_cb.  Without threads, all
+   traffic stalls while the file is read.
+*/
+static void
+reload_config_cb(evutil_socket_t, short, void *arg)
+{
+  reload_state *rs = (reload_state *)arg;
+
+  if (rs->busy) {
+    log_warn("SIGHUP: a reload is already under way; ignored");
+    return;
+  }
+  log_info("SIGHUP: reloading configuration from '%s'", config_file.c_str());
+  rs->busy = true;
+#ifdef HAVE_PTHREAD
+  rs->threaded = !pthread_create(&rs->thread, 0, reload_worker, rs);
+  if (rs->threaded)
+    return;
+  log_warn("cannot start a reload thread; traffic stalls meanwhile");
+#endif
+  reload_worker(rs);
+}
+
 /**
    This is called when we receive an asynchronous signal.
    It figures out the signal type and acts accordingly.
@@ -229,6 +457,8 @@ usage(void)
           "--registration-helper=<helper> ~ use <helper> to register with "
           "a relay database\n"
           "--pid-file=<file> ~ write process ID to <file> after startup\n"
+          "--config=<file> ~ read protocol configurations from <file>, "
+          "and reread it on SIGHUP\n"
           "--daemon ~ run as a daemon");
 
   exit(1);
@@ -253,6 +483,7 @@ handle_generic_args(const char *const *argv)
   bool timestamps_set = false;
   bool registration_helper_set = false;
   bool pidfile_set = false;
+  bool config_file_set = false;
   int i = 1;
 
   while (argv[i] &&
@@ -315,6 +546,13 @@ handle_generic_args(const char *const *argv)
       }
       pidfile_name = string(argv[i]+11);
       pidfile_set = true;
+    } else if (!strncmp(argv[i], "--config=", 9)) {
+      if (config_file_set) {
+        fprintf(stderr, "you've already set a config file!\n");
+        exit(1);
+      }
+      config_file = string(argv[i]+9);
+      config_file_set = true;
     } else if (!strcmp(argv[i], "--daemon")) {
       if (daemon_mode) {
         fprintf(stderr, "you've already requested daemon mode!\n");
@@ -343,10 +581,11 @@ main(int, const char *const *argv)
   struct event_config *evcfg;
   struct event *sig_int;
   struct event *sig_term;
+  struct event *sig_hup;
+  reload_state reload;
   struct event *stdin_eof;
   vector<config_t *> configs;
   const char *const *begin;
-  const char *const *end;
   struct stat st;
 
   /* Set the logging defaults before doing anything else.  It wouldn't
@@ -357,39 +596,22 @@ main(int, const char *const *argv)
   /* Handle optional non-protocol-specific arguments. */
   begin = argv + handle_generic_args(argv);
 
-  /* Find the subsets of argv that define each configuration.
-     Each configuration's subset consists of the entries in argv from
-     its recognized protocol name, up to but not including the next
-     recognized protocol name. */
-  if (!*begin || !config_is_supported(*begin))
-    usage();
-
-  do {
-    end = begin+1;
-    while (*end && !config_is_supported(*end))
-      end++;
-    if (log_do_debug()) {
-      string joined = *begin;
-      const char *const *p;
-      for (p = begin+1; p < end; p++) {
-        joined += " ";
-        joined += *p;
-      }
-      log_debug("configuration %lu: %s",
-                (unsigned long)configs.size()+1, joined.c_str());
-    }
-    if (end == begin+1) {
-      log_warn("no arguments for configuration %lu",
-               (unsigned long)configs.size()+1);
+  /* Find the subsets of argv, or of the config file, that define
+     each configuration; see create_configs. */
+  if (!config_file.empty()) {
+    if (*begin) {
+      log_warn("with --config, protocol configurations go in the file, "
+               "not on the command line");
       usage();
-    } else {
-      config_t *cfg = config_create(end - begin, begin);
-      if (!cfg)
-        return 2; /* diagnostic already issued */
-      configs.push_back(cfg);
     }
-    begin = end;
-  } while (*begin);
+    if (!read_config_file(config_file, configs))
+      return 2;
+  } else {
+    if (!*begin || !config_is_supported(*begin))
+      usage();
+    if (!create_configs(begin, configs))
+      return 2;
+  }
   log_assert(configs.size() > 0);
 
   /* Configurations have been established; proceed with initialization. */
@@ -444,6 +666,7 @@ main(int, const char *const *argv)
   /* ASN should this happen only when SOCKS is enabled? */
   if (init_evdns_base(the_event_base))
     log_abort("failed to initialize DNS resolver");
+  init_dns_cache(get_evdns_base());
 
   /* Handle signals. */
 #ifdef SIGPIPE
@@ -455,6 +678,27 @@ main(int, const char *const *argv)
                           handle_signal_cb, NULL);
   if (event_add(sig_int, NULL) || event_add(sig_term, NULL))
     log_abort("failed to initialize signal handling");
+  sig_hup = NULL;
+  reload.done = NULL;
+#ifdef SIGHUP
+  if (!config_file.empty()) {
+    reload.configs = &configs;
+    reload.busy = false;
+#ifdef AF_LOCAL
+    int rv = evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, reload.wake);
+#else
+    int rv = evutil_socketpair(AF_INET, SOCK_STREAM, 0, reload.wake);
+#endif
+    if (rv || evutil_make_socket_nonblocking(reload.wake[0]))
+      log_abort("failed to initialize configuration reloading");
+    reload.done = event_new(the_event_base, reload.wake[0],
+                            EV_READ|EV_PERSIST, reload_done_cb, &reload);
+    sig_hup = evsignal_new(the_event_base, SIGHUP,
+                           reload_config_cb, &reload);
+    if (event_add(reload.done, NULL) || event_add(sig_hup, NULL))
+      log_abort("failed to initialize signal handling");
+  }
+#endif
 
 #ifndef _WIN32
   /* trap and diagnose fatal signals */
@@ -523,9 +767,24 @@ main(int, const char *const *argv)
        i++)
     delete *i;
 
+  free_dns_cache();
   evdns_base_free(get_evdns_base(), 0);
   event_free(sig_int);
   event_free(sig_term);
+  if (sig_hup)
+    event_free(sig_hup);
+  if (reload.done) {
+    /* A reload still being read is abandoned. */
+#ifdef HAVE_PTHREAD
+    if (reload.busy && reload.threaded)
+      pthread_join(reload.thread, 0);
+#endif
+    for (size_t i = 0; i < reload.fresh.size(); i++)
+      delete reload.fresh[i];
+    event_free(reload.done);
+    evutil_closesocket(reload.wake[0]);
+    evutil_closesocket(reload.wake[1]);
+  }
   free(stdin_eof);
   event_base_free(the_event_base);
   event_config_free(evcfg);
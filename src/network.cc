@@ -7,6 +7,7 @@
 #include "listener.h"
 
 #include "connections.h"
+#include "dnscache.h"
 #include "socks.h"
 #include "protocol.h"
 
@@ -20,6 +21,10 @@
 
 using std::vector;
 
+/** Most data held from a SOCKS client that has been sent an optimistic
+    reply, before its outbound connection is made. */
+#define SOCKS_OPTIMISTIC_LIMIT 65536
+
 /** All our listeners. */
 static vector<listener_t *> listeners;
 
@@ -36,6 +41,7 @@ static void server_listener_cb(struct evconnlistener *evcl, evutil_socket_t fd,
 static void upstream_read_cb(struct bufferevent *bev, void *arg);
 static void downstream_read_cb(struct bufferevent *bev, void *arg);
 static void socks_read_cb(struct bufferevent *bev, void *arg);
+static void socks_optimistic_read_cb(struct bufferevent *bev, void *arg);
 
 static void upstream_flush_cb(struct bufferevent *bev, void *arg);
 static void downstream_flush_cb(struct bufferevent *bev, void *arg);
@@ -43,8 +49,8 @@ static void downstream_flush_cb(struct bufferevent *bev, void *arg);
 static void upstream_event_cb(struct bufferevent *bev, short what, void *arg);
 static void downstream_event_cb(struct bufferevent *bev, short what, void *arg);
 
-static void create_outbound_connections(circuit_t *ckt, bool is_socks);
-static void create_outbound_connections_socks(circuit_t *ckt);
+static bool create_outbound_connections(circuit_t *ckt, bool is_socks);
+static bool create_outbound_connections_socks(circuit_t *ckt);
 
 vector<listener_t *> const& get_all_listeners()
 {
@@ -258,7 +264,21 @@ socks_read_cb(struct bufferevent *bev, void *arg)
 
     if (status == ST_HAVE_ADDR) {
       bufferevent_disable(bev, EV_READ|EV_WRITE); /* wait for connection */
-      create_outbound_connections_socks(ckt);
+      if (create_outbound_connections_socks(ckt) &&
+          ckt->cfg()->socks_optimistic &&
+          socks_state_get_status(socks) == ST_HAVE_ADDR) {
+        /* Tell the client it is connected now, rather than when the
+           connection completes, so that it can start sending a round
+           trip sooner.  Its data is held in the input buffer until
+           then (see downstream_socks_connect_cb); if the connection
+           fails, all we can do is close the circuit. */
+        log_debug(ckt, "sending optimistic SOCKS reply");
+        socks_send_reply(socks, bufferevent_get_output(bev), 0);
+        bufferevent_setcb(bev, socks_optimistic_read_cb, upstream_flush_cb,
+                          upstream_event_cb, ckt);
+        bufferevent_setwatermark(bev, EV_READ, 0, SOCKS_OPTIMISTIC_LIMIT);
+        bufferevent_enable(bev, EV_READ|EV_WRITE);
+      }
       return;
     }
 
@@ -281,6 +301,20 @@ socks_read_cb(struct bufferevent *bev, void *arg)
   }
 }
 
+/**
+   This callback is responsible for data from a SOCKS client that has
+   been sent an optimistic reply, before its outbound connection is
+   made.  The data stays in the input buffer, which the read watermark
+   keeps from growing without bound.
+*/
+static void
+socks_optimistic_read_cb(struct bufferevent *bev, void *arg)
+{
+  circuit_t *ckt = (circuit_t *)arg;
+  log_debug(ckt, "%lu bytes held till connection",
+            (unsigned long)evbuffer_get_length(bufferevent_get_input(bev)));
+}
+
 /**
    This callback is responsible for handling "upstream" traffic --
    traffic coming in from the higher-level client or server that needs
@@ -447,7 +481,11 @@ downstream_flush_cb(struct bufferevent *bev, void *arg)
 
   if (remain == 0 && ((conn->pending_write_eof && conn->connected)
                       || (!conn->circuit() && conn->ever_received))) {
-    conn->write_eof = true;
+    if (!conn->write_eof) {
+      log_debug(conn, "sending EOF downstream");
+      shutdown(bufferevent_getfd(bev), SHUT_WR);
+      conn->write_eof = true;
+    }
     if (conn->read_eof && conn->write_eof)
       conn->close();
   }
@@ -571,10 +609,20 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
     if (socks_state_get_status(socks) == ST_HAVE_ADDR) {
       bufferevent_enable(ckt->up_buffer, EV_WRITE);
       socks_send_reply(socks, bufferevent_get_output(ckt->up_buffer), err);
-      circuit_do_flush(ckt);
-    } else {
-      ckt->close();
+    } else if (ckt->read_eof) {
+      /* Another connection for this circuit already failed. */
+      return;
     }
+
+    /* Hang up once the client has its reply.  If that was sent
+       optimistically, it said the connection succeeded, and it is too
+       late to take that back.  Anything else the client sent is
+       thrown away. */
+    struct evbuffer *input = bufferevent_get_input(ckt->up_buffer);
+    bufferevent_disable(ckt->up_buffer, EV_READ);
+    evbuffer_drain(input, evbuffer_get_length(input));
+    ckt->read_eof = true;
+    circuit_do_flush(ckt);
     return;
   }
 
@@ -586,12 +634,14 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
     struct sockaddr *sa = (struct sockaddr*)&ss;
     socklen_t slen = sizeof(&ss);
 
-    /* Figure out where we actually connected to, and tell the socks client */
+    /* Figure out where we actually connected to, and tell the socks
+       client, unless it was told optimistically. */
     if (getpeername(bufferevent_getfd(bev), sa, &slen) == 0) {
       socks_state_set_address(socks, sa);
       conn->peername = printable_address(sa, slen);
     }
-    socks_send_reply(socks, bufferevent_get_output(ckt->up_buffer), 0);
+    if (socks_state_get_status(socks) == ST_HAVE_ADDR)
+      socks_send_reply(socks, bufferevent_get_output(ckt->up_buffer), 0);
 
     /* Switch to regular upstream behavior. */
     socks_state_free(socks);
@@ -603,7 +653,10 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
                       upstream_event_cb, ckt);
     bufferevent_setcb(conn->buffer, downstream_read_cb, downstream_flush_cb,
                       downstream_event_cb, conn);
-    bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+    bufferevent_setwatermark(ckt->up_buffer, EV_READ, 0, 0);
+    /* An optimistic client may already have sent EOF. */
+    bufferevent_enable(ckt->up_buffer,
+                       ckt->pending_read_eof ? EV_WRITE : EV_READ|EV_WRITE);
     bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
     conn->connected = 1;
 
@@ -619,6 +672,15 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
          connection. */
       upstream_read_cb(ckt->up_buffer, ckt);
 
+    if (ckt->pending_read_eof) {
+      /* Pass on an EOF held while we were waiting. */
+      circuit_send_eof(ckt);
+      if (ckt->read_eof && ckt->write_eof) {
+        ckt->close();
+        return;
+      }
+    }
+
     if (ckt->pending_write_eof) {
       /* Try again to process the EOF. */
       circuit_recv_eof(ckt);
@@ -718,26 +780,32 @@ create_one_outbound_connection(circuit_t *ckt, struct evutil_addrinfo *addr,
   return true;
 }
 
-static void
+static bool
 create_outbound_connections(circuit_t *ckt, bool is_socks)
 {
   struct evutil_addrinfo *addr;
-  size_t n = 0;
+  vector<size_t> targets;
   bool any_successes = false;
 
-  while ((addr = ckt->cfg()->get_target_addrs(n))) {
-    any_successes |= create_one_outbound_connection(ckt, addr, n, is_socks);
-    n++;
+  ckt->cfg()->select_targets(targets);
+  for (size_t i = 0; i < targets.size(); i++) {
+    addr = ckt->cfg()->get_target_addrs(targets[i]);
+    if (addr)
+      any_successes |= create_one_outbound_connection(ckt, addr, targets[i],
+                                                      is_socks);
   }
 
-  if (n == 0) {
+  if (targets.empty()) {
     log_warn(ckt, "no target addresses available");
     ckt->close();
+    return false;
   }
   if (any_successes == 0) {
     log_warn(ckt, "no outbound connections were successful");
     ckt->close();
+    return false;
   }
+  return true;
 }
 
 void
@@ -746,7 +814,7 @@ circuit_reopen_downstreams(circuit_t *ckt)
   create_outbound_connections(ckt, false);
 }
 
-static void
+static bool
 create_outbound_connections_socks(circuit_t *ckt)
 {
   config_t *cfg = ckt->cfg();
@@ -755,6 +823,9 @@ create_outbound_connections_socks(circuit_t *ckt)
   const char *host;
   int af, port;
   struct evdns_base *dns = get_evdns_base();
+  dns_cache *cache = get_dns_cache();
+  struct sockaddr_storage ss;
+  socklen_t sslen;
 
   log_assert(cfg->mode == LSN_SOCKS_CLIENT);
   if (socks_state_get_address(ckt->socks_state, &af, &host, &port)) {
@@ -764,10 +835,8 @@ create_outbound_connections_socks(circuit_t *ckt)
 
   /* XXXX Feed socks state through the protocol and get a connection set.
      This is a stopgap. */
-  if (ckt->cfg()->ignore_socks_destination) {
-    create_outbound_connections(ckt, true);
-    return;
-  }
+  if (ckt->cfg()->ignore_socks_destination)
+    return create_outbound_connections(ckt, true);
 
   buf = bufferevent_socket_new(cfg->base, -1, BEV_OPT_CLOSE_ON_FREE);
   if (!buf) {
@@ -775,11 +844,24 @@ create_outbound_connections_socks(circuit_t *ckt)
     goto failure;
   }
 
-  log_info(ckt, "trying to connect to %s:%u", host, port);
-  if (bufferevent_socket_connect_hostname(buf, dns, af, host, port) < 0) {
-    log_info(ckt, "connection to %s:%d failed: %s", host, port,
-             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
-    goto failure;
+  /* Use a cached address for the destination if there is one, so as
+     not to wait for the DNS; otherwise have libevent resolve it. */
+  if (cache && cache->get(host, port, af, &ss, &sslen)) {
+    char *addr = printable_address((struct sockaddr *)&ss, sslen);
+    log_info(ckt, "trying to connect to %s:%u (%s)", host, port, addr);
+    free(addr);
+    if (bufferevent_socket_connect(buf, (struct sockaddr *)&ss, sslen) < 0) {
+      log_info(ckt, "connection to %s:%d failed: %s", host, port,
+               evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      goto failure;
+    }
+  } else {
+    log_info(ckt, "trying to connect to %s:%u", host, port);
+    if (bufferevent_socket_connect_hostname(buf, dns, af, host, port) < 0) {
+      log_info(ckt, "connection to %s:%d failed: %s", host, port,
+               evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      goto failure;
+    }
   }
 
   /* we don't know the peername yet */
@@ -787,13 +869,14 @@ create_outbound_connections_socks(circuit_t *ckt)
   ckt->add_downstream(conn);
   bufferevent_setcb(buf, downstream_read_cb, downstream_flush_cb,
                     downstream_socks_connect_cb, conn);
-  return;
+  return true;
 
  failure:
   /* XXXX send socks reply */
   ckt->close();
   if (buf)
     bufferevent_free(buf);
+  return false;
 }
 
 void
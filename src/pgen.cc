@@ -0,0 +1,159 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "pgen.h"
+
+#include <unistd.h>
+
+unsigned int
+pgen_default_threads()
+{
+#if defined HAVE_PTHREAD && defined _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0)
+    return n;
+#endif
+  return 1;
+}
+
+#ifdef HAVE_PTHREAD
+namespace {
+  struct thread_start
+  {
+    void (*fn)(void *, unsigned int);
+    void *arg;
+    unsigned int index;
+  };
+}
+
+static void *
+thread_main(void *arg)
+{
+  thread_start *ts = (thread_start *)arg;
+  ts->fn(ts->arg, ts->index);
+  return 0;
+}
+#endif
+
+void
+pgen_run_threads(unsigned int nthreads,
+                 void (*fn)(void *arg, unsigned int thread), void *arg)
+{
+#ifdef HAVE_PTHREAD
+  if (nthreads > 1) {
+    pthread_t *threads = new pthread_t[nthreads];
+    thread_start *starts = new thread_start[nthreads];
+    unsigned int i;
+
+    for (i = 0; i < nthreads; i++) {
+      starts[i].fn = fn;
+      starts[i].arg = arg;
+      starts[i].index = i;
+      if (pthread_create(&threads[i], 0, thread_main, &starts[i])) {
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    for (i = 0; i < nthreads; i++)
+      pthread_join(threads[i], 0);
+
+    delete[] threads;
+    delete[] starts;
+    return;
+  }
+#endif
+  for (unsigned int i = 0; i < nthreads; i++)
+    fn(arg, i);
+}
+
+pgen_file::pgen_file(const char *name)
+  : fname(name), entries(0), bytes(0)
+{
+  fp = fopen(fname, "wb");
+  if (!fp) {
+    perror(fname);
+    exit(1);
+  }
+}
+
+pgen_file::~pgen_file()
+{
+  if (ferror(fp) || fclose(fp)) {
+    perror(fname);
+    exit(1);
+  }
+}
+
+void
+pgen_file::write(const uint8_t *data, size_t len, unsigned long nentries)
+{
+  lock.lock();
+  if (fwrite(data, 1, len, fp) != len) {
+    perror(fname);
+    exit(1);
+  }
+  entries += nentries;
+  bytes += len;
+  lock.unlock();
+}
+
+pgen_buffer::pgen_buffer(pgen_file *f, size_t chunk)
+  : file(f), len(0), cap(chunk), entries(0)
+{
+  buf = (uint8_t *)xmalloc(cap);
+}
+
+pgen_buffer::~pgen_buffer()
+{
+  flush();
+  free(buf);
+}
+
+void
+pgen_buffer::flush()
+{
+  if (len)
+    file->write(buf, len, entries);
+  len = 0;
+  entries = 0;
+}
+
+uint8_t *
+pgen_buffer::start_entry(uint16_t ptype, uint16_t port, size_t length)
+{
+  size_t need = sizeof(pentry_header) + length;
+  if (len + need > cap) {
+    flush();
+    // an entry bigger than a chunk gets a buffer to itself
+    if (need > cap) {
+      cap = need;
+      free(buf);
+      buf = (uint8_t *)xmalloc(cap);
+    }
+  }
+
+  pentry_header pe;
+  memset(&pe, 0, sizeof pe);
+  pe.ptype = htons(ptype);
+  pe.length = htonl(length);
+  pe.port = htons(port);
+  memcpy(buf + len, &pe, sizeof pe);
+
+  uint8_t *body = buf + len + sizeof pe;
+  len += need;
+  entries++;
+  return body;
+}
+
+void
+pgen_buffer::add_entry(uint16_t ptype, uint16_t port,
+                       const void *a, size_t alen,
+                       const void *b, size_t blen)
+{
+  uint8_t *body = start_entry(ptype, port, alen + blen);
+  memcpy(body, a, alen);
+  if (blen)
+    memcpy(body + alen, b, blen);
+}
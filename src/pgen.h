@@ -20,4 +20,91 @@ struct pentry_header {
   uint8_t  pad2[2];
 };
 
+/* Support for generating traces on several threads at once (pgen.cc).
+   Where POSIX threads are not available, everything runs on one. */
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Entries are appended to a trace file in chunks of about this size. */
+#define PGEN_CHUNK_SIZE (4 << 20)
+
+/** How many threads to use if not told: one per online CPU. */
+unsigned int pgen_default_threads();
+
+/** Call FN(ARG, i) for each i from 0 to NTHREADS-1, each on a thread
+    of its own, and wait for them all to finish. */
+void pgen_run_threads(unsigned int nthreads,
+                      void (*fn)(void *arg, unsigned int thread),
+                      void *arg);
+
+struct pgen_mutex
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t m;
+  pgen_mutex() { pthread_mutex_init(&m, 0); }
+  ~pgen_mutex() { pthread_mutex_destroy(&m); }
+  void lock() { pthread_mutex_lock(&m); }
+  void unlock() { pthread_mutex_unlock(&m); }
+#else
+  void lock() {}
+  void unlock() {}
+#endif
+};
+
+/** A trace file being written by several threads.  Each thread
+    collects whole entries in a pgen_buffer of its own, which is
+    appended to the file in one piece when it fills up; entries from
+    different threads therefore never interleave, and the file is
+    written in large sequential chunks.  Write errors are fatal. */
+struct pgen_file
+{
+  const char *fname;
+  FILE *fp;
+  pgen_mutex lock;
+  unsigned long entries;
+  uint64_t bytes;
+
+  /** Open FNAME for writing, or exit with an error message. */
+  pgen_file(const char *name);
+  /** Close the file, or exit with an error message. */
+  ~pgen_file();
+
+  void write(const uint8_t *data, size_t len, unsigned long nentries);
+
+private:
+  pgen_file(const pgen_file&) DELETE_METHOD;
+  pgen_file& operator=(const pgen_file&) DELETE_METHOD;
+};
+
+struct pgen_buffer
+{
+  pgen_file *file;
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  unsigned long entries;
+
+  pgen_buffer(pgen_file *f, size_t chunk = PGEN_CHUNK_SIZE);
+  /** Flushes anything not yet written. */
+  ~pgen_buffer();
+
+  /** Start an entry of type PTYPE for PORT (both in host byte order)
+      whose body will be LENGTH bytes long, and return where to put
+      the body.  The pointer is good until the next call. */
+  uint8_t *start_entry(uint16_t ptype, uint16_t port, size_t length);
+
+  /** Add an entry whose body is A followed by B. */
+  void add_entry(uint16_t ptype, uint16_t port,
+                 const void *a, size_t alen,
+                 const void *b = 0, size_t blen = 0);
+
+  void flush();
+
+private:
+  pgen_buffer(const pgen_buffer&) DELETE_METHOD;
+  pgen_buffer& operator=(const pgen_buffer&) DELETE_METHOD;
+};
+
 #endif
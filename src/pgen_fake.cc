@@ -7,11 +7,12 @@
 #include "rng.h"
 #include "base64.h"
 
+#include <algorithm>
+#include <cmath>
 #include <string>
-#include <sstream>
+#include <unistd.h>
 
 using std::string;
-using std::ostringstream;
 
 // John Bauman's 1995 revision of the "General Service List" of common
 // English words -- see http://jbauman.com/aboutgsl.html -- "a" and "I"
@@ -364,9 +365,11 @@ enum payload_type {
   PT_HTML,
   PT_JS,
   PT_SWF,
-  PT_PDF
+  PT_PDF,
+  PT_COUNT
 };
 
+const char *const type_names[] = { "html", "js", "swf", "pdf" };
 const char *const type_extensions[] = { ".html", ".js", ".swf", ".pdf" };
 const char *const type_mimes[] = {
   "text/html; charset=utf-8",
@@ -375,14 +378,156 @@ const char *const type_mimes[] = {
   "application/pdf"
 };
 
+namespace {
+  /* Each thread has a generator of its own (xoshiro256**), so that
+     nothing is shared between them.  This is only filler for test
+     corpora; it need not be cryptographically strong, just fast. */
+  class fake_rng
+  {
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k)
+    { return (x << k) | (x >> (64 - k)); }
+
+  public:
+    fake_rng(uint64_t seed)
+    {
+      // splitmix64 expands the seed into the initial state
+      for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        s[i] = z ^ (z >> 31);
+      }
+    }
+
+    uint64_t next()
+    {
+      uint64_t rv = rotl(s[1] * 5, 7) * 9;
+      uint64_t t = s[1] << 17;
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl(s[3], 45);
+      return rv;
+    }
+
+    uint8_t byte() { return next() >> 56; }
+
+    void bytes(uint8_t *buf, size_t n)
+    {
+      for (; n >= 8; n -= 8, buf += 8) {
+        uint64_t x = next();
+        memcpy(buf, &x, 8);
+      }
+      if (n) {
+        uint64_t x = next();
+        memcpy(buf, &x, n);
+      }
+    }
+
+    /** As rng_int. */
+    unsigned int below(unsigned int max)
+    {
+      log_assert(max > 0);
+      return ((next() >> 32) * max) >> 32;
+    }
+
+    /** As rng_range. */
+    unsigned int range(unsigned int min, unsigned int max)
+    {
+      log_assert(max > min);
+      return min + below(max - min);
+    }
+
+    /** As rng_range_geom. */
+    unsigned int geom(unsigned int hi, unsigned int xv);
+  };
+
+  /* How big the payload of each type should be. */
+  struct size_dist
+  {
+    enum { GEOM, UNIFORM, FIXED } kind;
+    unsigned int a;
+    unsigned int b;
+
+    size_t draw(fake_rng &rng) const
+    {
+      switch (kind) {
+      case GEOM:    return rng.geom(a, b);
+      case UNIFORM: return rng.range(a, b + 1);
+      default:      return a;
+      }
+    }
+  };
+
+  struct fake_job
+  {
+    unsigned long count;
+    unsigned int nthreads;
+    uint64_t seed;
+    size_dist sizes[PT_COUNT];
+    pgen_file *file;
+    void (*gen_one)(struct gen_state &g, pgen_buffer &out);
+  };
+
+  /* Per-thread generator state.  The scratch strings keep their
+     storage from one entry to the next. */
+  struct gen_state
+  {
+    fake_rng rng;
+    const fake_job *job;
+    string head;
+    string body;
+
+    gen_state(const fake_job *j, uint64_t seed)
+      : rng(seed), job(j)
+    {
+      head.reserve(4096);
+      body.reserve(65536);
+    }
+  };
+}
+
+/* The same computation as rng_range_geom, on this thread's generator. */
+unsigned int
+fake_rng::geom(unsigned int hi, unsigned int xv)
+{
+  log_assert(hi <= ((unsigned int)INT_MAX)+1);
+  log_assert(0 < xv && xv < hi);
+
+  // uniform on (0, 1]
+  double U = ((next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+  double xe = 1./std::log(1. + 1./xv);
+  double ulo = std::exp(-double(hi)/xe);
+  U = ulo + U * (1-ulo);
+  double T = -std::log(U) * xe;
+  return std::min(hi-1, std::max(0U, (unsigned int)std::floor(T)));
+}
+
+static void
+put_num(string& s, unsigned long n)
+{
+  char buf[24];
+  int len = snprintf(buf, sizeof buf, "%lu", n);
+  s.append(buf, len);
+}
+
+static const char *
+common_word(gen_state& g)
+{
+  return words[g.rng.geom(nwords, nwords/3)];
+}
+
 // payloads.cc uses the *file extension* on the URL to decide what to
 // send back.  Use HTML half of the time, JS three-quarters of the
 // remaining time, and PDF or SWF each half of what's left over.
 static payload_type
-pick_payload_type()
+pick_payload_type(gen_state& g)
 {
-  uint8_t b;
-  rng_bytes(&b, 1);
+  uint8_t b = g.rng.byte();
   if (b >= 128)
     return PT_HTML;
   else if (b >= 32)
@@ -394,20 +539,22 @@ pick_payload_type()
 }
 
 static void
-gen_one_uripath(ostringstream& os)
+gen_one_uripath(gen_state& g, string& os)
 {
-  int n = rng_range_geom(10, 3);
-  for (int i = 0; i < n; i++)
-    os << words[rng_range_geom(nwords, nwords/3)] << '/';
+  int n = g.rng.geom(10, 3);
+  for (int i = 0; i < n; i++) {
+    os += common_word(g);
+    os += '/';
+  }
 
-  os << words[rng_range_geom(nwords, nwords/3)];
-  os << type_extensions[pick_payload_type()];
+  os += common_word(g);
+  os += type_extensions[pick_payload_type(g)];
 }
 
 static void
-gen_one_hostname(ostringstream& os)
+gen_one_hostname(gen_state& g, string& os)
 {
-  unsigned int choices = rng_int(0x10);
+  unsigned int choices = g.rng.below(0x10);
   bool use_www  = choices & 0x01;
   bool use_subd = choices & 0x02;
   unsigned int tld = (choices & 0x0C) >> 2;
@@ -415,17 +562,20 @@ gen_one_hostname(ostringstream& os)
   const char *const tlds[4] = { ".com", ".org", ".sv", ".ac.uk" };
 
   if (use_www)
-    os << "www.";
-  if (use_subd)
-    os << words[rng_range_geom(nwords, nwords/3)] << '.';
+    os += "www.";
+  if (use_subd) {
+    os += common_word(g);
+    os += '.';
+  }
 
-  os << words[rng_range_geom(nwords, nwords/3)] << tlds[tld];
+  os += common_word(g);
+  os += tlds[tld];
 }
 
 static void
-gen_one_cookie_header(ostringstream& os)
+gen_one_cookie_header(gen_state& g, string& os)
 {
-  int n = rng_range(1,5);
+  int n = g.rng.range(1,5);
   uint8_t buf[80];
   char obuf[160];
   int m;
@@ -433,62 +583,66 @@ gen_one_cookie_header(ostringstream& os)
   base64::encoder enc(false, '_', '.', '-');
 
   for (int i = 0; i < n; i++) {
-    os << words[rng_range_geom(nwords, nwords/3)] << '=';
+    os += common_word(g);
+    os += '=';
 
-    m = rng_range_geom(80, 20);
-    rng_bytes(buf, m);
+    m = g.rng.geom(80, 20);
+    g.rng.bytes(buf, m);
     mo = enc.encode((const char *)buf, m, obuf);
     mo += enc.encode_end(obuf + mo);
-    obuf[mo] = '\0';
-    os << obuf;
+    os.append(obuf, mo);
 
     if (i+1 < n)
-      os << ',';
+      os += ',';
   }
 }
 
 static void
-gen_one_html(ostringstream& cs, size_t approx_size)
+gen_one_html(gen_state& g, string& cs, size_t approx_size)
 {
   // HTML needs to be substantially bigger than anything else,
   // since we can only use the scripts which are only a small part
   // of the file.
   approx_size *= 5;
 
-  cs << "<!doctype html>\n<html><head>\n<title>";
-  int n = rng_range_geom(6, 2);
-  for (int i = 0; i < n; i++)
-    cs << words[rng_int(nwords)] << ' ';
-  cs << words[rng_int(nwords)]
-     << "</title>\n</head><body>\n<p>";
+  cs += "<!doctype html>\n<html><head>\n<title>";
+  int n = g.rng.geom(6, 2);
+  for (int i = 0; i < n; i++) {
+    cs += words[g.rng.below(nwords)];
+    cs += ' ';
+  }
+  cs += words[g.rng.below(nwords)];
+  cs += "</title>\n</head><body>\n<p>";
 
-  n = rng_range_geom(50, 20);
+  n = g.rng.geom(50, 20);
   bool in_script = false;
   do {
-    cs << words[rng_int(nwords)] << ' ';
+    cs += words[g.rng.below(nwords)];
+    cs += ' ';
     n--;
     if (n <= 0) {
-      n = rng_range_geom(50, 20);
+      n = g.rng.geom(50, 20);
       if (in_script) {
-        cs << "</script>\n<p>";
+        cs += "</script>\n<p>";
         in_script = false;
       } else {
         // jsSteg insists on <script type="text/javascript"> for no
         // apparent reason (and this is as a fixed string, not as
         // properly parsed HTML).
-        cs << "</p>\n<script type=\"text/javascript\">";
+        cs += "</p>\n<script type=\"text/javascript\">";
         in_script = true;
       }
     }
-  } while (size_t(cs.tellp()) < approx_size);
+  } while (cs.size() < approx_size);
 
-  cs << (in_script ? "</script>" : "</p>") << "\n</body></html>\n";
+  cs += in_script ? "</script>" : "</p>";
+  cs += "\n</body></html>\n";
 }
 
 static void
-gen_one_js(ostringstream& cs, size_t approx_size)
+gen_one_js(gen_state& g, string& cs, size_t approx_size)
 {
-  const char *const js_keywords[] = {
+  static const char *const js_keywords[] = {
     "break", "case", "catch", "class", "continue", "debugger", "default",
     "delete", "do", "else", "enum", "export", "extends", "false",
     "finally", "for", "function", "if", "implements", "import", "in",
@@ -498,7 +652,7 @@ gen_one_js(ostringstream& cs, size_t approx_size)
   };
   const size_t n_js_keywords = (sizeof js_keywords) / (sizeof js_keywords[0]);
 
-  const char *const js_punct[] = {
+  static const char *const js_punct[] = {
     "(", ")", "[", "]", "{", "}", ":", ";", ".", ",",
     "+", "-", "/", "*", "%", "++", "--", "&", "|", "<<", ">>", ">>>",
     "=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", ">>>=", "&=", "^=", "|=",
@@ -507,24 +661,21 @@ gen_one_js(ostringstream& cs, size_t approx_size)
   const size_t n_js_punct = (sizeof js_punct) / (sizeof js_punct[0]);
 
   do {
-    uint8_t which;
-    rng_bytes(&which, 1);
-    if (which < 32)
-      cs << js_keywords[rng_int(n_js_keywords)];
+    if (g.rng.byte() < 32)
+      cs += js_keywords[g.rng.below(n_js_keywords)];
     else
-      cs << words[rng_range_geom(nwords, nwords/3)];
+      cs += common_word(g);
 
-    rng_bytes(&which, 1);
-    if (which < 128)
-      cs << " ";
+    if (g.rng.byte() < 128)
+      cs += ' ';
     else
-      cs << js_punct[rng_int(n_js_punct)];
+      cs += js_punct[g.rng.below(n_js_punct)];
 
-  } while (size_t(cs.tellp()) < approx_size);
+  } while (cs.size() < approx_size);
 }
 
 static void
-gen_one_swf(ostringstream& cs, size_t approx_size)
+gen_one_swf(gen_state&, string& cs, size_t approx_size)
 {
   // This does not attempt to produce the SWF file format *at all*,
   // only its magic number and length field.  swfSteg.cc is presently
@@ -532,60 +683,59 @@ gen_one_swf(ostringstream& cs, size_t approx_size)
   // bytes of the file, and makes the length field be accurate.
   uint32_t size = approx_size + 3008;
 
-  cs << "CWS\t"; // compressed, version 9; it's not compressed now,
+  cs += "CWS\t"; // compressed, version 9; it's not compressed now,
                  // but it will be after swfSteg.cc gets done with it
-  cs << uint8_t((size & 0x000000ff)) // length is little endian
-     << uint8_t((size & 0x0000ff00) >>  8)
-     << uint8_t((size & 0x00ff0000) >> 16)
-     << uint8_t((size & 0xff000000) >> 24);
-
-  for (int i = 0; i < 1500; i++)
-    cs << '\xEE';
-  for (size_t i = 0; i < approx_size; i++)
-    cs << '\xDD';
-  for (int i = 0; i < 1500; i++)
-    cs << '\xCC';
+  cs += char(size & 0x000000ff); // length is little endian
+  cs += char((size & 0x0000ff00) >>  8);
+  cs += char((size & 0x00ff0000) >> 16);
+  cs += char((size & 0xff000000) >> 24);
+
+  cs.append(1500, '\xEE');
+  cs.append(approx_size, '\xDD');
+  cs.append(1500, '\xCC');
 }
 
 static void
-gen_one_pdf(ostringstream& cs, size_t approx_size)
+gen_one_pdf(gen_state& g, string& cs, size_t approx_size)
 {
   // This only duplicates the part of the PDF format that pdfSteg.cc
   // actually looks for: in particular, we do not attempt to generate
   // a valid trailer.  (It wouldn't be terribly hard to add.)
 
   int ctr = 1;
-  cs << "%PDF-1.5\n%\xA0\xA1\xA2\xA3\n";
+  cs += "%PDF-1.5\n%\xA0\xA1\xA2\xA3\n";
   do {
-    int size = rng_range_geom(2048, 512);
+    int size = g.rng.geom(2048, 512);
 
-    cs << ctr << " 0 obj <</Length " << size << ">>\nstream\n";
+    put_num(cs, ctr);
+    cs += " 0 obj <</Length ";
+    put_num(cs, size);
+    cs += ">>\nstream\n";
     ctr++;
 
-    for (int i = 0; i < size; i++)
-      cs << '\xBB';
+    cs.append(size, '\xBB');
 
-    cs << "\nendstream\nendobj\n";
-  } while (size_t(cs.tellp()) < approx_size);
+    cs += "\nendstream\nendobj\n";
+  } while (cs.size() < approx_size);
 
-  cs << "%%EOF\n";
+  cs += "%%EOF\n";
 }
 
 static void
-gen_one_client_trace(ostringstream& os, pentry_header& pe)
+gen_one_client_trace(gen_state& g, pgen_buffer& out)
 {
-  pe.ptype = htons(TYPE_HTTP_REQUEST);
-  pe.port = htons(80);
+  string& os = g.head;
+  os.clear();
 
-  os << "GET /";
+  os += "GET /";
 
-  gen_one_uripath(os);
+  gen_one_uripath(g, os);
 
-  os << " HTTP/1.1\r\nHost: ";
+  os += " HTTP/1.1\r\nHost: ";
 
-  gen_one_hostname(os);
+  gen_one_hostname(g, os);
 
-  os <<
+  os +=
     "\r\nUser-Agent: Mozilla/5.0 (Macintosh; "
         "Intel Mac OS X 10.6; rv:10.0) Gecko/20100101 Firefox/10.0"
     "\r\nAccept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"
@@ -593,70 +743,174 @@ gen_one_client_trace(ostringstream& os, pentry_header& pe)
     "\r\nAccept-Encoding: gzip, deflate"
     "\r\nCookie: ";
 
-  gen_one_cookie_header(os);
+  gen_one_cookie_header(g, os);
+
+  os += "\r\nConnection: keep-alive\r\n\r\n";
 
-  os << "\r\nConnection: keep-alive\r\n\r\n";
+  out.add_entry(TYPE_HTTP_REQUEST, 80, os.data(), os.size());
 }
 
 static void
-gen_one_server_trace(ostringstream& os, pentry_header& pe)
+gen_one_server_trace(gen_state& g, pgen_buffer& out)
 {
-  typedef void (*gen_payload_f)(ostringstream&, size_t);
-  const gen_payload_f type_payloadgens[] = {
+  typedef void (*gen_payload_f)(gen_state&, string&, size_t);
+  static const gen_payload_f type_payloadgens[] = {
     gen_one_html, gen_one_js, gen_one_swf, gen_one_pdf
   };
 
-  pe.ptype = htons(TYPE_HTTP_RESPONSE);
-  pe.port = htons(80);
+  payload_type pt = pick_payload_type(g);
+  size_t approx_size = g.job->sizes[pt].draw(g.rng);
 
-  payload_type pt = pick_payload_type();
-  size_t approx_size = rng_range_geom(16384, 4096);
+  string& cs = g.body;
+  cs.clear();
+  type_payloadgens[pt](g, cs, approx_size);
 
-  ostringstream cs;
-  type_payloadgens[pt](cs, approx_size);
-  string const& content = cs.str();
-
-  os <<
+  string& os = g.head;
+  os.clear();
+  os +=
     "HTTP/1.1 200 OK\r\n"
     "Server: Apache\r\n"
     "Accept-Ranges: bytes\r\n"
-    "Content-Type: " << type_mimes[pt] << "\r\n"
-    "Content-Length: " << content.size() << "\r\n"
-    "Connection: keep-alive\r\n\r\n" << content;
+    "Content-Type: ";
+  os += type_mimes[pt];
+  os += "\r\nContent-Length: ";
+  put_num(os, cs.size());
+  os += "\r\nConnection: keep-alive\r\n\r\n";
+
+  out.add_entry(TYPE_HTTP_RESPONSE, 80, os.data(), os.size(),
+                cs.data(), cs.size());
 }
 
 static void
-gen_traces(unsigned long n, const char *fname,
-           void (*gen_one)(ostringstream&, pentry_header&))
+gen_thread(void *arg, unsigned int thread)
 {
-  FILE *fp = fopen(fname, "wb");
-  if (!fp) {
-    perror(fname);
-    exit(1);
-  }
+  const fake_job *job = (const fake_job *)arg;
+  unsigned long lo = job->count * thread / job->nthreads;
+  unsigned long hi = job->count * (thread + 1) / job->nthreads;
 
-  for (unsigned long i = 0; i < n; i++) {
-    pentry_header pe;
-    memset(&pe, 0, sizeof(pe));
+  gen_state *g = new gen_state(job, job->seed + thread);
+  pgen_buffer *out = new pgen_buffer(job->file);
 
-    ostringstream os;
-    gen_one(os, pe);
+  for (unsigned long i = lo; i < hi; i++)
+    job->gen_one(*g, *out);
 
-    string const& o = os.str();
-    pe.length = htonl(o.size());
-    fwrite(&pe, sizeof(pentry_header), 1, fp);
-    fwrite(o.data(), o.size(), 1, fp);
-  }
+  delete out;
+  delete g;
+}
 
-  if (ferror(fp) || fclose(fp)) {
-    perror(fname);
-    exit(1);
+static void
+gen_traces(fake_job *job, const char *fname,
+           void (*gen_one)(gen_state&, pgen_buffer&))
+{
+  pgen_file file(fname);
+  job->file = &file;
+  job->gen_one = gen_one;
+  pgen_run_threads(job->nthreads, gen_thread, job);
+  job->file = 0;
+}
+
+/* Parse TYPE=geom:HI:MEAN, TYPE=uniform:LO:HI, or TYPE=fixed:N. */
+static bool
+parse_size_dist(const char *spec, size_dist *sizes)
+{
+  const char *eq = strchr(spec, '=');
+  if (!eq)
+    return false;
+
+  int t;
+  for (t = 0; t < PT_COUNT; t++)
+    if ((size_t)(eq - spec) == strlen(type_names[t]) &&
+        !strncmp(spec, type_names[t], eq - spec))
+      break;
+  if (t == PT_COUNT)
+    return false;
+
+  size_dist d;
+  char junk;
+  if (sscanf(eq + 1, "geom:%u:%u%c", &d.a, &d.b, &junk) == 2) {
+    d.kind = size_dist::GEOM;
+    if (d.b == 0 || d.b >= d.a || d.a > (unsigned int)INT_MAX)
+      return false;
+  } else if (sscanf(eq + 1, "uniform:%u:%u%c", &d.a, &d.b, &junk) == 2) {
+    d.kind = size_dist::UNIFORM;
+    if (d.b < d.a || d.b >= (unsigned int)INT_MAX)
+      return false;
+  } else if (sscanf(eq + 1, "fixed:%u%c", &d.a, &junk) == 1) {
+    d.kind = size_dist::FIXED;
+    d.b = 0;
+  } else {
+    return false;
   }
+
+  sizes[t] = d;
+  return true;
+}
+
+static void ATTR_NORETURN
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Usage: %s [-j threads] [-n entries] [-s seed] [-z type=dist]...\n"
+          "  writes traces/client.out and traces/server.out\n"
+          "  type: html, js, swf, pdf\n"
+          "  dist: geom:HI:MEAN, uniform:LO:HI, fixed:N (payload bytes;\n"
+          "        default geom:16384:4096, HTML is five times longer)\n",
+          argv0);
+  exit(1);
 }
 
 int
-main()
+main(int argc, char **argv)
 {
-  gen_traces(10000, "traces/client.out", gen_one_client_trace);
-  gen_traces(10000, "traces/server.out", gen_one_server_trace);
+  fake_job job;
+  bool seeded = false;
+  char *end;
+  int c;
+
+  job.count = 10000;
+  job.nthreads = pgen_default_threads();
+  for (int t = 0; t < PT_COUNT; t++) {
+    job.sizes[t].kind = size_dist::GEOM;
+    job.sizes[t].a = 16384;
+    job.sizes[t].b = 4096;
+  }
+
+  while ((c = getopt(argc, argv, "j:n:s:z:")) != -1) {
+    switch (c) {
+    case 'j':
+      job.nthreads = strtoul(optarg, &end, 10);
+      if (*end || job.nthreads < 1)
+        usage(argv[0]);
+      break;
+    case 'n':
+      job.count = strtoul(optarg, &end, 10);
+      if (*end)
+        usage(argv[0]);
+      break;
+    case 's':
+      job.seed = strtoull(optarg, &end, 0);
+      if (*end)
+        usage(argv[0]);
+      seeded = true;
+      break;
+    case 'z':
+      if (!parse_size_dist(optarg, job.sizes))
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    usage(argv[0]);
+
+  // With -s, each thread's stream (and so the set of entries written,
+  // though not their order) depends only on the seed and -j.
+  if (!seeded)
+    rng_bytes((uint8_t *)&job.seed, sizeof job.seed);
+
+  gen_traces(&job, "traces/client.out", gen_one_client_trace);
+  job.seed += job.nthreads;
+  gen_traces(&job, "traces/server.out", gen_one_server_trace);
+  return 0;
 }
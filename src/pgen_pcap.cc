@@ -2,13 +2,22 @@
  * See LICENSE for other credits and copying information
  */
 
+/* Extract HTTP requests and responses from packet captures into the
+   trace files the http steg module uses (traces/client.out and
+   traces/server.out).  Capture files are processed in parallel, one
+   per thread at a time; each thread reassembles the TCP flows of its
+   current file and streams the messages it finds into the output. */
+
 #include "util.h"
 #include "pgen.h"
 #include "compression.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <signal.h>
 #include <unistd.h>
+#include <vector>
+#include <tr1/unordered_map>
 #include <pcap/pcap.h>
 
 #define __FAVOR_BSD 1
@@ -17,529 +26,548 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
-#define NUM_FLOWS 1000
-#define NUM_LISTS 1000
+using std::vector;
+using std::tr1::unordered_map;
 
 #define CONN_DATA_REQUEST 1  /* payload packet sent by client */
 #define CONN_DATA_REPLY 2  /* payload packet sent by server */
 
 #define RECV_MTU 64000
-// #define PKT_MTU 1500
-#define MAX_CHAIN_LEN 4000
+#define PORT_HTTP 80
+
+/* Longest message we will reassemble. */
+#define MAX_MSG_LEN (8 << 20)
+
+/* Segment data is copied into pages of this size, which come from a
+   per-thread arena and are reused from one message to the next. */
+#define SEG_PAGE_SIZE 16384
+#define PAGES_PER_SLAB 64
 
 #define MSG_INSERTED 1
 #define MSG_INVALID 0
-#define MSG_SEQ_WRAP -2
 #define MSG_DUPLICATE -3
-#define CHAIN_TOO_LONG -4
-#define MSG_OVERLAP -5
-#define CHAIN_HAS_GAPS_OVERLAPS -6
-#define CHAIN_EMPTY -7
-
-struct msg {
-  uint8_t *buf;
-  uint16_t len;
-  uint32_t seqno;
-  msg *next_msg;
-};
-
-struct flow {
-  uint32_t src_ip;
-  uint32_t dst_ip;
-  uint16_t sport;
-  uint16_t dport;
-  uint8_t flags;
-  uint8_t proto;
-  struct timeval change_time;
-  int sockfd;
-  flow *next_flow;
-  msg *msg_buf_chain;
-  int chain_len;
-  int msg_len_so_far;
-  int dir;           /* data request or data reply */
-  uint32_t ack_so_far;  /* what's acknowledged by other end so far */
-};
-
-static flow *flows[NUM_LISTS];
-static pcap_t *descr;
-static int dir_flag = 0;
-static char *bp_filter;
-static char errbuf[PCAP_ERRBUF_SIZE];
-static struct bpf_program fp;
-static uint32_t netp;
-static const char *argv0;
+#define MSG_TOO_LONG -4
+
+namespace {
+  class page_arena
+  {
+    vector<uint8_t *> slabs;
+    vector<uint8_t *> free_pages;
+
+  public:
+    page_arena() {}
+    ~page_arena()
+    {
+      for (size_t i = 0; i < slabs.size(); i++)
+        free(slabs[i]);
+    }
 
-#define RECV_MTU 64000
-#define PORT_HTTP 80
+    uint8_t *get()
+    {
+      if (free_pages.empty()) {
+        uint8_t *slab = (uint8_t *)xmalloc(SEG_PAGE_SIZE * PAGES_PER_SLAB);
+        slabs.push_back(slab);
+        for (int i = PAGES_PER_SLAB - 1; i >= 0; i--)
+          free_pages.push_back(slab + i * SEG_PAGE_SIZE);
+      }
+      uint8_t *p = free_pages.back();
+      free_pages.pop_back();
+      return p;
+    }
 
-static FILE *client_file;
-static FILE *server_file;
+    void put(uint8_t *p) { free_pages.push_back(p); }
+
+  private:
+    page_arena(const page_arena&) DELETE_METHOD;
+    page_arena& operator=(const page_arena&) DELETE_METHOD;
+  };
+
+  /* A range of bytes received, as offsets from reassembly::base;
+     END is exclusive. */
+  struct seg_interval
+  {
+    uint32_t start;
+    uint32_t end;
+  };
+
+  /* One message being put back together from TCP segments that may
+     arrive out of order, duplicated, or overlapping.  The data goes
+     into its place in a sequence of pages; the ranges received so far
+     are kept as a sorted list of disjoint intervals, so the message
+     is complete (has no gaps) exactly when there is one interval.
+     Segments almost always arrive in order, which extends the last
+     interval in constant time. */
+  struct reassembly
+  {
+    uint32_t base;              // sequence number of pages[0][0]
+    size_t len;                 // bytes received
+    vector<uint8_t *> pages;
+    vector<seg_interval> have;
+
+    reassembly() : base(0), len(0) {}
+
+    bool empty() const { return have.empty(); }
+    bool complete() const { return have.size() == 1; }
+
+    int add(page_arena &arena, uint32_t seq, const uint8_t *data, size_t n);
+    void copy_out(uint8_t *out) const;
+    void clear(page_arena &arena);
+  };
+
+  struct flow_key
+  {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t sport;
+    uint16_t dport;
+
+    bool operator==(const flow_key &o) const
+    {
+      return src_ip == o.src_ip && dst_ip == o.dst_ip &&
+        sport == o.sport && dport == o.dport;
+    }
 
-static void ATTR_NORETURN
-usage()
-{
-  fprintf(stderr, "Usage: %s [-d dumpdir] [-r dumpfile] \"bpf filter\"\n",
-          argv0);
-  exit(1);
+    flow_key reverse() const
+    {
+      flow_key r = { dst_ip, src_ip, dport, sport };
+      return r;
+    }
+  };
+
+  struct flow_key_hash
+  {
+    size_t operator()(const flow_key &k) const
+    {
+      uint64_t h = ((uint64_t)k.src_ip << 32 | k.dst_ip)
+        ^ ((uint64_t)k.sport << 16 | k.dport) * 0x9e3779b97f4a7c15ull;
+      return h ^ (h >> 29);
+    }
+  };
+
+  struct flow
+  {
+    uint8_t flags;
+    int dir;              /* data request or data reply */
+    uint32_t ack_so_far;  /* what's acknowledged by other end so far */
+    reassembly msg;
+
+    flow() : flags(0), dir(0), ack_so_far(0) {}
+  };
+
+  typedef unordered_map<flow_key, flow, flow_key_hash> flow_table;
+
+  /* Work shared by all the threads. */
+  struct pcap_job
+  {
+    vector<char *> files;
+    size_t next_file;
+    const char *filter;
+    pgen_file *client;
+    pgen_file *server;
+    pgen_mutex lock;      // next_file, the totals, and pcap_compile
+
+    unsigned long packets;
+    unsigned long truncated;
+    unsigned long bad_segments;
+    unsigned long incomplete;
+    unsigned long invalid;
+
+    pcap_job() : next_file(0), filter(0), client(0), server(0),
+                 packets(0), truncated(0), bad_segments(0),
+                 incomplete(0), invalid(0) {}
+  };
+
+  /* Everything one thread needs. */
+  struct worker
+  {
+    pcap_job *job;
+    pcap_t *descr;
+    flow_table flows;
+    page_arena arena;
+    vector<uint8_t> msgbuf;
+    vector<uint8_t> inflated;
+    pgen_buffer client;
+    pgen_buffer server;
+
+    unsigned long packets;
+    unsigned long truncated;
+    unsigned long bad_segments;
+    unsigned long incomplete;
+    unsigned long invalid;
+
+    worker(pcap_job *j)
+      : job(j), descr(0), client(j->client), server(j->server),
+        packets(0), truncated(0), bad_segments(0), incomplete(0),
+        invalid(0) {}
+  };
 }
 
+static const char *argv0;
+static volatile sig_atomic_t stop_requested;
+
 static void ATTR_NORETURN
-terminate(int)
+usage()
 {
-  struct pcap_stat ps;
-  if (pcap_stats(descr, &ps) < 0) {
-    fputs("err: pcap stats not supported?\n", stderr);
-    exit(1);
-  }
-
-  printf("packets rcvd: %u, packets dropped: %u, interface drops: %u\n",
-         ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
+  fprintf(stderr,
+          "Usage: %s [-j threads] [-d dumpdir]... [-r dumpfile]... "
+          "\"bpf filter\"\n", argv0);
   exit(1);
 }
 
 static void
-free_msg_chain(flow *f)
+terminate(int)
 {
-  msg *m = f->msg_buf_chain;
-
-  while (m && f->chain_len > 0) {
-    msg *n = m->next_msg;
-    free(m);
-    m = n;
-  }
-
-  f->chain_len = 0;
-  f->msg_len_so_far = 0;
-  f->msg_buf_chain = 0;
+  stop_requested = 1;
 }
 
 static bool
-has_chain_gaps(flow *f)
+ends_before(const seg_interval &i, uint32_t off)
 {
-  msg *m = f->msg_buf_chain;
-
-  while (m) {
-    if (!m->next_msg)
-      return false;
-
-    if (m->seqno + m->len < m->next_msg->seqno) {
-      fprintf(stderr, "gap seqnos: %u %u %u %d\n",
-              m->seqno, m->len, m->next_msg->seqno, f->dport);
-      return true;
-    }
-
-    if (m->seqno + m->len  > m->next_msg-> seqno) {
-      fprintf(stderr, "overlap seqnos: %u %u %u\n",
-              m->seqno, m->len, m->next_msg->seqno);
-      return true;
-    }
-    m = m->next_msg;
-  }
-
-  return false;
+  return i.end < off;
 }
 
-static int
-write_inflate_msg(flow *f, FILE *file, pentry_header *ph)
+int
+reassembly::add(page_arena &arena, uint32_t seq, const uint8_t *data,
+                size_t n)
 {
-  msg *m = f->msg_buf_chain;
-  uint8_t *buf;
-  int pos = 0;
-  uint8_t *outbuf;
-  int outlen;
-
-  uint8_t *hdr_end;
-  uint8_t *hdr;
-  int hdrlen;
-
-  if (!f->msg_buf_chain)
-    return CHAIN_EMPTY;
-
-  if (strstr((char*) m->buf, "Transfer-Encoding: chunked"))
-    // we don't handle this yet....need a loop to unzip chunks individually...
+  if (n == 0 || n > RECV_MTU)
     return MSG_INVALID;
 
-  hdr_end = (uint8_t*) strstr((char*) m->buf, "\r\n\r\n");
-  if (!hdr_end) {
-    fprintf(stderr, "hdr too long?? \n");
-    return MSG_INVALID;
+  if (have.empty()) {
+    base = seq;
+  } else if ((int32_t)(seq - base) < 0) {
+    // This segment comes before anything received so far; make room
+    // for it at the front.
+    size_t k = ((base - seq) + SEG_PAGE_SIZE - 1) / SEG_PAGE_SIZE;
+    uint32_t shift = k * SEG_PAGE_SIZE;
+    if (have.back().end + (uint64_t)shift > MAX_MSG_LEN)
+      return MSG_TOO_LONG;
+    pages.insert(pages.begin(), k, (uint8_t *)0);
+    base -= shift;
+    for (size_t i = 0; i < have.size(); i++) {
+      have[i].start += shift;
+      have[i].end += shift;
+    }
   }
 
-  hdr_end += 4;
-  hdrlen = hdr_end - m->buf;
-  hdr = (uint8_t *) xmemdup(m->buf, hdrlen);
-
-  buf = (uint8_t *) xmalloc(f->msg_len_so_far);
-  outbuf = (uint8_t *) xmalloc(f->msg_len_so_far * 20);
-
-  pos = 0;
-
-  if (!m)
-    return  CHAIN_EMPTY;
-
-  memcpy(buf, hdr_end, m->len - hdrlen);
-  pos += m->len - hdrlen;
-  m = m->next_msg;
-
-  while (m) {
-    memcpy(buf+pos, m->buf, m->len);
-    pos += m->len;
-    m = m->next_msg;
+  uint32_t off = seq - base;
+  if (off > MAX_MSG_LEN || off + n > MAX_MSG_LEN)
+    return MSG_TOO_LONG;
+  uint32_t end = off + n;
+
+  // the first interval that ends at or after this segment's start
+  vector<seg_interval>::iterator first =
+    std::lower_bound(have.begin(), have.end(), off, ends_before);
+  if (first != have.end() && first->start <= off && first->end >= end)
+    return MSG_DUPLICATE;
+
+  for (uint32_t o = off; o < end; ) {
+    size_t pg = o / SEG_PAGE_SIZE, po = o % SEG_PAGE_SIZE;
+    size_t chunk = std::min((size_t)(SEG_PAGE_SIZE - po), (size_t)(end - o));
+    if (pg >= pages.size())
+      pages.resize(pg + 1, 0);
+    if (!pages[pg])
+      pages[pg] = arena.get();
+    memcpy(pages[pg] + po, data + (o - off), chunk);
+    o += chunk;
   }
 
-  outlen = decompress(buf, f->msg_len_so_far - hdrlen,
-                      outbuf, f->msg_len_so_far*20);
-
-  if (outlen < 0) {
-    fprintf(stderr, "unzip failed outlen = %d %d %d\n",
-            outlen, pos, f->msg_len_so_far-hdrlen);
-    return MSG_INVALID;
+  // merge with everything it overlaps or touches
+  seg_interval merged = { off, end };
+  vector<seg_interval>::iterator last = first;
+  while (last != have.end() && last->start <= end) {
+    merged.start = std::min(merged.start, last->start);
+    merged.end = std::max(merged.end, last->end);
+    len -= last->end - last->start;
+    ++last;
   }
-
-  ph->length = htonl(outlen+hdrlen);
-  fwrite(ph, sizeof(pentry_header), 1, file);
-  fwrite(hdr, hdrlen, 1, file);
-  fwrite(outbuf, outlen, 1, file);
-  free(buf);
-  free(outbuf);
-  free(hdr);
-  return 1;
+  len += merged.end - merged.start;
+  first = have.erase(first, last);
+  have.insert(first, merged);
+  return MSG_INSERTED;
 }
 
-static int
-write_msg_chains(flow *f, FILE *file, pentry_header *ph)
+void
+reassembly::copy_out(uint8_t *out) const
 {
-  msg *m = f->msg_buf_chain;
-  int cnt = 0;
-
-  if (has_chain_gaps(f))
-    return CHAIN_HAS_GAPS_OVERLAPS;
-
-  if (!m)
-    return CHAIN_EMPTY;
-
-  if (strstr((char*) m->buf, "200 OK") &&
-      strstr((char*) m->buf, "Content-Encoding: gzip"))
-    return write_inflate_msg(f, file, ph);
-
-  fwrite(ph, sizeof(pentry_header), 1, file);
-
-  while (m) {
-    fwrite(m->buf, m->len, 1, file);
-    cnt += m->len;
-    m = m->next_msg;
+  log_assert(complete());
+  for (uint32_t o = have[0].start; o < have[0].end; ) {
+    size_t pg = o / SEG_PAGE_SIZE, po = o % SEG_PAGE_SIZE;
+    size_t chunk = std::min((size_t)(SEG_PAGE_SIZE - po),
+                            (size_t)(have[0].end - o));
+    memcpy(out, pages[pg] + po, chunk);
+    out += chunk;
+    o += chunk;
   }
-
-  if (cnt != f->msg_len_so_far)
-    fprintf(stderr, "something funky in writing message\n");
-  return 1;
 }
 
-static bool
-is_valid_http_request(flow *f)
+void
+reassembly::clear(page_arena &arena)
 {
-  if (!f->msg_buf_chain) {
-    fprintf(stderr, "is_valid_http_request: invalid chain %d\n", f->chain_len);
-    return false;
-  }
-
-  if (!strncmp((char*) f->msg_buf_chain->buf, "GET", 3) ||
-      !strncmp((char*) f->msg_buf_chain->buf, "POST", 4)) {
-    msg *m = f->msg_buf_chain;
-    while (m->next_msg)
-      m = m->next_msg;
-
-    if (m->buf[m->len-2] == '\r' && m->buf[m->len-1] == '\n') {
-      return true;
-    }
-  }
-
-  return false;
+  for (size_t i = 0; i < pages.size(); i++)
+    if (pages[i])
+      arena.put(pages[i]);
+  pages.clear();
+  have.clear();
+  len = 0;
 }
 
-static int
-add_msg_to_flow(flow *f, uint8_t *buf, uint seq, int len)
+static const uint8_t *
+find_bytes(const uint8_t *buf, size_t len, const char *pat)
 {
-  if (len > RECV_MTU)
-    return MSG_INVALID;
-
-  if (f->chain_len >= MAX_CHAIN_LEN)
-    return CHAIN_TOO_LONG;
-
-  if (seq > seq + len)
-    return MSG_SEQ_WRAP;
-
-  msg *p = 0;
-  msg *m = f->msg_buf_chain;
-
-  if (!m) {
-    m = (msg *)xzalloc(sizeof(msg));
-    m->buf = (uint8_t *)xmalloc(len);
-    memcpy(m->buf, buf, len);
-    m->seqno = seq;
-    f->chain_len = 1;
-    f->msg_len_so_far += len;
-    f->msg_buf_chain = m;
-    m->len = len;
-    return MSG_INSERTED;
-  }
-
-  while (m) {
-    if (m->seqno == seq)
-      return MSG_DUPLICATE;
-
-    if (m->seqno < seq) {
-      if (m->seqno > seq + len)
-        return MSG_OVERLAP;
-      p = m;
-      m = m->next_msg;
-      continue;
-    }
-
-    if (m->seqno < seq + len)
-      return MSG_OVERLAP;
-
-    msg *n;
-    if (!p) {
-      p = (msg *)xzalloc(sizeof(msg));
-      p->buf = (uint8_t *)xmalloc(len);
-      memcpy(p->buf, buf, len);
-      p->seqno = seq;
-      p->next_msg = m;
-      f->chain_len++;
-      f->msg_len_so_far += len;
-      f->msg_buf_chain = p;
-      p->len = len;
-      return MSG_INSERTED;
-    }
-
-    n = (msg *)xzalloc(sizeof(msg));
-    n->buf = (uint8_t *)xmemdup(buf, len);
-    memcpy(n->buf, buf, len);
-    n->seqno = seq;
-    n->next_msg = m;
-    p->next_msg = n;
-    f->chain_len++;
-    f->msg_len_so_far += len;
-    n->len = len;
-    return MSG_INSERTED;
-  }
-
-  m = (msg *)xzalloc(sizeof(msg));
-  m->buf = (uint8_t *)xmemdup(buf, len);
-  m->seqno = seq;
-  p->next_msg = m;
-  f->chain_len++;
-  f->msg_len_so_far += len;
-  m->len = len;
-  return MSG_INSERTED;
-}
-
-static int
-hash_flow(flow *f)
-{
-  return (f->src_ip + f->dst_ip + f->sport + f->dport) % NUM_LISTS;
+  size_t plen = strlen(pat);
+  const uint8_t *end = buf + len;
+  for (const uint8_t *p = buf;
+       plen <= (size_t)(end - p) &&
+         (p = (const uint8_t *)memchr(p, pat[0], end - p + 1 - plen));
+       p++)
+    if (!memcmp(p, pat, plen))
+      return p;
+  return 0;
 }
 
 static bool
-flow_compare(flow *f1, flow *f2)
+is_valid_http_request(const uint8_t *buf, size_t len)
 {
-  return (f1->src_ip == f2->src_ip && f1->dst_ip == f2->dst_ip
-          && f1->sport == f2->sport && f1->dport == f2->dport);
+  return ((len >= 3 && !memcmp(buf, "GET", 3)) ||
+          (len >= 4 && !memcmp(buf, "POST", 4))) &&
+    buf[len-2] == '\r' && buf[len-1] == '\n';
 }
 
-static flow *
-add_to_flows(flow *f)
+static void
+write_response(worker *w, const uint8_t *buf, size_t len)
 {
-  int hval = hash_flow(f);
+  const uint8_t *hdr_end = find_bytes(buf, len, "\r\n\r\n");
+  size_t hdrlen = hdr_end ? hdr_end + 4 - buf : len;
 
-  flow *cflow = flows[hval];
-
-  if (!cflow) {
-    cflow = (flow *) xmalloc(sizeof(flow));
-    memcpy(cflow, f, sizeof(flow));
-    cflow->next_flow = 0;
-    flows[hval] = cflow;
-    return cflow;
-  }
-  else {
-    // add flow to the beginning of the chain
-    flow *old_flow = (flow *) xmalloc(sizeof(flow));
-    memcpy(old_flow, cflow, sizeof(flow));
-    memcpy(cflow, f, sizeof(flow));
-    cflow->next_flow = old_flow;
+  if (!find_bytes(buf, hdrlen, "200 OK") ||
+      !find_bytes(buf, hdrlen, "Content-Encoding: gzip")) {
+    w->server.add_entry(TYPE_HTTP_RESPONSE, PORT_HTTP, buf, len);
+    return;
   }
-  return cflow;
-}
 
-static flow *
-has_seen_flow(flow *f)
-{
-  int hval = hash_flow(f);
-  flow *cflow = flows[hval];
+  // we don't handle chunked encoding yet....need a loop to unzip
+  // chunks individually...
+  if (!hdr_end || find_bytes(buf, hdrlen, "Transfer-Encoding: chunked")) {
+    w->invalid++;
+    return;
+  }
 
-  while (cflow) {
-    if (flow_compare(cflow, f))
-      return cflow;
-    cflow = cflow->next_flow;
+  if (w->inflated.size() < len * 20)
+    w->inflated.resize(len * 20);
+  ssize_t outlen = decompress(buf + hdrlen, len - hdrlen,
+                              &w->inflated[0], len * 20);
+  if (outlen < 0) {
+    w->invalid++;
+    return;
   }
 
-  return 0;
+  w->server.add_entry(TYPE_HTTP_RESPONSE, PORT_HTTP, buf, hdrlen,
+                      &w->inflated[0], outlen);
 }
 
-static flow *
-reverse_flow(flow *f)
+static void
+write_packet(worker *w, const flow_key &k, flow *f)
 {
-  uint32_t tmp_ip;
-  uint16_t tmp_port;
+  uint16_t tport = f->dir == CONN_DATA_REQUEST ? k.dport : k.sport;
+  if (tport != PORT_HTTP)
+    return;
+
+  if (!f->msg.complete()) {
+    w->incomplete++;
+    return;
+  }
 
-  tmp_ip = f->src_ip;
-  f->src_ip = f->dst_ip;
-  f->dst_ip = tmp_ip;
+  size_t len = f->msg.len;
+  if (w->msgbuf.size() < len)
+    w->msgbuf.resize(len);
+  f->msg.copy_out(&w->msgbuf[0]);
 
-  tmp_port = f->sport;
-  f->sport = f->dport;
-  f->dport = tmp_port;
-  return f;
+  if (f->dir == CONN_DATA_REQUEST) {
+    if (is_valid_http_request(&w->msgbuf[0], len))
+      w->client.add_entry(TYPE_HTTP_REQUEST, PORT_HTTP, &w->msgbuf[0], len);
+  } else {
+    write_response(w, &w->msgbuf[0], len);
+  }
 }
 
 static void
-write_http_packet(flow *f)
+start_flow(worker *w, const flow_key &k, uint8_t flags, int dir)
 {
-  pentry_header ph;
-  ph.length = htonl(f->msg_len_so_far);
-  ph.port = htons(80);
-
-  if (f->dir == CONN_DATA_REQUEST) {
-    ph.ptype = htons(TYPE_HTTP_REQUEST);
-    if (is_valid_http_request(f))
-      write_msg_chains(f, client_file, &ph);
-  }
-  else {
-    ph.ptype = htons(TYPE_HTTP_RESPONSE);
-    write_msg_chains(f, server_file, &ph);
-  }
+  flow &f = w->flows[k];
+  f.msg.clear(w->arena);
+  f.flags = flags;
+  f.dir = dir;
+  f.ack_so_far = 0;
 }
 
 static void
-write_packet(flow *f)
+end_flow(worker *w, const flow_key &k, flow *f)
 {
-  uint16_t tport;
-  if (f->dir == CONN_DATA_REQUEST)
-    tport = f->dport;
-  else
-    tport = f->sport;
-
-  switch(tport) {
-  case PORT_HTTP:
-    write_http_packet(f);
-  }
+  f->msg.clear(w->arena);
+  w->flows.erase(k);
 }
 
 static void
-my_callback(uint8_t * /*unused*/,
-            const struct pcap_pkthdr *pkthdr,
-            const uint8_t *packet)
+packet_cb(uint8_t *user, const struct pcap_pkthdr *pkthdr,
+          const uint8_t *packet)
 {
+  worker *w = (worker *)user;
+  if (stop_requested) {
+    pcap_breakloop(w->descr);
+    return;
+  }
+  w->packets++;
 
-  struct ether_header *eth = (struct ether_header*) (packet) ;
-  int rval;
-
-  if (ntohs(eth->ether_type) == ETHERTYPE_IP) {
-
-    struct ip *iph = (struct ip*) (packet + sizeof(struct ether_header));
-    struct tcphdr *tcph = (struct tcphdr*)
-        ((uint8_t*)iph + sizeof(struct ip));
-
-    int len = htons(iph->ip_len) - 4*tcph->th_off - sizeof(struct ip);
-    uint8_t *payload = (uint8_t*) tcph + 4*tcph->th_off;
-    flow f;
-    flow *cflow;
-    flow *rflow;
-
-    memset(&f, 0, sizeof(flow));
-    f.src_ip = iph->ip_src.s_addr;
-    f.dst_ip = iph->ip_dst.s_addr;
-    f.sport  = ntohs(tcph->th_sport);
-    f.dport  = ntohs(tcph->th_dport);
-    f.flags  = tcph->th_flags;
-    f.proto  = iph->ip_p;
-    f.change_time = pkthdr->ts;
-
-    if (tcph->th_flags & TH_SYN && !(tcph->th_flags & TH_ACK)) {
-      f.dir = CONN_DATA_REQUEST;
-      add_to_flows(&f);
-      return;
-    }
+  if (pkthdr->caplen < sizeof(struct ether_header) + sizeof(struct ip) +
+      sizeof(struct tcphdr))
+    return;
 
-    else if ((tcph->th_flags & TH_SYN) && (tcph->th_flags & TH_ACK)) {
-        f.dir = CONN_DATA_REPLY;
-        add_to_flows(&f);
-        return;
-    }
+  const struct ether_header *eth = (const struct ether_header*) packet;
+  if (ntohs(eth->ether_type) != ETHERTYPE_IP)
+    return;
 
-    cflow = has_seen_flow(&f);
-    if (!cflow)
-      return;
+  const struct ip *iph =
+    (const struct ip*) (packet + sizeof(struct ether_header));
+  const struct tcphdr *tcph = (const struct tcphdr*)
+    ((const uint8_t*)iph + sizeof(struct ip));
+
+  int len = ntohs(iph->ip_len) - 4*tcph->th_off - sizeof(struct ip);
+  const uint8_t *payload = (const uint8_t*) tcph + 4*tcph->th_off;
+  if (len > 0 && payload + len > packet + pkthdr->caplen) {
+    // cut short by the snapshot length; what is missing leaves a gap
+    w->truncated++;
+    len = 0;
+  }
 
-    rflow = has_seen_flow(reverse_flow(&f));
-    if (!rflow)
-      return;
+  flow_key k = { iph->ip_src.s_addr, iph->ip_dst.s_addr,
+                 ntohs(tcph->th_sport), ntohs(tcph->th_dport) };
 
-    rflow->ack_so_far = ntohl(tcph->th_ack);
-    cflow->flags = cflow->flags | tcph->th_flags;
+  if (tcph->th_flags & TH_SYN && !(tcph->th_flags & TH_ACK)) {
+    start_flow(w, k, tcph->th_flags, CONN_DATA_REQUEST);
+    return;
+  }
+  else if ((tcph->th_flags & TH_SYN) && (tcph->th_flags & TH_ACK)) {
+    start_flow(w, k, tcph->th_flags, CONN_DATA_REPLY);
+    return;
+  }
 
-    if (len > 0 && ntohl(tcph->th_seq) >= cflow->ack_so_far) {
-      if (rflow->msg_len_so_far > 0) {
-        write_packet(rflow);
-        free_msg_chain(rflow);
-      }
+  flow_key rk = k.reverse();
+  flow_table::iterator ci = w->flows.find(k);
+  if (ci == w->flows.end())
+    return;
+  flow_table::iterator ri = w->flows.find(rk);
+  if (ri == w->flows.end())
+    return;
+  flow *cflow = &ci->second;
+  flow *rflow = &ri->second;
 
-      rval = add_msg_to_flow(cflow, payload, ntohl(tcph->th_seq), len);
+  rflow->ack_so_far = ntohl(tcph->th_ack);
+  cflow->flags = cflow->flags | tcph->th_flags;
 
-      if (rval <= 0 && rval !=MSG_DUPLICATE && rval != CHAIN_TOO_LONG) {
-        fprintf(stderr, "adding msg to flow failed %d %d\n", rval, len);
-      }
+  if (len > 0 && ntohl(tcph->th_seq) >= cflow->ack_so_far) {
+    // the other side has finished what it was saying
+    if (!rflow->msg.empty()) {
+      write_packet(w, rk, rflow);
+      rflow->msg.clear(w->arena);
     }
 
+    int rval = cflow->msg.add(w->arena, ntohl(tcph->th_seq), payload, len);
+    if (rval <= 0 && rval != MSG_DUPLICATE && rval != MSG_TOO_LONG)
+      w->bad_segments++;
+  }
 
-    if (cflow->flags & TH_RST || cflow->flags & TH_FIN) {
-      if (rflow->msg_len_so_far > 0) {
-        write_packet(rflow);
-        free_msg_chain(rflow);
-      }
-      return;
+  if (cflow->flags & TH_RST || cflow->flags & TH_FIN) {
+    if (!rflow->msg.empty()) {
+      write_packet(w, rk, rflow);
+      rflow->msg.clear(w->arena);
+    }
+
+    // Once both sides are done (or either has reset), nothing more
+    // can come of the connection; this side may have sent the last
+    // of its message along with the FIN or before the RST.
+    if (((cflow->flags | rflow->flags) & TH_RST) ||
+        (rflow->flags & TH_FIN)) {
+      if (!cflow->msg.empty())
+        write_packet(w, k, cflow);
+      end_flow(w, k, cflow);
+      end_flow(w, rk, rflow);
     }
   }
 }
 
 static void
-handle_pcap_file(const char *filename)
+handle_pcap_file(worker *w, const char *filename)
 {
-  descr = pcap_open_offline(filename, errbuf);
-  if (!descr) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct bpf_program fp;
+  int rv;
+
+  fprintf(stderr, "%s\n", filename);
+  w->descr = pcap_open_offline(filename, errbuf);
+  if (!w->descr) {
     fprintf(stderr, "%s: %s\n", filename, errbuf);
     exit(1);
   }
 
-  if (pcap_compile(descr, &fp, bp_filter, 1, netp) == -1) {
-    fprintf(stderr, "Error calling pcap_compile on \"%s\"\n", bp_filter);
+  // pcap_compile is not reentrant in all versions of libpcap
+  w->job->lock.lock();
+  rv = pcap_compile(w->descr, &fp, w->job->filter, 1, 0);
+  w->job->lock.unlock();
+  if (rv == -1) {
+    fprintf(stderr, "Error calling pcap_compile on \"%s\"\n",
+            w->job->filter);
     exit(1);
   }
 
   /* set the compiled program as the filter */
-  if (pcap_setfilter(descr, &fp) == -1) {
+  if (pcap_setfilter(w->descr, &fp) == -1) {
     fprintf(stderr,"Error setting filter\n");
     exit(1);
   }
+  pcap_freecode(&fp);
 
   /* main pcap loop */
-  pcap_loop(descr, -1, my_callback, 0);
-  pcap_close(descr);
+  pcap_loop(w->descr, -1, packet_cb, (uint8_t *)w);
+  pcap_close(w->descr);
+  w->descr = 0;
+
+  // Flows do not carry over from one capture file to the next, since
+  // the next file may well be handled by another thread.
+  for (flow_table::iterator i = w->flows.begin(); i != w->flows.end(); ++i)
+    i->second.msg.clear(w->arena);
+  w->flows.clear();
 }
 
 static void
-list_files(const char *dirname)
+run_worker(void *arg, unsigned int)
+{
+  pcap_job *job = (pcap_job *)arg;
+  worker *w = new worker(job);
+
+  while (!stop_requested) {
+    job->lock.lock();
+    size_t i = job->next_file++;
+    job->lock.unlock();
+    if (i >= job->files.size())
+      break;
+    handle_pcap_file(w, job->files[i]);
+  }
+
+  job->lock.lock();
+  job->packets += w->packets;
+  job->truncated += w->truncated;
+  job->bad_segments += w->bad_segments;
+  job->incomplete += w->incomplete;
+  job->invalid += w->invalid;
+  job->lock.unlock();
+
+  // flushes this thread's output
+  delete w;
+}
+
+static void
+list_files(pcap_job *job, const char *dirname)
 {
   DIR *dip;
   struct dirent *dit;
@@ -561,9 +589,7 @@ list_files(const char *dirname)
     fname[plen] = '/';
     memcpy(fname + plen + 1, dit->d_name, dlen);
     fname[plen + dlen + 1] = '\0';
-    fprintf(stderr, "%s\n", fname);
-    handle_pcap_file(fname);
-    free(fname);
+    job->files.push_back(fname);
   }
 
   closedir(dip);
@@ -573,49 +599,61 @@ int
 main(int argc, char **argv)
 {
   int c;
-  const char *dumpfile = 0;
+  unsigned int nthreads = pgen_default_threads();
+  pcap_job job;
 
   argv0 = argv[0];
 
-  while ((c = getopt (argc, argv, "r:d:")) != -1) {
+  while ((c = getopt (argc, argv, "r:d:j:")) != -1) {
     switch (c) {
     case 'r':
-      dumpfile = optarg;
+      job.files.push_back(xstrdup(optarg));
       break;
     case 'd':
-      dir_flag = 1;
-      dumpfile = optarg;
+      list_files(&job, optarg);
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      if (nthreads < 1)
+        usage();
       break;
     default:
       usage();
     }
   }
 
-  if (!argv[optind] || !dumpfile)
+  if (!argv[optind] || job.files.empty())
     usage();
 
-  bp_filter = xstrdup(argv[optind]);
-
-  client_file = fopen("traces/client.out", "w");
-  if (!client_file) {
-    perror("traces/client.out");
-    return 1;
-  }
-  server_file = fopen("traces/server.out", "w");
-  if (!server_file) {
-    perror("traces/server.out");
-    return 1;
-  }
+  job.filter = argv[optind];
+  if (nthreads > job.files.size())
+    nthreads = job.files.size();
 
-  /* catch ^C print stats and exit */
+  /* catch ^C, finish up cleanly, and exit */
   signal(SIGTERM, terminate);
   signal(SIGINT, terminate);
   signal(SIGHUP, terminate);
 
-  if (dir_flag)
-    list_files(dumpfile);
-  else
-    handle_pcap_file(dumpfile);
+  {
+    pgen_file client_file("traces/client.out");
+    pgen_file server_file("traces/server.out");
+    job.client = &client_file;
+    job.server = &server_file;
+
+    pgen_run_threads(nthreads, run_worker, &job);
+
+    fprintf(stderr,
+            "%lu packets in %lu files; wrote %lu requests, %lu responses\n"
+            "skipped %lu incomplete and %lu unusable messages, "
+            "%lu bad and %lu truncated segments\n",
+            job.packets,
+            (unsigned long)std::min(job.next_file, job.files.size()),
+            client_file.entries, server_file.entries,
+            job.incomplete, job.invalid, job.bad_segments, job.truncated);
+  }
+
+  for (size_t i = 0; i < job.files.size(); i++)
+    free(job.files[i]);
 
-  return 0;
+  return stop_requested ? 1 : 0;
 }
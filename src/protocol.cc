@@ -6,6 +6,8 @@
 #include "util.h"
 #include "protocol.h"
 
+using std::vector;
+
 /**
    Return 1 if 'name' is the name of a supported protocol, otherwise 0.
 */
@@ -40,3 +42,23 @@ config_create(int n_options, const char *const *options)
 /* Define this here rather than in the class definition so that the
    vtable will be emitted in only one place. */
 config_t::~config_t() {}
+
+void
+config_t::select_targets(vector<size_t> &out)
+{
+  for (size_t n = 0; get_target_addrs(n); n++)
+    out.push_back(n);
+}
+
+bool
+config_t::can_reload(const config_t *) const
+{
+  log_warn("%s: configuration cannot be changed while running", name());
+  return false;
+}
+
+void
+config_t::reload(config_t *)
+{
+  log_abort("%s: reload without can_reload", name());
+}
@@ -6,6 +6,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <vector>
+
 struct proto_module;
 struct steg_config_t;
 
@@ -23,8 +25,22 @@ struct config_t
   enum listen_mode           mode;
   /* stopgap, see create_outbound_connections_socks */
   bool ignore_socks_destination : 1;
-
-  config_t() : base(0), mode((enum listen_mode)-1) {}
+  /* send the SOCKS reply before the outbound connection is made,
+     see socks_read_cb */
+  bool socks_optimistic : 1;
+  /* give new server circuits a socketless upstream buffer instead of
+     connecting anywhere; bench_replay sets this on configurations it
+     never listens with, and there is no command-line option for it */
+  bool replay : 1;
+
+  /* Blocks sent and received on this configuration's circuits, kept
+     by protocols that frame their data into blocks (for benchmarks). */
+  uint64_t blocks_sent;
+  uint64_t blocks_received;
+
+  config_t()
+    : base(0), mode((enum listen_mode)-1), replay(false),
+      blocks_sent(0), blocks_received(0) {}
   virtual ~config_t();
 
   /** Return the name of the protocol associated with this
@@ -53,6 +69,26 @@ struct config_t
       same way as for get_listen_addrs.  */
   virtual evutil_addrinfo *get_target_addrs(size_t n) const = 0;
 
+  /** Append to OUT the values of N for which a circuit that needs new
+      outbound connections should connect to get_target_addrs(N).
+      The default is every set of target addresses; protocols that
+      keep track of which targets work best may choose fewer. */
+  virtual void select_targets(std::vector<size_t> &out);
+
+  /** Say whether FRESH, a configuration of the same protocol newly
+      built from a reloaded configuration file, can be taken over by
+      this one while it is in use, i.e. whether it differs only in
+      settings that can change without disturbing listeners and
+      existing circuits.  If not, log why.  The default is that
+      nothing can be reloaded. */
+  virtual bool can_reload(const config_t *fresh) const;
+
+  /** Take over FRESH's settings, which can_reload has accepted, for
+      connections and circuits created from now on.  FRESH is deleted
+      afterward; anything taken from it must be left out of what its
+      destructor frees. */
+  virtual void reload(config_t *fresh);
+
   /** Return the steganography module associated with either listener
       or target address set N.  If called on a protocol that doesn't
       use steganography, will return NULL.  */
@@ -136,7 +172,8 @@ extern const proto_module *const supported_protos[];
   virtual int  recv_eof();                              \
   virtual void expect_close();                          \
   virtual void cease_transmission();                    \
-  virtual void transmit_soon(unsigned long timeout)     \
+  virtual void transmit_soon(unsigned long timeout);    \
+  virtual void transmit_now()                           \
   /* deliberate absence of semicolon */
 
 #define CONN_STEG_STUBS(mod)                            \
@@ -145,6 +182,8 @@ extern const proto_module *const supported_protos[];
   void mod##_conn_t::cease_transmission()               \
   { log_abort(this, "steg stub called"); }              \
   void mod##_conn_t::transmit_soon(unsigned long)       \
+  { log_abort(this, "steg stub called"); }              \
+  void mod##_conn_t::transmit_now()                     \
   { log_abort(this, "steg stub called"); }
 
 #define CIRCUIT_DECLARE_METHODS(mod)            \
@@ -4,16 +4,24 @@
 
 #include "util.h"
 #include "chop_blk.h"
+#include "chop_health.h"
 #include "connections.h"
+#include "dnscache.h"
 #include "protocol.h"
 #include "rng.h"
 #include "steg.h"
 
+#include <algorithm>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <vector>
 
+#include <errno.h>
+#include <unistd.h>
+
 #include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 
 /* The chopper is the core StegoTorus protocol implementation.
    For its design, see doc/chopper.txt.  Note that it is still
@@ -37,9 +45,16 @@ struct chop_conn_t : conn_t
   chop_circuit_t *upstream;
   steg_t *steg;
   struct evbuffer *recv_pending;
-  struct event *must_send_timer;
+  conn_timer must_send_timer;
+  FILE *capture;
+  size_t capture_seen;
+  size_t target;          // client: index into config->down_addresses
+  uint64_t since_ms;      // client: when dialed, then when connected
+  uint64_t data_bytes;    // client: data carried, in both directions
   bool sent_handshake : 1;
+  bool received_handshake : 1;
   bool no_more_transmissions : 1;
+  bool capture_failed : 1;
 
   CONN_DECLARE_METHODS(chop);
 
@@ -48,7 +63,10 @@ struct chop_conn_t : conn_t
 
   void send();
   bool must_send_p() const;
-  static void must_send_timeout(evutil_socket_t, short, void *arg);
+  static void must_send_timeout(void *arg);
+
+  void capture_record(char type, struct evbuffer *data, size_t off);
+  void capture_inbound();
 };
 
 struct chop_circuit_t : circuit_t
@@ -105,21 +123,54 @@ struct chop_config_t : config_t
 {
   struct evutil_addrinfo *up_address;
   vector<struct evutil_addrinfo *> down_addresses;
+  vector<char *> down_names;      // client: host names, or NULL if numeric
   vector<steg_config_t *> steg_targets;
+  // Connections using each steg config; configs replaced by reload()
+  // are kept in retired_stegs until their last connection goes away.
+  unordered_map<steg_config_t *, size_t> steg_users;
+  vector<steg_config_t *> retired_stegs;
   chop_circuit_table circuits;
+  char *capture_dir;
+  target_health health;
+  size_t dial_best;
   bool trace_packets;
   bool encryption;
 
   CONFIG_DECLARE_METHODS(chop);
+  virtual void select_targets(vector<size_t> &out);
+  virtual bool can_reload(const config_t *fresh) const;
+  virtual void reload(config_t *fresh);
+
+  void steg_released(steg_config_t *sc);
 };
 
 // Configuration methods
 
+/* If ADDRESS (of the form HOST:PORT) names its host, rather than
+   giving a numeric address, return a copy of the name. */
+static char *
+host_name(const char *address)
+{
+  struct in_addr in;
+  char *host = xstrdup(address);
+  char *cp = strchr(host, ':');
+  if (cp)
+    *cp = '\0';
+  if (evutil_inet_pton(AF_INET, host, &in) == 1) {
+    free(host);
+    return 0;
+  }
+  return host;
+}
+
 chop_config_t::chop_config_t()
 {
   ignore_socks_destination = true;
+  socks_optimistic = false;
   trace_packets = false;
   encryption = true;
+  capture_dir = 0;
+  dial_best = 0;
 }
 
 chop_config_t::~chop_config_t()
@@ -129,15 +180,23 @@ chop_config_t::~chop_config_t()
   for (vector<struct evutil_addrinfo *>::iterator i = down_addresses.begin();
        i != down_addresses.end(); i++)
     evutil_freeaddrinfo(*i);
+  for (vector<char *>::iterator i = down_names.begin();
+       i != down_names.end(); i++)
+    free(*i);
 
   for (vector<steg_config_t *>::iterator i = steg_targets.begin();
        i != steg_targets.end(); i++)
     delete *i;
+  for (vector<steg_config_t *>::iterator i = retired_stegs.begin();
+       i != retired_stegs.end(); i++)
+    delete *i;
 
   for (chop_circuit_table::iterator i = circuits.begin();
        i != circuits.end(); i++)
     if (i->second)
       delete i->second;
+
+  free(capture_dir);
 }
 
 bool
@@ -179,6 +238,27 @@ chop_config_t::init(int n_options, const char *const *options)
       log_enable_timestamps();
     } else if (!strcmp(options[1], "--disable-encryption")) {
       encryption = false;
+    } else if (!strncmp(options[1], "--capture=", 10) && options[1][10]) {
+      free(capture_dir);
+      capture_dir = xstrdup(options[1] + 10);
+    } else if (!strcmp(options[1], "--socks-optimistic")) {
+      if (mode != LSN_SOCKS_CLIENT) {
+        log_warn("chop: --socks-optimistic is only valid in socks mode");
+        goto usage;
+      }
+      socks_optimistic = true;
+    } else if (!strncmp(options[1], "--dial-best=", 12)) {
+      char *end;
+      unsigned long k = strtoul(options[1] + 12, &end, 10);
+      if (mode == LSN_SIMPLE_SERVER) {
+        log_warn("chop: --dial-best option is not valid in server mode");
+        goto usage;
+      }
+      if (!options[1][12] || *end || k == 0) {
+        log_warn("chop: invalid --dial-best count '%s'", options[1] + 12);
+        goto usage;
+      }
+      dial_best = k;
     } else {
       log_warn("chop: unrecognized option '%s'", options[1]);
       goto usage;
@@ -194,15 +274,17 @@ chop_config_t::init(int n_options, const char *const *options)
   }
 
   // From here on out, arguments alternate between downstream
-  // addresses and steg targets.
+  // addresses and steg targets.  Clients may give host names for
+  // their downstream addresses; see select_targets.
   for (i = 2; i < n_options; i++) {
     struct evutil_addrinfo *addr =
-      resolve_address_port(options[i], 1, !listen_up, NULL);
+      resolve_address_port(options[i], !listen_up, !listen_up, NULL);
     if (!addr) {
       log_warn("chop: invalid down address: %s", options[i]);
       goto usage;
     }
     down_addresses.push_back(addr);
+    down_names.push_back(listen_up ? host_name(options[i]) : 0);
 
     i++;
     if (i == n_options) {
@@ -214,8 +296,12 @@ chop_config_t::init(int n_options, const char *const *options)
       log_warn("chop: steganographer '%s' not supported", options[i]);
       goto usage;
     }
-    steg_targets.push_back(steg_new(options[i], this));
+    steg_config_t *steg = steg_new(options[i], this);
+    if (!steg)
+      goto usage;
+    steg_targets.push_back(steg);
   }
+  health.resize(down_addresses.size());
   return true;
 
  usage:
@@ -259,6 +345,129 @@ chop_config_t::get_target_addrs(size_t n) const
   return NULL;
 }
 
+/* With --dial-best=K, a client circuit that needs new connections
+   opens them only to the K targets that have worked best so far (see
+   chop_health.h), rather than to every downstream address. */
+void
+chop_config_t::select_targets(vector<size_t> &out)
+{
+  if (mode == LSN_SIMPLE_SERVER) {
+    config_t::select_targets(out);
+    return;
+  }
+
+  // Targets given by name were resolved once, at startup; pick up any
+  // change in their addresses since then from the DNS cache.
+  dns_cache *cache = get_dns_cache();
+  for (size_t n = 0; cache && n < down_names.size(); n++) {
+    if (!down_names[n])
+      continue;
+    struct evutil_addrinfo *ai = cache->refresh(down_names[n],
+                                                down_addresses[n]);
+    if (ai) {
+      evutil_freeaddrinfo(down_addresses[n]);
+      down_addresses[n] = ai;
+    }
+  }
+
+  health.select(dial_best, out);
+  if (dial_best) {
+    for (size_t i = 0; i < out.size(); i++)
+      log_debug("chop: dialing target %lu", (unsigned long)out[i]);
+  }
+}
+
+/* Two addresses are the same if their first entries are. */
+static bool
+same_address(const struct evutil_addrinfo *a, const struct evutil_addrinfo *b)
+{
+  return a->ai_addrlen == b->ai_addrlen &&
+    !memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen);
+}
+
+/* Listeners and circuits depend on the mode and addresses, and peers
+   on the wire format, so those must stay the same; the steg modules
+   and their arguments, --dial-best, --socks-optimistic,
+   --trace-packets and --capture may change. */
+bool
+chop_config_t::can_reload(const config_t *c) const
+{
+  const chop_config_t *fresh = static_cast<const chop_config_t *>(c);
+
+  if (fresh->mode != mode ||
+      !same_address(fresh->up_address, up_address) ||
+      fresh->down_addresses.size() != down_addresses.size()) {
+    log_warn("chop: cannot change mode or addresses while running");
+    return false;
+  }
+  for (size_t n = 0; n < down_addresses.size(); n++) {
+    // Named targets may have moved since startup; compare the names.
+    bool same = down_names[n]
+      ? fresh->down_names[n] && !strcmp(fresh->down_names[n], down_names[n])
+      : !fresh->down_names[n] &&
+        same_address(fresh->down_addresses[n], down_addresses[n]);
+    if (!same) {
+      log_warn("chop: cannot change mode or addresses while running");
+      return false;
+    }
+  }
+  if (fresh->encryption != encryption) {
+    log_warn("chop: cannot change --disable-encryption while running");
+    return false;
+  }
+  return true;
+}
+
+/* Connections made from now on use FRESH's steg configs; existing
+   ones keep the configs they were made with, which are deleted when
+   the last of them closes.  Target health is kept. */
+void
+chop_config_t::reload(config_t *c)
+{
+  chop_config_t *fresh = static_cast<chop_config_t *>(c);
+
+  for (size_t n = 0; n < steg_targets.size(); n++) {
+    steg_config_t *old = steg_targets[n];
+    steg_targets[n] = fresh->steg_targets[n];
+    steg_targets[n]->cfg = this;
+    if (steg_users[old])
+      retired_stegs.push_back(old);
+    else {
+      steg_users.erase(old);
+      delete old;
+    }
+  }
+  fresh->steg_targets.clear();
+
+  dial_best = fresh->dial_best;
+  socks_optimistic = fresh->socks_optimistic;
+  trace_packets = fresh->trace_packets;
+  std::swap(capture_dir, fresh->capture_dir);
+
+  log_info("chop: reloaded configuration (%lu old steg config%s "
+           "still in use)", (unsigned long)retired_stegs.size(),
+           retired_stegs.size() == 1 ? "" : "s");
+}
+
+void
+chop_config_t::steg_released(steg_config_t *sc)
+{
+  unordered_map<steg_config_t *, size_t>::iterator u = steg_users.find(sc);
+  log_assert(u != steg_users.end() && u->second > 0);
+  if (--u->second)
+    return;
+
+  vector<steg_config_t *>::iterator r =
+    std::find(retired_stegs.begin(), retired_stegs.end(), sc);
+  if (r != retired_stegs.end()) {
+    log_debug("chop: last connection using an old %s config closed",
+              sc->name());
+    retired_stegs.erase(r);
+    steg_users.erase(u);
+    delete sc;
+  }
+}
+
 const steg_config_t *
 chop_config_t::get_steg(size_t n) const
 {
@@ -530,8 +739,11 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   // that contains no data at all.
   size_t lo = MIN_BLOCK_SIZE + (avail == MIN_BLOCK_SIZE ? 0 : 1);
 
+  // A block carries at most SECTION_LEN bytes of padding, so it can
+  // be no bigger than that plus the data we have.
+  size_t hi = std::min(MAX_BLOCK_SIZE, avail + SECTION_LEN + 1);
+
   // If this connection has not yet sent a handshake, it will need to.
-  size_t hi = MAX_BLOCK_SIZE;
   if (!conn->sent_handshake) {
     lo += HANDSHAKE_LEN;
     hi += HANDSHAKE_LEN;
@@ -565,10 +777,8 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t blocksize)
   size_t avail = evbuffer_get_length(xmit_pending);
   opcode_t op = op_DAT;
 
-  if (avail > blocksize - lo)
-    avail = blocksize - lo;
-  else if (avail > SECTION_LEN)
-    avail = SECTION_LEN;
+  if (avail > blocksize - lo || avail > SECTION_LEN)
+    avail = std::min(blocksize - lo, SECTION_LEN);
   else if (upstream_eof && !sent_fin)
     // this block will carry the last byte of real data to be sent in
     // this direction; mark it as such
@@ -644,7 +854,9 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
 
   evbuffer_free(block);
   evbuffer_drain(payload, d);
+  conn->data_bytes += d;
 
+  config->blocks_sent++;
   send_seq++;
   if (f == op_FIN) {
     sent_fin = true;
@@ -676,6 +888,9 @@ chop_circuit_t::pick_connection(size_t desired, size_t *blocksize)
   // that contains no data at all.
   size_t lo = MIN_BLOCK_SIZE + (desired == MIN_BLOCK_SIZE ? 0 : 1);
 
+  // At most SECTION_LEN bytes of padding can be added to the data.
+  size_t hi = std::min(MAX_BLOCK_SIZE, desired + SECTION_LEN + 1);
+
   log_debug(this, "target block size %lu bytes", (unsigned long)desired);
 
   // Find the best fit for the desired transmission from all the
@@ -701,18 +916,18 @@ chop_circuit_t::pick_connection(size_t desired, size_t *blocksize)
 
     size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
     size_t room = conn->steg->transmit_room(desired + shake, lo + shake,
-                                            MAX_BLOCK_SIZE + shake);
+                                            hi + shake);
     if (room == 0) {
       log_debug(conn, "offers 0 bytes (%s)",
                 conn->steg->cfg()->name());
       continue;
     }
 
-    if (room < lo + shake || room >= MAX_BLOCK_SIZE + shake)
+    if (room < lo + shake || room >= hi + shake)
       log_abort(conn, "steg size request (%lu) out of range [%lu, %lu]",
                 (unsigned long)room,
                 (unsigned long)(lo + shake),
-                (unsigned long)(MAX_BLOCK_SIZE + shake));
+                (unsigned long)(hi + shake));
 
     log_debug(conn, "offers %lu bytes (%s)", (unsigned long)room,
               conn->steg->cfg()->name());
@@ -869,8 +1084,11 @@ chop_config_t::conn_create(size_t index)
     free(conn);
     return 0;
   }
+  steg_users[steg_targets[index]]++;
 
   conn->recv_pending = evbuffer_new();
+  conn->target = index;
+  conn->since_ms = conn_clock_ms();
   return conn;
 }
 
@@ -880,18 +1098,115 @@ chop_conn_t::chop_conn_t()
 
 chop_conn_t::~chop_conn_t()
 {
-  if (this->must_send_timer)
-    event_free(this->must_send_timer);
-  if (steg)
+  if (steg) {
+    steg_config_t *sc = steg->cfg();
     delete steg;
+    config->steg_released(sc);
+  }
   evbuffer_free(recv_pending);
+  if (capture && fclose(capture))
+    log_warn(this, "error writing capture: %s", strerror(errno));
+}
+
+/* With --capture=DIR, each downstream connection records everything
+   it receives, before the steg module sees it, in a file of its own
+   in DIR, for bench_replay to feed back through recv() later.  The
+   file starts with a line
+
+     stegotorus-chop-capture 1 <client|server> <steg> <encrypted 0|1>
+
+   followed by records of a type byte, a four-byte big-endian length,
+   and that many bytes of data.  The types are R (bytes received, in
+   the chunks recv() saw them), T (a block was transmitted; no data),
+   and E (EOF received; no data).  T records let replay keep steg
+   modules that pair requests with responses in step. */
+
+void
+chop_conn_t::capture_record(char type, struct evbuffer *data, size_t off)
+{
+  if (capture_failed)
+    return;
+
+  if (!capture) {
+    char path[1024];
+    xsnprintf(path, sizeof path, "%s/chop-%lu-%u.cap", config->capture_dir,
+              (unsigned long)getpid(), serial);
+    capture = fopen(path, "wb");
+    if (!capture) {
+      log_warn(this, "cannot open capture file %s: %s",
+               path, strerror(errno));
+      capture_failed = true;
+      return;
+    }
+    fprintf(capture, "stegotorus-chop-capture 1 %s %s %d\n",
+            config->mode == LSN_SIMPLE_SERVER ? "server" : "client",
+            steg->cfg()->name(), config->encryption ? 1 : 0);
+    log_debug(this, "capturing to %s", path);
+  }
+
+  size_t len = data ? evbuffer_get_length(data) - off : 0;
+  uint8_t hdr[5] = {
+    (uint8_t)type,
+    (uint8_t)(len >> 24), (uint8_t)(len >> 16),
+    (uint8_t)(len >> 8), (uint8_t)len
+  };
+  fwrite(hdr, 1, sizeof hdr, capture);
+
+  if (len) {
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec v[8];
+    evbuffer_ptr_set(data, &pos, off, EVBUFFER_PTR_SET);
+    while (len) {
+      int n = evbuffer_peek(data, len, &pos, v, 8);
+      size_t got = 0;
+      for (int i = 0; i < n && got < len; i++) {
+        size_t k = std::min(v[i].iov_len, len - got);
+        fwrite(v[i].iov_base, 1, k, capture);
+        got += k;
+      }
+      len -= got;
+      evbuffer_ptr_set(data, &pos, got, EVBUFFER_PTR_ADD);
+    }
+  }
+
+  if (ferror(capture)) {
+    log_warn(this, "error writing capture: %s", strerror(errno));
+    capture_failed = true;
+  }
+}
+
+/* Record whatever has arrived on this connection since the last call.
+   The steg module consumes input from the front, so the bytes not yet
+   recorded are always at the end of the buffer. */
+void
+chop_conn_t::capture_inbound()
+{
+  struct evbuffer *in = inbound();
+  if (evbuffer_get_length(in) > capture_seen)
+    capture_record('R', in, capture_seen);
+  capture_seen = evbuffer_get_length(in);
 }
 
 void
 chop_conn_t::close()
 {
-  if (this->must_send_timer)
-    event_del(this->must_send_timer);
+  this->must_send_timer.disarm();
+
+  if (config->mode != LSN_SIMPLE_SERVER) {
+    // A connection that never connected failed, unless its circuit
+    // gave up on it first.
+    if (connected)
+      config->health.closed(target, data_bytes,
+                            conn_clock_ms() - since_ms);
+    else if (upstream)
+      config->health.failed(target);
+
+    if (log_do_debug()) {
+      char buf[256];
+      config->health.format(target, buf, sizeof buf);
+      log_debug(this, "target %lu: %s", (unsigned long)target, buf);
+    }
+  }
 
   if (upstream)
     upstream->drop_downstream(this);
@@ -927,13 +1242,17 @@ chop_conn_t::send(struct evbuffer *block)
     }
   }
 
+  // This transmission satisfies any pending must-send, but the steg
+  // module may ask for another (e.g. to answer a pipelined request),
+  // so disarm the timer before rather than after.
+  must_send_timer.disarm();
   if (steg->transmit(block)) {
     log_warn(this, "failed to transmit block");
     return -1;
   }
   sent_handshake = true;
-  if (must_send_timer)
-    evtimer_del(must_send_timer);
+  if (config->capture_dir)
+    capture_record('T', 0, 0);
   return 0;
 }
 
@@ -948,8 +1267,13 @@ chop_conn_t::handshake()
   // to associate this new connection with.  Note that in some cases
   // it's possible for us to have _already_ sent something on this
   // connection by the time we get called back!  Don't do it twice.
-  if (config->mode != LSN_SIMPLE_SERVER && !sent_handshake)
-    send();
+  if (config->mode != LSN_SIMPLE_SERVER) {
+    uint64_t now = conn_clock_ms();
+    config->health.connected(target, now - since_ms);
+    since_ms = now;
+    if (!sent_handshake)
+      send();
+  }
   return 0;
 }
 
@@ -969,6 +1293,7 @@ chop_conn_t::recv_handshake()
     = this->config->circuits.insert(in);
   chop_circuit_t *ck;
 
+  received_handshake = true;
   if (!out.second) { // element already exists
     if (!out.first->second) {
       log_debug(this, "stale circuit");
@@ -982,7 +1307,17 @@ chop_conn_t::recv_handshake()
       log_warn(this, "failed to create new circuit");
       return -1;
     }
-    if (circuit_open_upstream(ck)) {
+    if (config->replay) {
+      // Replaying a capture: there is no upstream to connect to, just
+      // a buffer for bench_replay to empty.
+      struct bufferevent *sink = bufferevent_socket_new(config->base, -1, 0);
+      if (!sink) {
+        log_warn(this, "failed to create upstream buffer");
+        ck->close();
+        return -1;
+      }
+      circuit_add_upstream(ck, sink, xstrdup("replay"));
+    } else if (circuit_open_upstream(ck)) {
       log_warn(this, "failed to begin upstream connection");
       ck->close();
       return -1;
@@ -999,9 +1334,15 @@ chop_conn_t::recv_handshake()
 int
 chop_conn_t::recv()
 {
+  if (config->capture_dir)
+    capture_inbound();
+
   if (steg->receive(recv_pending))
     return -1;
 
+  if (config->capture_dir)
+    capture_seen = evbuffer_get_length(inbound());
+
   // If that succeeded but did not copy anything into recv_pending,
   // wait for more data.
   if (evbuffer_get_length(recv_pending) == 0)
@@ -1020,7 +1361,20 @@ chop_conn_t::recv()
       return 0;
     }
 
-    // We're the server. Try to receive a handshake.
+    // We're the server.  If this connection has had its handshake
+    // already, its circuit has closed since, and the client has sent
+    // more on it (steg modules that take turns may); as above, that
+    // must be chaff, and there is no handshake in it.
+    if (received_handshake) {
+      log_debug(this, "discarding data after circuit closed");
+      evbuffer_drain(recv_pending, evbuffer_get_length(recv_pending));
+      if (must_send_p())
+        send();
+      conn_do_flush(this);
+      return 0;
+    }
+
+    // Try to receive a handshake.
     if (recv_handshake())
       return -1;
 
@@ -1123,6 +1477,8 @@ chop_conn_t::recv()
 
     if (!upstream->recv_queue.insert(hdr.seqno(), hdr.opcode(), data, this))
       return -1; // insert() logs an error
+    config->blocks_received++;
+    data_bytes += hdr.dlen();
   }
 
   return upstream->process_queue();
@@ -1135,6 +1491,10 @@ chop_conn_t::recv_eof()
   // us to get here before we've processed _any_ data -- including the
   // handshake! -- from a new connection, so we have to do this before
   // we look at ->upstream.  */
+  if (config->capture_dir) {
+    capture_inbound();
+    capture_record('E', 0, 0);
+  }
   if (evbuffer_get_length(inbound()) > 0) {
     if (recv())
       return -1;
@@ -1165,31 +1525,36 @@ void
 chop_conn_t::cease_transmission()
 {
   no_more_transmissions = true;
-  if (must_send_timer)
-    evtimer_del(must_send_timer);
+  must_send_timer.disarm();
   conn_do_flush(this);
 }
 
 void
 chop_conn_t::transmit_soon(unsigned long milliseconds)
 {
-  struct timeval tv;
-
   log_debug(this, "must send within %lu milliseconds", milliseconds);
 
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
+  must_send_timer.set(must_send_timeout, this);
+  must_send_timer.arm(milliseconds);
+}
+
+void
+chop_conn_t::transmit_now()
+{
+  // The connection may have been closed, or begun to flush, since the
+  // steg module asked to transmit.
+  if (no_more_transmissions || pending_write_eof || write_eof ||
+      !(bufferevent_get_enabled(buffer) & EV_WRITE))
+    return;
 
-  if (!must_send_timer)
-    must_send_timer = evtimer_new(config->base, must_send_timeout, this);
-  evtimer_add(must_send_timer, &tv);
+  log_debug(this, "transmitting now");
+  send();
 }
 
 void
 chop_conn_t::send()
 {
-  if (must_send_timer)
-    evtimer_del(must_send_timer);
+  must_send_timer.disarm();
 
   if (!steg) {
     log_warn(this, "send() called with no steg module available");
@@ -1243,6 +1608,8 @@ chop_conn_t::send()
 
     if (steg->transmit(chaff))
       conn_do_flush(this);
+    else if (config->capture_dir)
+      capture_record('T', 0, 0);
 
     evbuffer_free(chaff);
   }
@@ -1251,11 +1618,11 @@ chop_conn_t::send()
 bool
 chop_conn_t::must_send_p() const
 {
-  return must_send_timer && evtimer_pending(must_send_timer, 0);
+  return must_send_timer.pending();
 }
 
 /* static */ void
-chop_conn_t::must_send_timeout(evutil_socket_t, short, void *arg)
+chop_conn_t::must_send_timeout(void *arg)
 {
   static_cast<chop_conn_t *>(arg)->send();
 }
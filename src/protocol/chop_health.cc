@@ -0,0 +1,133 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "chop_health.h"
+
+#include <algorithm>
+
+using std::vector;
+
+double
+target_stats::cost() const
+{
+  if (!attempts)
+    return 0;
+
+  double ms = (attempts > failures) ? connect_ms : HEALTH_UNREACHABLE_MS;
+  if (goodput > 0)
+    ms += HEALTH_REF_BYTES * 1000.0 / goodput;
+
+  // A target that fails half the time needs two tries per connection,
+  // and so on; but do not let one that always fails cost infinitely
+  // much, or it could never be probed back into use.
+  double ok = 1 - fail_rate;
+  if (ok < 0.05)
+    ok = 0.05;
+  return ms / ok;
+}
+
+static void
+update(double &avg, double sample, bool first)
+{
+  avg = first ? sample : avg + HEALTH_ALPHA * (sample - avg);
+}
+
+void
+target_health::connected(size_t n, uint64_t ms)
+{
+  target_stats &t = targets.at(n);
+  update(t.connect_ms, ms, t.attempts == t.failures);
+  update(t.fail_rate, 0, t.attempts == 0);
+  t.attempts++;
+}
+
+void
+target_health::failed(size_t n)
+{
+  target_stats &t = targets.at(n);
+  update(t.fail_rate, 1, t.attempts == 0);
+  t.attempts++;
+  t.failures++;
+}
+
+void
+target_health::closed(size_t n, uint64_t bytes, uint64_t ms)
+{
+  target_stats &t = targets.at(n);
+  t.bytes += bytes;
+  if (bytes < HEALTH_MIN_BYTES)
+    return;
+  update(t.goodput, bytes * 1000.0 / std::max(ms, (uint64_t)1),
+         t.samples == 0);
+  t.samples++;
+}
+
+namespace {
+  struct by_cost
+  {
+    const vector<target_stats> &targets;
+    by_cost(const vector<target_stats> &t) : targets(t) {}
+    bool operator()(size_t a, size_t b) const
+    { return targets[a].cost() < targets[b].cost(); }
+  };
+}
+
+void
+target_health::select(size_t k, vector<size_t> &out)
+{
+  size_t n = targets.size();
+  selections++;
+
+  if (k == 0 || k >= n) {
+    for (size_t i = 0; i < n; i++) {
+      targets[i].last_dialed = selections;
+      out.push_back(i);
+    }
+    return;
+  }
+
+  vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), by_cost(targets));
+
+  for (size_t i = 0; i < k; i++) {
+    targets[order[i]].last_dialed = selections;
+    out.push_back(order[i]);
+  }
+
+  // Probe one of the rest: any that has never been tried, or else,
+  // from time to time, the one that has waited longest.
+  size_t probe = n;
+  for (size_t i = k; i < n; i++) {
+    size_t t = order[i];
+    if (!targets[t].attempts) {
+      if (probe == n || targets[t].last_dialed < targets[probe].last_dialed)
+        probe = t;
+    }
+  }
+  if (probe == n && selections % HEALTH_PROBE_EVERY == 0) {
+    for (size_t i = k; i < n; i++) {
+      size_t t = order[i];
+      if (probe == n || targets[t].last_dialed < targets[probe].last_dialed)
+        probe = t;
+    }
+  }
+  if (probe != n) {
+    targets[probe].last_dialed = selections;
+    out.push_back(probe);
+  }
+}
+
+void
+target_health::format(size_t n, char *buf, size_t len) const
+{
+  const target_stats &t = targets.at(n);
+  snprintf(buf, len,
+           "%lu connections, %lu failed (rate %.2f), connect %.1f ms, "
+           "goodput %.0f B/s, %lu bytes; cost %.1f ms",
+           t.attempts, t.failures, t.fail_rate, t.connect_ms, t.goodput,
+           (unsigned long)t.bytes, t.cost());
+}
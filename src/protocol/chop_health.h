@@ -0,0 +1,98 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef CHOP_HEALTH_H
+#define CHOP_HEALTH_H
+
+#include <vector>
+
+/** Health of the servers (downstream addresses) a chop client can
+    connect to.
+
+    Each outbound connection reports how long it took to connect, or
+    that it failed to; and when it closes, how much data it carried
+    and for how long.  From running averages of these, every target
+    gets a cost: the expected time, in milliseconds, for a new
+    connection to it to connect and then carry HEALTH_REF_BYTES at
+    the goodput seen so far, scaled up by its failure rate.
+
+    When a circuit needs new connections it can dial just the k
+    cheapest targets.  Targets that have never been tried count as
+    cheapest, so that each is tried early on; and every so often one
+    of the others is dialed as well, so that a target that was slow
+    or down gets the chance to show that it has recovered. */
+
+/** Weight of each new sample in the running averages. */
+#define HEALTH_ALPHA 0.25
+
+/** Size of the transfer by which targets are compared. */
+#define HEALTH_REF_BYTES 65536
+
+/** A connection that carried less data than this tells us nothing
+    about goodput. */
+#define HEALTH_MIN_BYTES 4096
+
+/** Assumed connect time, in milliseconds, for a target that has been
+    tried but has never accepted a connection. */
+#define HEALTH_UNREACHABLE_MS 1000
+
+/** Every this many selections, probe one target that was not chosen. */
+#define HEALTH_PROBE_EVERY 8
+
+struct target_stats
+{
+  unsigned long attempts;     // connections that connected or failed
+  unsigned long failures;
+  unsigned long samples;      // connections that reported goodput
+  unsigned long last_dialed;  // selection in which last dialed, or 0
+  uint64_t bytes;             // data carried, in total
+  double connect_ms;          // running averages
+  double fail_rate;
+  double goodput;             // bytes per second
+
+  target_stats()
+    : attempts(0), failures(0), samples(0), last_dialed(0), bytes(0),
+      connect_ms(0), fail_rate(0), goodput(0) {}
+
+  /** The estimated cost of a new connection to this target, in
+      milliseconds; 0 if it has never been tried. */
+  double cost() const;
+};
+
+class target_health
+{
+  std::vector<target_stats> targets;
+  unsigned long selections;
+
+public:
+  target_health() : selections(0) {}
+
+  /** Track N targets, numbered from 0. */
+  void resize(size_t n) { targets.resize(n); }
+  size_t size() const { return targets.size(); }
+  const target_stats &operator[](size_t n) const { return targets[n]; }
+
+  /** A connection to target N connected after MS milliseconds. */
+  void connected(size_t n, uint64_t ms);
+
+  /** A connection to target N failed before it connected. */
+  void failed(size_t n);
+
+  /** A connection to target N closed after carrying BYTES of data
+      over MS milliseconds. */
+  void closed(size_t n, uint64_t bytes, uint64_t ms);
+
+  /** Append to OUT the targets that a circuit should dial now: the K
+      cheapest (or all of them, if K is 0 or at least the number of
+      targets), and, if any of the rest has never been tried, or
+      every HEALTH_PROBE_EVERY selections, the one of the rest that
+      was dialed least recently. */
+  void select(size_t k, std::vector<size_t> &out);
+
+  /** Write a one-line summary of target N into BUF, which is of size
+      LEN. */
+  void format(size_t n, char *buf, size_t len) const;
+};
+
+#endif
@@ -72,6 +72,18 @@ null_config_t::init(int n_options, const char *const *options)
   } else
     goto usage;
 
+  while (n_options > 1 && options[1][0] == '-') {
+    if (!strcmp(options[1], "--socks-optimistic")
+        && this->mode == LSN_SOCKS_CLIENT) {
+      this->socks_optimistic = true;
+    } else {
+      log_warn("null: unrecognized option '%s'", options[1]);
+      goto usage;
+    }
+    options++;
+    n_options--;
+  }
+
   if (n_options != (this->mode == LSN_SOCKS_CLIENT ? 2 : 3))
     goto usage;
 
@@ -89,11 +101,14 @@ null_config_t::init(int n_options, const char *const *options)
 
  usage:
   log_warn("null syntax:\n"
-           "\tnull <mode> <listen_address> [<target_address>]\n"
+           "\tnull <mode> [--socks-optimistic] <listen_address> "
+           "[<target_address>]\n"
            "\t\tmode ~ server|client|socks\n"
            "\t\tlisten_address, target_address ~ host:port\n"
            "\ttarget_address is required for server and client mode,\n"
            "\tand forbidden for socks mode.\n"
+           "\t--socks-optimistic (socks mode only) answers SOCKS requests\n"
+           "\tbefore the outbound connection is made.\n"
            "Examples:\n"
            "\tstegotorus null socks 127.0.0.1:5000\n"
            "\tstegotorus null client 127.0.0.1:5000 192.168.1.99:11253\n"
@@ -439,6 +439,8 @@ socks4_send_reply(struct evbuffer *dest, socks_state_t *state, int status)
   /* ASN: What should we do here in the case of an FQDN request? */
   memcpy(msg+4, &in.s_addr, 4);
   evbuffer_add(dest, msg, 8);
+
+  state->state = ST_SENT_REPLY; /* SOCKS phase is now done. */
 }
 
 /**
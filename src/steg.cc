@@ -11,8 +11,9 @@ int
 steg_is_supported(const char *name)
 {
   const steg_module *const *s;
+  size_t len = strcspn(name, ":");
   for (s = supported_stegs; *s; s++)
-    if (!strcmp(name, (**s).name))
+    if (strlen((**s).name) == len && !strncmp(name, (**s).name, len))
       return 1;
   return 0;
 }
@@ -22,12 +23,29 @@ steg_config_t *
 steg_new(const char *name, config_t *cfg)
 {
   const steg_module *const *s;
+  size_t len = strcspn(name, ":");
+  const char *args = name[len] ? name + len + 1 : 0;
   for (s = supported_stegs; *s; s++)
-    if (!strcmp(name, (**s).name))
-      return (**s).new_(cfg);
+    if (strlen((**s).name) == len && !strncmp(name, (**s).name, len)) {
+      steg_config_t *c = (**s).new_(cfg);
+      if (c->init(args))
+        return c;
+      delete c;
+      return 0;
+    }
  return 0;
 }
 
+bool
+steg_config_t::init(const char *args)
+{
+  if (args) {
+    log_warn("steg module %s takes no arguments", name());
+    return false;
+  }
+  return true;
+}
+
 /* Define these here rather than in the class definition so that the
    vtables will be emitted in only one place. */
 steg_config_t::~steg_config_t() {}
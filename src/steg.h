@@ -28,6 +28,13 @@ struct steg_config_t
       this method in your subclass, STEG_DEFINE_MODULE does it for you. */
   virtual const char *name() const = 0;
 
+  /** Initialize yourself from ARGS, the text after the colon when
+      the module is named as MODULE:ARGS, or NULL if there was no
+      colon.  On error, log a diagnostic and return false.  You only
+      need to define this method if your module takes arguments; the
+      default accepts none. */
+  virtual bool init(const char *args);
+
   /** Create an extended 'steg_t' object (see below) from this
       configuration, associated with connection CONN.  */
   virtual steg_t *steg_create(conn_t *conn) = 0;
@@ -99,6 +106,9 @@ struct steg_module
 
 extern const steg_module *const supported_stegs[];
 
+/* NAME, in both of these, is a module name, optionally followed by a
+   colon and arguments for the module's init method.  steg_new returns
+   NULL if the module rejects the arguments. */
 int steg_is_supported(const char *name);
 steg_config_t *steg_new(const char *name, config_t *cfg);
 
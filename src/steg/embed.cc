@@ -7,24 +7,28 @@
 #include "protocol.h"
 #include "steg.h"
 #include "rng.h"
+#include "embed_trace.h"
+#include "pacing.h"
 
 #include <errno.h>
 #include <event2/buffer.h>
-#include <vector>
 
-using std::vector;
+// Padding is added by reference to this, a page at a time.
+static const unsigned char zero_page[4096] = { 0 };
 
-namespace {
-  struct trace_t {
-    vector<short> pkt_sizes;  // packet sizes (positive = client->server)
-    vector<int> pkt_times;    // packet inter-arrival times
-  };
+// If a packet goes out more than this many milliseconds after it was
+// due, the trace's timing is taken up again from when it did go out,
+// rather than rushing out the packets after it to catch up.
+#define EMBED_RESYNC_MS 100
 
+namespace {
   struct embed_steg_config_t : steg_config_t {
     bool is_clientside;
-    vector<trace_t> traces;
+    embed_traces traces;
+    pacer pace;
 
     STEG_CONFIG_DECLARE_METHODS(embed);
+    virtual bool init(const char *args);
 
     size_t get_random_trace() const;
   };
@@ -34,70 +38,73 @@ namespace {
     conn_t *conn;
 
     int cur_idx;           // current trace index
-    trace_t *cur;             // current trace
+    uint32_t cur_first;    // index of the current trace's first packet
+    int cur_len;           // number of packets in the current trace
     int cur_pkt;           // current packet in the trace
-    struct timeval last_pkt;  // time at which last packet was sent/received
+    uint64_t anchor;       // time the current packet's delay counts from
+    pace_slot slot;        // when the next outgoing packet is due
 
     embed_steg_t(embed_steg_config_t *cf, conn_t *cn);
 
     STEG_DECLARE_METHODS(embed);
 
+    void set_trace(int idx);
     bool advance_packet();
     short get_pkt_size();
     bool is_outgoing();
     int get_pkt_time();
     bool is_finished();
+    uint64_t due() { return anchor + get_pkt_time(); }
+    void schedule_next();
   };
 }
 
 STEG_DEFINE_MODULE(embed);
 
-static int
-millis_since(struct timeval *last)
-{
-  struct timeval cur;
-  int diff = 0;
-  gettimeofday(&cur, NULL);
-
-  diff += (cur.tv_sec - last->tv_sec) * 1000;
-  diff += (cur.tv_usec - last->tv_usec) / 1000;
-  return diff;
-}
-
 embed_steg_config_t::embed_steg_config_t(config_t *cfg)
   : steg_config_t(cfg),
     is_clientside(cfg->mode != LSN_SIMPLE_SERVER)
 {
-  // read in traces to use for connections
-  FILE *trace_file = fopen("traces/embed.txt", "r");
-  if (!trace_file)
-    log_abort("opening traces/embed.txt: %s", strerror(errno));
-
-  int num_traces;
-  if (fscanf(trace_file, "%d", &num_traces) < 1)
-    log_abort("couldn't read number of traces");
-
-  traces.resize(num_traces);
-
-  for (vector<trace_t>::iterator p = traces.begin(); p != traces.end(); ++p) {
-    int num_pkt;
-    if (fscanf(trace_file, "%d", &num_pkt) < 1)
-      log_abort("couldn't read number of packets in trace %ld",
-                (long)(p - traces.begin()));
-
-    p->pkt_sizes.resize(num_pkt);
-    p->pkt_times.resize(num_pkt);
-    for (int i = 0; i < num_pkt; i++)
-      if (fscanf(trace_file, "%hd %d", &p->pkt_sizes[i], &p->pkt_times[i]) < 1)
-        log_abort("couldn't read trace entry %ld/%d",
-                  (long)(p - traces.begin()), i);
+}
+
+bool
+embed_steg_config_t::init(const char *args)
+{
+  const char *dir = "traces";
+  char fname[1024];
+
+  if (args) {
+    if (strncmp(args, "traces=", 7) || !args[7]) {
+      log_warn("embed: bad argument '%s' (want traces=DIR)", args);
+      return false;
+    }
+    dir = args + 7;
+  }
+
+  // Read in traces to use for connections.  Both ends must load the
+  // same trace set; a binary one (see embed_compile) is preferred,
+  // since it is simply mapped into memory.
+  xsnprintf(fname, sizeof fname, "%s/embed.bin", dir);
+  if (traces.load(fname)) {
+    if (errno != ENOENT) {
+      log_warn("embed: %s is unusable", fname);
+      return false;
+    }
+    xsnprintf(fname, sizeof fname, "%s/embed.txt", dir);
+    if (traces.load_text(fname)) {
+      log_warn("embed: %s is unusable", fname);
+      return false;
+    }
   }
 
-  log_debug("read %d traces", num_traces);
+  log_debug("read %u traces, %u packets", traces.num_traces,
+            traces.num_pkts);
+  return true;
 }
 
 embed_steg_config_t::~embed_steg_config_t()
 {
+  pace.report("embed");
 }
 
 steg_t *
@@ -109,55 +116,75 @@ embed_steg_config_t::steg_create(conn_t *conn)
 size_t
 embed_steg_config_t::get_random_trace() const
 {
-  return rng_int(traces.size());
+  return rng_int(traces.num_traces);
+}
+
+void
+embed_steg_t::set_trace(int idx)
+{
+  cur_idx = idx;
+  cur_first = config->traces.offsets[idx];
+  cur_len = config->traces.trace_len(idx);
+  cur_pkt = 0;
 }
 
 bool
 embed_steg_t::advance_packet()
 {
   cur_pkt++;
-  return cur_pkt == int(cur->pkt_sizes.size());
+  return cur_pkt == cur_len;
 }
 
 short
 embed_steg_t::get_pkt_size()
 {
-  return abs(cur->pkt_sizes[cur_pkt]);
+  return abs(config->traces.sizes[cur_first + cur_pkt]);
 }
 
 bool
 embed_steg_t::is_outgoing()
 {
-  return (cur->pkt_sizes[cur_pkt] < 0) ^ config->is_clientside;
+  return (config->traces.sizes[cur_first + cur_pkt] < 0)
+    ^ config->is_clientside;
 }
 
 int
 embed_steg_t::get_pkt_time()
 {
-  return cur->pkt_times[cur_pkt];
+  return config->traces.times[cur_first + cur_pkt];
 }
 
 bool
 embed_steg_t::is_finished()
 {
   if (cur_idx == -1) return true;
-  return cur_pkt >= int(cur->pkt_sizes.size());
+  return cur_pkt >= cur_len;
+}
+
+// Have the pacer wake us when the next packet is due, if it is ours
+// to send.
+void
+embed_steg_t::schedule_next()
+{
+  if (!is_finished() && is_outgoing())
+    config->pace.schedule(&slot, due());
+  else
+    config->pace.cancel(&slot);
 }
 
 embed_steg_t::embed_steg_t(embed_steg_config_t *cf, conn_t *cn)
   : config(cf), conn(cn)
 {
   cur_idx = -1;
-  if (config->is_clientside) {
-    cur_idx = config->get_random_trace();
-    cur = &config->traces[cur_idx];
-    cur_pkt = 0;
-  }
-  gettimeofday(&last_pkt, NULL);
+  if (config->is_clientside)
+    set_trace(config->get_random_trace());
+  anchor = pacer::now();
+  slot.conn = conn;
 }
 
 embed_steg_t::~embed_steg_t()
 {
+  config->pace.cancel(&slot);
 }
 
 steg_config_t *
@@ -171,8 +198,12 @@ embed_steg_t::transmit_room(size_t, size_t lo, size_t hi)
 {
   if (is_finished() || !is_outgoing()) return 0;
 
-  int time_diff = millis_since(&last_pkt);
-  if (get_pkt_time() > time_diff+10) return 0;
+  // The first packet of a trace is not scheduled until the connection
+  // is up, which is when we are first asked.  Once it is scheduled, it
+  // goes out on time even if this offer is not taken up.
+  if (!slot.pending())
+    config->pace.schedule(&slot, due());
+  if (!pacer::is_due(due())) return 0;
 
   // 2 bytes for data length, 4 bytes for the index of a new trace
   size_t room = get_pkt_size() - 2;
@@ -190,6 +221,7 @@ embed_steg_t::transmit(struct evbuffer *source)
   short src_len = evbuffer_get_length(source);
   short pkt_size = get_pkt_size();
   short used = src_len + 2;
+  uint64_t was_due = due();
 
   // starting a new trace, send the index
   if (cur_pkt == 0) {
@@ -206,24 +238,27 @@ embed_steg_t::transmit(struct evbuffer *source)
   log_debug("sending data with length %d", src_len);
 
   // if there is more space in the packet, pad it
-  if (pkt_size > used) {
-    size_t padding = pkt_size - used;
-    unsigned char zero[padding];
-    memset(zero, 0, padding);
-    evbuffer_add(dest, zero, padding);
+  for (int padding = pkt_size - used; padding > 0; ) {
+    size_t n = padding;
+    if (n > sizeof zero_page) n = sizeof zero_page;
+    if (evbuffer_add_reference(dest, zero_page, n, 0, 0)) return -1;
+    padding -= n;
   }
 
+  // the next packet's delay counts from when this one was due
+  config->pace.sent(was_due);
+  anchor = was_due;
+  if (pacer::now() > was_due + EMBED_RESYNC_MS)
+    anchor = pacer::now();
+
   // check if this trace is finished and whether we need to send again
   if (advance_packet()) {
     log_debug("send finished trace");
+    config->pace.cancel(&slot);
     conn->cease_transmission();
-  } else if (is_outgoing()) {
-    log_debug("sending again in %d ms", get_pkt_time());
-    conn->transmit_soon(get_pkt_time());
+  } else {
+    schedule_next();
   }
-
-  // update last time
-  gettimeofday(&last_pkt, NULL);
   return 0;
 }
 
@@ -233,14 +268,19 @@ embed_steg_t::receive(struct evbuffer *dest)
   struct evbuffer *source = conn->inbound();
   short src_len = evbuffer_get_length(source);
   short pkt_size = 0;
+  bool got_pkt = false;
 
   log_debug("receiving buffer of length %d", src_len);
 
   // if we are receiving the first packet of the trace, read the index
   if (cur_idx == -1) {
-    if (evbuffer_remove(source, &cur_idx, 4) != 4) return -1;
-    cur = &config->traces[cur_idx];
-    cur_pkt = 0;
+    int idx;
+    if (evbuffer_remove(source, &idx, 4) != 4) return -1;
+    if (idx < 0 || (uint32_t)idx >= config->traces.num_traces) {
+      log_warn(conn, "peer asked for nonexistent trace %d", idx);
+      return -1;
+    }
+    set_trace(idx);
     pkt_size += 4;
 
     log_debug("received first packet of trace %d", cur_idx);
@@ -271,12 +311,14 @@ return -1;
 
     src_len -= exp_pkt_size;
     pkt_size = 0;
+    got_pkt = true;
 
     log_debug("received packet %d of trace %d",
               cur_pkt, cur_idx);
 
     // advance packet; if done with trace, sender should close connection
     if (advance_packet()) {
+      config->pace.cancel(&slot);
       conn->cease_transmission();
       conn->expect_close();
       log_debug("received last packet in trace");
@@ -284,14 +326,14 @@ return -1;
     }
   }
 
-  if (is_outgoing()) {
-    log_debug("preparing to send in %d ms", get_pkt_time());
-    conn->transmit_soon(get_pkt_time());
+  // the next packet's delay counts from when this one arrived
+  if (got_pkt) {
+    anchor = pacer::now();
+    if (is_outgoing())
+      log_debug("preparing to send in %d ms", get_pkt_time());
+    schedule_next();
   }
 
   log_debug("remaining source length: %d", src_len);
-
-  // update last time
-  gettimeofday(&last_pkt, NULL);
   return 0;
 }
@@ -0,0 +1,272 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "embed_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using std::vector;
+
+// Far more than any real trace set, and small enough that none of the
+// size arithmetic below can overflow.
+#define EMBED_TRACE_MAX_COUNT (1u << 26)
+
+#define HEADER_WORDS 4
+
+static size_t
+image_size(uint32_t num_traces, uint32_t num_pkts)
+{
+  return (HEADER_WORDS + num_traces + 1) * sizeof(uint32_t)
+    + num_pkts * (sizeof(int32_t) + sizeof(int16_t));
+}
+
+embed_traces::embed_traces()
+  : num_traces(0), num_pkts(0), offsets(0), times(0), sizes(0),
+    image(0), image_len(0), mapped(false)
+{
+}
+
+embed_traces::~embed_traces()
+{
+  clear();
+}
+
+void
+embed_traces::clear()
+{
+  if (image) {
+#ifndef _WIN32
+    if (mapped)
+      munmap(image, image_len);
+    else
+#endif
+      free(image);
+  }
+  image = 0;
+  image_len = 0;
+  mapped = false;
+  num_traces = num_pkts = 0;
+  offsets = 0;
+  times = 0;
+  sizes = 0;
+}
+
+/* Check that BASE holds a well-formed trace set of exactly LEN bytes,
+   and point the arrays into it. */
+int
+embed_traces::adopt(void *base, size_t len)
+{
+  const uint32_t *hdr = (const uint32_t *)base;
+
+  if (len < HEADER_WORDS * sizeof(uint32_t)) {
+    log_warn("trace file too short");
+    return -1;
+  }
+  if (hdr[0] != EMBED_TRACE_MAGIC) {
+    log_warn("bad magic number %08x in trace file", hdr[0]);
+    return -1;
+  }
+  if (hdr[1] != EMBED_TRACE_VERSION) {
+    log_warn("unsupported trace file version %u", hdr[1]);
+    return -1;
+  }
+  if (hdr[2] == 0 || hdr[2] > EMBED_TRACE_MAX_COUNT ||
+      hdr[3] > EMBED_TRACE_MAX_COUNT) {
+    log_warn("implausible trace file counts: %u traces, %u packets",
+             hdr[2], hdr[3]);
+    return -1;
+  }
+  if (len != image_size(hdr[2], hdr[3])) {
+    log_warn("trace file is %lu bytes, should be %lu",
+             (unsigned long)len, (unsigned long)image_size(hdr[2], hdr[3]));
+    return -1;
+  }
+
+  uint32_t nt = hdr[2], np = hdr[3];
+  const uint32_t *offs = hdr + HEADER_WORDS;
+  const int32_t *tms = (const int32_t *)(offs + nt + 1);
+  const int16_t *szs = (const int16_t *)(tms + np);
+
+  if (offs[0] != 0 || offs[nt] != np) {
+    log_warn("trace file offset table does not cover the packets");
+    return -1;
+  }
+  for (uint32_t i = 0; i < nt; i++)
+    if (offs[i+1] <= offs[i]) {
+      log_warn("trace %u in trace file is empty or out of order", i);
+      return -1;
+    }
+  for (uint32_t i = 0; i < np; i++)
+    if (tms[i] < 0 || szs[i] == SHRT_MIN) {
+      log_warn("bad trace file entry %u: %d %d", i, szs[i], tms[i]);
+      return -1;
+    }
+
+  num_traces = nt;
+  num_pkts = np;
+  offsets = offs;
+  times = tms;
+  sizes = szs;
+  return 0;
+}
+
+int
+embed_traces::load(const char *fname)
+{
+  struct stat st;
+  int fd;
+
+  clear();
+
+  fd = open(fname, O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      log_warn("opening %s: %s", fname, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st)) {
+    log_warn("%s: %s", fname, strerror(errno));
+    goto fail;
+  }
+  image_len = st.st_size;
+  if (image_len == 0) {
+    log_warn("%s: empty file", fname);
+    goto fail;
+  }
+
+#ifndef _WIN32
+  image = mmap(0, image_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    image = 0;
+    log_warn("mapping %s: %s", fname, strerror(errno));
+    goto fail;
+  }
+  mapped = true;
+#else
+  image = xmalloc(image_len);
+  for (size_t got = 0; got < image_len; ) {
+    ssize_t n = read(fd, (char *)image + got, image_len - got);
+    if (n <= 0) {
+      log_warn("reading %s: %s", fname, n ? strerror(errno) : "short file");
+      goto fail;
+    }
+    got += n;
+  }
+#endif
+
+  if (adopt(image, image_len)) {
+    log_warn("%s: not a usable trace file", fname);
+    goto fail;
+  }
+  close(fd);
+  return 0;
+
+ fail:
+  close(fd);
+  clear();
+  errno = EINVAL;
+  return -1;
+}
+
+int
+embed_traces::load_text(const char *fname)
+{
+  vector<uint32_t> offs;
+  vector<int32_t> tms;
+  vector<int16_t> szs;
+  int nt, np, size, time;
+
+  clear();
+
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    log_warn("opening %s: %s", fname, strerror(errno));
+    return -1;
+  }
+
+  if (fscanf(f, "%d", &nt) != 1 || nt <= 0 ||
+      (unsigned)nt > EMBED_TRACE_MAX_COUNT) {
+    log_warn("%s: couldn't read number of traces", fname);
+    goto fail;
+  }
+
+  offs.reserve(nt + 1);
+  for (int t = 0; t < nt; t++) {
+    offs.push_back(tms.size());
+    if (fscanf(f, "%d", &np) != 1 || np <= 0 ||
+        tms.size() + np > EMBED_TRACE_MAX_COUNT) {
+      log_warn("%s: couldn't read number of packets in trace %d", fname, t);
+      goto fail;
+    }
+    for (int i = 0; i < np; i++) {
+      if (fscanf(f, "%d %d", &size, &time) != 2 ||
+          size <= SHRT_MIN || size > SHRT_MAX || time < 0) {
+        log_warn("%s: couldn't read trace entry %d/%d", fname, t, i);
+        goto fail;
+      }
+      szs.push_back(size);
+      tms.push_back(time);
+    }
+  }
+  offs.push_back(tms.size());
+  fclose(f);
+
+  {
+    uint32_t hdr[HEADER_WORDS] = {
+      EMBED_TRACE_MAGIC, EMBED_TRACE_VERSION, (uint32_t)nt,
+      (uint32_t)tms.size()
+    };
+    size_t len = image_size(hdr[2], hdr[3]);
+    char *p = (char *)xmalloc(len);
+
+    image = p;
+    image_len = len;
+    memcpy(p, hdr, sizeof hdr);
+    p += sizeof hdr;
+    memcpy(p, &offs[0], offs.size() * sizeof(uint32_t));
+    p += offs.size() * sizeof(uint32_t);
+    memcpy(p, &tms[0], tms.size() * sizeof(int32_t));
+    p += tms.size() * sizeof(int32_t);
+    memcpy(p, &szs[0], szs.size() * sizeof(int16_t));
+  }
+  // can only fail if the code above is wrong
+  log_assert(!adopt(image, image_len));
+  return 0;
+
+ fail:
+  fclose(f);
+  return -1;
+}
+
+int
+embed_traces::save(const char *fname) const
+{
+  log_assert(image);
+
+  FILE *f = fopen(fname, "wb");
+  if (!f) {
+    log_warn("opening %s: %s", fname, strerror(errno));
+    return -1;
+  }
+  if (fwrite(image, 1, image_len, f) != image_len) {
+    log_warn("writing %s: %s", fname, strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  if (fclose(f)) {
+    log_warn("writing %s: %s", fname, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _EMBED_TRACE_H
+#define _EMBED_TRACE_H
+
+/** The packet traces the embed steg module imitates.
+
+    A trace is a sequence of packets, each with a size (positive for
+    client to server, negative for server to client) and a time in
+    milliseconds to wait before sending it; no trace is empty.  All
+    the traces are kept in two flat arrays, with an offset table
+    saying where each trace begins, in a single block of memory laid
+    out exactly as a binary trace file is, so that a binary file can
+    simply be mapped into memory.
+
+    The binary file layout is a header of four 32-bit words: magic,
+    version, number of traces, total number of packets; then the
+    offset table (number of traces + 1 words, each the index of the
+    trace's first packet; the last is the number of packets); then
+    the 32-bit packet times; then the 16-bit packet sizes.  Integers
+    are in the byte order of the machine that wrote the file; a file
+    from a machine of the other byte order is rejected as having a
+    bad magic number.
+
+    The text format, which embed_compile converts to the binary one,
+    is the number of traces, then for each trace its number of packets
+    followed by that many "size time" pairs, all whitespace separated. */
+
+#define EMBED_TRACE_MAGIC   0x54424d45 /* "EMBT" on little-endian */
+#define EMBED_TRACE_VERSION 1
+
+struct embed_traces
+{
+  uint32_t num_traces;
+  uint32_t num_pkts;
+  const uint32_t *offsets;
+  const int32_t *times;
+  const int16_t *sizes;
+
+  embed_traces();
+  ~embed_traces();
+
+  /** Load a binary trace file.  Returns 0 on success; -1 with errno
+      set to ENOENT if the file does not exist; or -1 with errno set
+      to anything else (and logs why) if it cannot be read or is
+      malformed. */
+  int load(const char *fname);
+
+  /** Load a text trace file.  Returns 0 on success; -1 (and logs
+      why) if it cannot be read or is malformed. */
+  int load_text(const char *fname);
+
+  /** Write the traces out as a binary trace file.  Returns 0 on
+      success; -1 (and logs why) on failure. */
+  int save(const char *fname) const;
+
+  void clear();
+
+  uint32_t trace_len(uint32_t i) const
+  { return offsets[i+1] - offsets[i]; }
+
+private:
+  // The arrays, laid out as in a binary file: either a mapping of
+  // the file or a heap block.
+  void *image;
+  size_t image_len;
+  bool mapped;
+
+  int adopt(void *base, size_t len);
+
+  embed_traces(const embed_traces&) DELETE_METHOD;
+  embed_traces& operator=(const embed_traces&) DELETE_METHOD;
+};
+
+#endif
@@ -13,6 +13,8 @@
 #include "swfSteg.h"
 #include "pdfSteg.h"
 #include "jsSteg.h"
+#include "http_resp.h"
+#include "http_parse.h"
 #include "base64.h"
 #include "b64cookies.h"
 
@@ -21,6 +23,16 @@
 #define MIN_COOKIE_SIZE 24
 #define MAX_COOKIE_SIZE 1024
 
+// Largest number of request/response exchanges carried by one cover
+// connection (the same as Apache's default MaxKeepAliveRequests).
+// Setting this to 1 closes each connection after a single exchange.
+#define HTTP_MAX_EXCHANGES 100
+
+// Largest number of requests the client will have outstanding on one
+// connection, and the server will accept before answering any of
+// them.  Setting this to 1 turns pipelining off.
+#define HTTP_PIPELINE_DEPTH 4
+
 int
 http_server_receive(steg_t *s, conn_t *conn, struct evbuffer *dest, struct evbuffer* source);
 
@@ -35,6 +47,7 @@ namespace {
     payloads pl;
 
     STEG_CONFIG_DECLARE_METHODS(http);
+    virtual bool init(const char *args);
   };
 
   struct http_steg_t : steg_t
@@ -43,11 +56,26 @@ namespace {
     conn_t *conn;
     char peer_dnsname[512];
 
-    bool have_transmitted : 1;
-    bool have_received : 1;
-    int type;
+    /** Content types of the requests that have been sent (client) or
+        received (server) but not yet answered, oldest first. */
+    int pending[HTTP_PIPELINE_DEPTH];
+    unsigned int npending;
+    /** Number of requests sent or received on this connection. */
+    unsigned int requests;
+    /** False once either side has said the connection is to close
+        after the last pending request. */
+    bool keep_alive : 1;
+
+    /** Scratch space for building requests or responses on this
+        connection. */
+    http_scratch scratch;
+    /** Parser state for the message at the front of the inbound
+        buffer, kept from one read to the next. */
+    http_parser parser;
 
     http_steg_t(http_steg_config_t *cf, conn_t *cn);
+    void push_request(int type);
+    void pop_request();
     STEG_DECLARE_METHODS(http);
   };
 }
@@ -58,21 +86,46 @@ http_steg_config_t::http_steg_config_t(config_t *cfg)
   : steg_config_t(cfg),
     is_clientside(cfg->mode != LSN_SIMPLE_SERVER)
 {
+}
+
+/* The cover traffic catalog is read from DIR/client.out or
+   DIR/server.out, where DIR is "traces" unless the module is named as
+   http:traces=DIR. */
+bool
+http_steg_config_t::init(const char *args)
+{
+  const char *dir = "traces";
+  char fname[1024];
 
-  if (is_clientside)
-    load_payloads(this->pl, "traces/client.out");
-  else {
-    load_payloads(this->pl, "traces/server.out");
+  if (args) {
+    if (strncmp(args, "traces=", 7) || !args[7]) {
+      log_warn("http: bad argument '%s' (want traces=DIR)", args);
+      return false;
+    }
+    dir = args + 7;
+  }
+
+  if (is_clientside) {
+    xsnprintf(fname, sizeof fname, "%s/client.out", dir);
+    if (load_payloads(this->pl, fname))
+      return false;
+    init_client_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_REQUEST);
+  } else {
+    xsnprintf(fname, sizeof fname, "%s/server.out", dir);
+    if (load_payloads(this->pl, fname))
+      return false;
     init_JS_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, JS_MIN_AVAIL_SIZE);
     //   init_JS_payload_pool(this, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, JS_MIN_AVAIL_SIZE, HTTP_CONTENT_HTML);
     init_HTML_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, HTML_MIN_AVAIL_SIZE);
-    init_PDF_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, PDF_MIN_AVAIL_SIZE);
-    init_SWF_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, 0);
+    init_PDF_payload_pool(this->pl, HTTP_TEMPLATE_MAX_SIZE, TYPE_HTTP_RESPONSE, PDF_MIN_AVAIL_SIZE);
+    init_SWF_payload_pool(this->pl, HTTP_TEMPLATE_MAX_SIZE, TYPE_HTTP_RESPONSE, SWF_MIN_AVAIL_SIZE);
   }
+  return true;
 }
 
 http_steg_config_t::~http_steg_config_t()
 {
+  free_payloads(this->pl);
 }
 
 steg_t *
@@ -87,7 +140,8 @@ int http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source, conn_t
 
 void evbuffer_dump(struct evbuffer *buf, FILE *out);
 void buf_dump(unsigned char* buf, int len, FILE *out);
-int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen);
+size_t gen_uri_field(char* uri, size_t uri_sz, const char* data,
+                     size_t datalen, int* type);
 
 
 void
@@ -140,7 +194,7 @@ buf_dump(unsigned char* buf, int len, FILE *out)
 
 http_steg_t::http_steg_t(http_steg_config_t *cf, conn_t *cn)
   : config(cf), conn(cn),
-    have_transmitted(false), have_received(false)
+    npending(0), requests(0), keep_alive(true)
 {
   memset(peer_dnsname, 0, sizeof peer_dnsname);
 }
@@ -155,6 +209,25 @@ http_steg_t::cfg()
   return config;
 }
 
+/* Note that a request for content of type TYPE has been sent or
+   received, and is awaiting its response. */
+void
+http_steg_t::push_request(int type)
+{
+  log_assert(npending < HTTP_PIPELINE_DEPTH);
+  pending[npending++] = type;
+  requests++;
+}
+
+/* Note that the oldest pending request has been answered. */
+void
+http_steg_t::pop_request()
+{
+  log_assert(npending > 0);
+  npending--;
+  memmove(pending, pending + 1, npending * sizeof(int));
+}
+
 static size_t
 clamp(size_t val, size_t lo, size_t hi)
 {
@@ -166,11 +239,11 @@ clamp(size_t val, size_t lo, size_t hi)
 size_t
 http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
 {
-  if (have_transmitted)
-    /* can't send any more on this connection */
-    return 0;
-
   if (config->is_clientside) {
+    if (!keep_alive || npending == HTTP_PIPELINE_DEPTH)
+      /* can't send any more on this connection, for now or for good */
+      return 0;
+
     // MIN_COOKIE_SIZE and MAX_COOKIE_SIZE are *after* base64'ing
     if (lo < MIN_COOKIE_SIZE*3/4)
       lo = MIN_COOKIE_SIZE*3/4;
@@ -179,35 +252,42 @@ http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
       hi = MAX_COOKIE_SIZE*3/4;
   }
   else {
-    if (!have_received)
+    if (npending == 0)
+      /* nothing to answer */
       return 0;
 
-    switch (type) {
+    switch (pending[0]) {
     case HTTP_CONTENT_SWF:
-      if (hi >= 1024)
-        hi = 1024;
+      // get_payload wants a template with more capacity than we use
+      if (config->pl.max_SWF_capacity > 0 &&
+          hi >= config->pl.max_SWF_capacity)
+        hi = config->pl.max_SWF_capacity - 1;
       break;
 
     case HTTP_CONTENT_JAVASCRIPT:
-      if (hi >= config->pl.max_JS_capacity / 2)
-        hi = config->pl.max_JS_capacity / 2;
+      // hex encoding doubles the data, and get_payload wants a
+      // template with more capacity than that
+      if (hi >= (config->pl.max_JS_capacity - 1) / 2)
+        hi = (config->pl.max_JS_capacity - 1) / 2;
       break;
 
     case HTTP_CONTENT_HTML:
-      if (hi >= config->pl.max_HTML_capacity / 2)
-        hi = config->pl.max_HTML_capacity / 2;
+      if (hi >= (config->pl.max_HTML_capacity - 1) / 2)
+        hi = (config->pl.max_HTML_capacity - 1) / 2;
       break;
 
     case HTTP_CONTENT_PDF:
-      if (hi >= PDF_MIN_AVAIL_SIZE)
-        hi = PDF_MIN_AVAIL_SIZE;
+      // get_payload wants a template with more capacity than we use
+      if (config->pl.max_PDF_capacity > 0 &&
+          hi >= config->pl.max_PDF_capacity)
+        hi = config->pl.max_PDF_capacity - 1;
       break;
     }
   }
 
   if (hi < lo)
     log_abort("hi<lo: client=%d type=%d hi=%ld lo=%ld",
-              config->is_clientside, type,
+              config->is_clientside, npending ? pending[0] : -1,
               (unsigned long)hi, (unsigned long)lo);
 
   return clamp(pref + rng_range_geom(hi - lo, 8), lo, hi);
@@ -258,295 +338,285 @@ lookup_peer_name_from_ip(const char* p_ip, char* p_name)  {
 
 
 
+/* Reserve N contiguous bytes at the end of DEST for a request that
+   is about to be written there. */
+static char *
+reserve_request(struct evbuffer *dest, size_t n, struct evbuffer_iovec *v)
+{
+  if (evbuffer_reserve_space(dest, n, v, 1) != 1 || v->iov_len < n) {
+    log_warn("failed to reserve %lu bytes for a request", (unsigned long)n);
+    return NULL;
+  }
+  return (char *)v->iov_base;
+}
+
+/* Append to P the header of request template T, with our own Host
+   field after the request line (the rest of the line being written
+   by the caller if SKIP_LINE is true), and return the new end. */
+static char *
+put_request_header(char *p, const request_template *t, const char *host,
+                   size_t host_len, bool skip_line)
+{
+  if (!skip_line) {
+    memcpy(p, t->hdr, t->line_len);
+    p += t->line_len;
+  }
+  memcpy(p, "\r\nHost: ", 8);
+  p += 8;
+  memcpy(p, host, host_len);
+  p += host_len;
+  memcpy(p, t->hdr + t->line_len, t->hdr_len - t->line_len);
+  return p + (t->hdr_len - t->line_len);
+}
+
+static const char conn_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char conn_close[] = "Connection: close\r\n\r\n";
+
 int
 http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source,
                              conn_t *conn)
 {
   struct evbuffer *dest = conn->outbound();
   size_t sbuflen = evbuffer_get_length(source);
-  int bufsize = 10000;
-  char* buf = (char*) xmalloc(bufsize);
-
-  char* data;
-  char* data2 = (char*) xmalloc (sbuflen*4);
-  char* cookiebuf = (char*) xmalloc (sbuflen*8);
-  size_t payload_len = 0;
-  size_t cnt = 0;
-  size_t cookie_len = 0;
-  size_t rval;
-  size_t len = 0;
+  const request_template *t = find_client_payload(s->config->pl, -1);
   // '+' -> '-', '/' -> '_', '=' -> '.' per
   // RFC4648 "Base 64 encoding with URL and filename safe alphabet"
   // (which does not replace '=', but dot is an obvious choice; for
   // this use case, the fact that some file systems don't allow more
   // than one dot in a filename is irrelevant).
   base64::encoder E(false, '-', '_', '.');
+  struct evbuffer_iovec v;
+  char *b64, *req, *p;
+  size_t b64len, host_len, reqmax;
+  int nv, i;
 
-  data = (char*) evbuffer_pullup(source, sbuflen);
-  if (!data) {
-    log_debug("evbuffer_pullup failed");
-    goto err;
-  }
-
-  // retry up to 10 times
-  while (!payload_len) {
-    payload_len = find_client_payload(s->config->pl, buf, bufsize,
-                                      TYPE_HTTP_REQUEST);
-    if (cnt++ == 10) {
-      goto err;
-    }
-  }
-  buf[payload_len] = 0;
+  if (!t)
+    return -1;
 
   if (s->peer_dnsname[0] == '\0')
     lookup_peer_name_from_ip(conn->peername, s->peer_dnsname);
+  host_len = strlen(s->peer_dnsname);
 
-  memset(data2, 0, sbuflen*4);
-  len  = E.encode(data, sbuflen, data2);
-  len += E.encode_end(data2+len);
-
-  cookie_len = gen_b64_cookies(cookiebuf, data2, len);
-  cookiebuf[cookie_len] = 0;
-
-  log_debug(conn, "cookie input %lu encoded %lu final %lu/%lu",
-            (unsigned long)sbuflen, (unsigned long)len,
-            (unsigned long)cookie_len, (unsigned long)strlen(cookiebuf));
-  log_debug(conn, "cookie encoded: %s", data2);
-  log_debug(conn, "cookie final: %s", cookiebuf);
-
-  // add uri field
-  rval = evbuffer_add(dest, buf, strstr(buf, "\r\n") - buf + 2);
-  if (rval) {
-    log_warn("error adding uri field\n");
-    goto err;
-  }
-
-  rval = evbuffer_add(dest, "Host: ", 6);
-  if (rval) {
-    log_warn("error adding host field\n");
-    goto err;
-  }
-
-  rval = evbuffer_add(dest, s->peer_dnsname, strlen(s->peer_dnsname));
-  if (rval) {
-    log_warn("error adding peername field\n");
-    goto err;
+  // Base64 the data straight out of the source buffer's chains.
+  b64 = (char *)s->scratch.alloc((sbuflen + 2) / 3 * 4 + 1);
+  nv = evbuffer_peek(source, sbuflen, 0, 0, 0);
+  {
+    struct evbuffer_iovec iv[nv];
+    if (evbuffer_peek(source, sbuflen, 0, iv, nv) != nv) {
+      s->scratch.reset();
+      return -1;
+    }
+    b64len = 0;
+    for (i = 0; i < nv; i++)
+      b64len += E.encode((const char *)iv[i].iov_base, iv[i].iov_len,
+                         b64 + b64len);
+    b64len += E.encode_end(b64 + b64len);
   }
 
-
-  rval = evbuffer_add(dest, strstr(buf, "\r\n"), payload_len - (unsigned int) (strstr(buf, "\r\n") - buf));
-  if (rval) {
-    log_warn("error adding HTTP fields\n");
-    goto err;
+  // Cutting the base64 into cookies at most triples its length
+  // (a one-character name and an empty value per cookie).
+  reqmax = t->hdr_len + 8 + host_len + 8 + 3 * b64len + 2
+    + sizeof conn_keep_alive;
+  req = reserve_request(dest, reqmax, &v);
+  if (!req) {
+    s->scratch.reset();
+    return -1;
   }
 
-  rval =   evbuffer_add(dest, "Cookie: ", 8);
-  if (rval) {
-    log_warn("error adding cookie fields\n");
-    goto err;
+  p = put_request_header(req, t, s->peer_dnsname, host_len, false);
+  memcpy(p, "Cookie: ", 8);
+  p += 8;
+  p += gen_b64_cookies(p, b64, b64len);
+  memcpy(p, "\r\n", 2);
+  p += 2;
+
+  s->keep_alive = s->requests + 1 < HTTP_MAX_EXCHANGES;
+  if (s->keep_alive) {
+    memcpy(p, conn_keep_alive, sizeof conn_keep_alive - 1);
+    p += sizeof conn_keep_alive - 1;
+  } else {
+    memcpy(p, conn_close, sizeof conn_close - 1);
+    p += sizeof conn_close - 1;
   }
-  rval = evbuffer_add(dest, cookiebuf, cookie_len);
 
-  if (rval) {
-    log_warn("error adding cookie buf\n");
-    goto err;
+  log_assert((size_t)(p - req) <= reqmax);
+  v.iov_len = p - req;
+  s->scratch.reset();
+  if (evbuffer_commit_space(dest, &v, 1)) {
+    log_warn("error committing request");
+    return -1;
   }
 
-
-  rval = evbuffer_add(dest, "\r\n\r\n", 4);
-
-  if (rval) {
-    log_warn("error adding terminators \n");
-    goto err;
-  }
+  log_debug(conn, "cookie input %lu encoded %lu request %lu",
+            (unsigned long)sbuflen, (unsigned long)b64len,
+            (unsigned long)(p - req));
 
   evbuffer_drain(source, sbuflen);
   log_debug("CLIENT TRANSMITTED payload %d\n", (int) sbuflen);
-  conn->cease_transmission();
+  if (!s->keep_alive)
+    conn->cease_transmission();
 
-  s->type = find_uri_type(buf, bufsize);
-  s->have_transmitted = true;
-
-
-  free(buf);
-  free(data2);
+  s->push_request(t->uri_type);
   return 0;
-
-err:
-  free(buf);
-  free(data2);
-  return -1;
-
 }
 
 
+/* A small pool of random bytes, so that generating a URI does not
+   cost a call to the random number generator per character. */
+namespace {
+  struct rand_pool
+  {
+    uint8_t bytes[64];
+    size_t next;
+
+    rand_pool() : next(sizeof bytes) {}
+    unsigned int get()
+    {
+      if (next == sizeof bytes) {
+        rng_bytes(bytes, sizeof bytes);
+        next = 0;
+      }
+      return bytes[next++];
+    }
+  };
+}
 
+/* Write to URI (of size URI_SZ) a request line prefix "GET /...ext "
+   hiding the DATALEN characters of DATA among random filler and path
+   separators.  Stores in TYPE the content type the extension implies,
+   and returns the length of what was written, or 0 if it did not fit. */
+size_t
+gen_uri_field(char* uri, size_t uri_sz, const char* data, size_t datalen,
+              int* type)
+{
+  static const struct { char ext[7]; size_t len; int type; } exts[] = {
+    { ".swf ",  5, HTTP_CONTENT_SWF },
+    { ".htm ",  5, HTTP_CONTENT_HTML },
+    { ".html ", 6, HTTP_CONTENT_HTML },
+    { ".js ",   4, HTTP_CONTENT_JAVASCRIPT },
+  };
+  rand_pool rp;
+  size_t so_far = 5;
 
-int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
-  unsigned int so_far = 0;
-  uri[0] = 0;
-
-  strcat(uri, "GET /");
-  so_far = 5;
+  if (uri_sz < so_far + 6)
+    return 0;
+  memcpy(uri, "GET /", 5);
 
   while (datalen > 0) {
-    unsigned int r = rand() % 4;
-
-    if (r == 1) {
-      r = rand() % 46;
-      if (r < 20)
-        uri[so_far++] = 'g' + r;
-      else
-        uri[so_far++] = 'A' + r - 20;
-    }
-    else {
-      uri[so_far++] = data[0];
-      data++;
+    // one byte decides both whether to emit filler before the next
+    // data character (1 in 4) and what separator to follow it with
+    unsigned int r = rp.get();
+
+    if ((r & 3) == 1) {
+      unsigned int f = rp.get() % 46;
+      uri[so_far++] = f < 20 ? 'g' + f : 'A' + f - 20;
+    } else {
+      uri[so_far++] = *data++;
       datalen--;
     }
 
-
-
-    r = rand() % 8;
-
-    if (r == 0 && datalen > 0)
+    r >>= 2;
+    if ((r & 7) == 0 && datalen > 0)
       uri[so_far++] = '/';
-
-    if (r == 2 && datalen > 0)
+    if ((r & 7) == 2 && datalen > 0)
       uri[so_far++] = '_';
 
-
-    if (so_far > uri_sz - 6) {
-      log_warn("too small\n");
+    if (so_far > uri_sz - 8) {
+      log_debug("uri buffer too small");
       return 0;
     }
   }
 
-  switch(rand()%4){
-  case 1:
-    memcpy(uri+so_far, ".htm ", 6);
-    break;
-  case 2:
-    memcpy(uri+so_far, ".html ", 7);
-    break;
-  case 3:
-    memcpy(uri+so_far, ".js ", 5);
-    break;
-  case 0:
-    memcpy(uri+so_far, ".swf ", 6);
-    break;
-
-  }
-
-  return strlen(uri);
-
+  unsigned int e = rp.get() % 4;
+  memcpy(uri + so_far, exts[e].ext, exts[e].len);
+  *type = exts[e].type;
+  return so_far + exts[e].len;
 }
 
 
-
-
-
 int
 http_client_uri_transmit (http_steg_t *s,
                           struct evbuffer *source, conn_t *conn)
 {
-
-
   struct evbuffer *dest = conn->outbound();
-
-
-  struct evbuffer_iovec *iv;
-  int i, nv;
-
-  /* Convert all the data in 'source' to hexadecimal and write it to
-     'scratch'. Data is padded to a multiple of four characters with
-     equals signs. */
   size_t slen = evbuffer_get_length(source);
-  size_t datalen = 0;
-  int cnt = 0;
-  char data[2*slen];
+  const request_template *t = find_client_payload(s->config->pl, -1);
+  struct evbuffer_iovec v;
+  char *hex, *req, *p;
+  size_t hexlen = 0, urimax, urilen, host_len, reqmax;
+  int nv, i, type = -1;
 
-  char outbuf[1024];
-  int len =0;
-  char buf[10000];
+  if (!t)
+    return -1;
 
   if (s->peer_dnsname[0] == '\0')
     lookup_peer_name_from_ip(conn->peername, s->peer_dnsname);
+  host_len = strlen(s->peer_dnsname);
 
-  nv = evbuffer_peek(source, slen, NULL, NULL, 0);
-  iv = (evbuffer_iovec *)xzalloc(sizeof(struct evbuffer_iovec) * nv);
-  if (evbuffer_peek(source, slen, NULL, iv, nv) != nv) {
-    free(iv);
-    return -1;
-  }
-
-  for (i = 0; i < nv; i++) {
-    const unsigned char *p = (const unsigned char *)iv[i].iov_base;
-    const unsigned char *limit = p + iv[i].iov_len;
-    char c;
-    while (p < limit) {
-      c = *p++;
-      data[datalen++] = "0123456789abcdef"[(c & 0xF0) >> 4];
-      data[datalen++] = "0123456789abcdef"[(c & 0x0F) >> 0];
+  /* Convert all the data in 'source' to hexadecimal. */
+  hex = (char *)s->scratch.alloc(2 * slen);
+  nv = evbuffer_peek(source, slen, 0, 0, 0);
+  {
+    struct evbuffer_iovec iv[nv];
+    if (evbuffer_peek(source, slen, 0, iv, nv) != nv) {
+      s->scratch.reset();
+      return -1;
+    }
+    for (i = 0; i < nv; i++) {
+      const unsigned char *q = (const unsigned char *)iv[i].iov_base;
+      const unsigned char *limit = q + iv[i].iov_len;
+      while (q < limit) {
+        unsigned char c = *q++;
+        hex[hexlen++] = "0123456789abcdef"[c >> 4];
+        hex[hexlen++] = "0123456789abcdef"[c & 0x0F];
       }
+    }
   }
-  free(iv);
-
 
+  // Filler and separators make the URI about half again as long as
+  // the hex; room for four times as much makes a retry very unlikely.
+  urimax = 4 * hexlen + 16;
+  reqmax = urimax + 10 + (t->hdr_len - t->line_len) + 8 + host_len
+    + sizeof conn_keep_alive;
+  req = reserve_request(dest, reqmax, &v);
+  if (!req) {
+    s->scratch.reset();
+    return -1;
+  }
 
   do {
-    datalen = gen_uri_field(outbuf, sizeof(outbuf), data, datalen);
-  } while (datalen == 0);
-
-
-
-
-  // retry up to 10 times
-  while (!len) {
-    len = find_client_payload(s->config->pl, buf, sizeof(buf),
-                              TYPE_HTTP_REQUEST);
-    if (cnt++ == 10) return -1;
+    urilen = gen_uri_field(req, urimax, hex, hexlen, &type);
+  } while (urilen == 0);
+  s->scratch.reset();
+
+  p = req + urilen;
+  memcpy(p, "HTTP/1.1", 8);
+  p = put_request_header(p + 8, t, s->peer_dnsname, host_len, true);
+
+  s->keep_alive = s->requests + 1 < HTTP_MAX_EXCHANGES;
+  if (s->keep_alive) {
+    memcpy(p, conn_keep_alive, sizeof conn_keep_alive - 1);
+    p += sizeof conn_keep_alive - 1;
+  } else {
+    memcpy(p, conn_close, sizeof conn_close - 1);
+    p += sizeof conn_close - 1;
   }
 
-
-  if (evbuffer_add(dest, outbuf, datalen)  ||  // add uri field
-      evbuffer_add(dest, "HTTP/1.1\r\nHost: ", 19) ||
-      evbuffer_add(dest, s->peer_dnsname, strlen(s->peer_dnsname)) ||
-      evbuffer_add(dest, strstr(buf, "\r\n"), len - (unsigned int) (strstr(buf, "\r\n") - buf))  ||  // add everything but first line
-      evbuffer_add(dest, "\r\n", 2)) {
-      log_debug("error ***********************");
-      return -1;
+  log_assert((size_t)(p - req) <= reqmax);
+  v.iov_len = p - req;
+  if (evbuffer_commit_space(dest, &v, 1)) {
+    log_warn("error committing request");
+    return -1;
   }
 
-
-
   evbuffer_drain(source, slen);
-  conn->cease_transmission();
-  s->type = find_uri_type(outbuf, sizeof(outbuf));
-  s->have_transmitted = 1;
+  if (!s->keep_alive)
+    conn->cease_transmission();
+  s->push_request(type);
   return 0;
-
 }
 
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
 int
 http_steg_t::transmit(struct evbuffer *source)
 {
@@ -569,31 +639,51 @@ http_steg_t::transmit(struct evbuffer *source)
   }
   else {
     int rval = -1;
-    switch(type) {
+
+    if (npending == 0) {
+      log_warn(conn, "no request to answer");
+      return -1;
+    }
+
+    // Only the response to the last request before the connection
+    // closes says so.
+    bool last = !keep_alive && npending == 1;
+
+    http_date_refresh(bufferevent_get_base(conn->buffer));
+
+    switch(pending[0]) {
 
     case HTTP_CONTENT_SWF:
-      rval = http_server_SWF_transmit(this->config->pl, source, conn);
+      rval = http_server_SWF_transmit(this->config->pl, source, conn,
+                                      !last, scratch);
       break;
 
     case HTTP_CONTENT_JAVASCRIPT:
-      rval = http_server_JS_transmit(this->config->pl, source, conn, HTTP_CONTENT_JAVASCRIPT);
+      rval = http_server_JS_transmit(this->config->pl, source, conn,
+                                     HTTP_CONTENT_JAVASCRIPT, !last,
+                                     scratch);
       break;
 
     case HTTP_CONTENT_HTML:
-      rval = http_server_JS_transmit(this->config->pl, source, conn, HTTP_CONTENT_HTML);
+      rval = http_server_JS_transmit(this->config->pl, source, conn,
+                                     HTTP_CONTENT_HTML, !last,
+                                     scratch);
       break;
 
     case HTTP_CONTENT_PDF:
-      rval = http_server_PDF_transmit(this->config->pl, source, conn);
+      rval = http_server_PDF_transmit(this->config->pl, source, conn,
+                                      !last, scratch);
       break;
     }
 
     if (rval == 0) {
-      have_transmitted = 1;
-      // FIXME: should decide whether or not to do this based on the
-      // Connection: header.  (Needs additional changes elsewhere, esp.
-      // in transmit_room.)
-      conn->cease_transmission();
+      pop_request();
+      if (npending > 0)
+        // Pipelined requests get answered in order; the next one is
+        // owed a response whether or not there is data for it.
+        conn->transmit_soon(100);
+      else if (last)
+        conn->cease_transmission();
     }
     return rval;
   }
@@ -608,10 +698,12 @@ int
 http_server_receive(http_steg_t *s, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
 
   char* data;
-  int type;
+  int nreq = 0;
 
-  do {
-    struct evbuffer_ptr s2 = evbuffer_search(source, "\r\n\r\n", sizeof ("\r\n\r\n") -1 , NULL);
+  // The client may have pipelined several requests; take each complete
+  // one in turn, and leave any partial one for next time.
+  while (evbuffer_get_length(source)) {
+    http_parser &req = s->parser;
     char *p;
     char *pend;
 
@@ -620,36 +712,54 @@ http_server_receive(http_steg_t *s, conn_t *conn, struct evbuffer *dest, struct
     int sofar = 0;
     //int cookie_mode = 0;
 
-
-    if (s2.pos == -1) {
+    int rv = req.parse(source);
+    if (rv < 0) {
+      log_warn(conn, "malformed request");
+      return RECV_BAD;
+    }
+    if (rv == 0 || evbuffer_get_length(source) < req.message_len()) {
       log_debug(conn, "Did not find end of request %d",
                 (int) evbuffer_get_length(source));
-      return RECV_INCOMPLETE;
+      break;
     }
 
-    log_debug(conn, "SERVER received request header of length %d", (int)s2.pos);
+    log_debug(conn, "SERVER received request header of length %d",
+              (int)req.header_len);
 
-    data = (char*) evbuffer_pullup(source, s2.pos+4);
+    if (!s->keep_alive) {
+      log_warn(conn, "request after the connection was to close");
+      return RECV_BAD;
+    }
+    if (s->npending == HTTP_PIPELINE_DEPTH) {
+      log_warn(conn, "more than %d pipelined requests",
+               HTTP_PIPELINE_DEPTH);
+      return RECV_BAD;
+    }
+
+    data = (char*) evbuffer_pullup(source, req.header_len);
 
     if (data == NULL) {
       log_debug(conn, "SERVER evbuffer_pullup fails");
       return RECV_BAD;
     }
 
-    data[s2.pos+3] = 0;
+    s->push_request(find_uri_type((char *)data, req.first_line_len));
 
-    type = find_uri_type((char *)data, s2.pos+4);
+    // Honor the client's Connection: header, up to our own limit on
+    // exchanges per connection.
+    s->keep_alive = req.keep_alive && s->requests < HTTP_MAX_EXCHANGES;
 
-    if (strstr((char*) data, "Cookie") != NULL) {
-      p = strstr((char*) data, "Cookie:") + sizeof "Cookie: "-1;
+    if (req.cookie_len) {
+      p = data + req.cookie_off;
+      pend = p + req.cookie_len;
       //cookie_mode = 1;
     }
-    else
+    else {
       p = data + sizeof "GET /" -1;
+      pend = data + req.first_line_len;
+    }
 
-    log_debug("Cookie: %s", p);
-    pend = strstr(p, "\r\n");
-    log_assert(pend);
+    log_debug("Cookie: %.*s", (int)(pend - p), p);
     if (pend - p > MAX_COOKIE_SIZE * 3/2)
       log_abort(conn, "cookie too big: %lu (max %lu)",
                 (unsigned long)(pend - p), (unsigned long)MAX_COOKIE_SIZE);
@@ -671,16 +781,16 @@ http_server_receive(http_steg_t *s, conn_t *conn, struct evbuffer *dest, struct
       log_debug(conn, "Failed to transfer buffer");
       return RECV_BAD;
     }
-    evbuffer_drain(source, s2.pos + sizeof("\r\n\r\n") - 1);
-  } while (evbuffer_get_length(source));
+    evbuffer_drain(source, req.message_len());
+    req.reset();
+    nreq++;
+  }
 
-  s->have_received = 1;
-  s->type = type;
+  if (nreq == 0)
+    return RECV_INCOMPLETE;
 
-  // FIXME: should decide whether or not to do this based on the
-  // Connection: header.  (Needs additional changes elsewhere, esp.
-  // in transmit_room.)
-  conn->expect_close();
+  if (!s->keep_alive)
+    conn->expect_close();
 
   conn->transmit_soon(100);
   return RECV_GOOD;
@@ -690,33 +800,88 @@ int
 http_steg_t::receive(struct evbuffer *dest)
 {
   struct evbuffer *source = conn->inbound();
-  // unsigned int type;
-  int rval = RECV_BAD;
+  int rval = RECV_INCOMPLETE;
 
 
   if (config->is_clientside) {
-    switch(type) {
+    // There may be responses to several pipelined requests in SOURCE;
+    // they come back in the order the requests went out.
+    while (evbuffer_get_length(source) > 0) {
+      if (npending == 0) {
+        log_warn(conn, "response without a request");
+        rval = RECV_BAD;
+        break;
+      }
 
-    case HTTP_CONTENT_SWF:
-      rval = http_handle_client_SWF_receive(this, conn, dest, source);
-      break;
+      // Nothing looks at the response until all of it is here.
+      int rv = parser.parse(source);
+      if (rv < 0) {
+        log_warn(conn, "malformed response");
+        rval = RECV_BAD;
+        break;
+      }
+      if (rv == 0) {
+        rval = RECV_INCOMPLETE;
+        break;
+      }
+      if (parser.content_length < 0) {
+        log_warn(conn, "response without Content-Length");
+        rval = RECV_BAD;
+        break;
+      }
+      if (evbuffer_get_length(source) < parser.message_len()) {
+        rval = RECV_INCOMPLETE;
+        break;
+      }
 
-    case HTTP_CONTENT_JAVASCRIPT:
-    case HTTP_CONTENT_HTML:
-      rval = http_handle_client_JS_receive(this, conn, dest, source);
-      break;
+      bool server_closing = !parser.keep_alive;
+      size_t hlen = parser.header_len;
+      size_t clen = parser.content_length;
 
-    case HTTP_CONTENT_PDF:
-      rval = http_handle_client_PDF_receive(this, conn, dest, source);
-      break;
-    }
+      switch(pending[0]) {
 
-    if (rval == RECV_GOOD) have_received = 1;
-    return rval;
+      case HTTP_CONTENT_SWF:
+        rval = http_handle_client_SWF_receive(dest, source, hlen, clen);
+        break;
+
+      case HTTP_CONTENT_JAVASCRIPT:
+      case HTTP_CONTENT_HTML:
+        rval = http_handle_client_JS_receive(dest, source, hlen, clen);
+        break;
+
+      case HTTP_CONTENT_PDF:
+        rval = http_handle_client_PDF_receive(dest, source, hlen, clen);
+        break;
+
+      default:
+        rval = RECV_BAD;
+        break;
+      }
+
+      if (rval != RECV_GOOD)
+        break;
+
+      parser.reset();
+      pop_request();
+      if (server_closing) {
+        if (npending > 0)
+          log_debug(conn, "server closed with %u requests unanswered",
+                    npending);
+        npending = 0;
+        if (keep_alive) {
+          keep_alive = false;
+          conn->cease_transmission();
+        }
+      }
+      if (!keep_alive && npending == 0) {
+        conn->expect_close();
+        break;
+      }
+    }
 
   } else {
-    return http_server_receive(this, conn, dest, source);
+    rval = http_server_receive(this, conn, dest, source);
   }
 
-
+  return rval == RECV_BAD ? -1 : 0;
 }
@@ -0,0 +1,183 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "http_parse.h"
+
+#include <event2/buffer.h>
+
+http_parser::http_parser()
+{
+  reset();
+}
+
+void
+http_parser::reset()
+{
+  scanned = 0;
+  line_start = 0;
+  prefix_len = 0;
+  memset(tail, 0, sizeof tail);
+  done = false;
+
+  header_len = 0;
+  first_line_len = 0;
+  content_length = -1;
+  cookie_off = 0;
+  cookie_len = 0;
+  keep_alive = false;
+}
+
+/* Report whether the LEN-byte header line LINE is the field NAME
+   (which includes the colon). */
+static bool
+field_p(const char *line, size_t len, const char *name)
+{
+  size_t nlen = strlen(name);
+  return len >= nlen && !strncasecmp(line, name, nlen);
+}
+
+/* Skip spaces and tabs from P up to LIMIT. */
+static const char *
+skip_lws(const char *p, const char *limit)
+{
+  while (p < limit && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+/* Called with 'scanned' just past the newline at the end of a line.
+   Only the first LINE_PREFIX bytes of the line are in 'prefix', and
+   its last few bytes are in 'tail'.  */
+int
+http_parser::end_line()
+{
+  size_t len = scanned - line_start - 1;
+  int cr = len > 0 && tail[sizeof tail - 1] == '\r';
+  len -= cr;
+
+  size_t plen = len < prefix_len ? len : prefix_len;
+  const char *plimit = prefix + plen;
+  int rv = 0;
+
+  if (len == 0) {
+    if (line_start == 0) {
+      log_debug("HTTP message begins with a blank line");
+      return -1;
+    }
+    header_len = scanned;
+    done = true;
+    rv = 1;
+
+  } else if (line_start == 0) {
+    // "HTTP/1.1 200 OK" or "GET /foo HTTP/1.1".  HTTP/1.1 connections
+    // persist by default, HTTP/1.0 ones do not.
+    const char *t = tail + sizeof tail - cr - 8;
+    first_line_len = len;
+    keep_alive = ((plen >= 8 && !memcmp(prefix, "HTTP/1.1", 8)) ||
+                  (len >= 8 && !memcmp(t, "HTTP/1.1", 8)));
+
+  } else if (field_p(prefix, plen, "Content-Length:")) {
+    const char *p = skip_lws(prefix + sizeof "Content-Length:" - 1, plimit);
+    const char *q = plimit;
+    long val = 0;
+
+    while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+      q--;
+    if (len > prefix_len || p == q) {
+      log_debug("bad Content-Length header");
+      return -1;
+    }
+    for (; p < q; p++) {
+      if (*p < '0' || *p > '9' || val > (LONG_MAX - 9) / 10) {
+        log_debug("bad Content-Length header");
+        return -1;
+      }
+      val = val * 10 + (*p - '0');
+    }
+    content_length = val;
+
+  } else if (field_p(prefix, plen, "Connection:")) {
+    const char *p = skip_lws(prefix + sizeof "Connection:" - 1, plimit);
+    if (plimit - p >= 5 && !strncasecmp(p, "close", 5))
+      keep_alive = false;
+    else if (plimit - p >= 10 && !strncasecmp(p, "keep-alive", 10))
+      keep_alive = true;
+
+  } else if (field_p(prefix, plen, "Cookie:")) {
+    const char *p = skip_lws(prefix + sizeof "Cookie:" - 1, plimit);
+    cookie_off = line_start + (p - prefix);
+    cookie_len = line_start + len - cookie_off;
+  }
+
+  line_start = scanned;
+  prefix_len = 0;
+  memset(tail, 0, sizeof tail);
+  return rv;
+}
+
+int
+http_parser::parse(struct evbuffer *source)
+{
+  if (done)
+    return 1;
+
+  size_t avail = evbuffer_get_length(source);
+  if (avail <= scanned)
+    return 0;
+
+  struct evbuffer_ptr start;
+  if (evbuffer_ptr_set(source, &start, scanned, EVBUFFER_PTR_SET)) {
+    log_warn("evbuffer_ptr_set failed");
+    return -1;
+  }
+
+  int n = evbuffer_peek(source, avail - scanned, &start, 0, 0);
+  struct evbuffer_iovec v[n];
+  if (evbuffer_peek(source, avail - scanned, &start, v, n) != n) {
+    log_warn("evbuffer_peek failed");
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    const char *p = (const char *)v[i].iov_base;
+    const char *limit = p + v[i].iov_len;
+
+    while (p < limit) {
+      const char *nl = (const char *)memchr(p, '\n', limit - p);
+      const char *end = nl ? nl : limit;
+      size_t seg = end - p;
+
+      if (prefix_len < LINE_PREFIX) {
+        size_t take = LINE_PREFIX - prefix_len;
+        if (take > seg)
+          take = seg;
+        memcpy(prefix + prefix_len, p, take);
+        prefix_len += take;
+      }
+      if (seg >= sizeof tail) {
+        memcpy(tail, end - sizeof tail, sizeof tail);
+      } else if (seg > 0) {
+        memmove(tail, tail + seg, sizeof tail - seg);
+        memcpy(tail + sizeof tail - seg, p, seg);
+      }
+      scanned += seg;
+
+      if (!nl)
+        break;
+
+      scanned++;
+      int rv = end_line();
+      if (rv)
+        return rv;
+      p = nl + 1;
+    }
+
+    if (scanned > HTTP_MAX_HEADER_SIZE) {
+      log_warn("HTTP header longer than %d bytes", HTTP_MAX_HEADER_SIZE);
+      return -1;
+    }
+  }
+  return 0;
+}
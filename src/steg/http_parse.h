@@ -0,0 +1,74 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _HTTP_PARSE_H
+#define _HTTP_PARSE_H
+
+#include <event2/buffer.h>
+
+// Longest HTTP header we are prepared to wait for.
+#define HTTP_MAX_HEADER_SIZE 65536
+
+/** Incremental parser for the header of the HTTP request or response
+    at the front of an evbuffer.
+
+    Data for a message may arrive in many small pieces.  Rather than
+    searching the whole buffer for the end of the header each time
+    something arrives, call parse() after each read; it looks only at
+    the bytes that arrived since the previous call, and picks out the
+    header fields the steg modules care about as it goes past them.
+    Once parse() reports a complete header, the fields below describe
+    the message, and the caller can tell from message_len() whether
+    the body is all there yet without looking at the data again.
+
+    After the caller has consumed (drained) the message, reset() gets
+    the parser ready for the next one on the same connection. */
+class http_parser
+{
+  // Header lines are examined only this far; that is enough for all
+  // the field names and values we need to look at.
+  enum { LINE_PREFIX = 48 };
+
+  size_t scanned;
+  size_t line_start;
+  size_t prefix_len;
+  char prefix[LINE_PREFIX];
+  char tail[9];
+  bool done;
+
+  int end_line();
+
+public:
+  /** Length of the header, including the blank line that ends it. */
+  size_t header_len;
+  /** Length of the first (request or status) line, not counting
+      its CRLF. */
+  size_t first_line_len;
+  /** Value of the Content-Length header, or -1 if there is none. */
+  long content_length;
+  /** Offset and length of the value of the Cookie header, if any;
+      cookie_len is zero if there is none. */
+  size_t cookie_off;
+  size_t cookie_len;
+  /** Whether the connection is to stay open after this message,
+      according to its HTTP version and Connection header. */
+  bool keep_alive;
+
+  http_parser();
+
+  /** Scan what has been added to SOURCE since the last call.  Returns
+      1 once the header is complete, 0 if more data is needed, or -1
+      if the header is malformed or longer than HTTP_MAX_HEADER_SIZE. */
+  int parse(struct evbuffer *source);
+
+  /** Total length of the message: the header plus Content-Length
+      bytes of body.  Only meaningful once parse() has returned 1. */
+  size_t message_len() const
+  { return header_len + (content_length > 0 ? content_length : 0); }
+
+  /** Start over on the next message. */
+  void reset();
+};
+
+#endif
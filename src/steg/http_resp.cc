@@ -0,0 +1,401 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "http_resp.h"
+#include "payloads.h"
+
+#include <event2/event.h>
+
+/* Scratch allocations are rounded up to this, which is enough
+   alignment for anything we put in them. */
+#define SCRATCH_ALIGN 16
+
+/* The arena itself is grown in units of this size. */
+#define SCRATCH_GRANULE 4096
+
+struct http_scratch::overflow
+{
+  overflow *next;
+  /* pad the header out so that the data after it stays aligned */
+  char pad[SCRATCH_ALIGN - sizeof(overflow *)];
+};
+
+http_scratch::http_scratch()
+  : base(0), size(0), used(0), demand(0), spill(0),
+    heap_allocs(0), body_moves(0), bytes_moved(0)
+{
+}
+
+http_scratch::~http_scratch()
+{
+  reset();
+  free(base);
+}
+
+void *
+http_scratch::alloc(size_t n)
+{
+  log_assert(n <= SIZE_T_CEILING);
+  n = (n + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+  demand += n;
+
+  if (size - used >= n) {
+    void *p = base + used;
+    used += n;
+    return p;
+  }
+
+  overflow *o = (overflow *)xmalloc(sizeof(overflow) + n);
+  heap_allocs++;
+  o->next = spill;
+  spill = o;
+  return o + 1;
+}
+
+void
+http_scratch::reset()
+{
+  while (spill) {
+    overflow *o = spill;
+    spill = o->next;
+    free(o);
+  }
+
+  if (demand > size) {
+    size = (demand + SCRATCH_GRANULE - 1) & ~(size_t)(SCRATCH_GRANULE - 1);
+    free(base);
+    base = (char *)xmalloc(size);
+    heap_allocs++;
+  }
+
+  used = 0;
+  demand = 0;
+}
+
+/* Response headers.
+
+   A response header is one of a small number of variants (the same
+   Server field, one of four Vary fields, an Expires field or not,
+   Content-Encoding or not, and two Connection fields) for each content
+   type.  Each variant is built once, as a template with the Date,
+   Expires and Content-Length values left out and their offsets noted,
+   so that building a header costs a couple of memcpys and rendering
+   an integer. The Date value is kept pre-rendered and only changes
+   once a second. */
+
+#define RESP_TEMPLATE_SIZE 400
+#define RESP_MAX_CONTENT_TYPE 100
+
+/* vary(4) x expires(2) x gzip(2) x keep_alive(2) */
+#define RESP_VARIANTS 32
+
+struct resp_template
+{
+  unsigned short len;
+  unsigned short date_off;
+  unsigned short expires_off;   /* 0 if there is no Expires field */
+  unsigned short clen_off;      /* where the Content-Length digits go */
+  char text[RESP_TEMPLATE_SIZE];
+};
+
+/* Content types the steg modules produce; templates for these are
+   cached.  Anything else is built from scratch each time. */
+static const char resp_content_types[][32] = {
+  "application/x-javascript",
+  "text/html",
+  "application/pdf",
+  "application/x-shockwave-flash",
+};
+#define RESP_CONTENT_TYPES \
+  (sizeof resp_content_types / sizeof resp_content_types[0])
+
+static struct
+{
+  bool ready;
+  resp_template v[RESP_VARIANTS];
+} resp_templates[RESP_CONTENT_TYPES];
+
+static struct
+{
+  time_t sec;
+  char date[HTTP_DATE_LEN];
+} date_cache = { -1, { 0 } };
+
+void
+http_date_render(char *out, time_t t)
+{
+  static const char days[] = "SunMonTueWedThuFriSat";
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+  long z = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+  long secs = t - z * 86400;
+  int wday = (int)((z % 7 + 11) % 7);   // 1970-01-01 was a Thursday
+
+  // days since the epoch to a Gregorian date; see
+  // http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+  z += 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  int mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+  int mon = (int)(mp < 10 ? mp + 3 : mp - 9);
+  long year = yoe + era * 400 + (mon <= 2);
+  int hour = (int)(secs / 3600), min = (int)(secs / 60 % 60);
+  int sec = (int)(secs % 60);
+
+  memcpy(out, days + 3 * wday, 3);
+  out[3] = ',';
+  out[4] = ' ';
+  out[5] = '0' + mday / 10;
+  out[6] = '0' + mday % 10;
+  out[7] = ' ';
+  memcpy(out + 8, months + 3 * (mon - 1), 3);
+  out[11] = ' ';
+  out[12] = '0' + year / 1000 % 10;
+  out[13] = '0' + year / 100 % 10;
+  out[14] = '0' + year / 10 % 10;
+  out[15] = '0' + year % 10;
+  out[16] = ' ';
+  out[17] = '0' + hour / 10;
+  out[18] = '0' + hour % 10;
+  out[19] = ':';
+  out[20] = '0' + min / 10;
+  out[21] = '0' + min % 10;
+  out[22] = ':';
+  out[23] = '0' + sec / 10;
+  out[24] = '0' + sec % 10;
+  memcpy(out + 25, " GMT", 4);
+}
+
+void
+http_date_refresh(struct event_base *base)
+{
+  struct timeval tv;
+  if (event_base_gettimeofday_cached(base, &tv))
+    tv.tv_sec = time(0);
+  if (tv.tv_sec != date_cache.sec) {
+    http_date_render(date_cache.date, tv.tv_sec);
+    date_cache.sec = tv.tv_sec;
+  }
+}
+
+static char *
+append(char *p, const char *s, size_t n)
+{
+  memcpy(p, s, n);
+  return p + n;
+}
+#define APPEND(p, lit) append(p, lit, sizeof lit - 1)
+
+static int
+build_resp_template(resp_template *t, const char *content_type,
+                    int variant)
+{
+  static const char vary[][40] = {
+    "",
+    "Vary: Cookie\r\n",
+    "Vary: Accept-Encoding, User-Agent\r\n",
+    "Vary: *\r\n",
+  };
+  size_t ctlen = strlen(content_type);
+  bool keep_alive = variant & 1;
+  bool gzip = variant & 2;
+  bool expires = variant & 4;
+  int v = variant >> 3;
+  char *p = t->text;
+
+  if (ctlen > RESP_MAX_CONTENT_TYPE) {
+    log_warn("content type too long: %s", content_type);
+    return -1;
+  }
+
+  p = APPEND(p, "HTTP/1.1 200 OK\r\nDate: ");
+  t->date_off = p - t->text;
+  p += HTTP_DATE_LEN;
+  p = APPEND(p, "\r\nServer: Apache\r\n");
+  p = append(p, vary[v], strlen(vary[v]));
+  t->expires_off = 0;
+  if (expires) {
+    p = APPEND(p, "Expires: ");
+    t->expires_off = p - t->text;
+    p += HTTP_DATE_LEN;
+    p = APPEND(p, "\r\n");
+  }
+  p = APPEND(p, "Content-Length: ");
+  t->clen_off = p - t->text;
+  if (gzip)
+    p = APPEND(p, "\r\nContent-Encoding: gzip");
+  p = APPEND(p, "\r\nContent-Type: ");
+  p = append(p, content_type, ctlen);
+  if (keep_alive)
+    p = APPEND(p, "\r\nConnection: Keep-Alive\r\n\r\n");
+  else
+    p = APPEND(p, "\r\nConnection: close\r\n\r\n");
+
+  t->len = p - t->text;
+  log_assert(t->len <= RESP_TEMPLATE_SIZE);
+  return 0;
+}
+
+/* Write a response header to BUF as gen_response_header does, and
+   also report the offset of the Content-Length digits in *CLEN_OFF
+   and their number in *CLEN_DIGITS. */
+static int
+put_response_header(const char *content_type, int gzip, int keep_alive,
+                    int length, char *buf, int buflen,
+                    size_t *clen_off, size_t *clen_digits)
+{
+  // The same choices, with the same odds, as always.
+  int r = rand() % 9;
+  int vary = (r >= 1 && r <= 3) ? r : 0;
+  int expires = rand() % 4 == 2;
+  int variant = (vary << 3) | (expires << 2) | (!!gzip << 1) | !!keep_alive;
+  resp_template scratch_t;
+  const resp_template *t = 0;
+  size_t i;
+
+  for (i = 0; i < RESP_CONTENT_TYPES; i++)
+    if (!strcmp(content_type, resp_content_types[i])) {
+      if (!resp_templates[i].ready) {
+        for (int j = 0; j < RESP_VARIANTS; j++)
+          build_resp_template(&resp_templates[i].v[j],
+                              resp_content_types[i], j);
+        resp_templates[i].ready = true;
+      }
+      t = &resp_templates[i].v[variant];
+      break;
+    }
+  if (!t) {
+    if (build_resp_template(&scratch_t, content_type, variant))
+      return -1;
+    t = &scratch_t;
+  }
+
+  char digits[12];
+  size_t nd = 0;
+  unsigned int n = length;
+  do {
+    digits[sizeof digits - ++nd] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+
+  if ((size_t)buflen < t->len + nd + 1) {
+    log_warn("gen_response_header: buflen too small");
+    return -1;
+  }
+
+  if (date_cache.sec == -1)
+    http_date_refresh(0);
+
+  memcpy(buf, t->text, t->clen_off);
+  memcpy(buf + t->date_off, date_cache.date, HTTP_DATE_LEN);
+  if (t->expires_off)
+    http_date_render(buf + t->expires_off, date_cache.sec + rand() % 10000);
+  memcpy(buf + t->clen_off, digits + sizeof digits - nd, nd);
+  memcpy(buf + t->clen_off + nd, t->text + t->clen_off,
+         t->len - t->clen_off);
+  buf[t->len + nd] = '\0';
+
+  if (clen_off)
+    *clen_off = t->clen_off;
+  if (clen_digits)
+    *clen_digits = nd;
+  return t->len + nd;
+}
+
+int
+gen_response_header(const char* content_type, int gzip, int keep_alive,
+                    int length, char* buf, int buflen)
+{
+  return put_response_header(content_type, gzip, keep_alive, length,
+                             buf, buflen, 0, 0);
+}
+
+http_resp_builder::http_resp_builder(struct evbuffer *dest,
+                                     http_scratch &scratch)
+  : dest(dest), scratch(scratch),
+    clen(0), clen_digits(0), hdr_len(0), body_max(0)
+{
+  space.iov_base = 0;
+  space.iov_len = 0;
+}
+
+http_resp_builder::~http_resp_builder()
+{
+  scratch.reset();
+}
+
+char *
+http_resp_builder::begin(const char *content_type, int gzip, bool keep_alive,
+                         size_t bmax)
+{
+  log_assert(!space.iov_base);
+
+  if (!dest || bmax > (size_t)INT_MAX - MAX_RESP_HDR_SIZE) {
+    log_warn("cannot build a %lu-byte response",
+             (unsigned long)bmax);
+    return 0;
+  }
+
+  if (evbuffer_reserve_space(dest, MAX_RESP_HDR_SIZE + bmax,
+                             &space, 1) != 1) {
+    log_warn("evbuffer_reserve_space failed");
+    space.iov_base = 0;
+    return 0;
+  }
+
+  char *hdr = (char *)space.iov_base;
+  size_t clen_off;
+  int n = put_response_header(content_type, gzip, keep_alive, (int)bmax,
+                              hdr, MAX_RESP_HDR_SIZE,
+                              &clen_off, &clen_digits);
+  if (n < 0) {
+    log_warn("gen_response_header failed");
+    space.iov_base = 0;
+    return 0;
+  }
+  clen = hdr + clen_off;
+
+  hdr_len = n;
+  body_max = bmax;
+  return hdr + hdr_len;
+}
+
+int
+http_resp_builder::commit(size_t body_len)
+{
+  log_assert(space.iov_base);
+  log_assert(body_len <= body_max);
+
+  char digits[24];
+  size_t ndigits = xsnprintf(digits, sizeof digits, "%lu",
+                             (unsigned long)body_len);
+  log_assert(ndigits <= clen_digits);
+
+  memcpy(clen, digits, ndigits);
+  if (ndigits < clen_digits) {
+    // Close the gap left by the shorter length: everything from the
+    // end of the old digits to the end of the body moves down.
+    char *from = clen + clen_digits;
+    char *end = (char *)space.iov_base + hdr_len + body_len;
+    size_t shift = clen_digits - ndigits;
+    memmove(clen + ndigits, from, end - from);
+    hdr_len -= shift;
+    scratch.body_moves++;
+    scratch.bytes_moved += end - from;
+  }
+
+  space.iov_len = hdr_len + body_len;
+  if (evbuffer_commit_space(dest, &space, 1)) {
+    log_warn("evbuffer_commit_space failed");
+    space.iov_base = 0;
+    return -1;
+  }
+
+  space.iov_base = 0;
+  return hdr_len + body_len;
+}
@@ -0,0 +1,133 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _HTTP_RESP_H
+#define _HTTP_RESP_H
+
+#include <event2/buffer.h>
+#include <time.h>
+
+struct event_base;
+
+/** Length of an RFC 1123 date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT". */
+#define HTTP_DATE_LEN 29
+
+/** Write the RFC 1123 form of T to OUT: exactly HTTP_DATE_LEN bytes,
+    not NUL-terminated. */
+void http_date_render(char *out, time_t t);
+
+/** Bring the date that response headers carry up to date with the
+    cached clock of BASE (or the system clock, if BASE is NULL).  The
+    date is only re-rendered when the second changes, so this is
+    cheap enough to call before every response. */
+void http_date_refresh(struct event_base *base);
+
+/** Write a response header for a body of LENGTH bytes of
+    CONTENT_TYPE into BUF, which holds BUFLEN bytes, and NUL-terminate
+    it.  The header carries the current date (see http_date_refresh),
+    gzip encoding if GZIP, and a Connection header to match
+    KEEP_ALIVE; a Vary or Expires header is sometimes added, as a
+    real server might.  Returns the header's length, or -1 if BUF is
+    too small. */
+int gen_response_header(const char* content_type, int gzip, int keep_alive,
+                        int length, char* buf, int buflen);
+
+/** Per-connection scratch arena for building HTTP responses.
+
+    Every server response needs a few temporary buffers (hex-encoded
+    data, uncompressed bodies, and so on) whose sizes are similar from
+    one response to the next.  Rather than allocating and freeing them
+    each time, transmit functions carve them out of this arena, which
+    is reset after each response.  If a response asks for more than
+    the arena holds, the extra requests are satisfied from the heap
+    and the arena grows to the high-water mark on the next reset, so
+    that in steady state no heap allocation happens at all.
+
+    The counters are for the benefit of benchmarks and debugging
+    logs; nothing in the steg modules depends on them. */
+class http_scratch
+{
+  struct overflow;
+
+  char *base;
+  size_t size;
+  size_t used;
+  size_t demand;
+  overflow *spill;
+
+  http_scratch(const http_scratch&) DELETE_METHOD;
+  http_scratch& operator=(const http_scratch&) DELETE_METHOD;
+
+public:
+  /** Number of times the arena has called the heap allocator. */
+  unsigned long heap_allocs;
+  /** Number of responses whose body had to be slid down behind a
+      header that came out shorter than planned. */
+  unsigned long body_moves;
+  /** Total bytes moved by those slides. */
+  unsigned long bytes_moved;
+
+  http_scratch();
+  ~http_scratch();
+
+  /** Return a pointer to N bytes of scratch space, suitably aligned
+      for any type.  The space remains valid until the next reset(). */
+  void *alloc(size_t n);
+
+  /** Release everything handed out by alloc().  Grows the arena if
+      the most recent round of allocations did not fit.  */
+  void reset();
+};
+
+/** Builds one HTTP response directly in the output evbuffer of a
+    connection.
+
+    begin() reserves enough contiguous space in DEST for a response
+    header plus BODY_MAX bytes of body, writes a response header
+    (see gen_response_header) into the front of it, and returns a
+    pointer to where the body should go.  The caller then generates
+    the body in place, and calls commit() with its actual length.
+    commit() patches Content-Length and commits the space to DEST.
+
+    The header says "Connection: Keep-Alive" if KEEP_ALIVE is true,
+    and "Connection: close" otherwise; it is up to the caller to
+    actually keep the connection open or close it to match.
+
+    The header is generated with BODY_MAX as the provisional length;
+    if the actual length has fewer digits, the body is moved down
+    by the difference.  Callers should therefore give as tight a
+    BODY_MAX as they can.
+
+    If the builder is destroyed without commit() having been called,
+    nothing is added to DEST.  In either case the scratch arena is
+    reset on destruction, so scratch allocations made while building
+    a response must not outlive the builder. */
+class http_resp_builder
+{
+  struct evbuffer *dest;
+  http_scratch &scratch;
+  struct evbuffer_iovec space;
+  char *clen;
+  size_t clen_digits;
+  size_t hdr_len;
+  size_t body_max;
+
+  http_resp_builder(const http_resp_builder&) DELETE_METHOD;
+  http_resp_builder& operator=(const http_resp_builder&) DELETE_METHOD;
+
+public:
+  http_resp_builder(struct evbuffer *dest, http_scratch &scratch);
+  ~http_resp_builder();
+
+  /** Reserve space and write the header; returns the body pointer,
+      or NULL on failure. */
+  char *begin(const char *content_type, int gzip, bool keep_alive,
+              size_t body_max);
+
+  /** Finish the response, whose body is BODY_LEN bytes long.
+      Returns the total number of bytes added to DEST, or -1. */
+  int commit(size_t body_len);
+};
+
+#endif
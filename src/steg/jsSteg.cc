@@ -8,6 +8,7 @@
 #include "cookies.h"
 #include "compression.h"
 #include "connections.h"
+#include "http_resp.h"
 
 #include <ctype.h>
 
@@ -602,15 +603,15 @@ int decodeHTTPBody (char *jData, char *dataBuf, unsigned int jdlen,
 
 
 
-void printerr(int errno) {
-  if (errno == INVALID_BUF_SIZE) {
+void printerr(int err) {
+  if (err == INVALID_BUF_SIZE) {
     printf ("Error: Output buffer too small\n");
   }
-  else if (errno == INVALID_DATA_CHAR) {
+  else if (err == INVALID_DATA_CHAR) {
     printf ("Error: Non-hex char in data\n");
   }
   else {
-    printf ("Unknown error: %i\n", errno);
+    printf ("Unknown error: %i\n", err);
   }
 }
 
@@ -726,18 +727,19 @@ int testDecode2(char *inBuf, char *outBuf,
 
 int
 http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
-                         unsigned int content_type)
+                         unsigned int content_type, bool keep_alive,
+                         http_scratch& scratch)
 {
 
   struct evbuffer_iovec *iv;
   int nv;
   struct evbuffer *dest = conn->outbound();
   size_t sbuflen = evbuffer_get_length(source);
-  char *hend, *jsTemplate = NULL, *outbuf, *outbuf2;
-  char data[(int) sbuflen*2];
-  char newHdr[MAX_RESP_HDR_SIZE];
+  char *hend, *jsTemplate = NULL, *data, *outbuf, *body;
+  const char *ctype;
   unsigned int datalen = 0, cnt = 0, mjs = 0;
-  int r, i, mode, jsLen, hLen, cLen, newHdrLen = 0, outbuf2len;
+  int r, i, mode, jsLen, hLen, cLen, outbuf2len;
+  size_t body_max;
 
   int gzipMode = JS_GZIP_RESP;
 
@@ -750,17 +752,6 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
     return -1;
   }
 
-  // log_debug("SERVER: dumping data with length %d:", (int) sbuflen);
-  // evbuffer_dump(source, stderr);
-
-  nv = evbuffer_peek(source, sbuflen, NULL, NULL, 0);
-  iv = (evbuffer_iovec *)xzalloc(sizeof(struct evbuffer_iovec) * nv);
-
-  if (evbuffer_peek(source, sbuflen, NULL, iv, nv) != nv) {
-    free(iv);
-    return -1;
-  }
-
   if (content_type == HTTP_CONTENT_JAVASCRIPT) {
     mjs = pl.max_JS_capacity;
   } else if (content_type == HTTP_CONTENT_HTML) {
@@ -778,7 +769,22 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
     return -1;
   }
 
+  // All temporaries below come from the per-connection scratch arena,
+  // which the builder releases when it goes out of scope.
+  http_resp_builder rb(dest, scratch);
+
+  // log_debug("SERVER: dumping data with length %d:", (int) sbuflen);
+  // evbuffer_dump(source, stderr);
+
+  nv = evbuffer_peek(source, sbuflen, NULL, NULL, 0);
+  iv = (evbuffer_iovec *)scratch.alloc(sizeof(struct evbuffer_iovec) * nv);
+
+  if (evbuffer_peek(source, sbuflen, NULL, iv, nv) != nv)
+    return -1;
+
   // Convert data in 'source' to hexadecimal and write it to data
+  // (NUL-terminated, for the sake of isxString)
+  data = (char *)scratch.alloc(sbuflen*2 + 1);
   cnt = 0;
   for (i = 0; i < nv; i++) {
     const unsigned char *p = (const unsigned char *)iv[i].iov_base;
@@ -793,8 +799,7 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
       cnt++;
     }
   }
-
-  free(iv);
+  data[datalen] = '\0';
 
   //log_debug("SERVER encoded data in hex string (len %d):", datalen);
   //    buf_dump((unsigned char*)data, datalen, stderr);
@@ -825,9 +830,34 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
   // log_debug("HTTP resp tempmlate:");
   // buf_dump((unsigned char*)jsTemplate, jsLen, stderr);
 
+  if (mode == CONTENT_JAVASCRIPT) { // JavaScript in HTTP body
+    ctype = "application/x-javascript";
+  } else if (mode == CONTENT_HTML_JAVASCRIPT) { // JavaScript(s) embedded in HTML doc
+    ctype = "text/html";
+  } else { // unknown mode
+    log_warn("SERVER ERROR: unknown mode for creating the HTTP response header");
+    return -1;
+  }
+
   hLen = hend+4-jsTemplate;
   cLen = jsLen - hLen;
-  outbuf = (char *)xmalloc(cLen);
+
+  // Without compression the encoded body goes straight into the
+  // response; with it, it is staged in scratch and compressed into
+  // the response.
+  if (gzipMode == 1)
+    body_max = compress_bound(cLen, c_format_gzip);
+  else
+    body_max = cLen;
+
+  body = rb.begin(ctype, gzipMode, keep_alive, body_max);
+  if (!body)
+    return -1;
+
+  if (gzipMode == 1)
+    outbuf = (char *)scratch.alloc(cLen);
+  else
+    outbuf = body;
 
   r = encodeHTTPBody(data, hend+4, outbuf, datalen, cLen, cLen, mode);
 
@@ -838,61 +868,25 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
 
   // work in progress
   if (gzipMode == 1) {
-    // conservative estimate:
-    // sizeof outbuf2 = cLen + 10-byte for gzip header + 8-byte for crc
-    outbuf2 = (char *)xmalloc(cLen+18);
-
     outbuf2len = compress((const uint8_t *)outbuf, cLen,
-                          (uint8_t *)outbuf2, cLen+18, c_format_gzip);
+                          (uint8_t *)body, body_max, c_format_gzip);
 
     if (outbuf2len <= 0) {
       log_warn("gzDeflate for outbuf fails");
-      free(outbuf2);
       return -1;
     }
-    free(outbuf);
-
   } else {
-    outbuf2 = outbuf;
     outbuf2len = cLen;
   }
 
-  // outbuf2 points to the HTTP payload (of length outbuf2len) to be sent
-
-  if (mode == CONTENT_JAVASCRIPT) { // JavaScript in HTTP body
-    newHdrLen = gen_response_header((char*) "application/x-javascript", gzipMode,
-                                    outbuf2len, newHdr, sizeof(newHdr));
-  } else if (mode == CONTENT_HTML_JAVASCRIPT) { // JavaScript(s) embedded in HTML doc
-    newHdrLen = gen_response_header((char*) "text/html", gzipMode,
-                                    outbuf2len, newHdr, sizeof(newHdr));
-  } else { // unknown mode
-    log_warn("SERVER ERROR: unknown mode for creating the HTTP response header");
-    free(outbuf2);
-    return -1;
-  }
-  if (newHdrLen < 0) {
-    log_warn("SERVER ERROR: gen_response_header fails for jsSteg");
-    free(outbuf2);
-    return -1;
-  }
-
-  // newHdr points to the HTTP header (of length newHdrLen) to be sent
-
-  if (evbuffer_add(dest, newHdr, newHdrLen)) {
-    log_warn("SERVER ERROR: evbuffer_add() fails for newHdr");
-    free(outbuf2);
-    return -1;
-  }
+  // body now holds the HTTP payload (of length outbuf2len) to be sent
 
-  if (evbuffer_add(dest, outbuf2, outbuf2len)) {
-    log_warn("SERVER ERROR: evbuffer_add() fails for outbuf2");
-    free(outbuf2);
+  if (rb.commit(outbuf2len) < 0) {
+    log_warn("SERVER ERROR: unable to commit the HTTP response");
     return -1;
   }
 
   evbuffer_drain(source, sbuflen);
-
-  free(outbuf2);
   return 0;
 }
 
@@ -902,17 +896,14 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
 
 
 int
-http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
-  struct evbuffer_ptr s2;
-  int response_len = 0;
-  unsigned int content_len = 0;
-  unsigned int hdrLen;
-  char buf[10];
+http_handle_client_JS_receive(struct evbuffer *dest, struct evbuffer* source,
+                              size_t hdr_len, size_t content_len) {
+  int response_len = hdr_len + content_len;
+  unsigned int hdrLen = hdr_len;
   char respMsg[HTTP_MSG_BUF_SIZE];
   char data[HTTP_MSG_BUF_SIZE];
   char buf2[HTTP_MSG_BUF_SIZE];
 
-  unsigned char *field, *fieldStart, *fieldEnd, *fieldValStart;
   char *httpBody;
 
   int decCnt, fin, i, j, k, gzipMode=0, httpBodyLen, buf2len, contentType = 0;
@@ -921,56 +912,11 @@ http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, str
   char c;
 
 
-  s2 = evbuffer_search(source, "\r\n\r\n", sizeof ("\r\n\r\n") -1 , NULL);
-  if (s2.pos == -1) {
-    log_debug("CLIENT Did not find end of HTTP header %d", (int) evbuffer_get_length(source));
-    //      evbuffer_dump(source, stderr);
-    return RECV_INCOMPLETE;
-    }
-
-  log_debug("CLIENT received response header with len %d", (int)s2.pos);
-
-  response_len = 0;
-  hdrLen = s2.pos + strlen("\r\n\r\n");
-  response_len += hdrLen;
-
-  // get content length, e.g., Content-Length: 22417
-  field = evbuffer_pullup(source, s2.pos);
-  if (field == NULL) {
-    log_debug("CLIENT unable to pullup the complete HTTP header");
-    return RECV_BAD;
-  }
-
-  fieldStart = (unsigned char*) strstr((char*) field, "Content-Length: ");
-  if (fieldStart == NULL) {
-    log_debug("CLIENT unable to find Content-Length in the header");
-    return RECV_BAD;
-  }
-
-  fieldEnd = (unsigned char*) strstr((char *)fieldStart, "\r\n");
-  if (fieldEnd == NULL) {
-    log_debug("CLIENT unable to find end of line for Content-Length");
-    return RECV_BAD;
-  }
-
-  fieldValStart = fieldStart+strlen("Content-Length: ");
-  if ((unsigned int) (fieldEnd-fieldValStart) > (sizeof(buf)-1)) {
-    log_debug("CLIENT: Value of Content-Length too large");
-    return RECV_BAD;
-  }
-  memcpy(buf, fieldValStart, fieldEnd-fieldValStart);
-  buf[fieldEnd-fieldValStart] = 0;
-
-  content_len = atoi(buf);
-  log_debug("CLIENT received Content-Length = %d\n", content_len);
-
-  response_len += content_len;
-
-  if (response_len > (int) evbuffer_get_length(source))
-    return RECV_INCOMPLETE;
+  log_debug("CLIENT received response header with len %d", (int)hdrLen);
+  log_debug("CLIENT received Content-Length = %d\n", (int)content_len);
 
   // read the entire HTTP resp
-  if (response_len < HTTP_MSG_BUF_SIZE) {
+  if (hdr_len + content_len < HTTP_MSG_BUF_SIZE) {
     r = evbuffer_copyout(source, respMsg, response_len);
     log_debug("CLIENT %d char copied from source to respMsg (expected %d)", (int)r, response_len);
     if (r < 0) {
@@ -1087,8 +1033,6 @@ http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, str
 
   log_debug("Drained source for %d char\n", response_len);
 
-  //  downcast_steg(s)->have_received = 1;
-  conn->expect_close();
   return RECV_GOOD;
 }
 
@@ -6,6 +6,7 @@
 #define _JSSTEG_H
 
 struct payloads;
+class http_scratch;
 
 int encodeHTTPBody(char *data, char *jTemplate, char *jData, unsigned int dlen,
                    unsigned int jtlen, unsigned int jdlen, int mode);
@@ -32,7 +33,7 @@ int decode (char *jData, char *dataBuf, unsigned int jdlen,
 int decode2 (char *jData, char *dataBuf, unsigned int jdlen,
              unsigned int dataBufSize, int *fin );
 
-void printerr(int errno);
+void printerr(int err);
 
 int testEncode(char *data, char *js, char *outBuf,
                unsigned int dlen, unsigned int jslen,
@@ -53,10 +54,11 @@ int testDecode2(char *inBuf, char *outBuf,
 
 int
 http_server_JS_transmit (payloads& pl, struct evbuffer *source,
-                         conn_t *conn, unsigned int content_type);
+                         conn_t *conn, unsigned int content_type,
+                         bool keep_alive, http_scratch& scratch);
 
 int
-http_handle_client_JS_receive(steg_t *s, conn_t *conn,
-                              struct evbuffer *dest, struct evbuffer* source);
+http_handle_client_JS_receive(struct evbuffer *dest, struct evbuffer* source,
+                              size_t hdr_len, size_t content_len);
 
 #endif
@@ -6,32 +6,107 @@
 #include "connections.h"
 #include "protocol.h"
 #include "steg.h"
+
+#include <algorithm>
+
+#include <netinet/in.h>
+
 #include <event2/buffer.h>
 
+/* By default, each connection carries one request from the client
+   and one response from the server.  Given arguments, as in
+
+     nosteg_rr:turns=N,request=BYTES,response=BYTES,delay=MS
+
+   each connection carries N requests, each followed by its response,
+   so that the cost of chop and of connection management under
+   turn-taking can be measured without that of real steganography.
+   Messages are REQUEST or RESPONSE bytes long (as near as the
+   protocol allows; 0, the default, means as much as there is to
+   send).  The server answers each request within DELAY milliseconds
+   (default 100) even if it has nothing to send; as with the http
+   module, the client sends its next request when the protocol has
+   something to send on it.  In this mode each message is preceded by
+   its length, as a four-byte big-endian number, so that turns are
+   told apart however the data is split up in transit. */
+
 namespace {
   struct nosteg_rr_steg_config_t : steg_config_t
   {
+    unsigned long turns;
+    unsigned long request_size;
+    unsigned long response_size;
+    unsigned long delay;
+    bool framed : 1;
+
     STEG_CONFIG_DECLARE_METHODS(nosteg_rr);
+    virtual bool init(const char *args);
   };
 
   struct nosteg_rr_steg_t : steg_t
   {
     nosteg_rr_steg_config_t *config;
     conn_t *conn;
+    unsigned long sent;     // messages transmitted
+    size_t in_left;         // bytes of the incoming message still to come
 
     bool can_transmit : 1;
     bool did_transmit : 1;
 
     nosteg_rr_steg_t(nosteg_rr_steg_config_t *cf, conn_t *cn);
     STEG_DECLARE_METHODS(nosteg_rr);
+
+    void received_message();
   };
 }
 
 STEG_DEFINE_MODULE(nosteg_rr);
 
 nosteg_rr_steg_config_t::nosteg_rr_steg_config_t(config_t *cfg)
-  : steg_config_t(cfg)
+  : steg_config_t(cfg), turns(1), request_size(0), response_size(0),
+    delay(100), framed(false)
+{
+}
+
+bool
+nosteg_rr_steg_config_t::init(const char *args)
 {
+  if (!args)
+    return true;
+
+  framed = true;
+  char *a = xstrdup(args);
+  for (char *p = strtok(a, ","); p; p = strtok(0, ",")) {
+    char *eq = strchr(p, '=');
+    char *end;
+    unsigned long v;
+    if (!eq || !eq[1])
+      goto bad;
+    *eq = '\0';
+    v = strtoul(eq + 1, &end, 10);
+    if (*end)
+      goto bad;
+    if (!strcmp(p, "turns") && v > 0)
+      turns = v;
+    else if (!strcmp(p, "request"))
+      request_size = v;
+    else if (!strcmp(p, "response"))
+      response_size = v;
+    else if (!strcmp(p, "delay"))
+      delay = v;
+    else
+      goto bad;
+  }
+  free(a);
+  log_debug("nosteg_rr: %lu turns, request %lu, response %lu, delay %lu ms",
+            turns, request_size, response_size, delay);
+  return true;
+
+ bad:
+  log_warn("nosteg_rr: bad argument in '%s' (want turns=N, request=BYTES, "
+           "response=BYTES, delay=MS)", args);
+  free(a);
+  return false;
 }
 
 nosteg_rr_steg_config_t::~nosteg_rr_steg_config_t()
@@ -46,7 +121,7 @@ nosteg_rr_steg_config_t::steg_create(conn_t *conn)
 
 nosteg_rr_steg_t::nosteg_rr_steg_t(nosteg_rr_steg_config_t *cf,
                                    conn_t *cn)
-  : config(cf), conn(cn),
+  : config(cf), conn(cn), sent(0), in_left(0),
     can_transmit(cf->cfg->mode != LSN_SIMPLE_SERVER),
     did_transmit(false)
 {
@@ -63,9 +138,17 @@ nosteg_rr_steg_t::cfg()
 }
 
 size_t
-nosteg_rr_steg_t::transmit_room(size_t pref, size_t, size_t)
+nosteg_rr_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
 {
-  return can_transmit ? pref : 0;
+  if (!can_transmit)
+    return 0;
+
+  size_t want = config->cfg->mode == LSN_SIMPLE_SERVER
+    ? config->response_size : config->request_size;
+  if (want == 0)
+    return pref;
+  // HI itself is too big; larger sizes get the largest block there is.
+  return std::max(lo, std::min(want, hi - 1));
 }
 
 int
@@ -75,9 +158,16 @@ nosteg_rr_steg_t::transmit(struct evbuffer *source)
 
   struct evbuffer *dest = conn->outbound();
 
-  log_debug(conn, "transmitting %lu bytes",
-            (unsigned long)evbuffer_get_length(source));
+  size_t len = evbuffer_get_length(source);
+  log_debug(conn, "transmitting %lu bytes", (unsigned long)len);
 
+  if (config->framed) {
+    uint32_t hdr = htonl(len);
+    if (evbuffer_add(dest, &hdr, sizeof hdr)) {
+      log_warn(conn, "failed to transfer buffer");
+      return -1;
+    }
+  }
   if (evbuffer_add_buffer(dest, source)) {
     log_warn(conn, "failed to transfer buffer");
     return -1;
@@ -85,7 +175,8 @@ nosteg_rr_steg_t::transmit(struct evbuffer *source)
 
   did_transmit = true;
   can_transmit = false;
-  conn->cease_transmission();
+  if (++sent >= config->turns)
+    conn->cease_transmission();
 
   return 0;
 }
@@ -99,6 +190,36 @@ nosteg_rr_steg_t::receive(struct evbuffer *dest)
             config->cfg->mode == LSN_SIMPLE_SERVER ? "server" : "client",
             (unsigned long)evbuffer_get_length(source));
 
+  if (config->framed) {
+    for (;;) {
+      size_t avail = evbuffer_get_length(source);
+      if (in_left == 0) {
+        uint32_t hdr;
+        if (avail < sizeof hdr)
+          break;
+        evbuffer_remove(source, &hdr, sizeof hdr);
+        in_left = ntohl(hdr);
+        if (in_left == 0) {
+          log_warn(conn, "empty message");
+          return -1;
+        }
+        continue;
+      }
+      if (avail == 0)
+        break;
+
+      size_t n = std::min(avail, in_left);
+      if (evbuffer_remove_buffer(source, dest, n) != (int)n) {
+        log_warn(conn, "failed to transfer buffer");
+        return -1;
+      }
+      in_left -= n;
+      if (in_left == 0)
+        received_message();
+    }
+    return 0;
+  }
+
   if (evbuffer_add_buffer(dest, source)) {
     log_warn(conn, "failed to transfer buffer");
     return -1;
@@ -109,8 +230,22 @@ nosteg_rr_steg_t::receive(struct evbuffer *dest)
 
   if (config->cfg->mode == LSN_SIMPLE_SERVER && !did_transmit) {
     can_transmit = true;
-    conn->transmit_soon(100);
+    conn->transmit_soon(config->delay);
   }
 
   return 0;
 }
+
+/* In framed mode, a whole message has been received, so it is now our
+   turn: the server's to answer it, or, if there are turns left, the
+   client's to send the next request. */
+void
+nosteg_rr_steg_t::received_message()
+{
+  if (sent >= config->turns)
+    return;
+
+  can_transmit = true;
+  if (config->cfg->mode == LSN_SIMPLE_SERVER)
+    conn->transmit_soon(config->delay);
+}
@@ -0,0 +1,213 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "connections.h"
+#include "pacing.h"
+
+#include <event2/event.h>
+
+void
+pace_histogram::clear()
+{
+  memset(buckets, 0, sizeof buckets);
+  count = 0;
+  early = 0;
+  total = 0;
+  max = 0;
+}
+
+void
+pace_histogram::add(long err)
+{
+  count++;
+  if (err < 0) {
+    early++;
+    buckets[0]++;
+    return;
+  }
+
+  unsigned long e = err;
+  unsigned int b = 0;
+  while (e && b < PACE_HIST_BUCKETS - 1) {
+    e >>= 1;
+    b++;
+  }
+  buckets[b]++;
+  total += err;
+  if ((unsigned long)err > max)
+    max = err;
+}
+
+void
+pace_histogram::format(char *buf, size_t len) const
+{
+  int n = snprintf(buf, len,
+                   "%lu packets, %lu early, mean %.1f ms late, max %lu ms;",
+                   count, early,
+                   count ? (double)total / count : 0.0, max);
+  for (unsigned int b = 0; b < PACE_HIST_BUCKETS; b++) {
+    if (n < 0 || (size_t)n >= len)
+      return;
+    if (b < PACE_HIST_BUCKETS - 1)
+      n += snprintf(buf + n, len - n, " <%lu:%lu", 1ul << b, buckets[b]);
+    else
+      n += snprintf(buf + n, len - n, " >=%lu:%lu", 1ul << (b - 1),
+                    buckets[b]);
+  }
+}
+
+pacer::pacer()
+  : wakeup(0), wakeup_at(0), wakeups(0), fired(0)
+{
+}
+
+pacer::~pacer()
+{
+  for (size_t i = 0; i < heap.size(); i++)
+    heap[i]->index = (size_t)-1;
+  if (wakeup)
+    event_free(wakeup);
+}
+
+uint64_t
+pacer::now()
+{
+  return conn_clock_ms();
+}
+
+void
+pacer::sift_up(size_t i)
+{
+  pace_slot *s = heap[i];
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (heap[parent]->due <= s->due)
+      break;
+    heap[i] = heap[parent];
+    heap[i]->index = i;
+    i = parent;
+  }
+  heap[i] = s;
+  s->index = i;
+}
+
+void
+pacer::sift_down(size_t i)
+{
+  pace_slot *s = heap[i];
+  size_t n = heap.size();
+  for (;;) {
+    size_t child = 2*i + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && heap[child + 1]->due < heap[child]->due)
+      child++;
+    if (s->due <= heap[child]->due)
+      break;
+    heap[i] = heap[child];
+    heap[i]->index = i;
+    i = child;
+  }
+  heap[i] = s;
+  s->index = i;
+}
+
+void
+pacer::remove_at(size_t i)
+{
+  pace_slot *s = heap[i];
+  pace_slot *last = heap.back();
+  heap.pop_back();
+  s->index = (size_t)-1;
+  if (last != s) {
+    heap[i] = last;
+    last->index = i;
+    sift_down(i);
+    sift_up(last->index);
+  }
+}
+
+/* Set the libevent timer for the earliest deadline, if it is not
+   already set for it. */
+void
+pacer::arm(struct event_base *base)
+{
+  if (heap.empty()) {
+    if (wakeup)
+      evtimer_del(wakeup);
+    return;
+  }
+
+  uint64_t due = heap[0]->due;
+  if (!wakeup) {
+    wakeup = evtimer_new(base, wakeup_cb, this);
+    log_assert(wakeup);
+  } else if (due == wakeup_at && evtimer_pending(wakeup, 0))
+    return;
+
+  uint64_t cur = now();
+  uint64_t delay = due > cur ? due - cur : 0;
+  struct timeval tv;
+  tv.tv_sec = delay / 1000;
+  tv.tv_usec = (delay % 1000) * 1000;
+  evtimer_add(wakeup, &tv);
+  wakeup_at = due;
+}
+
+void
+pacer::schedule(pace_slot *slot, uint64_t due)
+{
+  log_assert(slot->conn);
+  slot->due = due;
+  if (slot->pending()) {
+    sift_down(slot->index);
+    sift_up(slot->index);
+  } else {
+    heap.push_back(slot);
+    sift_up(heap.size() - 1);
+  }
+  arm(bufferevent_get_base(slot->conn->buffer));
+}
+
+void
+pacer::cancel(pace_slot *slot)
+{
+  if (!slot->pending())
+    return;
+  remove_at(slot->index);
+  if (heap.empty() && wakeup)
+    evtimer_del(wakeup);
+}
+
+/* Have every connection due within the batch window transmit.  A
+   connection may schedule its next packet (or another connection's)
+   while we are at it; any that are due by then go out now too. */
+void
+pacer::wakeup_cb(evutil_socket_t, short, void *arg)
+{
+  pacer *p = static_cast<pacer *>(arg);
+  uint64_t limit = now() + PACE_BATCH_MS;
+
+  p->wakeups++;
+  while (!p->heap.empty() && p->heap[0]->due <= limit) {
+    pace_slot *s = p->heap[0];
+    p->remove_at(0);
+    p->fired++;
+    s->conn->transmit_now();
+  }
+  p->arm(event_get_base(p->wakeup));
+}
+
+void
+pacer::report(const char *name) const
+{
+  char buf[512];
+
+  if (!errors.count)
+    return;
+  errors.format(buf, sizeof buf);
+  log_info("%s pacing: %s (%lu wakeups for %lu deadlines)",
+           name, buf, wakeups, fired);
+}
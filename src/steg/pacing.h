@@ -0,0 +1,107 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _PACING_H
+#define _PACING_H
+
+#include <event2/util.h>
+#include <vector>
+
+/** Packet pacing for steg modules that replay traces.
+
+    Each connection of such a module knows when its next packet is due
+    to go out.  Rather than waiting for the protocol to ask whether it
+    can send (which it does only when it has data, or on its own
+    timers), the module gives that deadline to a pacer.  The pacer
+    keeps all its connections' deadlines in a heap, and wakes up, on
+    one libevent timer, exactly when the earliest of them is due; at
+    that point it has every connection that is due within
+    PACE_BATCH_MS transmit at once (conn_t::transmit_now), which pulls
+    whatever data is waiting on the circuit into the packet.
+
+    The module reports how late each packet actually went out, and
+    the pacer keeps a histogram of these errors. */
+
+/** Deadlines this close together are met by the same wakeup. */
+#define PACE_BATCH_MS 1
+
+/** Histogram buckets: under 1 ms, then powers of two up to 1024 ms
+    and over. */
+#define PACE_HIST_BUCKETS 12
+
+struct pace_histogram
+{
+  unsigned long buckets[PACE_HIST_BUCKETS];
+  unsigned long count;
+  unsigned long early;
+  uint64_t total;
+  unsigned long max;
+
+  pace_histogram() { clear(); }
+  void clear();
+
+  /** Record a packet sent ERR milliseconds after it was due (negative
+      if before). */
+  void add(long err);
+
+  /** Write a one-line summary into BUF, which is of size LEN. */
+  void format(char *buf, size_t len) const;
+};
+
+struct pace_slot
+{
+  conn_t *conn;
+  uint64_t due;
+  size_t index;
+
+  pace_slot() : conn(0), due(0), index((size_t)-1) {}
+
+  bool pending() const { return index != (size_t)-1; }
+};
+
+class pacer
+{
+  std::vector<pace_slot *> heap;
+  struct event *wakeup;
+  uint64_t wakeup_at;
+
+  void sift_up(size_t i);
+  void sift_down(size_t i);
+  void remove_at(size_t i);
+  void arm(struct event_base *base);
+  static void wakeup_cb(evutil_socket_t, short, void *arg);
+
+public:
+  pace_histogram errors;
+  unsigned long wakeups;
+  unsigned long fired;
+
+  pacer();
+  ~pacer();
+
+  /** Milliseconds on the clock deadlines are measured by. */
+  static uint64_t now();
+
+  /** Have SLOT's connection transmit at time DUE, replacing any
+      earlier deadline for it.  SLOT->conn must be set. */
+  void schedule(pace_slot *slot, uint64_t due);
+
+  /** Forget SLOT's deadline, if any. */
+  void cancel(pace_slot *slot);
+
+  /** True if a packet due at DUE may go out now. */
+  static bool is_due(uint64_t due) { return due <= now() + PACE_BATCH_MS; }
+
+  /** Record that the packet due at DUE has just gone out. */
+  void sent(uint64_t due) { errors.add((long)(int64_t)(now() - due)); }
+
+  /** Log the pacing statistics under NAME, if anything has been sent. */
+  void report(const char *name) const;
+
+private:
+  pacer(const pacer&) DELETE_METHOD;
+  pacer& operator=(const pacer&) DELETE_METHOD;
+};
+
+#endif
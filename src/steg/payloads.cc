@@ -4,9 +4,12 @@
 
 #include "util.h"
 #include "payloads.h"
+#include "pdfSteg.h"
 #include "swfSteg.h"
+#include "compression.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <time.h>
 
 /*
@@ -183,11 +186,11 @@ log_debug("new: hdrLen = %d, bodyLen = %d, payloadLen = %d", hdrLen, bodyLen, hd
   return -1;
 }
 
-void load_payloads(payloads& pl, const char* fname)
+int load_payloads(payloads& pl, const char* fname)
 {
   FILE* f;
-  char buf[HTTP_MSG_BUF_SIZE];
-  char buf2[HTTP_MSG_BUF_SIZE];
+  char* buf;
+  char* buf2;
   pentry_header pentry;
   int pentryLen;
   int r;
@@ -195,12 +198,16 @@ void load_payloads(payloads& pl, const char* fname)
   srand(time(NULL));
   f = fopen(fname, "r");
   if (f == NULL) {
-    fprintf(stderr, "Cannot open trace file %s. Exiting\n", fname);
-    exit(1);
+    log_warn("cannot open trace file %s: %s", fname, strerror(errno));
+    return -1;
   }
 
   memset(pl.payload_hdrs, 0, sizeof(pl.payload_hdrs));
   pl.payload_count = 0;
+  pl.req_template_count = 0;
+
+  buf = (char *)xmalloc(HTTP_TEMPLATE_MAX_SIZE + 1);
+  buf2 = (char *)xmalloc(HTTP_TEMPLATE_MAX_SIZE);
 
   while (pl.payload_count < MAX_PAYLOADS) {
 
@@ -209,7 +216,7 @@ void load_payloads(payloads& pl, const char* fname)
     }
    
     pentryLen = ntohl(pentry.length);
-    if((unsigned int) pentryLen > sizeof(buf)) {
+    if((unsigned int) pentryLen > HTTP_TEMPLATE_MAX_SIZE) {
 #ifdef DEBUG
       // fprintf(stderr, "pentry too big %d %d\n", pentry.length, ntohl(pentry.length));
       fprintf(stderr, "pentry too big %d\n", pentryLen);
@@ -227,6 +234,7 @@ void load_payloads(payloads& pl, const char* fname)
 
     if (fread(buf, 1, pentry.length, f) < (unsigned int) pentry.length)
       break;
+    buf[pentry.length] = 0;
 
     // todo:
     // fixed content length for gzip'd HTTP msg
@@ -236,7 +244,7 @@ void load_payloads(payloads& pl, const char* fname)
 
     r = -1;
     if (pentry.ptype == TYPE_HTTP_RESPONSE) {
-      r = fixContentLen (buf, pentry.length, buf2, HTTP_MSG_BUF_SIZE);
+      r = fixContentLen (buf, pentry.length, buf2, HTTP_TEMPLATE_MAX_SIZE);
       // log_debug("for payload_count %d, fixContentLen returns %d", payload_count, r);
     }
     // else {
@@ -259,108 +267,28 @@ void load_payloads(payloads& pl, const char* fname)
 
   log_debug("loaded %d payloads from %s\n", pl.payload_count, fname);
 
+  free(buf);
+  free(buf2);
   fclose(f);
+  return 0;
 }
 
-
-
-
-
-void gen_rfc_1123_date(char* buf, int buf_size) {
-  time_t t = time(NULL);
-  struct tm *my_tm = gmtime(&t);
-  strftime(buf, buf_size, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", my_tm);
-}
-
-
-
-void gen_rfc_1123_expiry_date(char* buf, int buf_size) {
-  time_t t = time(NULL) + rand() % 10000;
-  struct tm *my_tm = gmtime(&t);
-  strftime(buf, buf_size, "Expires: %a, %d %b %Y %H:%M:%S GMT\r\n", my_tm);
-}
-
-
-
-
-
-int gen_response_header(char* content_type, int gzip, int length, char* buf, int buflen) {
-  char* ptr;
-
-  // conservative assumption here.... 
-  if (buflen < 400) {
-    fprintf(stderr, "gen_response_header: buflen too small\n");
-    return -1;
-  }
-
-  sprintf(buf, "HTTP/1.1 200 OK\r\n");
-  ptr = buf + strlen("HTTP/1.1 200 OK\r\n");
-  gen_rfc_1123_date(ptr, buflen - (ptr - buf));
-  ptr = ptr + strlen(ptr);
-
-  sprintf(ptr, "Server: Apache\r\n");
-  ptr = ptr + strlen(ptr);
-
-  switch(rand() % 9) {
-  case 1:
-    sprintf(ptr, "Vary: Cookie\r\n");
-    ptr = ptr + strlen(ptr);
-    break;
-
-  case 2:
-    sprintf(ptr, "Vary: Accept-Encoding, User-Agent\r\n");
-    ptr = ptr + strlen(ptr);
-    break;
-
-  case 3:
-    sprintf(ptr, "Vary: *\r\n");
-    ptr = ptr + strlen(ptr);
-    break;
-
-  }
-
-
-  switch(rand() % 4) {
-  case 2:
-    gen_rfc_1123_expiry_date(ptr, buflen - (ptr - buf));
-    ptr = ptr + strlen(ptr);
-  }
-
-
-  
-
-  if (gzip) 
-    sprintf(ptr, "Content-Length: %d\r\nContent-Encoding: gzip\r\nContent-Type: %s\r\n", length, content_type);
-  else
-    sprintf(ptr, "Content-Length: %d\r\nContent-Type: %s\r\n", length, content_type);
-    
-  ptr += strlen(ptr);
-
-  switch(rand() % 4) {
-  case 2:
-  case 3:
-  case 4:
-    sprintf(ptr, "Connection: Keep-Alive\r\n\r\n");
-    break;
-  default:
-    sprintf(ptr, "Connection: close\r\n\r\n");
-    break;    
-  }
-
-  ptr += strlen(ptr);
-
-  return ptr - buf;
+void free_payloads(payloads& pl)
+{
+  for (int i = 0; i < pl.payload_count; i++)
+    free(pl.payloads[i]);
+  pl.payload_count = 0;
 }
 
 
 
 
 
-
 int parse_client_headers(char* inbuf, char* outbuf, int len) {
   // client-side
   // remove Host: field
   // remove referrer fields?
+  // remove Connection: fields (the steg module supplies its own)
 
   char* ptr = inbuf;
   int outlen = 0;
@@ -376,11 +304,14 @@ int parse_client_headers(char* inbuf, char* outbuf, int len) {
 
     if (!strncmp(ptr, "Host:", 5) ||
 	!strncmp(ptr, "Referer:", 8) ||
-	!strncmp(ptr, "Cookie:", 7)) {
+	!strncmp(ptr, "Cookie:", 7) ||
+	!strncasecmp(ptr, "Connection:", 11) ||
+	!strncasecmp(ptr, "Keep-Alive:", 11)) {
       goto next;
     }
 
-    memcpy(outbuf + outlen, ptr, end - ptr + 2);
+    // outbuf may be inbuf
+    memmove(outbuf + outlen, ptr, end - ptr + 2);
     outlen += end - ptr + 2;
 
   next:
@@ -408,78 +339,61 @@ int parse_client_headers(char* inbuf, char* outbuf, int len) {
 */
 
 
-int 
-find_uri_type(char* buf_orig, int buflen) {
-
-  char* uri;
-  char* ext;
-
-  char* buf = (char *)xmalloc(buflen+1);
-  char* uri_end;
-
-
-  memcpy(buf, buf_orig, buflen);
-  buf[buflen] = 0;
-
-  
-  if (strncmp(buf, "GET", 3) != 0
-      && strncmp(buf, "POST", 4) != 0) {
-    fprintf(stderr, "HERE %s\n", buf);
+int
+find_uri_type(const char* buf, int buflen) {
+  const char* limit = buf + buflen;
+  const char* uri;
+  const char* uri_end;
+  const char* ext;
+  size_t elen;
+
+  if ((buflen < 3 || strncmp(buf, "GET", 3) != 0)
+      && (buflen < 4 || strncmp(buf, "POST", 4) != 0)) {
+    log_debug("not a GET or POST: %.*s", buflen, buf);
     return -1;
   }
-  
-
-
-  uri = strchr(buf, ' ') + 1;
 
+  uri = (const char*)memchr(buf, ' ', buflen);
   if (uri == NULL) {
-    fprintf(stderr, "Invalid URL\n");
+    log_debug("Invalid URL");
     return -1;
   }
+  uri++;
 
-  uri_end = strchr(uri, ' ');
-
+  uri_end = (const char*)memchr(uri, ' ', limit - uri);
   if (uri_end == NULL) {
-    fprintf(stderr, "unterminated uri\n");
+    log_debug("unterminated uri");
     return -1;
   }
 
-  uri_end[0] = 0;
-  
-
-
-
-
-  ext = strrchr(uri, '/');
-
-  if (ext == NULL) {
-    fprintf(stderr, "no / in url: find_uri_type...");
+  for (ext = uri_end; ext > uri && ext[-1] != '/'; ext--)
+    ;
+  if (ext == uri) {
+    log_debug("no / in url: find_uri_type...");
     return -1;
   }
 
-  ext = strchr(ext, '.');
+  ext = (const char*)memchr(ext, '.', uri_end - ext);
+  elen = ext ? uri_end - ext : 0;
 
+#define EXT_IS(e) (elen >= sizeof(e) - 1 && !strncmp(ext, e, sizeof(e) - 1))
 
-  if (ext == NULL || !strncmp(ext, ".html", 5) || !strncmp(ext, ".htm", 4) || !strncmp(ext, ".php", 4)
-      || !strncmp(ext, ".jsp", 4) || !strncmp(ext, ".asp", 4))
+  if (ext == NULL || EXT_IS(".html") || EXT_IS(".htm") || EXT_IS(".php")
+      || EXT_IS(".jsp") || EXT_IS(".asp"))
     return HTTP_CONTENT_HTML;
 
-
-  if (!strncmp(ext, ".js", 3) || !strncmp(ext, ".JS", 3))
+  if (EXT_IS(".js") || EXT_IS(".JS"))
     return HTTP_CONTENT_JAVASCRIPT;
 
-  if (!strncmp(ext, ".pdf", 4) || !strncmp(ext, ".PDF", 4))
+  if (EXT_IS(".pdf") || EXT_IS(".PDF"))
     return HTTP_CONTENT_PDF;
 
-
-  if (!strncmp(ext, ".swf", 4) || !strncmp(ext, ".SWF", 4))
+  if (EXT_IS(".swf") || EXT_IS(".SWF"))
     return HTTP_CONTENT_SWF;
 
+#undef EXT_IS
 
-
-  free(buf);
   return -1;
-  
 }
 
 /*
@@ -534,44 +448,87 @@ find_uri_type(char* buf) {
 
 
 
-unsigned int find_client_payload(payloads& pl, char* buf, int len, int type) {
-  int r = rand() % pl.payload_count;
-  int cnt = 0;
-  char* inbuf;
+/* Prepare the client request templates of type TYPE, no longer than
+   LEN, for find_client_payload: strip the header fields that the steg
+   module supplies itself (in place), note where the request line ends,
+   and sort them by the content type their URI asks for, so that none
+   of that has to be done per request.  Templates asking for a type
+   the server cannot answer are left out. */
+int init_client_payload_pool(payloads& pl, int len, int type) {
+  int* utypes = (int*)xmalloc(pl.payload_count * sizeof(int) + 1);
+  int next[MAX_CONTENT_TYPE];
+  int r, x, n = 0;
 
-  log_debug("trying payload %d", r);
-  while (1) {
+  memset(pl.reqTypeCount, 0, sizeof(pl.reqTypeCount));
+  for (r = 0; r < pl.payload_count; r++) {
     pentry_header* p = &pl.payload_hdrs[r];
-    if (p->ptype == type) {
-      inbuf = pl.payloads[r];
-      if (find_uri_type(inbuf, p->length) != HTTP_CONTENT_SWF &&
-          find_uri_type(inbuf, p->length) != HTTP_CONTENT_HTML &&
-	  find_uri_type(inbuf, p->length) != HTTP_CONTENT_JAVASCRIPT &&
-	  find_uri_type(inbuf, p->length) != HTTP_CONTENT_PDF) {
-	goto next;
-      }
-      if (p->length > len) {
-	fprintf(stderr, "BUFFER TOO SMALL... \n");
-	goto next;
-      }
-      else
-	len = p->length;
-      break;
-    }
-  next:
-    r = (r+1) % pl.payload_count;
+    char* msg = pl.payloads[r];
+    char* eol;
 
-    // no matching payloads...
-    if (cnt++ == pl.payload_count) {
-      log_warn("no matching payloads");
-      return 0;
+    utypes[r] = -1;
+    if (p->ptype != type || p->length > len)
+      continue;
+
+    eol = strstr(msg, "\r\n");
+    if (eol == NULL || strstr(msg, "\r\n\r\n") == NULL) {
+      log_debug("client template %d has no complete header", r);
+      continue;
     }
+
+    x = find_uri_type(msg, eol - msg);
+    if (x != HTTP_CONTENT_SWF && x != HTTP_CONTENT_HTML &&
+        x != HTTP_CONTENT_JAVASCRIPT && x != HTTP_CONTENT_PDF)
+      continue;
+
+    utypes[r] = x;
+    pl.reqTypeCount[x]++;
+  }
+
+  for (x = 0; x < MAX_CONTENT_TYPE; x++) {
+    pl.reqTypeStart[x] = next[x] = n;
+    n += pl.reqTypeCount[x];
+  }
+  pl.req_template_count = n;
+
+  for (r = 0; r < pl.payload_count; r++) {
+    if (utypes[r] < 0)
+      continue;
+
+    char* msg = pl.payloads[r];
+    request_template* t = &pl.req_templates[next[utypes[r]]++];
+    t->line_len = strstr(msg, "\r\n") - msg;
+    t->hdr_len = parse_client_headers(msg, msg, pl.payload_hdrs[r].length);
+    msg[t->hdr_len] = 0;
+    t->hdr = msg;
+    t->uri_type = utypes[r];
+  }
+  free(utypes);
+
+  log_debug("client request templates: %d html, %d js, %d pdf, %d swf",
+            pl.reqTypeCount[HTTP_CONTENT_HTML],
+            pl.reqTypeCount[HTTP_CONTENT_JAVASCRIPT],
+            pl.reqTypeCount[HTTP_CONTENT_PDF],
+            pl.reqTypeCount[HTTP_CONTENT_SWF]);
+  return pl.req_template_count;
+}
+
+
+/* Pick a client request template at random from those asking for
+   content of type URI_TYPE, or from all of them if URI_TYPE is -1. */
+const request_template *find_client_payload(payloads& pl, int uri_type) {
+  int start = 0, count = pl.req_template_count;
+
+  if (uri_type >= 0 && uri_type < MAX_CONTENT_TYPE) {
+    start = pl.reqTypeStart[uri_type];
+    count = pl.reqTypeCount[uri_type];
   }
 
-  inbuf[len] = 0;
+  if (count == 0) {
+    log_warn("no matching payloads");
+    return NULL;
+  }
 
-  // clean up the buffer...
-  return parse_client_headers(inbuf, buf, len);
+  return &pl.req_templates[start + rand() % count];
 }
 
 
@@ -874,26 +831,30 @@ unsigned int capacityJS3 (char* buf, int len, int mode) {
  *
  * return a pointer for the first occurrence of pattern in blob, if found
  * otherwise, return NULL
- * 
+ *
+ * Candidate positions are located with memchr on the first char of the
+ * pattern, which the C library vectorizes; only those are compared in full.
  */
 char *
-strInBinary (const char *pattern, unsigned int patternLen, 
+strInBinary (const char *pattern, unsigned int patternLen,
              const char *blob, unsigned int blobLen) {
-  int found = 0;
-  char *cp = (char *)blob;
+  const char *cp, *last;
 
-  while (1) {
-    if (blob+blobLen-cp < (int) patternLen) break;
-    if (*cp == pattern[0]) {
-      if (memcmp(cp, pattern, patternLen) == 0) {
-        found = 1;
-        break;
-      }
-    }
-    cp++; 
+  if (patternLen < 1 || blobLen < patternLen)
+    return NULL;
+
+  // a match can start anywhere in [blob, last]
+  cp = blob;
+  last = blob + (blobLen - patternLen);
+  while (cp <= last) {
+    cp = (const char *)memchr(cp, pattern[0], last - cp + 1);
+    if (!cp)
+      break;
+    if (memcmp(cp+1, pattern+1, patternLen-1) == 0)
+      return (char *)cp;
+    cp++;
   }
-  if (found) return cp;
-  else return NULL;
+  return NULL;
 }
 
 
@@ -1042,10 +1003,16 @@ int has_eligible_HTTP_content (char* buf, int len, int type) {
 
 
 
+/*
+ * capacityPDF returns the number of data bytes that pdfSteg can
+ * embed in the PDF document in the HTTP msg buf, spread across all of
+ * its stream objects.  The data is zlib-compressed before embedding;
+ * since it is normally encrypted, we assume the worst case and size
+ * it by compress_bound() rather than by any expected compression ratio.
+ */
 unsigned int capacityPDF (char* buf, int len) {
-  char *hEnd, *bp, *streamStart, *streamEnd;
-  int cnt=0;
-  int size;
+  char *hEnd;
+  size_t room, cap, need;
 
   // jump to the beginning of the body of the HTTP message
   hEnd = strstr(buf, "\r\n\r\n");
@@ -1053,23 +1020,19 @@ unsigned int capacityPDF (char* buf, int len) {
     // cannot find the separator between HTTP header and HTTP body
     return 0;
   }
-  bp = hEnd + 4;
 
-  while (bp < (buf+len)) {
-     streamStart = strInBinary("stream", 6, bp, (buf+len)-bp);
-     if (streamStart == NULL) break;
-     bp = streamStart+6;
-     streamEnd = strInBinary("endstream", 9, bp, (buf+len)-bp);
-     if (streamEnd == NULL) break;
-     // count the number of char between streamStart+6 and streamEnd
-     size = streamEnd - (streamStart+6) - 2; // 2 for \r\n before streamEnd
-     if (size > 0) {
-       cnt = cnt + size;
-       // log_debug("capacity of pdf increase by %d", size);
-     }
-     bp += 9;
-  }
-  return cnt;
+  room = pdf_stream_room(hEnd + 4, (buf+len) - (hEnd+4));
+
+  // the largest cap with compress_bound(cap) <= room; compress_bound
+  // grows no faster than its argument, so this converges in a step
+  // or two
+  cap = room;
+  while (cap > 0 && (need = compress_bound(cap, c_format_zlib)) > room)
+    cap = (need - room < cap) ? cap - (need - room) : 0;
+
+  if (cap > UINT_MAX)
+    cap = UINT_MAX;
+  return cap;
 }
 
 
@@ -1295,10 +1258,9 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
     if (mode > 0) {
       // use capacityPDF() to find out the amount of data that we
       // can encode in the pdf doc 
-      // cap = minCapacity+1;
       cap = capacityPDF(msgbuf, p->length);
       if (cap > minCapacity) {
-	pl.typePayloadCap[contentType][cnt] = (cap-PDF_DELIMITER_SIZE)/2;
+	pl.typePayloadCap[contentType][cnt] = cap;
 	pl.typePayload[contentType][cnt] = r;
 	cnt++;
 	
@@ -1333,16 +1295,20 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
 }
 
 int
-init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
+init_SWF_payload_pool(payloads& pl, int len, int type, int minCapacity)
 {
   // stat for usable payload
   int minPayloadSize = 0, maxPayloadSize = 0; 
   int sumPayloadSize = 0;
+  int minPayloadCap = 0, maxPayloadCap = 0;
+  int sumPayloadCap = 0;
 
   int cnt = 0;
   int r;
   pentry_header* p;
   char* msgbuf;
+  char* swf;
+  int cap;
   int mode;
   unsigned int contentType = HTTP_CONTENT_SWF;
 
@@ -1363,23 +1329,33 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
 
     mode = has_eligible_HTTP_content(msgbuf, p->length, HTTP_CONTENT_SWF);
     if (mode > 0) {
+      // use swf_capacity() to find out how much data a response based
+      // on this template can carry without outgrowing it; small
+      // templates still get to carry minCapacity bytes
+      swf = strstr(msgbuf, "\r\n\r\n") + 4;
+      cap = swf_capacity(swf, p->length - (swf - msgbuf));
+      if (cap < minCapacity)
+        cap = minCapacity;
+
+      pl.typePayloadCap[contentType][cnt] = cap;
       pl.typePayload[contentType][cnt] = r;
       cnt++;
       // update stat
       if (cnt == 1) {
-	minPayloadSize = p->length; 
-	maxPayloadSize = p->length;
+	minPayloadSize = p->length; maxPayloadSize = p->length;
+	minPayloadCap = cap; maxPayloadCap = cap;
       } 
       else {
-	if (minPayloadSize > p->length) 
-	  minPayloadSize = p->length; 
-	if (maxPayloadSize < p->length) 
-	  maxPayloadSize = p->length; 
+	if (minPayloadSize > p->length) minPayloadSize = p->length; 
+	if (maxPayloadSize < p->length) maxPayloadSize = p->length; 
+	if (minPayloadCap > cap) minPayloadCap = cap;
+	if (maxPayloadCap < cap) maxPayloadCap = cap;
       }
-      sumPayloadSize += p->length;
+      sumPayloadSize += p->length; sumPayloadCap += cap;
     }
   }
     
+  pl.max_SWF_capacity = maxPayloadCap;
   pl.initTypePayload[contentType] = 1;
   pl.typePayloadCount[contentType] = cnt;
   log_debug("init_payload_pool: typePayloadCount for contentType %d = %d",
@@ -1387,6 +1363,9 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
   log_debug("minPayloadSize = %d", minPayloadSize); 
   log_debug("maxPayloadSize = %d", maxPayloadSize); 
   log_debug("avgPayloadSize = %f", (float)sumPayloadSize/(float)cnt); 
+  log_debug("minPayloadCap  = %d", minPayloadCap); 
+  log_debug("maxPayloadCap  = %d", maxPayloadCap); 
+  log_debug("avgPayloadCap  = %f", (float)sumPayloadCap/(float)cnt); 
   return 1;
 }
 
@@ -9,8 +9,10 @@
    server_data, client data, protocol data
 */
 
+// Results of the receive functions.  http_steg_t::receive maps these
+// onto the steg_t convention, which has no separate "incomplete".
 #define RECV_GOOD 0
-#define RECV_INCOMPLETE 0
+#define RECV_INCOMPLETE 1
 #define RECV_BAD -1
 
 #define CONN_DATA_REQUEST 1  /* payload packet sent by client */
@@ -43,11 +45,20 @@
 
 #define HTTP_MSG_BUF_SIZE 100000
 
+// largest HTTP msg that load_payloads will keep as a template; only
+// the content types that can make use of large templates (currently
+// PDF and SWF) admit ones bigger than HTTP_MSG_BUF_SIZE
+#define HTTP_TEMPLATE_MAX_SIZE 1048576
+
 #define PDF_DELIMITER_SIZE 2
 #define PDF_MIN_AVAIL_SIZE 10240
 // PDF_MIN_AVAIL_SIZE should reflect the min number of data bytes
 // a pdf doc can encode
 
+#define SWF_MIN_AVAIL_SIZE 1024
+// every SWF template may carry at least SWF_MIN_AVAIL_SIZE data bytes,
+// even if that makes the response bigger than the template
+
 // specifying the type of contents as an input argument
 // for has_eligible_HTTP_content()
 #define HTTP_CONTENT_JAVASCRIPT         1
@@ -109,6 +120,16 @@ struct service_state {
   int dir;
 };
 
+/* A client request template, as prepared by init_client_payload_pool:
+   the request line, then the header fields the steg module does not
+   supply itself, each ending in CRLF (there is no blank line). */
+struct request_template {
+  const char *hdr;
+  int hdr_len;
+  int line_len;   /* length of the request line, not counting CRLF */
+  int uri_type;   /* content type the URI asks for (HTTP_CONTENT_*) */
+};
+
 struct payloads {
   int initTypePayload[MAX_CONTENT_TYPE];
   int typePayloadCount[MAX_CONTENT_TYPE];
@@ -118,14 +139,26 @@ struct payloads {
   unsigned int max_JS_capacity;
   unsigned int max_HTML_capacity;
   unsigned int max_PDF_capacity;
+  unsigned int max_SWF_capacity;
 
   pentry_header payload_hdrs[MAX_PAYLOADS];
   char* payloads[MAX_PAYLOADS];
   int payload_count;
+
+  // client request templates, grouped by uri_type: those of type x
+  // are req_templates[reqTypeStart[x] .. reqTypeStart[x] +
+  // reqTypeCount[x]), and only the types the server can answer
+  // appear at all
+  request_template req_templates[MAX_PAYLOADS];
+  int req_template_count;
+  int reqTypeStart[MAX_CONTENT_TYPE];
+  int reqTypeCount[MAX_CONTENT_TYPE];
 };
 
-void load_payloads(payloads& pl, const char* fname);
-unsigned int find_client_payload(payloads& pl, char* buf, int len, int type);
+/* Return 0 on success, -1 (after logging why) if FNAME cannot be read. */
+int load_payloads(payloads& pl, const char* fname);
+void free_payloads(payloads& pl);
+const request_template *find_client_payload(payloads& pl, int uri_type);
 unsigned int find_server_payload(payloads& pl, char** buf, int len, int type,
                                  int contentType);
 
@@ -133,6 +166,7 @@ int init_JS_payload_pool(payloads& pl, int len, int type, int minCapacity);
 int init_SWF_payload_pool(payloads& pl, int len, int type, int minCapacity);
 int init_PDF_payload_pool(payloads& pl, int len, int type,int minCapacity);
 int init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity);
+int init_client_payload_pool(payloads& pl, int len, int type);
 
 
 int get_next_payload (payloads& pl, int contentType, char** buf, int* size,
@@ -142,8 +176,6 @@ int get_payload (payloads& pl, int contentType, int cap, char** buf,
 
 int has_eligible_HTTP_content (char* buf, int len, int type);
 int fixContentLen (char* payload, int payloadLen, char *buf, int bufLen);
-void gen_rfc_1123_date(char* buf, int buf_size);
-void gen_rfc_1123_expiry_date(char* buf, int buf_size);
 int parse_client_headers(char* inbuf, char* outbuf, int len);
 int skipJSPattern (char *cp, int len);
 int isalnum_ (char c);
@@ -159,9 +191,6 @@ char * strInBinary (const char *pattern, unsigned int patternLen,
 unsigned int capacityPDF (char* buf, int len);
 unsigned int get_max_PDF_capacity(void);
 int find_content_length (char *hdr, int hlen);
-int find_uri_type(char* buf, int size);
-
-int gen_response_header(char* content_type, int gzip, int length,
-                        char* buf, int buflen);
+int find_uri_type(const char* buf, int size);
 
 #endif
@@ -6,6 +6,7 @@
 #include "pdfSteg.h"
 #include "connections.h"
 #include "payloads.h"
+#include "http_resp.h"
 #include <event2/buffer.h>
 #include "compression.h"
 
@@ -19,6 +20,14 @@
 #define STREAM_END         "endstream"
 #define STREAM_END_SIZE    9
 
+// upper bound on the size of the stream dictionary and keywords
+// written around the embedded data when pdf_embed_streams has to
+// rewrite a stream object
+#define PDF_STREAM_OVERHEAD 80
+
+// the client gives up on a response that decompresses to more than this
+#define PDF_MAX_UNWRAP_SIZE (64 * 1024 * 1024)
+
 #define DEBUG
 
 
@@ -46,29 +55,46 @@ pdf_add_delimiter(const char *inbuf, size_t inbuflen,
                   char *outbuf, size_t outbuflen,
                   const char delimiter1, const char delimiter2)
 {
-  size_t cnt;
-  const char *ibp;
-  char ic, rc;
+  size_t cnt, room, run;
+  const char *ibp, *ilimit, *dp;
+  char rc;
 
   log_assert(delimiter1 != delimiter2);
   if (inbuflen > SIZE_T_CEILING || outbuflen > SIZE_T_CEILING)
     return -1;
 
+  // the escaped data must leave room for the end-of-data pattern,
+  // plus one spare byte
+  if (outbuflen < 3)
+    return -1;
+  room = outbuflen - 2;
+
+  // Copy runs of non-delimiter chars in bulk, using memchr to find the
+  // end of each run; only the delimiters themselves are handled one at
+  // a time.
   cnt = 0;
   ibp = inbuf;
-  while (size_t(ibp-inbuf) < inbuflen && cnt < outbuflen-2) {
-    ic = *ibp++;
-    if (ic != delimiter1) {
-      outbuf[cnt++] = ic;
-    } else {
-      outbuf[cnt++] = delimiter1;
-      outbuf[cnt++] = delimiter1;
-    }
-  }
+  ilimit = inbuf + inbuflen;
+  while (ibp < ilimit) {
+    dp = (const char *)memchr(ibp, delimiter1, ilimit - ibp);
+    run = (dp ? dp : ilimit) - ibp;
 
-  // error if outbuf is not large enough for storing the resulting data
-  if (cnt >= outbuflen-2)
-    return -1;
+    // error if outbuf is not large enough for storing the resulting data
+    if (run >= room - cnt)
+      return -1;
+    memcpy(outbuf + cnt, ibp, run);
+    cnt += run;
+    ibp += run;
+
+    if (!dp)
+      break;
+
+    if (2 >= room - cnt)
+      return -1;
+    outbuf[cnt++] = delimiter1;
+    outbuf[cnt++] = delimiter1;
+    ibp++;
+  }
 
   // put delimiter1 and a char that is not a delimiter1
   // as the end-of-data pattern at the end of outbuf
@@ -89,7 +115,7 @@ pdf_add_delimiter(const char *inbuf, size_t inbuflen,
  * pdf_add_delimiter.
  *
  * returns the length of data written to outbuf, if succeed;
- * otherwise, it returns -1
+ * otherwise (including when outbuf is too small), it returns -1
  *
  * endFlag indicates whether the end-of-encoding byte pattern (i.e.,
  * delimiter1 followed by non-delimiter1) is detected
@@ -102,25 +128,29 @@ pdf_remove_delimiter(const char *inbuf, size_t inbuflen,
                      char *outbuf, size_t outbuflen,
                      char delimiter1, bool *endFlag, bool *escape)
 {
-  size_t cnt;
-  const char *ibp;
-  char ic1, ic2;
+  size_t cnt, run;
+  const char *ibp, *ilimit, *dp;
 
   cnt = 0;
   *endFlag = false;
   ibp = inbuf;
+  ilimit = inbuf + inbuflen;
 
   if (inbuflen > SIZE_T_CEILING || outbuflen > SIZE_T_CEILING)
     return -1;
 
+  if (inbuflen == 0)
+    return 0;
+
   // special case: 2-char, end-of-data pattern could be in two buffers
   // if *escape == true, we need to see if
   // 1) (*ibp == delimiter1) -> put delimiter1 in outbuf
   // 2) (*ibp != delimiter1) -> end-of-data detected
   if (*escape) {
-    ic1 = *ibp;
-    if (ic1 == delimiter1) {
-      outbuf[cnt++] = ic1; ibp++;
+    if (*ibp == delimiter1) {
+      if (outbuflen < 1)
+        return -1;
+      outbuf[cnt++] = delimiter1; ibp++;
     } else {
       *endFlag = 1;
       return 0;
@@ -128,30 +158,42 @@ pdf_remove_delimiter(const char *inbuf, size_t inbuflen,
   }
 
   *escape = false;
-  while (size_t(ibp-inbuf+1) < inbuflen && cnt < outbuflen) {
-    ic1 = *ibp++;
-    if (ic1 != delimiter1) {
-      outbuf[cnt++] = ic1;
-    } else {
-      // lookahead 1 char
-      ic2 = *ibp;
-      // if the next char is delimiter1
-      if (ic2 == delimiter1) {
-        outbuf[cnt++] = delimiter1; ibp++;
-      } else { // end-of-data pattern detected
-        *endFlag = true;
-        return cnt;
-      }
+
+  // Every char but the last can be decided on without looking past
+  // the end of inbuf.  Copy runs of non-delimiter chars in bulk; each
+  // delimiter found is examined together with the char after it.
+  while (ibp + 1 < ilimit) {
+    dp = (const char *)memchr(ibp, delimiter1, ilimit - 1 - ibp);
+    run = (dp ? dp : ilimit - 1) - ibp;
+
+    if (run > outbuflen - cnt)
+      return -1;
+    memcpy(outbuf + cnt, ibp, run);
+    cnt += run;
+    ibp += run;
+
+    if (!dp)
+      break;
+
+    if (ibp[1] == delimiter1) { // escaped delimiter1
+      if (cnt >= outbuflen)
+        return -1;
+      outbuf[cnt++] = delimiter1;
+      ibp += 2;
+    } else { // end-of-data pattern detected
+      *endFlag = true;
+      return cnt;
     }
   }
 
-  if (size_t(ibp-inbuf) == inbuflen)
+  if (ibp == ilimit)
     return cnt;
 
   // handling the last char in inbuf, if needed
-  ic1 = *ibp;
-  if (ic1 != delimiter1) {
-    outbuf[cnt++] = ic1;
+  if (*ibp != delimiter1) {
+    if (cnt >= outbuflen)
+      return -1;
+    outbuf[cnt++] = *ibp;
   } else {
     // look at the next stream obj to handle the special cases
     *escape = true;
@@ -168,244 +210,313 @@ pdf_remove_delimiter(const char *inbuf, size_t inbuflen,
  * return a pointer for the first occurrence of pattern in blob,
  * starting from the end of blob, if found; otherwise, return NULL
  *
+ * Candidate positions are located with memrchr on the last char of
+ * the pattern, where the C library provides it.
  */
+static const char *
+find_last_char(const char *s, char c, size_t n)
+{
+#ifdef HAVE_MEMRCHR
+  return (const char *)memrchr(s, c, n);
+#else
+  const char *p = s + n;
+  while (p > s)
+    if (*--p == c)
+      return p;
+  return 0;
+#endif
+}
+
 char *
 strInBinaryRewind (const char *pattern, unsigned int patternLen,
-             const char *blob, unsigned int blobLen) {
-  int found = 0;
-  char *cp;
-
-  if (patternLen < 1 || blobLen < 1) return 0;
-  cp = (char *) blob + blobLen - 1;
-  while (cp >= blob) {
-    if (cp - (patternLen-1) < blob) break;
-    if (*cp == pattern[patternLen-1]) {
-      if (memcmp(cp-(patternLen-1), pattern, patternLen-1) == 0) {
-        found = 1;
-        break;
-      }
-    }
-    cp--;
+                   const char *blob, unsigned int blobLen) {
+  const char *first, *cp;
+  size_t n;
+
+  if (patternLen < 1 || blobLen < patternLen) return NULL;
+
+  // the last char of a match can be anywhere in [first, blob+blobLen)
+  first = blob + patternLen - 1;
+  n = blobLen - (patternLen - 1);
+  while (n > 0) {
+    cp = find_last_char(first, pattern[patternLen-1], n);
+    if (!cp)
+      break;
+    if (memcmp(cp-(patternLen-1), pattern, patternLen-1) == 0)
+      return (char *)(cp-(patternLen-1));
+    n = cp - first;
   }
-  if (found) return (cp-(patternLen-1));
-  else return NULL;
+  return NULL;
 }
 
 
 /*
- * pdf_wrap embeds data of length dlen inside the stream objects of the PDF
- * document (length plen) that appears in the body of a HTTP msg, and
- * stores the result in the output buffer of size outsize
+ * pdf_next_stream finds the first stream object in [tp, plimit), and
+ * sets *start and *end to the bounds of the part of its contents that
+ * pdfSteg may overwrite, and *next to just past its endstream keyword.
  *
- * pdf_wrap returns the length of the pdf document with the data embedded
- * inside, if succeed; otherwise, it returns -1 to indicate an error
+ * The overwritable part begins after the end-of-line that follows the
+ * stream keyword, and stops two bytes short of the endstream keyword,
+ * which leaves the end-of-line before endstream alone.  Since neither
+ * boundary depends on the stream's contents, the receiver finds the
+ * same bounds in the document that we send as we did in the template.
  *
+ * returns false if there is no (complete) stream object in [tp, plimit)
  */
-ssize_t
-pdf_wrap(const char *data, size_t dlen,
-         const char *pdfTemplate, size_t plen,
-         char *outbuf, size_t outbufsize)
+static bool
+pdf_next_stream(const char *tp, const char *plimit,
+                const char **start, const char **end, const char **next)
 {
-  int data2size = 2*dlen+10; 
-  // see rfc 1950 for zlib format, in addition to compressed data, we have
-  // 2-byte compression method and flags +
-  // 4-byte dict ID +
-  // 4-byte ADLER32 checksum
-  char data2[data2size];
-  const char *tp, *plimit;
-  char *op, *streamStart, *streamEnd, *filterStart;
-  size_t data2len, size;
-  int np;
+  const char *streamStart, *streamEnd, *cp;
+
+  streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, tp, plimit-tp);
+  if (streamStart == NULL)
+    return false;
+
+  // Skip the end-of-line, deciding how long it is only from bytes
+  // that are themselves skipped, and so never overwritten.
+  cp = streamStart + STREAM_BEGIN_SIZE;
+  cp += (cp < plimit && *cp == '\r') ? 2 : 1;
+  if (cp > plimit)
+    return false;
+
+  streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, cp, plimit-cp);
+  if (streamEnd == NULL)
+    return false;
+
+  *start = cp;
+  *end = (streamEnd - cp > 2) ? streamEnd - 2 : cp;
+  *next = streamEnd + STREAM_END_SIZE;
+  return true;
+}
 
-  if (dlen > SIZE_T_CEILING || plen > SIZE_T_CEILING ||
-      outbufsize > SIZE_T_CEILING)
-    return -1;
+/*
+ * pdf_stream_room returns the number of bytes of compressed data that
+ * pdf_embed_streams can store in the stream objects of the PDF document
+ * pdf (length plen) without changing its size.
+ */
+size_t
+pdf_stream_room(const char *pdf, size_t plen)
+{
+  const char *tp, *plimit, *start, *end;
+  size_t room = 0;
+
+  tp = pdf;
+  plimit = pdf+plen;
+  while (pdf_next_stream(tp, plimit, &start, &end, &tp))
+    room += end - start;
+  return room;
+}
 
-  data2len = compress((const uint8_t *)data, dlen, 
-                      (uint8_t *)data2, data2size, c_format_zlib);
-  if ((int)data2len < 0) {
-    log_warn("compress failed and returned %lu", (unsigned long)data2len);
+/*
+ * pdf_embed_streams stores the zlib-compressed data zdata (length zlen)
+ * in the stream objects of the PDF document pdfTemplate (length plen),
+ * and puts the result in outbuf (of size outbufsize).
+ *
+ * The data is split across as many stream objects as it takes, in
+ * document order, and each one is overwritten in place, so that the
+ * document keeps its size and its stream dictionaries.  Whatever is
+ * left of the last stream used is not touched; zlib knows where its
+ * own data ends, so the receiver can simply decompress the contents of
+ * all the streams, concatenated.  If the data does not fit, the last
+ * stream object in the document takes the remainder, and its dictionary
+ * is rewritten to match its new length.
+ *
+ * returns the length of the resulting document, if succeed; otherwise,
+ * it returns -1
+ */
+static ssize_t
+pdf_embed_streams(const char *zdata, size_t zlen,
+                  const char *pdfTemplate, size_t plen,
+                  char *outbuf, size_t outbufsize)
+{
+  const char *tp, *plimit, *start, *end, *next, *nstart, *nend, *nnext;
+  const char *filterStart;
+  char *op, *olimit;
+  size_t size;
+  int np;
+
+  if (plen > outbufsize) {
+    log_warn("pdf output buffer too small");
     return -1;
   }
 
-  op = outbuf;       // current pointer for output buffer
   tp = pdfTemplate;  // current pointer for http msg template
   plimit = pdfTemplate+plen;
 
-  while (tp < plimit) {
-    // find the next stream obj
-    streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, tp, plimit-tp);
-    if (streamStart == NULL) {
-      log_warn("Cannot find stream in pdf");
+  if (!pdf_next_stream(tp, plimit, &start, &end, &next)) {
+    log_warn("Cannot find stream in pdf");
+    return -1;
+  }
+
+  memcpy(outbuf, pdfTemplate, plen);
+
+  for (;;) {
+    size = end - start;
+    if (zlen <= size ||
+        pdf_next_stream(next, plimit, &nstart, &nend, &nnext)) {
+      // overwrite the contents of this stream in place
+      if (size > zlen)
+        size = zlen;
+      memcpy(outbuf + (start - pdfTemplate), zdata, size);
+      zdata += size;
+      zlen -= size;
+      if (zlen == 0)
+        return plen;
+
+      tp = next;
+      start = nstart;
+      end = nend;
+      next = nnext;
+      continue;
+    }
+
+    // This is the last stream object and the data does not fit in it:
+    // rewrite the object from its dictionary onward.
+    filterStart = strInBinaryRewind(" obj", 4, tp, start-tp);
+    if (filterStart == NULL) {
+      log_warn("Cannot find obj");
       return -1;
     }
 
-    streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, tp, plimit-tp);
-    if (streamEnd == NULL) {
-      log_warn("Cannot find endstream in pdf");
+    op = outbuf + (filterStart + 4 - pdfTemplate);
+    olimit = outbuf + outbufsize;
+
+    // write meta-data for stream object
+    np = snprintf(op, olimit-op,
+                  " <<\n/Length %lu\n/Filter /FlateDecode\n>>\nstream\n",
+                  (unsigned long)zlen);
+    if (np < 0 || size_t(np) >= size_t(olimit-op)) {
+      log_warn("pdf output buffer too small");
       return -1;
     }
+    op += np;
 
-    filterStart = strInBinaryRewind(" obj", 4, tp, streamStart-tp);
-    if (filterStart == NULL) {
-      log_warn("Cannot find obj\n");
+    // copy compressed data to outbuf, followed by the two bytes that
+    // pdf_next_stream leaves alone, and endstream
+    if (zlen + 2 + STREAM_END_SIZE > size_t(olimit-op)) {
+      log_warn("pdf output buffer too small");
       return -1;
-    } else {
-      // copy everything between tp and up and and including "obj" to outbuf
-      size = filterStart - tp + 4;
-      memcpy(op, tp, size);
-      op[size] = 0;
-      op += size;
-
-      // write meta-data for stream object
-      np = sprintf(op, " <<\n/Length %d\n/Filter /FlateDecode\n>>\nstream\n", (int)data2len);
-      if (np < 0) {
-        log_warn("sprintf failed\n");
-        return -1;
-      }
-      op += np;
+    }
+    memcpy(op, zdata, zlen);
+    op += zlen;
+    *op++ = '\r';
+    *op++ = '\n';
+    memcpy(op, STREAM_END, STREAM_END_SIZE);
+    op += STREAM_END_SIZE;
+
+    // copy the rest of pdfTemplate to outbuf
+    size = plimit-next;
+    if (size > size_t(olimit-op)) {
+      log_warn("pdf output buffer too small");
+      return -1;
+    }
+    memcpy(op, next, size);
+    op += size;
+    return (op-outbuf);
+  }
+}
 
-      // copy compressed data to outbuf 
-      memcpy(op, data2, data2len);
-      op += data2len;
+/*
+ * pdf_wrap embeds data of length dlen inside the stream objects of the PDF
+ * document (length plen) that appears in the body of a HTTP msg, and
+ * stores the result in the output buffer of size outsize
+ *
+ * pdf_wrap returns the length of the pdf document with the data embedded
+ * inside, if succeed; otherwise, it returns -1 to indicate an error
+ *
+ */
+ssize_t
+pdf_wrap(const char *data, size_t dlen,
+         const char *pdfTemplate, size_t plen,
+         char *outbuf, size_t outbufsize)
+{
+  size_t data2size;
+  char *data2;
+  ssize_t data2len, rv;
 
-      // write endstream to outbuf
-      np = sprintf(op, "\nendstream");
-      if (np < 0) {
-        log_warn("sprintf failed\n");
-        return -1;
-      }
-      op += np;
-    }
+  if (dlen > SIZE_T_CEILING || plen > SIZE_T_CEILING ||
+      outbufsize > SIZE_T_CEILING)
+    return -1;
 
-    // done with encoding data
-    tp = streamEnd+STREAM_END_SIZE;
-    break;
+  data2size = compress_bound(dlen, c_format_zlib);
+  data2 = (char *)xmalloc(data2size);
+  data2len = compress((const uint8_t *)data, dlen,
+                      (uint8_t *)data2, data2size, c_format_zlib);
+  if (data2len < 0) {
+    log_warn("compress failed and returned %ld", (long)data2len);
+    free(data2);
+    return -1;
   }
 
-  // copy the rest of pdfTemplate to outbuf
-  size = plimit-tp;
-  log_debug("copying the rest of pdfTemplate to outbuf (size %lu)",
-            (unsigned long)size);
-  memcpy(op, tp, size);
-  op += size;
-  return (op-outbuf);
+  rv = pdf_embed_streams(data2, data2len, pdfTemplate, plen,
+                         outbuf, outbufsize);
+  free(data2);
+  return rv;
 }
 
 /*
  * pdf_unwrap is the inverse operation of pdf_wrap
+ *
+ * returns the length of the data written to outbuf, if succeed;
+ * -2 if outbuf is too small; -1 on any other error, including
+ * truncated or corrupt stream contents
  */
 ssize_t
 pdf_unwrap(const char *data, size_t dlen,
            char *outbuf, size_t outbufsize)
 {
-  const char *dp, *dlimit;
-  char *op, *streamStart, *streamEnd;
-  size_t cnt, size, size2;
-
-  int streamObjStartSkip=0;
-  int streamObjEndSkip=0;
+  const char *dp, *dlimit, *start, *end;
+  char *gather;
+  size_t glen;
+  ssize_t rv;
 
   if (dlen > SIZE_T_CEILING || outbufsize > SIZE_T_CEILING)
     return -1;
 
-  dp = data;   // current pointer for data
-  op = outbuf; // current pointer for outbuf
-  cnt = 0;     // number of char decoded
+  // collect the contents of all the stream objects; decompress()
+  // stops at the end of the zlib data and ignores the rest
+  gather = (char *)xmalloc(dlen ? dlen : 1);
+  glen = 0;
+  dp = data;
   dlimit = data+dlen;
+  while (pdf_next_stream(dp, dlimit, &start, &end, &dp)) {
+    memcpy(gather + glen, start, end - start);
+    glen += end - start;
+  }
 
-   
-  while (dp < dlimit) {
-    // find the next stream obj
-    streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, dp, dlimit-dp);
-    if (streamStart == NULL) {
-      log_warn("Cannot find stream in pdf");
-      return -1;
-    }
-
-    dp = streamStart + STREAM_BEGIN_SIZE;
-
-    // streamObjStartSkip = size of end-of-line (EOL) char(s) after the stream keyword
-    if ( *dp == '\n' ) {
-      streamObjStartSkip = 1;
-    } else {
-      log_debug("Cannot find linefeed after the stream keyword");
-    }
-
-    dp = dp + streamObjStartSkip;
-
-    streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, dp, dlimit-dp);
-    if (streamEnd == NULL) {
-      log_warn("Cannot find endstream in pdf");
-      return -1;
-    }
-
-    // streamObjEndSkip = size of end-of-line (EOL) char(s) at the end of stream obj
-    if (*(streamEnd-1) == '\n') {
-      streamObjEndSkip = 1;
-    } else {
-      log_debug("Cannot find linefeed before the endstream keyword");
-    }
-
-    // compute the size of stream obj payload
-    size = (streamEnd-streamObjEndSkip) - dp;
-
-    size2 = decompress((const uint8_t *)dp, size, (uint8_t *)op, outbufsize);
-    if ((int)size2 < 0) {
-      log_warn("decompress failed; size2 = %d\n", (int)size2);
-      return -1;
-    } else {
-      op += size2;
-      cnt = size2;
-      break;  // done decoding
-    }
+  if (glen == 0) {
+    log_warn("Cannot find stream in pdf");
+    free(gather);
+    return -1;
   }
 
-  return cnt;
+  rv = decompress((const uint8_t *)gather, glen,
+                  (uint8_t *)outbuf, outbufsize);
+  if (rv == -1)
+    log_warn("decompress failed");
+  free(gather);
+  return rv;
 }
 
 int
 http_server_PDF_transmit(payloads &pl, struct evbuffer *source,
-                         conn_t *conn)
+                         conn_t *conn, bool keep_alive,
+                         http_scratch &scratch)
 {
   struct evbuffer *dest = conn->outbound();
   size_t sbuflen = evbuffer_get_length(source);
   unsigned int mpdf;
-  char *pdfTemplate = NULL, *hend;
+  char *pdfTemplate = NULL, *hend, *body;
+  const char *data1;
+  char *data2;
   int pdfTemplateSize = 0;
-  char data1[sbuflen];
-  char outbuf[HTTP_MSG_BUF_SIZE];
-  int cnt, hLen, outbuflen, i;
-
-  char newHdr[MAX_RESP_HDR_SIZE];
-  int newHdrLen = 0;
-
-  struct evbuffer_iovec *iv;
-  int nv;
+  int hLen;
+  size_t data2size, body_max;
+  ssize_t data2len, outbuflen;
 
   log_debug("Entering SERVER PDF transmit with sbuflen %d", (int)sbuflen);
 
-  nv = evbuffer_peek(source, sbuflen, NULL, NULL, 0);
-  iv = (evbuffer_iovec *)xzalloc(sizeof(struct evbuffer_iovec) * nv);
-
-  if (evbuffer_peek(source, sbuflen, NULL, iv, nv) != nv) {
-    free(iv);
-    return -1;
-  }
-
-  cnt = 0;
-  for (i = 0; i < nv; i++) {
-    const unsigned char *p = (const unsigned char *)iv[i].iov_base;
-    const unsigned char *limit = p + iv[i].iov_len;
-    while (p < limit && cnt < (int)sbuflen) {
-      data1[cnt++] = *p++;
-    }
-  }
-
-  free(iv);
-
-  log_debug("SERVER sbuflen = %d; cnt = %d", (int)sbuflen, cnt);
-
   mpdf = pl.max_PDF_capacity;
 
   if (mpdf <= 0) {
@@ -436,79 +547,63 @@ http_server_PDF_transmit(payloads &pl, struct evbuffer *source,
 
   hLen = hend+4-pdfTemplate;
 
-  log_debug("SERVER calling pdf_wrap for data1 with length %d", cnt);
-  outbuflen = pdf_wrap(data1, cnt, hend+4, pdfTemplateSize-hLen, outbuf,
-                      HTTP_MSG_BUF_SIZE);
-  if (outbuflen < 0) {
-    log_warn("SERVER pdf_wrap fails");
+  // compress the data into scratch space, then splice it into the
+  // template directly in the output buffer
+  data1 = (const char *)evbuffer_pullup(source, sbuflen);
+  if (!data1 && sbuflen) {
+    log_warn("SERVER evbuffer_pullup fails");
     return -1;
   }
-  log_debug("SERVER pdfSteg sends resp with hdr len %d body len %d",
-            hLen, outbuflen);
 
-  newHdrLen = gen_response_header((char*) "application/pdf", 0,
-                                  outbuflen, newHdr, sizeof(newHdr));
-  if (newHdrLen < 0) {
-    log_warn("SERVER ERROR: gen_response_header fails for pdfSteg");
+  http_resp_builder rb(dest, scratch);
+
+  data2size = compress_bound(sbuflen, c_format_zlib);
+  data2 = (char *)scratch.alloc(data2size);
+  data2len = compress((const uint8_t *)data1, sbuflen,
+                      (uint8_t *)data2, data2size, c_format_zlib);
+  if (data2len < 0) {
+    log_warn("SERVER compress fails");
     return -1;
   }
 
-  if (evbuffer_add(dest, newHdr, newHdrLen)) {
-    log_warn("SERVER ERROR: evbuffer_add() fails for newHdr");
+  // The template keeps its size unless the data overflows its last
+  // stream object, which is then rewritten; that never takes more than
+  // PDF_STREAM_OVERHEAD bytes beyond the data.
+  body_max = (pdfTemplateSize - hLen) + data2len + PDF_STREAM_OVERHEAD;
+  body = rb.begin("application/pdf", 0, keep_alive, body_max);
+  if (!body)
     return -1;
-  }
 
-  if (evbuffer_add(dest, outbuf, outbuflen)) {
-    log_warn("SERVER ERROR: evbuffer_add() fails for outbuf");
+  log_debug("SERVER calling pdf_wrap for data1 with length %d", (int)sbuflen);
+  outbuflen = pdf_embed_streams(data2, data2len, hend+4, pdfTemplateSize-hLen,
+                                body, body_max);
+  if (outbuflen < 0) {
+    log_warn("SERVER pdf_wrap fails");
     return -1;
   }
+  log_debug("SERVER pdfSteg sends resp with hdr len %d body len %d",
+            hLen, (int)outbuflen);
+
+  if (rb.commit(outbuflen) < 0)
+    return -1;
 
   evbuffer_drain(source, sbuflen);
   return 0;
 }
 
 int
-http_handle_client_PDF_receive(steg_t *, conn_t *conn, struct evbuffer *dest,
-                               struct evbuffer* source)
+http_handle_client_PDF_receive(struct evbuffer *dest, struct evbuffer* source,
+                               size_t hdrLen, size_t content_len)
 {
-  struct evbuffer_ptr s2;
-  unsigned int response_len = 0, hdrLen;
-  char outbuf[HTTP_MSG_BUF_SIZE];
-  int content_len = 0, outbuflen;
+  struct evbuffer_iovec space;
+  size_t response_len = hdrLen + content_len;
+  size_t outbufsize;
+  ssize_t outbuflen;
   char *httpHdr, *httpBody;
 
   log_debug("Entering CLIENT PDF receive");
-
-  s2 = evbuffer_search(source, "\r\n\r\n", sizeof ("\r\n\r\n") -1 , NULL);
-  if (s2.pos == -1) {
-    log_warn("CLIENT Did not find end of HTTP header %d",
-             (int) evbuffer_get_length(source));
-    return RECV_INCOMPLETE;
-  }
-
-  log_debug("CLIENT received response header with len %d", (int)s2.pos);
-
-  response_len = 0;
-  hdrLen = s2.pos + strlen("\r\n\r\n");
-  response_len += hdrLen;
-
-  httpHdr = (char *) evbuffer_pullup(source, s2.pos);
-  if (httpHdr == NULL) {
-    log_warn("CLIENT unable to pullup the complete HTTP header");
-    return RECV_BAD;
-  }
-
-  content_len = find_content_length(httpHdr, hdrLen);
-  if (content_len < 0) {
-    log_warn("CLIENT unable to find content length");
-    return RECV_BAD;
-  }
-  log_debug("CLIENT received Content-Length = %d\n", content_len);
-
-  response_len += content_len;
-
-  if (response_len > evbuffer_get_length(source))
-    return RECV_INCOMPLETE;
+  log_debug("CLIENT received response header with len %d", (int)hdrLen);
+  log_debug("CLIENT received Content-Length = %d\n", (int)content_len);
 
   httpHdr = (char *) evbuffer_pullup(source, response_len);
 
@@ -519,16 +614,30 @@ http_handle_client_PDF_receive(steg_t *, conn_t *conn, struct evbuffer *dest,
 
   httpBody = httpHdr + hdrLen;
 
-  outbuflen = pdf_unwrap(httpBody, content_len, outbuf, HTTP_MSG_BUF_SIZE);
+  // Decompress straight into dest.  The data is normally encrypted,
+  // hence incompressible, so the first guess at its size is enough.
+  outbufsize = content_len + 1024;
+  for (;;) {
+    if (evbuffer_reserve_space(dest, outbufsize, &space, 1) != 1) {
+      log_warn("CLIENT ERROR: evbuffer_reserve_space fails");
+      return RECV_BAD;
+    }
+    outbuflen = pdf_unwrap(httpBody, content_len,
+                           (char *)space.iov_base, outbufsize);
+    if (outbuflen != -2 || outbufsize >= PDF_MAX_UNWRAP_SIZE)
+      break;
+    outbufsize *= 2;
+  }
   if (outbuflen < 0) {
-    log_warn("CLIENT ERROR: pdf_unwrap fails\n");
+    log_warn("CLIENT ERROR: pdf_unwrap fails");
     return RECV_BAD;
   }
 
-  log_debug("CLIENT unwrapped data of length %d:", outbuflen);
+  log_debug("CLIENT unwrapped data of length %d:", (int)outbuflen);
 
-  if (evbuffer_add(dest, outbuf, outbuflen)) {
-    log_warn("CLIENT ERROR: evbuffer_add to dest fails\n");
+  space.iov_len = outbuflen;
+  if (evbuffer_commit_space(dest, &space, 1)) {
+    log_warn("CLIENT ERROR: evbuffer_commit_space to dest fails");
     return RECV_BAD;
   }
 
@@ -537,6 +646,5 @@ http_handle_client_PDF_receive(steg_t *, conn_t *conn, struct evbuffer *dest,
     return RECV_BAD;
   }
 
-  conn->expect_close();
   return RECV_GOOD;
 }
@@ -6,14 +6,20 @@
 #define _PDFSTEG_H
 
 struct payloads;
+class http_scratch;
 
 // These are the public interface.
 
 int http_server_PDF_transmit(payloads &pl, struct evbuffer *source,
-                             conn_t *conn);
-int http_handle_client_PDF_receive(steg_t *s, conn_t *conn,
-                                   struct evbuffer *dest,
-                                   struct evbuffer* source);
+                             conn_t *conn, bool keep_alive,
+                             http_scratch &scratch);
+int http_handle_client_PDF_receive(struct evbuffer *dest,
+                                   struct evbuffer* source,
+                                   size_t hdr_len, size_t content_len);
+
+// Used by the payload pool to work out the capacity of each template.
+
+size_t pdf_stream_room(const char *pdf, size_t plen);
 
 // These are exposed only for the sake of unit tests.
 
@@ -25,6 +31,9 @@ ssize_t pdf_remove_delimiter(const char *inbuf, size_t inbuflen,
                              char *outbuf, size_t outbuflen,
                              char delimiter1, bool *endFlag, bool *escape);
 
+char *strInBinaryRewind(const char *pattern, unsigned int patternLen,
+                        const char *blob, unsigned int blobLen);
+
 ssize_t pdf_wrap(const char *data, size_t dlen,
                  const char *pdfTemplate, size_t plen,
                  char *outbuf, size_t outbufsize);
@@ -6,9 +6,16 @@
 #include "compression.h"
 #include "connections.h"
 #include "payloads.h"
+#include "http_resp.h"
 
 #include <event2/buffer.h>
 
+// the client gives up on a response that inflates to more than this
+#define SWF_MAX_UNWRAP_SIZE (64 * 1024 * 1024)
+
+// amount of data used to measure the compressed-size model of a template
+#define SWF_PROBE_LEN 65536
+
 static const char http_response_1[] =
   "HTTP/1.1 200 OK\r\n"
   "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n"
@@ -17,26 +24,94 @@ static const char http_response_1[] =
   "Content-Type: application/x-shockwave-flash\r\n"
   "Content-Length: ";
 
-unsigned int
-swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz) {
+/* A response carries the template's 8-byte SWF header, then the
+   compressed concatenation of the first SWF_SAVE_HEADER_LEN bytes
+   after that header, the data, and the last SWF_SAVE_FOOTER_LEN bytes
+   of the template.  We model the compressed size of that as
+
+     (compressed size of the saved parts alone)
+     + (extra cost of the deflate blocks where data and saved parts mix)
+     + compress_bound(data length)
+
+   The first two terms depend on the template, and are measured here
+   by compressing the saved parts with and without SWF_PROBE_LEN bytes
+   of incompressible data between them.  (The data is normally
+   encrypted, so that is the case that matters; the probe comes from
+   a fixed-seed generator of its own, so that a template's capacity
+   does not depend on anything else that uses rand().)  The mixing cost
+   varies a little from one run of deflate to the next, so we allow
+   some slack on top of it.  The capacity of a template is the most
+   data for which the model says the response will be no bigger than
+   the template itself. */
+size_t
+swf_capacity(const char *swf, size_t swf_len)
+{
+  const size_t saved_len = SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN;
+  uint8_t *buf, *zbuf;
+  size_t zbound, pbound, excess, overhead, room, cap, need, i;
+  ssize_t zsaved, zprobe;
+  uint32_t x = 2463534242u;
+
+  if (swf_len < 8 + saved_len)
+    return 0;
+
+  buf = (uint8_t *)xmalloc(saved_len + SWF_PROBE_LEN);
+  zbound = compress_bound(saved_len + SWF_PROBE_LEN, c_format_zlib);
+  zbuf = (uint8_t *)xmalloc(zbound);
+
+  memcpy(buf, swf+8, SWF_SAVE_HEADER_LEN);
+  memcpy(buf+SWF_SAVE_HEADER_LEN, swf + swf_len - SWF_SAVE_FOOTER_LEN,
+         SWF_SAVE_FOOTER_LEN);
+  zsaved = compress(buf, saved_len, zbuf, zbound, c_format_zlib);
+
+  memmove(buf + SWF_SAVE_HEADER_LEN + SWF_PROBE_LEN,
+          buf + SWF_SAVE_HEADER_LEN, SWF_SAVE_FOOTER_LEN);
+  for (i = 0; i < SWF_PROBE_LEN; i++) {
+    // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[SWF_SAVE_HEADER_LEN + i] = (uint8_t)(x >> 24);
+  }
+  zprobe = compress(buf, saved_len + SWF_PROBE_LEN, zbuf, zbound,
+                    c_format_zlib);
+
+  free(buf);
+  free(zbuf);
+  if (zsaved < 0 || zprobe < 0)
+    return 0;
+
+  pbound = compress_bound(SWF_PROBE_LEN, c_format_zlib);
+  excess = (size_t)zprobe > zsaved + pbound ? zprobe - zsaved - pbound : 0;
+  overhead = 8 + zsaved + excess + excess/2 + 64;
+  if (swf_len <= overhead)
+    return 0;
+  room = swf_len - overhead;
+
+  // the largest cap with compress_bound(cap) <= room
+  cap = room;
+  while (cap > 0 && (need = compress_bound(cap, c_format_zlib)) > room)
+    cap = (need - room < cap) ? cap - (need - room) : 0;
+  return cap;
+}
 
+int
+swf_wrap(payloads& pl, struct evbuffer *source, size_t in_len,
+         struct evbuffer *dest, bool keep_alive, http_scratch& scratch)
+{
   char* swf;
   int in_swf_len;
 
-  char* tmp_buf;
-  int out_swf_len;
-
   char* resp;
   int resp_len;
 
-  char hdr[512];
-  unsigned int hdr_len;
-
-  char* tmp_buf2;
-  
-
+  char* tmp_buf;
+  size_t tmp_len;
+  char* body;
+  ssize_t out_swf_len;
+  size_t body_max;
 
-  if (!get_payload(pl, HTTP_CONTENT_SWF, -1, &resp, &resp_len)) {
+  if (!get_payload(pl, HTTP_CONTENT_SWF, in_len, &resp, &resp_len)) {
     log_warn("swfsteg: no suitable payload found\n");
     return -1;
   }
@@ -44,116 +119,107 @@ swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz) {
   swf = strstr(resp, "\r\n\r\n") + 4;
   in_swf_len = resp_len - (swf - resp);
 
-
-
-  
-  if (out_sz - in_len < (SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 8 + 512)) {
-    fprintf(stderr, "swfsteg: outbuf too small %d \n", out_sz - in_len);
-
-    log_warn("swfsteg: outbuf too small\n");
+  if (in_swf_len < 8 + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN) {
+    log_warn("swfsteg: payload too short (%d)", in_swf_len);
     return -1;
   }
 
-
-  tmp_buf = (char *)xmalloc(in_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN);
-  tmp_buf2 = (char *)xmalloc(in_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512);
+  // Assemble the uncompressed SWF in scratch space, then compress it
+  // straight into the response body, after the 8-byte SWF header.
+  http_resp_builder rb(dest, scratch);
+  tmp_len = in_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN;
+  tmp_buf = (char *)scratch.alloc(tmp_len);
 
   memcpy(tmp_buf, swf+8, SWF_SAVE_HEADER_LEN);
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN, inbuf, in_len);
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN+in_len, swf + in_swf_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
-  out_swf_len =
-    compress((const uint8_t *)tmp_buf,
-             SWF_SAVE_HEADER_LEN + in_len + SWF_SAVE_FOOTER_LEN,
-             (uint8_t *)tmp_buf2+8,
-             in_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512-8,
-             c_format_zlib);
-
-  hdr_len =   gen_response_header((char*) "application/x-shockwave-flash", 0, out_swf_len + 8, hdr, sizeof(hdr));
-
-  //  fprintf(stderr, "hdr = %s\n", hdr);
-				       
-  memcpy(tmp_buf2, swf, 4);
-  ((int*) (tmp_buf2))[1] = out_swf_len;
-  
-  memcpy(outbuf, hdr, hdr_len);
-  memcpy(outbuf+hdr_len, tmp_buf2, out_swf_len + 8);
+  if (evbuffer_copyout(source, tmp_buf+SWF_SAVE_HEADER_LEN, in_len)
+      != (ssize_t)in_len) {
+    log_warn("swfsteg: evbuffer_copyout failed");
+    return -1;
+  }
+  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN+in_len,
+         swf + in_swf_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
 
-  free(tmp_buf);
-  free(tmp_buf2);
-  return out_swf_len + 8 + hdr_len;
-}
+  body_max = 8 + compress_bound(tmp_len, c_format_zlib);
+  body = rb.begin("application/x-shockwave-flash", 0, keep_alive,
+                  body_max);
+  if (!body)
+    return -1;
 
+  out_swf_len = compress((const uint8_t *)tmp_buf, tmp_len,
+                         (uint8_t *)body+8, body_max-8, c_format_zlib);
+  if (out_swf_len < 0) {
+    log_warn("swfsteg: compress failed");
+    return -1;
+  }
 
+  // SWF header: signature and version from the template, then the
+  // length of the compressed data.
+  int32_t swf_len = out_swf_len;
+  memcpy(body, swf, 4);
+  memcpy(body+4, &swf_len, 4);
 
+  return rb.commit(out_swf_len + 8);
+}
 
-unsigned int
+/* Returns the length of the data written to OUTBUF, -2 if OUTBUF is
+   too small, or -1 on any other error. */
+int
 swf_unwrap(char* inbuf, int in_len, char* outbuf, int out_sz)
 {
+  const int saved_len = SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN;
   int inf_len;
-  size_t tmp_len = in_len * 32;
-  char* tmp_buf = (char *)xmalloc(tmp_len);
+  size_t tmp_len;
+  char* tmp_buf;
+
+  if (in_len < 8 || out_sz < 0)
+    return -1;
+
+  // The data is normally incompressible, so this is usually enough.
+  tmp_len = in_len + saved_len + 1024;
+  tmp_buf = (char *)xmalloc(tmp_len);
 
   for (;;) {
     inf_len = decompress((const uint8_t *)inbuf + 8, in_len - 8,
                          (uint8_t *)tmp_buf, tmp_len);
-    if (inf_len != -2)
+    if (inf_len != -2 || tmp_len > (size_t)out_sz + saved_len)
       break;
     tmp_len *= 2;
     tmp_buf = (char *)xrealloc(tmp_buf, tmp_len);
   }
 
-  if (inf_len < 0 ||
-      out_sz < inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN) {
-    fprintf(stderr, "inf_len = %d\n", inf_len);
+  if (inf_len == -2 || (inf_len >= saved_len && out_sz < inf_len - saved_len)) {
+    free(tmp_buf);
+    return -2;
+  }
+  if (inf_len == -1) {
+    // truncated or corrupt; more room would not help
+    free(tmp_buf);
+    return -1;
+  }
+  if (inf_len < saved_len) {
+    log_warn("swfsteg: bad payload (inflated length %d)", inf_len);
     free(tmp_buf);
     return -1;
   }
 
-  memcpy(outbuf, tmp_buf + SWF_SAVE_HEADER_LEN,
-         inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN);
-  return inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN;
+  memcpy(outbuf, tmp_buf + SWF_SAVE_HEADER_LEN, inf_len - saved_len);
+  free(tmp_buf);
+  return inf_len - saved_len;
 }
 
 int
-http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
+http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn,
+                         bool keep_alive, http_scratch& scratch)
 {
-
   struct evbuffer *dest = conn->outbound();
   size_t sbuflen = evbuffer_get_length(source);
-  char* inbuf;
-  char* outbuf;
-  int outlen;
 
-  inbuf = (char *)xmalloc(sbuflen);
-
-  if (evbuffer_remove(source, inbuf, sbuflen) == -1) {
-    log_debug("evbuffer_remove failed in http_server_SWF_transmit");
-    return -1;
-  }
-
-  outbuf = (char *)xmalloc(4*sbuflen + SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 512);
-
-  //  fprintf(stderr, "server wrapping swf len %d\n", (int) sbuflen);
-  outlen = swf_wrap(pl, inbuf, sbuflen, outbuf, 4*sbuflen + SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 512);
-
-  if (outlen < 0) {
+  if (swf_wrap(pl, source, sbuflen, dest, keep_alive, scratch) < 0) {
     log_warn("swf_wrap failed\n");
-    //    fprintf(stderr, "swf_wrap failed\n");
-    free(inbuf);
-    free(outbuf);
-    return -1;
-  }
-
-  
-  if (evbuffer_add(dest, outbuf, outlen)) {
-    log_debug("SERVER ERROR: http_server_transmit: evbuffer_add() fails for jsTemplate");
-    free(inbuf);
-    free(outbuf);
     return -1;
   }
 
-  free(inbuf);
-  free(outbuf);
+  evbuffer_drain(source, sbuflen);
   return 0;
 }
 
@@ -161,72 +227,48 @@ http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
 
 
 int
-http_handle_client_SWF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
-  struct evbuffer_ptr s2;
-  unsigned int response_len = 0, hdrLen;
-  char outbuf[HTTP_MSG_BUF_SIZE];
-  int content_len = 0, outbuflen;
+http_handle_client_SWF_receive(struct evbuffer *dest, struct evbuffer* source,
+                               size_t hdrLen, size_t content_len)
+{
+  struct evbuffer_iovec space;
+  size_t response_len = hdrLen + content_len;
+  int outbuflen, outbufsize;
   char *httpHdr, *httpBody;
 
+  log_debug("CLIENT received response header with len %d", (int)hdrLen);
+  log_debug("CLIENT received Content-Length = %d\n", (int)content_len);
 
-
-  s2 = evbuffer_search(source, "\r\n\r\n", sizeof ("\r\n\r\n") -1 , NULL);
-  if (s2.pos == -1) {
-    log_warn("CLIENT Did not find end of HTTP header %d", (int) evbuffer_get_length(source));
-    fprintf(stderr, "client did not find end of HTTP header\n");
-
-    //    evbuffer_dump(source, stderr);
-    return RECV_INCOMPLETE;
-  }
-
-  log_debug("CLIENT received response header with len %d", (int)s2.pos);
-
-  response_len = 0;
-  hdrLen = s2.pos + strlen("\r\n\r\n");
-  response_len += hdrLen;
-
-  httpHdr = (char *) evbuffer_pullup(source, s2.pos);
+  httpHdr = (char *) evbuffer_pullup(source, response_len);
   if (httpHdr == NULL) {
-    log_warn("CLIENT unable to pullup the complete HTTP header");
+    log_warn("CLIENT unable to pullup the complete HTTP response");
     return RECV_BAD;
   }
-
-  content_len = find_content_length(httpHdr, hdrLen);
-
-
-
-  if (content_len < 0) {
-    log_warn("CLIENT unable to find content length");
-    return RECV_BAD;
-  }
-  log_debug("CLIENT received Content-Length = %d\n", content_len);
-
-
-
-  response_len += content_len;
-
-  if (response_len > evbuffer_get_length(source))
-    return RECV_INCOMPLETE;
-
-
-
-  httpHdr = (char *) evbuffer_pullup(source, response_len);
   httpBody = httpHdr + hdrLen;
 
 
-  outbuflen = swf_unwrap(httpBody, content_len, outbuf, HTTP_MSG_BUF_SIZE);
+  // Inflate straight into dest.  The data is normally encrypted,
+  // hence incompressible, so the first guess at its size is enough.
+  outbufsize = content_len + 1024;
+  for (;;) {
+    if (evbuffer_reserve_space(dest, outbufsize, &space, 1) != 1) {
+      log_debug("CLIENT ERROR: evbuffer_reserve_space fails\n");
+      return RECV_BAD;
+    }
+    outbuflen = swf_unwrap(httpBody, content_len, (char *)space.iov_base,
+                           outbufsize);
+    if (outbuflen != -2 || outbufsize >= SWF_MAX_UNWRAP_SIZE)
+      break;
+    outbufsize *= 2;
+  }
 
   if (outbuflen < 0) {
-    fprintf(stderr, "swf_unwrap failed\n");
     log_debug("CLIENT ERROR: swf_unwrap failed\n");
     return RECV_BAD;
   }
 
-  //  fprintf(stderr, "CLIENT unwrapped data of length %d:", outbuflen);
-  // buf_dump(outbuf, outbuflen, stderr);
-
-  if (evbuffer_add(dest, outbuf, outbuflen)) {
-    log_debug("CLIENT ERROR: evbuffer_add to dest fails\n");
+  space.iov_len = outbuflen;
+  if (evbuffer_commit_space(dest, &space, 1)) {
+    log_debug("CLIENT ERROR: evbuffer_commit_space to dest fails\n");
     return RECV_BAD;
   }
 
@@ -236,7 +278,5 @@ http_handle_client_SWF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, st
     return RECV_BAD;
   }
 
-  //  downcast_steg(s)->have_received = 1;
-  conn->expect_close();
   return RECV_GOOD;
 }
@@ -6,21 +6,27 @@
 #define _SWFSTEG_H
 
 struct payloads;
+class http_scratch;
 
 #define SWF_SAVE_HEADER_LEN 1500
 #define SWF_SAVE_FOOTER_LEN 1500
 
-unsigned int
-swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz);
+int
+swf_wrap(payloads& pl, struct evbuffer *source, size_t in_len,
+         struct evbuffer *dest, bool keep_alive, http_scratch& scratch);
 
-unsigned int
+int
 swf_unwrap(char* inbuf, int in_len, char* outbuf, int out_sz);
 
+size_t
+swf_capacity(const char* swf, size_t swf_len);
+
 int
-http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn);
+http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn,
+                         bool keep_alive, http_scratch& scratch);
 
 int
-http_handle_client_SWF_receive(steg_t *s, conn_t *conn, struct evbuffer *dest,
-                               struct evbuffer* source);
+http_handle_client_SWF_receive(struct evbuffer *dest, struct evbuffer* source,
+                               size_t hdr_len, size_t content_len);
 
 #endif
@@ -0,0 +1,453 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Microbenchmarks for the per-block machinery of the chop protocol:
+
+   header_encode, header_decode
+       Constructing a chop_blk::header for transmission, and decoding
+       and validating one on receipt, with AES and with the no-op ECB
+       used by --disable-encryption.
+
+   reassembly
+       reassembly_queue::insert() and remove_next() for one block each,
+       with blocks arriving in order, in reverse, or shuffled, in
+       groups of 1 to 256 (the whole receive window) before the queue
+       is drained.
+
+   process_queue
+       chop_conn_t::recv() on a client circuit with encryption disabled
+       and the nosteg module, given groups of blocks with large data
+       sections, in order or reversed.  Besides process_queue() itself
+       this counts header decoding, copying each block out of the
+       receive buffer and into the reassembly queue, and delivering
+       the data to the (socketless) upstream buffer; it is the whole
+       receive path short of the steg module and the cipher.
+
+   Each case runs for at least the time given with -t.  Results are
+   written to standard output as JSON, one object per case, all with
+   the same keys: nanoseconds per operation (one block, or one header)
+   and, where there is data, throughput in MB/s (10^6 bytes).  Naming
+   benchmarks on the command line runs only those. */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "protocol.h"
+#include "protocol/chop_blk.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+using std::string;
+using std::vector;
+using namespace chop_blk;
+
+namespace {
+  enum pattern { IN_ORDER, REVERSE, SHUFFLE };
+
+  const char *const pattern_names[] = { "in_order", "reverse", "shuffle" };
+
+  struct result
+  {
+    string bench;
+    string variant;
+    uint64_t ops;
+    double seconds;
+    uint64_t bytes;
+  };
+
+  struct header_state
+  {
+    ecb_encryptor *enc;
+    ecb_decryptor *dec;
+    struct evbuffer *wire;
+    uint32_t seqno;           // for the next header_encode
+    uint32_t window;          // the receive window the wire header is in
+  };
+
+  struct reassembly_state
+  {
+    reassembly_queue queue;
+    vector<struct evbuffer *> pool;
+    vector<uint32_t> order;
+    uint32_t seqno;
+  };
+}
+
+static const char *argv0;
+static double min_seconds = 0.2;
+static uint32_t rng_state = 1;
+
+/* Written to, so that the compiler cannot discard the work. */
+static volatile uint32_t sink;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options] [benchmark...]\n"
+          "  -t ms            run each case for at least this long "
+          "(default 200)\n"
+          "  benchmarks: header_encode header_decode reassembly "
+          "process_queue\n",
+          argv0);
+  exit(1);
+}
+
+static uint32_t
+next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+/* Fill ORDER with the offsets 0 ... N-1 in the order given by P. */
+static void
+make_order(vector<uint32_t> &order, size_t n, pattern p)
+{
+  order.resize(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = p == REVERSE ? n - 1 - i : i;
+  if (p == SHUFFLE)
+    for (size_t i = n; i > 1; i--)
+      std::swap(order[i - 1], order[next_random() % i]);
+}
+
+/* Call FN(ARG, n) with n doubling until a call takes at least
+   min_seconds; record the last call in R. */
+static void
+run_timed(result &r, size_t (*fn)(void *, size_t), void *arg)
+{
+  size_t n = 16;
+  for (;;) {
+    double t0 = bench_now();
+    r.ops = fn(arg, n);
+    r.seconds = bench_now() - t0;
+    if (r.seconds >= min_seconds || n > ((size_t)1 << 40))
+      break;
+    n *= 2;
+  }
+}
+
+static void
+print_result(const result &r, bool first)
+{
+  printf("%s\n  {\"bench\": \"%s\", \"variant\": \"%s\", \"ops\": %lu, "
+         "\"ns_per_op\": %.2f, \"mb_per_s\": %.1f}", first ? "" : ",",
+         r.bench.c_str(), r.variant.c_str(), (unsigned long)r.ops,
+         r.ops ? r.seconds * 1e9 / r.ops : 0.0,
+         r.bytes && r.seconds > 0 ? r.bytes / r.seconds / 1e6 : 0.0);
+  fflush(stdout);
+}
+
+static size_t
+header_encode_ops(void *arg, size_t n)
+{
+  header_state *s = (header_state *)arg;
+  uint32_t acc = 0;
+  for (size_t i = 0; i < n; i++) {
+    header hdr(s->seqno++, 1024, 64, op_DAT, *s->enc);
+    acc += hdr.nonce()[0];
+  }
+  sink = acc;
+  return n;
+}
+
+static size_t
+header_decode_ops(void *arg, size_t n)
+{
+  header_state *s = (header_state *)arg;
+  uint32_t acc = 0;
+  for (size_t i = 0; i < n; i++) {
+    header hdr(s->wire, *s->dec);
+    if (!hdr.valid(s->window))
+      log_abort("header_decode: block header rejected");
+    acc += hdr.total_len();
+  }
+  sink = acc;
+  return n;
+}
+
+static void
+bench_headers(vector<result> &results)
+{
+  static const uint8_t key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+  };
+
+  for (int real = 1; real >= 0; real--) {
+    header_state s;
+    s.enc = real ? ecb_encryptor::create(key, sizeof key)
+      : ecb_encryptor::create_noop();
+    s.dec = real ? ecb_decryptor::create(key, sizeof key)
+      : ecb_decryptor::create_noop();
+    s.seqno = 0;
+    s.window = 0;
+    s.wire = evbuffer_new();
+
+    // header_encode moves s.seqno on, but the header to be decoded
+    // stays at the front of the receive window.
+    header hdr(s.window, 1024, 64, op_DAT, *s.enc);
+    evbuffer_add(s.wire, hdr.nonce(), HEADER_LEN);
+
+    result r;
+    r.variant = real ? "aes" : "noop";
+    r.bytes = 0;
+    r.bench = "header_encode";
+    run_timed(r, header_encode_ops, &s);
+    results.push_back(r);
+
+    r.bench = "header_decode";
+    run_timed(r, header_decode_ops, &s);
+    results.push_back(r);
+
+    evbuffer_free(s.wire);
+    delete s.enc;
+    delete s.dec;
+  }
+}
+
+/* Insert blocks in groups the size of s->order, in that order, and
+   drain the queue after each group. */
+static size_t
+reassembly_ops(void *arg, size_t n)
+{
+  reassembly_state *s = (reassembly_state *)arg;
+  size_t fill = s->order.size();
+  size_t done = 0;
+
+  while (done < n) {
+    for (size_t i = 0; i < fill; i++) {
+      if (!s->queue.insert(s->seqno + s->order[i], op_DAT,
+                           s->pool[i], 0))
+        log_abort("reassembly_queue rejected block %u",
+                  s->seqno + s->order[i]);
+    }
+    for (size_t i = 0; i < fill; i++) {
+      reassembly_elt blk = s->queue.remove_next();
+      if (!blk.data)
+        log_abort("reassembly_queue lost block %u", s->seqno);
+      s->pool[i] = blk.data;
+      s->seqno++;
+    }
+    done += fill;
+  }
+  return done;
+}
+
+static void
+bench_reassembly(vector<result> &results)
+{
+  static const size_t fills[] = { 1, 8, 64, 256 };
+
+  for (size_t f = 0; f < sizeof fills / sizeof fills[0]; f++) {
+    for (int p = IN_ORDER; p <= SHUFFLE; p++) {
+      if (fills[f] == 1 && p != IN_ORDER)
+        continue;
+
+      reassembly_state *s = new reassembly_state;
+      s->seqno = 0;
+      make_order(s->order, fills[f], (pattern)p);
+      for (size_t i = 0; i < fills[f]; i++)
+        s->pool.push_back(evbuffer_new());
+
+      char buf[64];
+      xsnprintf(buf, sizeof buf, "%s/fill=%lu", pattern_names[p],
+                (unsigned long)fills[f]);
+      result r;
+      r.bench = "reassembly";
+      r.variant = buf;
+      r.bytes = 0;
+      run_timed(r, reassembly_ops, s);
+      results.push_back(r);
+
+      for (size_t i = 0; i < s->pool.size(); i++)
+        evbuffer_free(s->pool[i]);
+      delete s;
+    }
+  }
+}
+
+/* Feed a chop client connection groups of FILL blocks with DLEN bytes
+   of data each, in the order given by P, until at least min_seconds
+   have been spent in recv(). */
+static void
+bench_process_queue_case(struct event_base *base, vector<result> &results,
+                         size_t dlen, size_t fill, pattern p)
+{
+  const char *argv[] = {
+    "chop", "client", "--disable-encryption",
+    "127.0.0.1:1", "127.0.0.1:2", "nosteg", 0
+  };
+  config_t *cfg = config_create(6, argv);
+  if (!cfg)
+    log_abort("failed to configure chop");
+  cfg->base = base;
+
+  struct bufferevent *buf = bufferevent_socket_new(base, -1, 0);
+  conn_t *conn = conn_create(cfg, 0, buf, xstrdup("bench"));
+  bench_unfreeze(buf);
+
+  circuit_t *ckt = circuit_create(cfg, 0);
+  circuit_add_upstream(ckt, bufferevent_socket_new(base, -1, 0),
+                       xstrdup("bench"));
+  ckt->add_downstream(conn);
+  bench_unfreeze(ckt->up_buffer);
+  struct evbuffer *up = bufferevent_get_output(ckt->up_buffer);
+
+  // These are what the circuit uses with encryption disabled.
+  ecb_encryptor *hdr_enc = ecb_encryptor::create_noop();
+  gcm_encryptor *enc = gcm_encryptor::create_noop();
+
+  vector<uint32_t> order;
+  make_order(order, fill, p);
+  vector<uint8_t> data(dlen), block(MIN_BLOCK_SIZE + dlen);
+  for (size_t i = 0; i < dlen; i++)
+    data[i] = next_random() >> 24;
+
+  result r;
+  char vbuf[64];
+  xsnprintf(vbuf, sizeof vbuf, "%s/fill=%lu/dlen=%lu", pattern_names[p],
+            (unsigned long)fill, (unsigned long)dlen);
+  r.bench = "process_queue";
+  r.variant = vbuf;
+  r.ops = r.bytes = 0;
+  r.seconds = 0;
+
+  uint32_t seqno = 0;
+  while (r.seconds < min_seconds) {
+    struct evbuffer *in = conn->inbound();
+    for (size_t i = 0; i < fill; i++) {
+      header hdr(seqno + order[i], dlen, 0, op_DAT, *hdr_enc);
+      memcpy(&block[0], hdr.nonce(), HEADER_LEN);
+      enc->encrypt(&block[HEADER_LEN], &data[0], dlen, hdr.nonce(),
+                   HEADER_LEN);
+      evbuffer_add(in, &block[0], block.size());
+    }
+    seqno += fill;
+
+    double t0 = bench_now();
+    int rv = conn->recv();
+    r.seconds += bench_now() - t0;
+    if (rv)
+      log_abort("chop rejected blocks");
+
+    size_t got = evbuffer_get_length(up);
+    if (got != fill * dlen)
+      log_abort("delivered %lu bytes, expected %lu",
+                (unsigned long)got, (unsigned long)(fill * dlen));
+    evbuffer_drain(up, got);
+    evbuffer_drain(conn->outbound(), evbuffer_get_length(conn->outbound()));
+    r.ops += fill;
+    r.bytes += got;
+  }
+  results.push_back(r);
+
+  delete hdr_enc;
+  delete enc;
+  bench_close(conn, cfg);
+}
+
+static void
+bench_process_queue(struct event_base *base, vector<result> &results)
+{
+  static const size_t dlens[] = { 1024, 16384, SECTION_LEN };
+  static const size_t fills[] = { 1, 16, 64 };
+
+  for (size_t d = 0; d < sizeof dlens / sizeof dlens[0]; d++)
+    for (size_t f = 0; f < sizeof fills / sizeof fills[0]; f++)
+      for (int p = IN_ORDER; p <= REVERSE; p++) {
+        if (fills[f] == 1 && p != IN_ORDER)
+          continue;
+        bench_process_queue_case(base, results, dlens[d], fills[f],
+                                 (pattern)p);
+      }
+}
+
+static bool
+wanted(const vector<string> &names, const char *bench)
+{
+  if (names.empty())
+    return true;
+  for (size_t i = 0; i < names.size(); i++)
+    if (names[i] == bench)
+      return true;
+  return false;
+}
+
+int
+main(int argc, char **argv)
+{
+  int c;
+
+  argv0 = argv[0];
+  while ((c = getopt(argc, argv, "t:")) != -1) {
+    switch (c) {
+    case 't': {
+      char *end;
+      unsigned long v = strtoul(optarg, &end, 10);
+      if (*end || end == optarg || !v)
+        usage();
+      min_seconds = v / 1000.0;
+      break;
+    }
+    default:
+      usage();
+    }
+  }
+
+  vector<string> names(argv + optind, argv + argc);
+  for (size_t i = 0; i < names.size(); i++)
+    if (names[i] != "header_encode" && names[i] != "header_decode" &&
+        names[i] != "reassembly" && names[i] != "process_queue")
+      usage();
+
+  // Each process_queue case ends by closing its circuit mid-stream,
+  // which chop warns about.
+  log_set_method(LOG_METHOD_STDERR, 0);
+  log_set_min_severity("error");
+  init_crypto();
+
+  struct event_base *base = event_base_new();
+  if (!base || event_base_priority_init(base, 2)) {
+    fprintf(stderr, "%s: failed to initialize libevent\n", argv0);
+    return 1;
+  }
+  conn_global_init(base);
+
+  vector<result> results;
+  if (wanted(names, "header_encode") || wanted(names, "header_decode"))
+    bench_headers(results);
+  if (wanted(names, "reassembly"))
+    bench_reassembly(results);
+  if (wanted(names, "process_queue"))
+    bench_process_queue(base, results);
+
+  printf("{\"min_seconds\": %.3f,\n \"results\": [", min_seconds);
+  bool first = true;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (!wanted(names, results[i].bench.c_str()))
+      continue;
+    print_result(results[i], first);
+    first = false;
+  }
+  printf("]}\n");
+
+  conn_start_shutdown(0);
+  event_base_dispatch(base);
+  event_base_free(base);
+  free_crypto();
+  return 0;
+}
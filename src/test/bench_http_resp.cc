@@ -0,0 +1,230 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Benchmark for the HTTP server response path: builds a stream of
+   JavaScript, HTML, PDF and SWF responses through the same functions
+   the http steg module uses, and reports how many heap allocations
+   and how many body copies each response costs.  Payload templates
+   are read from a server trace file (traces/server.out by default;
+   run pgen_fake or pgen_pcap to make one). */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "rng.h"
+#include "steg/payloads.h"
+#include "steg/http_resp.h"
+#include "steg/jsSteg.h"
+#include "steg/pdfSteg.h"
+#include "steg/swfSteg.h"
+
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+namespace {
+  struct bench_case
+  {
+    const char *name;
+    int content_type;
+  };
+
+  const bench_case cases[] = {
+    { "js",   HTTP_CONTENT_JAVASCRIPT },
+    { "html", HTTP_CONTENT_HTML },
+    { "pdf",  HTTP_CONTENT_PDF },
+    { "swf",  HTTP_CONTENT_SWF },
+  };
+}
+
+static const char *argv0;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "Usage: %s [-n responses] [-s bytes] [-c] [tracefile]\n"
+          "  -n  number of responses per content type (default 10000)\n"
+          "  -s  bytes of covert data per response, at most what the\n"
+          "      steg module would allow (default: 1024, or less)\n"
+          "  -c  cold: use a fresh scratch arena for every response,\n"
+          "      as for one response per connection\n",
+          argv0);
+  exit(1);
+}
+
+/* get_payload wants a template with strictly more capacity than is
+   asked for, and JS and HTML carry data hex-encoded. */
+static size_t
+capacity_for(payloads &pl, int content_type)
+{
+  switch (content_type) {
+  case HTTP_CONTENT_JAVASCRIPT: return (pl.max_JS_capacity - 1) / 2;
+  case HTTP_CONTENT_HTML:       return (pl.max_HTML_capacity - 1) / 2;
+  case HTTP_CONTENT_PDF:        return pl.max_PDF_capacity - 1;
+  case HTTP_CONTENT_SWF:        return pl.max_SWF_capacity - 1;
+  default:                      return 0;
+  }
+}
+
+static int
+transmit_one(payloads &pl, int content_type, struct evbuffer *source,
+             conn_t *conn, http_scratch &scratch)
+{
+  switch (content_type) {
+  case HTTP_CONTENT_JAVASCRIPT:
+  case HTTP_CONTENT_HTML:
+    return http_server_JS_transmit(pl, source, conn, content_type, true,
+                                   scratch);
+  case HTTP_CONTENT_PDF:
+    return http_server_PDF_transmit(pl, source, conn, true, scratch);
+  case HTTP_CONTENT_SWF:
+    return http_server_SWF_transmit(pl, source, conn, true, scratch);
+  default:
+    return -1;
+  }
+}
+
+static void
+run_case(const bench_case &bc, payloads &pl, struct event_base *base,
+         unsigned long n, size_t want, bool cold)
+{
+  if (pl.typePayloadCount[bc.content_type] == 0) {
+    printf("%-5s no templates in trace, skipped\n", bc.name);
+    return;
+  }
+
+  size_t len = capacity_for(pl, bc.content_type);
+  if (want ? want < len : len > 1024)
+    len = want ? want : 1024;
+
+  uint8_t *data = (uint8_t *)xmalloc(len);
+  rng_bytes(data, len);
+
+  bench_conn *conn = new bench_conn(base);
+  struct evbuffer *source = evbuffer_new();
+  struct evbuffer *dest = conn->outbound();
+  http_scratch *scratch = new http_scratch;
+
+  unsigned long allocs = 0, arena_allocs = 0, moves = 0, moved = 0;
+  unsigned long failures = 0;
+  size_t wire = 0;
+  double elapsed = 0;
+
+  // One untimed round to let the arena reach its working size.
+  evbuffer_add(source, data, len);
+  transmit_one(pl, bc.content_type, source, conn, *scratch);
+  evbuffer_drain(source, evbuffer_get_length(source));
+  evbuffer_drain(dest, evbuffer_get_length(dest));
+
+  for (unsigned long i = 0; i < n; i++) {
+    if (cold) {
+      delete scratch;
+      scratch = new http_scratch;
+    }
+    evbuffer_add(source, data, len);
+
+    uint64_t a0 = bench_allocs;
+    unsigned long s0 = scratch->heap_allocs;
+    unsigned long m0 = scratch->body_moves;
+    unsigned long b0 = scratch->bytes_moved;
+    double t0 = bench_now();
+
+    int rv = transmit_one(pl, bc.content_type, source, conn, *scratch);
+
+    elapsed += bench_now() - t0;
+    allocs += bench_allocs - a0;
+    arena_allocs += scratch->heap_allocs - s0;
+    moves += scratch->body_moves - m0;
+    moved += scratch->bytes_moved - b0;
+
+    if (rv)
+      failures++;
+    wire += evbuffer_get_length(dest);
+    evbuffer_drain(source, evbuffer_get_length(source));
+    evbuffer_drain(dest, evbuffer_get_length(dest));
+  }
+
+  printf("%-5s %lu x %lu bytes: %.1f bytes/resp on wire, %.2f us/resp, "
+         "%.2f allocs/resp (%.2f arena), %.3f body copies/resp "
+         "(%.1f bytes/resp)%s\n",
+         bc.name, n, (unsigned long)len,
+         (double)wire / n, elapsed * 1e6 / n,
+         (double)allocs / n, (double)arena_allocs / n,
+         (double)moves / n, (double)moved / n,
+         failures ? " [some responses failed]" : "");
+
+  delete scratch;
+  evbuffer_free(source);
+  delete conn;
+  free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *tracefile = "traces/server.out";
+  unsigned long n = 10000;
+  size_t want = 0;
+  bool cold = false;
+  int c;
+
+  argv0 = argv[0];
+
+  while ((c = getopt(argc, argv, "n:s:c")) != -1) {
+    switch (c) {
+    case 'n':
+      n = strtoul(optarg, 0, 10);
+      break;
+    case 's':
+      want = strtoul(optarg, 0, 10);
+      break;
+    case 'c':
+      cold = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind < argc)
+    tracefile = argv[optind++];
+  if (optind < argc || n == 0)
+    usage();
+
+  log_set_method(LOG_METHOD_NULL, 0);
+  init_crypto();
+  bench_count_allocs = true;
+
+  struct event_base *base = event_base_new();
+  if (!base) {
+    fprintf(stderr, "%s: failed to initialize libevent\n", argv0);
+    return 1;
+  }
+
+  // Same setup as the server side of the http steg module.
+  payloads *pl = new payloads;
+  if (load_payloads(*pl, tracefile)) {
+    fprintf(stderr, "%s: cannot read %s\n", argv0, tracefile);
+    return 1;
+  }
+  init_JS_payload_pool(*pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE,
+                       JS_MIN_AVAIL_SIZE);
+  init_HTML_payload_pool(*pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE,
+                         HTML_MIN_AVAIL_SIZE);
+  init_PDF_payload_pool(*pl, HTTP_TEMPLATE_MAX_SIZE, TYPE_HTTP_RESPONSE,
+                        PDF_MIN_AVAIL_SIZE);
+  init_SWF_payload_pool(*pl, HTTP_TEMPLATE_MAX_SIZE, TYPE_HTTP_RESPONSE,
+                        SWF_MIN_AVAIL_SIZE);
+
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++)
+    run_case(cases[i], *pl, base, n, want, cold);
+
+  free_payloads(*pl);
+  delete pl;
+  event_base_free(base);
+  free_crypto();
+  return 0;
+}
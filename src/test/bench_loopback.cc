@@ -0,0 +1,613 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Loopback benchmark for the whole client/server stack.  For each
+   steg module named on the command line, runs a chop client and a
+   chop server in one process, together with a stand-in for the
+   application on either end, and pushes two workloads across the
+   tunnel over 127.0.0.1:
+
+   bulk  - every stream uploads its share of a number of bytes, and
+           then downloads the same amount;
+   rr    - every stream makes requests of one size and waits for a
+           response of another, one at a time.
+
+   Results are written to standard output as JSON: throughput in
+   MB/s (10^6 bytes), chop blocks sent per second in both directions,
+   request latency percentiles, and CPU time per byte carried.  The
+   CPU time covers the whole process -- both ends of the tunnel and
+   the workload itself.  Each steg module is run in a child process
+   of its own, so that none of them sees another's leftover state. */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "listener.h"
+#include "protocol.h"
+#include "rng.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+using std::string;
+using std::vector;
+
+/* Senders keep between these many bytes queued on their sockets. */
+#define FILL_LOW  (64 * 1024)
+#define FILL_HIGH (256 * 1024)
+#define PATTERN_LEN (64 * 1024)
+
+namespace {
+  struct bench_opts
+  {
+    bool bulk;
+    bool rr;
+    size_t bulk_bytes;
+    unsigned long requests;
+    size_t request_size;
+    size_t response_size;
+    unsigned int streams;
+    unsigned int port;
+    unsigned int timeout;
+    bool encryption;
+  };
+
+  enum phase_t { PH_IDLE, PH_WARMUP, PH_UPLOAD, PH_DOWNLOAD, PH_RR };
+
+  struct bench;
+
+  /* One end of an application connection: a client stream, or the
+     application server's side of one. */
+  struct endpoint
+  {
+    bench *b;
+    struct bufferevent *bev;
+    bool client;
+    size_t to_send;
+    size_t partial;          // bytes of the current request or response
+    unsigned long requests_left;
+    double sent_at;
+  };
+
+  struct phase_result
+  {
+    double seconds;
+    uint64_t bytes;
+    uint64_t blocks;
+    double cpu_seconds;
+  };
+
+  struct bench
+  {
+    const bench_opts *opts;
+    struct event_base *base;
+    config_t *client_cfg;
+    config_t *server_cfg;
+    struct evconnlistener *app_server;
+    vector<endpoint *> streams;
+    vector<endpoint *> sinks;
+    vector<double> latencies;
+
+    phase_t phase;
+    bool done;
+    const char *error;
+    uint64_t up_received;
+    uint64_t down_received;
+    unsigned int streams_finished;
+  };
+}
+
+static const char *argv0;
+static uint8_t *pattern;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options] [steg...]\n"
+          "  -w bulk|rr|both  workloads to run (default both)\n"
+          "  -b bytes         bulk bytes in each direction (default 16M)\n"
+          "  -n requests      request/response exchanges (default 200)\n"
+          "  -q bytes         request size (default 500)\n"
+          "  -s bytes         response size (default 10000)\n"
+          "  -c streams       concurrent streams (default 1)\n"
+          "  -p port          first loopback port to use (default 5800)\n"
+          "  -t seconds       give up on a workload after this long "
+          "(default 120)\n"
+          "  -x               disable chop's encryption\n"
+          "  steg modules default to nosteg (nosteg_rr leaves every\n"
+          "  connection open, and a circuit can have only 64, so it\n"
+          "  manages a few dozen exchanges, with -w rr -n 30 or so)\n",
+          argv0);
+  exit(1);
+}
+
+static double
+cpu_seconds(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static uint64_t
+blocks_sent(const bench *b)
+{
+  return b->client_cfg->blocks_sent + b->server_cfg->blocks_sent;
+}
+
+static void
+finish_phase(bench *b, const char *error)
+{
+  if (b->done)
+    return;
+  b->done = true;
+  b->error = error;
+  event_base_loopbreak(b->base);
+}
+
+static void
+fill(endpoint *e)
+{
+  struct evbuffer *out = bufferevent_get_output(e->bev);
+  while (e->to_send > 0 && evbuffer_get_length(out) < FILL_HIGH) {
+    size_t n = std::min(e->to_send, (size_t)PATTERN_LEN);
+    evbuffer_add_reference(out, pattern, n, 0, 0);
+    e->to_send -= n;
+  }
+}
+
+static void
+send_request(endpoint *e)
+{
+  e->sent_at = bench_now();
+  e->to_send += e->b->opts->request_size;
+  fill(e);
+}
+
+static void
+client_read(endpoint *e, size_t n)
+{
+  bench *b = e->b;
+  b->down_received += n;
+
+  if (b->phase == PH_DOWNLOAD) {
+    if (b->down_received == b->opts->bulk_bytes)
+      finish_phase(b, 0);
+    return;
+  }
+
+  e->partial += n;
+  while (e->partial >= b->opts->response_size) {
+    e->partial -= b->opts->response_size;
+    if (b->phase == PH_RR)
+      b->latencies.push_back(bench_now() - e->sent_at);
+    if (--e->requests_left > 0) {
+      send_request(e);
+    } else if (++b->streams_finished == b->streams.size()) {
+      finish_phase(b, 0);
+      return;
+    }
+  }
+}
+
+static void
+server_read(endpoint *e, size_t n)
+{
+  bench *b = e->b;
+  b->up_received += n;
+
+  if (b->phase == PH_UPLOAD) {
+    if (b->up_received == b->opts->bulk_bytes)
+      finish_phase(b, 0);
+    return;
+  }
+
+  e->partial += n;
+  while (e->partial >= b->opts->request_size) {
+    e->partial -= b->opts->request_size;
+    e->to_send += b->opts->response_size;
+  }
+  fill(e);
+}
+
+static void
+read_cb(struct bufferevent *bev, void *arg)
+{
+  endpoint *e = (endpoint *)arg;
+  struct evbuffer *in = bufferevent_get_input(bev);
+  size_t n = evbuffer_get_length(in);
+  evbuffer_drain(in, n);
+  if (e->client)
+    client_read(e, n);
+  else
+    server_read(e, n);
+}
+
+static void
+write_cb(struct bufferevent *, void *arg)
+{
+  fill((endpoint *)arg);
+}
+
+static void
+event_cb(struct bufferevent *, short what, void *arg)
+{
+  endpoint *e = (endpoint *)arg;
+  if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+    finish_phase(e->b, e->client
+                 ? "client stream closed early"
+                 : "application server connection closed early");
+}
+
+static endpoint *
+new_endpoint(bench *b, struct bufferevent *bev, bool client)
+{
+  endpoint *e = new endpoint;
+  e->b = b;
+  e->bev = bev;
+  e->client = client;
+  bufferevent_setcb(bev, read_cb, write_cb, event_cb, e);
+  bufferevent_setwatermark(bev, EV_WRITE, FILL_LOW, 0);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  return e;
+}
+
+static void
+app_accept_cb(struct evconnlistener *, evutil_socket_t fd,
+              struct sockaddr *, int, void *arg)
+{
+  bench *b = (bench *)arg;
+  struct bufferevent *bev =
+    bufferevent_socket_new(b->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    evutil_closesocket(fd);
+    finish_phase(b, "failed to accept application connection");
+    return;
+  }
+  b->sinks.push_back(new_endpoint(b, bev, false));
+}
+
+static void
+timeout_cb(evutil_socket_t, short, void *arg)
+{
+  finish_phase((bench *)arg, "timed out");
+}
+
+/* Run the event loop until the current phase is over, and measure
+   it.  Returns false on failure. */
+static bool
+run_phase(bench *b, phase_t phase, uint64_t bytes, double t0,
+          phase_result *res)
+{
+  struct event *timer = evtimer_new(b->base, timeout_cb, b);
+  struct timeval tv = { (time_t)b->opts->timeout, 0 };
+  double c0 = cpu_seconds();
+  uint64_t k0 = blocks_sent(b);
+
+  b->phase = phase;
+  b->done = false;
+  b->error = 0;
+  evtimer_add(timer, &tv);
+  while (!b->done)
+    event_base_loop(b->base, EVLOOP_ONCE);
+  event_free(timer);
+
+  res->seconds = bench_now() - t0;
+  res->bytes = bytes;
+  res->blocks = blocks_sent(b) - k0;
+  res->cpu_seconds = cpu_seconds() - c0;
+  return !b->error;
+}
+
+static void
+start_requests(bench *b, unsigned long total)
+{
+  unsigned int n = b->streams.size();
+  b->streams_finished = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    endpoint *e = b->streams[i];
+    e->requests_left = total / n + (i < total % n ? 1 : 0);
+    if (e->requests_left)
+      send_request(e);
+    else
+      b->streams_finished++;
+  }
+}
+
+static void
+json_phase(string &out, const char *name, const phase_result &r)
+{
+  bench_json_add(out, ", \"%s\": {\"seconds\": %.4f, \"bytes\": %lu, "
+                 "\"mb_per_s\": %.3f, \"blocks\": %lu, "
+                 "\"blocks_per_s\": %.1f, \"cpu_ns_per_byte\": %.2f",
+                 name, r.seconds,
+                 (unsigned long)r.bytes, r.bytes / r.seconds / 1e6,
+                 (unsigned long)r.blocks, r.blocks / r.seconds,
+                 r.bytes ? r.cpu_seconds * 1e9 / r.bytes : 0.0);
+}
+
+static double
+percentile(const vector<double> &sorted, double q)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = (size_t)(q * sorted.size());
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static config_t *
+make_config(const char *mode, const bench_opts &o, unsigned int up,
+            unsigned int down, const char *steg)
+{
+  char upa[32], downa[32];
+  const char *argv[8];
+  int n = 0;
+
+  xsnprintf(upa, sizeof upa, "127.0.0.1:%u", up);
+  xsnprintf(downa, sizeof downa, "127.0.0.1:%u", down);
+  argv[n++] = "chop";
+  argv[n++] = mode;
+  if (!o.encryption)
+    argv[n++] = "--disable-encryption";
+  argv[n++] = upa;
+  argv[n++] = downa;
+  argv[n++] = steg;
+  argv[n] = 0;
+  return config_create(n, argv);
+}
+
+/* Benchmark STEG, the INDEXth module to be run, with the options at
+   ARG, and return its results as a JSON object. */
+static string
+run_steg(const char *steg, size_t index, void *arg)
+{
+  const bench_opts &o = *(const bench_opts *)arg;
+  unsigned int port = o.port + 4 * index;
+  string out;
+  bench b;
+  phase_result up, down, rr;
+  struct sockaddr_in sin;
+
+  memset(&up, 0, sizeof up);
+  memset(&down, 0, sizeof down);
+  memset(&rr, 0, sizeof rr);
+  b.opts = &o;
+  b.phase = PH_IDLE;
+  b.done = false;
+  b.error = 0;
+  b.up_received = 0;
+  b.down_received = 0;
+  b.streams_finished = 0;
+
+  bench_json_add(out, "{\"steg\": \"%s\"", steg);
+
+  b.base = event_base_new();
+  if (!b.base || event_base_priority_init(b.base, 2)) {
+    bench_json_add(out, ", \"error\": \"failed to initialize libevent\"}");
+    return out;
+  }
+  conn_global_init(b.base);
+
+  // application server <- chop server <- chop client <- streams
+  b.server_cfg = make_config("server", o, port + 1, port + 2, steg);
+  b.client_cfg = make_config("client", o, port, port + 2, steg);
+  if (!b.server_cfg || !b.client_cfg ||
+      !listener_open(b.base, b.server_cfg) ||
+      !listener_open(b.base, b.client_cfg)) {
+    bench_json_add(out, ", \"error\": \"failed to set up the tunnel\"}");
+    return out;
+  }
+
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(port + 1);
+  b.app_server = evconnlistener_new_bind(b.base, app_accept_cb, &b,
+                                         LEV_OPT_CLOSE_ON_FREE|
+                                         LEV_OPT_REUSEABLE, -1,
+                                         (struct sockaddr *)&sin, sizeof sin);
+  if (!b.app_server) {
+    bench_json_add(out, ", \"error\": \"failed to open application server\"}");
+    return out;
+  }
+
+  sin.sin_port = htons(port);
+  for (unsigned int i = 0; i < o.streams; i++) {
+    struct bufferevent *bev =
+      bufferevent_socket_new(b.base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev || bufferevent_socket_connect(bev, (struct sockaddr *)&sin,
+                                           sizeof sin)) {
+      bench_json_add(out, ", \"error\": \"failed to connect to the tunnel\"}");
+      return out;
+    }
+    b.streams.push_back(new_endpoint(&b, bev, true));
+  }
+
+  // One exchange per stream sets up the circuits before anything is
+  // measured.
+  {
+    phase_result warm;
+    bench_opts wo = o;
+    wo.request_size = 1;
+    wo.response_size = 1;
+    b.opts = &wo;
+    start_requests(&b, o.streams);
+    bool ok = run_phase(&b, PH_WARMUP, 0, bench_now(), &warm);
+    b.opts = &o;
+    if (!ok) {
+      bench_json_add(out, ", \"error\": \"setup: %s\"}", b.error);
+      return out;
+    }
+  }
+  b.up_received = b.down_received = 0;
+
+  if (o.bulk) {
+    double t0 = bench_now();
+    for (unsigned int i = 0; i < o.streams; i++) {
+      endpoint *e = b.streams[i];
+      e->to_send = o.bulk_bytes / o.streams
+        + (i < o.bulk_bytes % o.streams ? 1 : 0);
+      fill(e);
+    }
+    if (!run_phase(&b, PH_UPLOAD, o.bulk_bytes, t0, &up)) {
+      bench_json_add(out, ", \"error\": \"upload: %s\"}", b.error);
+      return out;
+    }
+
+    // and the application server sends as much back
+    t0 = bench_now();
+    size_t ns = b.sinks.size();
+    for (size_t i = 0; i < ns; i++) {
+      endpoint *e = b.sinks[i];
+      e->to_send = o.bulk_bytes / ns + (i < o.bulk_bytes % ns ? 1 : 0);
+      fill(e);
+    }
+    if (!run_phase(&b, PH_DOWNLOAD, o.bulk_bytes, t0, &down)) {
+      bench_json_add(out, ", \"error\": \"download: %s\"}", b.error);
+      return out;
+    }
+    json_phase(out, "upload", up);
+    out += "}";
+    json_phase(out, "download", down);
+    out += "}";
+  }
+
+  if (o.rr) {
+    for (size_t i = 0; i < b.streams.size(); i++)
+      b.streams[i]->partial = 0;
+    for (size_t i = 0; i < b.sinks.size(); i++)
+      b.sinks[i]->partial = 0;
+    b.latencies.clear();
+    b.latencies.reserve(o.requests);
+
+    double t0 = bench_now();
+    start_requests(&b, o.requests);
+    if (!run_phase(&b, PH_RR, o.requests * (o.request_size + o.response_size),
+                   t0, &rr)) {
+      bench_json_add(out, ", \"error\": \"rr: %s\"}", b.error);
+      return out;
+    }
+
+    std::sort(b.latencies.begin(), b.latencies.end());
+    json_phase(out, "rr", rr);
+    bench_json_add(out, ", \"requests\": %lu, \"requests_per_s\": %.1f, "
+                   "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+                   o.requests, o.requests / rr.seconds,
+                   percentile(b.latencies, 0.5) * 1e3,
+                   percentile(b.latencies, 0.99) * 1e3,
+                   b.latencies.empty() ? 0.0 : b.latencies.back() * 1e3);
+  }
+
+  out += "}";
+  return out;
+}
+
+int
+main(int argc, char **argv)
+{
+  bench_opts o;
+  size_t v;
+  int c;
+
+  argv0 = argv[0];
+  o.bulk = o.rr = true;
+  o.bulk_bytes = 16 << 20;
+  o.requests = 200;
+  o.request_size = 500;
+  o.response_size = 10000;
+  o.streams = 1;
+  o.port = 5800;
+  o.timeout = 120;
+  o.encryption = true;
+
+  while ((c = getopt(argc, argv, "w:b:n:q:s:c:p:t:x")) != -1) {
+    switch (c) {
+    case 'w':
+      o.bulk = !strcmp(optarg, "bulk") || !strcmp(optarg, "both");
+      o.rr = !strcmp(optarg, "rr") || !strcmp(optarg, "both");
+      if (!o.bulk && !o.rr)
+        usage();
+      break;
+    case 'b':
+      if (!bench_parse_size(optarg, &o.bulk_bytes) || !o.bulk_bytes)
+        usage();
+      break;
+    case 'n':
+      if (!bench_parse_size(optarg, &v) || !v)
+        usage();
+      o.requests = v;
+      break;
+    case 'q':
+      if (!bench_parse_size(optarg, &o.request_size) || !o.request_size)
+        usage();
+      break;
+    case 's':
+      if (!bench_parse_size(optarg, &o.response_size) || !o.response_size)
+        usage();
+      break;
+    case 'c':
+      if (!bench_parse_size(optarg, &v) || !v || v > 1000)
+        usage();
+      o.streams = v;
+      break;
+    case 'p':
+      if (!bench_parse_size(optarg, &v) || v < 1024 || v > 65000)
+        usage();
+      o.port = v;
+      break;
+    case 't':
+      if (!bench_parse_size(optarg, &v) || !v)
+        usage();
+      o.timeout = v;
+      break;
+    case 'x':
+      o.encryption = false;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  vector<const char *> stegs(argv + optind, argv + argc);
+  if (stegs.empty())
+    stegs.push_back("nosteg");
+
+  log_set_method(LOG_METHOD_STDERR, 0);
+  log_set_min_severity("warn");
+#ifdef SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  init_crypto();
+  pattern = (uint8_t *)xmalloc(PATTERN_LEN);
+  rng_bytes(pattern, PATTERN_LEN);
+
+  printf("{\"bulk_bytes\": %lu, \"requests\": %lu, \"request_size\": %lu, "
+         "\"response_size\": %lu, \"streams\": %u, \"encryption\": %s,\n"
+         " \"results\": [",
+         o.bulk ? (unsigned long)o.bulk_bytes : 0ul, o.rr ? o.requests : 0ul,
+         (unsigned long)o.request_size, (unsigned long)o.response_size,
+         o.streams, o.encryption ? "true" : "false");
+  fflush(stdout);
+
+  if (!bench_each_steg(stegs, run_steg, &o))
+    return 1;
+  printf("]}\n");
+
+  free(pattern);
+  free_crypto();
+  return 0;
+}
@@ -0,0 +1,317 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Replay benchmark for the chop receive path.  Reads capture files
+   written by a chop configured with --capture=DIR (one per downstream
+   connection; see chop.cc for the format) and feeds each one back
+   through the steg module's receive(), block decryption, reassembly
+   and process_queue(), exactly as the connection received it, but
+   with no sockets and no waiting.  Only the time spent in recv() and
+   recv_eof() is counted.
+
+   Client-side captures are replayed on a circuit created up front;
+   server-side captures create theirs from the handshake, as they
+   would live, but with no upstream connection (see config_t::replay);
+   their times therefore include deriving the circuit's
+   keys.  Transmissions are replayed where the capture recorded
+   them, so that steg modules which pair requests with responses stay
+   in step, and what they write is thrown away.
+
+   Results are written to standard output as JSON, one object per
+   capture: bytes and blocks received per round, bytes delivered
+   upstream per round, and decode throughput in MB/s (10^6 bytes)
+   and blocks per second over all rounds.  Steg modules that need
+   traces (http, embed) read them from traces/ as usual. */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "protocol.h"
+
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+using std::string;
+using std::vector;
+
+namespace {
+  struct record
+  {
+    char type;
+    size_t off;
+    size_t len;
+  };
+
+  struct capture
+  {
+    string mode;
+    string steg;
+    bool encryption;
+    string data;
+    vector<record> records;
+  };
+
+  struct replay_result
+  {
+    double seconds;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t delivered;
+    unsigned long errors;
+  };
+}
+
+static const char *argv0;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options] capture...\n"
+          "  -r rounds        replay each capture this many times "
+          "(default 10)\n"
+          "  -v               log chop's warnings\n",
+          argv0);
+  exit(1);
+}
+
+/* Read a capture file into C.  Returns an error message, or 0. */
+static const char *
+load_capture(const char *path, capture &c)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return strerror(errno);
+
+  char line[256], mode[16], steg[64];
+  int version, encryption;
+  if (!fgets(line, sizeof line, f) ||
+      sscanf(line, "stegotorus-chop-capture %d %15s %63s %d",
+             &version, mode, steg, &encryption) != 4 ||
+      version != 1 ||
+      (strcmp(mode, "client") && strcmp(mode, "server"))) {
+    fclose(f);
+    return "not a chop capture file";
+  }
+  c.mode = mode;
+  c.steg = steg;
+  c.encryption = encryption != 0;
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+    c.data.append(buf, n);
+  bool err = ferror(f);
+  fclose(f);
+  if (err)
+    return "read error";
+
+  const uint8_t *p = (const uint8_t *)c.data.data();
+  size_t off = 0;
+  while (off < c.data.size()) {
+    if (c.data.size() - off < 5)
+      return "truncated record header";
+    record r;
+    r.type = p[off];
+    r.len = ((size_t)p[off+1] << 24) | ((size_t)p[off+2] << 16) |
+      ((size_t)p[off+3] << 8) | p[off+4];
+    r.off = off + 5;
+    if (r.type != 'R' && r.type != 'T' && r.type != 'E')
+      return "unknown record type";
+    if (c.data.size() - r.off < r.len)
+      return "truncated record";
+    c.records.push_back(r);
+    off = r.off + r.len;
+  }
+  return 0;
+}
+
+static config_t *
+make_config(struct event_base *base, const capture &c)
+{
+  const char *argv[8];
+  int n = 0;
+
+  // The addresses are never used.
+  argv[n++] = "chop";
+  argv[n++] = c.mode.c_str();
+  if (!c.encryption)
+    argv[n++] = "--disable-encryption";
+  argv[n++] = "127.0.0.1:1";
+  argv[n++] = "127.0.0.1:2";
+  argv[n++] = c.steg.c_str();
+  argv[n] = 0;
+
+  config_t *cfg = config_create(n, argv);
+  if (cfg) {
+    cfg->base = base;
+    cfg->replay = true;
+  }
+  return cfg;
+}
+
+/* Throw away whatever the connection has transmitted and the circuit
+   has delivered, counting the latter. */
+static void
+drain(conn_t *conn, replay_result &r)
+{
+  struct evbuffer *out = conn->outbound();
+  evbuffer_drain(out, evbuffer_get_length(out));
+
+  circuit_t *ckt = conn->circuit();
+  if (ckt && ckt->up_buffer) {
+    bench_unfreeze(ckt->up_buffer);
+    out = bufferevent_get_output(ckt->up_buffer);
+    r.delivered += evbuffer_get_length(out);
+    evbuffer_drain(out, evbuffer_get_length(out));
+  }
+}
+
+/* Replay C once, adding to R. */
+static void
+replay_once(struct event_base *base, const capture &c, replay_result &r)
+{
+  config_t *cfg = make_config(base, c);
+  if (!cfg) {
+    r.errors++;
+    return;
+  }
+
+  struct bufferevent *buf = bufferevent_socket_new(base, -1, 0);
+  conn_t *conn = conn_create(cfg, 0, buf, xstrdup("replay"));
+  // Nothing is ever written to a socket, but transmit_now() only
+  // transmits on connections that are open for writing.
+  bufferevent_enable(buf, EV_WRITE);
+  bench_unfreeze(buf);
+
+  if (cfg->mode != LSN_SIMPLE_SERVER) {
+    circuit_t *ckt = circuit_create(cfg, 0);
+    circuit_add_upstream(ckt, bufferevent_socket_new(base, -1, 0),
+                         xstrdup("replay"));
+    ckt->add_downstream(conn);
+  }
+
+  const char *data = c.data.data();
+  for (size_t i = 0; i < c.records.size(); i++) {
+    const record &rec = c.records[i];
+    int rv = 0;
+    double t0;
+
+    switch (rec.type) {
+    case 'R':
+      evbuffer_add(conn->inbound(), data + rec.off, rec.len);
+      t0 = bench_now();
+      rv = conn->recv();
+      r.seconds += bench_now() - t0;
+      r.bytes += rec.len;
+      break;
+    case 'E':
+      t0 = bench_now();
+      rv = conn->recv_eof();
+      r.seconds += bench_now() - t0;
+      break;
+    case 'T':
+      conn->transmit_now();
+      break;
+    }
+    drain(conn, r);
+    if (rv) {
+      r.errors++;
+      break;
+    }
+  }
+
+  r.blocks += cfg->blocks_received;
+  bench_close(conn, cfg);
+}
+
+static void
+run_capture(struct event_base *base, const char *path, unsigned int rounds)
+{
+  capture c;
+  const char *err = load_capture(path, c);
+  if (err) {
+    printf("{\"capture\": \"%s\", \"error\": \"%s\"}", path, err);
+    return;
+  }
+
+  replay_result r;
+  memset(&r, 0, sizeof r);
+  for (unsigned int i = 0; i < rounds; i++)
+    replay_once(base, c, r);
+
+  printf("{\"capture\": \"%s\", \"mode\": \"%s\", \"steg\": \"%s\", "
+         "\"records\": %lu, \"bytes\": %lu, \"blocks\": %lu, "
+         "\"delivered\": %lu, \"seconds\": %.4f, \"mb_per_s\": %.3f, "
+         "\"blocks_per_s\": %.1f, \"errors\": %lu}",
+         path, c.mode.c_str(), c.steg.c_str(),
+         (unsigned long)c.records.size(), (unsigned long)(r.bytes / rounds),
+         (unsigned long)(r.blocks / rounds),
+         (unsigned long)(r.delivered / rounds), r.seconds,
+         r.seconds > 0 ? r.bytes / r.seconds / 1e6 : 0.0,
+         r.seconds > 0 ? r.blocks / r.seconds : 0.0, r.errors);
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned int rounds = 10;
+  bool verbose = false;
+  int c;
+
+  argv0 = argv[0];
+  while ((c = getopt(argc, argv, "r:v")) != -1) {
+    switch (c) {
+    case 'r': {
+      char *end;
+      unsigned long v = strtoul(optarg, &end, 10);
+      if (*end || end == optarg || !v)
+        usage();
+      rounds = v;
+      break;
+    }
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind == argc)
+    usage();
+
+  // Closing a circuit mid-stream is expected here, and chop warns
+  // about it.
+  log_set_method(LOG_METHOD_STDERR, 0);
+  log_set_min_severity(verbose ? "warn" : "error");
+  init_crypto();
+
+  struct event_base *base = event_base_new();
+  if (!base || event_base_priority_init(base, 2)) {
+    fprintf(stderr, "%s: failed to initialize libevent\n", argv0);
+    return 1;
+  }
+  conn_global_init(base);
+
+  printf("{\"rounds\": %u,\n \"results\": [", rounds);
+  for (int i = optind; i < argc; i++) {
+    printf("%s\n  ", i > optind ? "," : "");
+    run_capture(base, argv[i], rounds);
+    fflush(stdout);
+  }
+  printf("]}\n");
+
+  conn_start_shutdown(0);
+  event_base_dispatch(base);
+  event_base_free(base);
+  free_crypto();
+  return 0;
+}
@@ -0,0 +1,460 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Goodput benchmark for the steg modules.  For each module (all of
+   supported_stegs, or those named on the command line), pairs a
+   client-side and a server-side steg_t over in-memory connections and
+   pushes random chop-sized blocks through transmit_room(), transmit()
+   and receive() in both directions, checking that every block comes
+   out as it went in.  When a pair of connections can carry no more
+   (the cover protocol has finished with them), a new pair is made.
+
+   Results are written to standard output as JSON, one object per
+   module, with the same keys every time:
+
+   covert_per_wire        bytes handed to transmit() per byte of
+                          cover traffic written, overall and for each
+                          direction ("up" is client to server)
+   cpu_ns_per_covert_byte CPU time spent inside the module's methods
+   messages_per_mb        cover messages (transmit() calls) per 10^6
+                          covert bytes
+   allocs_per_mb          heap allocations made inside the module's
+                          methods per 10^6 covert bytes (glibc only;
+                          -1 elsewhere)
+
+   Modules that pace their output (embed) are given real time to do
+   so; the waiting is not counted as CPU time.  Each module is run in
+   a child process of its own. */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "protocol.h"
+#include "steg.h"
+#include "protocol/chop_blk.h"
+
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+using std::string;
+using std::vector;
+using chop_blk::MIN_BLOCK_SIZE;
+using chop_blk::MAX_BLOCK_SIZE;
+using chop_blk::SECTION_LEN;
+
+/* Give up on a pair of connections after this long without either
+   side being able to transmit. */
+#define IDLE_LIMIT_MS 500
+
+namespace {
+  struct bench_opts
+  {
+    size_t bytes;
+    size_t max_data;
+    unsigned int timeout;
+    uint32_t seed;
+  };
+
+  struct endpoint
+  {
+    bench_conn *conn;
+    steg_t *steg;
+  };
+
+  struct direction
+  {
+    uint64_t covert;
+    uint64_t wire;
+    uint64_t messages;
+    struct evbuffer *expect;    // sent but not yet received
+  };
+
+  struct bench
+  {
+    const bench_opts *opts;
+    struct event_base *base;
+    config_t *client_cfg;
+    config_t *server_cfg;
+    endpoint client;
+    endpoint server;
+    direction up;
+    direction down;
+    struct evbuffer *received;
+    uint8_t *pool;
+    uint32_t rng;
+
+    double cpu;
+    unsigned int conns;
+    unsigned long errors;
+    const char *error;
+  };
+}
+
+static const char *argv0;
+
+static void ATTR_NORETURN
+usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options] [steg...]\n"
+          "  -b bytes         covert bytes to carry per module "
+          "(default 16M)\n"
+          "  -s bytes         largest data section in a block "
+          "(default 65535)\n"
+          "  -t seconds       give up on a module after this long "
+          "(default 60)\n"
+          "  -r seed          seed for block sizes (default 1)\n"
+          "  steg modules default to all of them\n",
+          argv0);
+  exit(1);
+}
+
+static double
+cpu_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t
+next_random(bench *b)
+{
+  // xorshift32: the block sizes only need to be varied and repeatable
+  b->rng ^= b->rng << 13;
+  b->rng ^= b->rng >> 17;
+  b->rng ^= b->rng << 5;
+  return b->rng;
+}
+
+/* Bracket calls into the steg module. */
+static double
+enter(void)
+{
+  bench_count_allocs = true;
+  return cpu_now();
+}
+
+static void
+leave(bench *b, double t0)
+{
+  bench_count_allocs = false;
+  b->cpu += cpu_now() - t0;
+}
+
+static void
+fail(bench *b, const char *what)
+{
+  if (!b->error)
+    b->error = what;
+  b->errors++;
+}
+
+static void
+close_pair(bench *b)
+{
+  delete b->client.steg;
+  delete b->server.steg;
+  delete b->client.conn;
+  delete b->server.conn;
+  b->client.steg = b->server.steg = 0;
+  b->client.conn = b->server.conn = 0;
+
+  // Anything in flight went with the connections.
+  evbuffer_drain(b->up.expect, evbuffer_get_length(b->up.expect));
+  evbuffer_drain(b->down.expect, evbuffer_get_length(b->down.expect));
+}
+
+static bool
+open_pair(bench *b)
+{
+  b->client.conn = new bench_conn(b->base);
+  b->server.conn = new bench_conn(b->base);
+  double t0 = enter();
+  b->client.steg =
+    const_cast<steg_config_t *>(b->client_cfg->get_steg(0))
+    ->steg_create(b->client.conn);
+  b->server.steg =
+    const_cast<steg_config_t *>(b->server_cfg->get_steg(0))
+    ->steg_create(b->server.conn);
+  leave(b, t0);
+  b->conns++;
+  return b->client.steg && b->server.steg;
+}
+
+/* Transmit one block from FROM to TO, if FROM's steg module will take
+   one, and check what comes out at the other end.  Returns true if a
+   block was sent. */
+static bool
+send_block(bench *b, endpoint &from, endpoint &to, direction &d)
+{
+  if (from.conn->ceased)
+    return false;
+
+  size_t lo = MIN_BLOCK_SIZE + 1;
+  size_t hi = MAX_BLOCK_SIZE;
+  size_t pref = lo + next_random(b) % b->opts->max_data;
+
+  double t0 = enter();
+  size_t room = from.steg->transmit_room(pref, lo, hi);
+  leave(b, t0);
+  if (room == 0)
+    return false;
+  if (room < lo || room >= hi) {
+    fail(b, "transmit_room out of range");
+    from.conn->ceased = true;
+    return false;
+  }
+
+  const uint8_t *data = b->pool + next_random(b) % MAX_BLOCK_SIZE;
+  struct evbuffer *block = evbuffer_new();
+  evbuffer_add(block, data, room);
+  evbuffer_add(d.expect, data, room);
+
+  t0 = enter();
+  int rv = from.steg->transmit(block);
+  leave(b, t0);
+  evbuffer_free(block);
+  from.conn->must_send = false;
+  if (rv) {
+    fail(b, "transmit failed");
+    from.conn->ceased = true;
+    return false;
+  }
+  d.covert += room;
+  d.messages++;
+
+  struct evbuffer *wire = from.conn->outbound();
+  d.wire += evbuffer_get_length(wire);
+  evbuffer_add_buffer(to.conn->inbound(), wire);
+
+  t0 = enter();
+  rv = to.steg->receive(b->received);
+  leave(b, t0);
+  if (rv) {
+    fail(b, "receive failed");
+    to.conn->ceased = from.conn->ceased = true;
+    return true;
+  }
+
+  size_t n = evbuffer_get_length(b->received);
+  if (n > evbuffer_get_length(d.expect) ||
+      memcmp(evbuffer_pullup(b->received, n),
+             evbuffer_pullup(d.expect, n), n)) {
+    fail(b, "received data does not match");
+    to.conn->ceased = from.conn->ceased = true;
+  }
+  evbuffer_drain(b->received, n);
+  evbuffer_drain(d.expect, n);
+  return true;
+}
+
+static void
+wake_cb(evutil_socket_t, short, void *)
+{
+}
+
+static config_t *
+make_config(const char *mode, const char *steg)
+{
+  const char *argv[] = {
+    "chop", mode, "127.0.0.1:1", "127.0.0.1:2", steg, 0
+  };
+  return config_create(5, argv);
+}
+
+static void
+json_direction(string &out, const char *name, const direction &d)
+{
+  bench_json_add(out, ", \"%s\": {\"covert_bytes\": %lu, \"wire_bytes\": %lu, "
+                 "\"covert_per_wire\": %.4f, \"messages\": %lu}", name,
+                 (unsigned long)d.covert, (unsigned long)d.wire,
+                 d.wire ? (double)d.covert / d.wire : 0.0,
+                 (unsigned long)d.messages);
+}
+
+/* Benchmark STEG with the options at ARG, and return its results as
+   a JSON object. */
+static string
+run_steg(const char *steg, size_t, void *arg)
+{
+  const bench_opts &o = *(const bench_opts *)arg;
+  string out;
+  bench b;
+
+  memset(&b, 0, sizeof b);
+  b.opts = &o;
+  b.rng = o.seed ? o.seed : 1;
+
+  bench_json_add(out, "{\"steg\": \"%s\"", steg);
+
+  b.base = event_base_new();
+  if (!b.base || event_base_priority_init(b.base, 2)) {
+    bench_json_add(out, ", \"error\": \"failed to initialize libevent\"}");
+    return out;
+  }
+  conn_global_init(b.base);
+
+  b.client_cfg = make_config("client", steg);
+  b.server_cfg = make_config("server", steg);
+  if (!b.client_cfg || !b.server_cfg) {
+    bench_json_add(out, ", \"error\": \"failed to configure the module\"}");
+    return out;
+  }
+  b.client_cfg->base = b.server_cfg->base = b.base;
+
+  b.up.expect = evbuffer_new();
+  b.down.expect = evbuffer_new();
+  b.received = evbuffer_new();
+  b.pool = (uint8_t *)xmalloc(2 * MAX_BLOCK_SIZE);
+  for (size_t i = 0; i < 2 * MAX_BLOCK_SIZE; i++)
+    b.pool[i] = next_random(&b) >> 24;
+
+  struct event *wake = evtimer_new(b.base, wake_cb, 0);
+  double start = bench_now();
+  double idle_since = 0;
+  bool timed_out = false;
+
+  if (!open_pair(&b))
+    fail(&b, "failed to create steg instances");
+
+  while (!b.errors && b.up.covert + b.down.covert < o.bytes) {
+    if (bench_now() - start > o.timeout) {
+      timed_out = true;
+      break;
+    }
+
+    // The client always has something to say; the server says
+    // something whenever the cover protocol lets it.
+    bool sent = send_block(&b, b.client, b.server, b.up);
+    sent = send_block(&b, b.server, b.client, b.down) || sent;
+    if (sent) {
+      idle_since = 0;
+      continue;
+    }
+
+    // Neither end could transmit.  If both are done, or nothing has
+    // happened for a while, move on to a fresh pair of connections;
+    // otherwise give timers (pacing, must-send) a chance to run.
+    if (!idle_since)
+      idle_since = bench_now();
+    if ((b.client.conn->ceased && b.server.conn->ceased) ||
+        bench_now() - idle_since > IDLE_LIMIT_MS / 1000.0) {
+      close_pair(&b);
+      if (!open_pair(&b)) {
+        fail(&b, "failed to create steg instances");
+        break;
+      }
+      idle_since = 0;
+      continue;
+    }
+    struct timeval tv = { 0, 10000 };
+    evtimer_add(wake, &tv);
+    event_base_loop(b.base, EVLOOP_ONCE);
+  }
+
+  double wall = bench_now() - start;
+  uint64_t covert = b.up.covert + b.down.covert;
+  uint64_t wire = b.up.wire + b.down.wire;
+  double mb = covert / 1e6;
+
+  bench_json_add(out, ", \"connections\": %u, \"covert_bytes\": %lu, "
+                 "\"wire_bytes\": %lu, \"covert_per_wire\": %.4f", b.conns,
+                 (unsigned long)covert, (unsigned long)wire,
+                 wire ? (double)covert / wire : 0.0);
+  json_direction(out, "up", b.up);
+  json_direction(out, "down", b.down);
+  bench_json_add(out, ", \"cpu_ns_per_covert_byte\": %.2f, "
+                 "\"messages_per_mb\": %.1f, \"allocs\": %ld, "
+                 "\"allocs_per_mb\": %.1f, \"seconds\": %.3f, \"errors\": %lu",
+                 covert ? b.cpu * 1e9 / covert : 0.0,
+                 mb > 0 ? (b.up.messages + b.down.messages) / mb : 0.0,
+                 BENCH_HAVE_ALLOC_COUNT ? (long)bench_allocs : -1L,
+                 BENCH_HAVE_ALLOC_COUNT && mb > 0 ? bench_allocs / mb : -1.0,
+                 wall, b.errors);
+  if (b.error)
+    bench_json_add(out, ", \"error\": \"%s\"", b.error);
+  else if (timed_out)
+    bench_json_add(out, ", \"error\": \"timed out\"");
+  out += "}";
+
+  close_pair(&b);
+  event_free(wake);
+  evbuffer_free(b.up.expect);
+  evbuffer_free(b.down.expect);
+  evbuffer_free(b.received);
+  free(b.pool);
+  delete b.client_cfg;
+  delete b.server_cfg;
+  return out;
+}
+
+int
+main(int argc, char **argv)
+{
+  bench_opts o;
+  size_t v;
+  int c;
+
+  argv0 = argv[0];
+  o.bytes = 16 << 20;
+  o.max_data = SECTION_LEN;
+  o.timeout = 60;
+  o.seed = 1;
+
+  while ((c = getopt(argc, argv, "b:s:t:r:")) != -1) {
+    switch (c) {
+    case 'b':
+      if (!bench_parse_size(optarg, &o.bytes) || !o.bytes)
+        usage();
+      break;
+    case 's':
+      if (!bench_parse_size(optarg, &o.max_data) || !o.max_data ||
+          o.max_data > SECTION_LEN)
+        usage();
+      break;
+    case 't':
+      if (!bench_parse_size(optarg, &v) || !v)
+        usage();
+      o.timeout = v;
+      break;
+    case 'r':
+      if (!bench_parse_size(optarg, &v))
+        usage();
+      o.seed = v;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  vector<const char *> stegs(argv + optind, argv + argc);
+  if (stegs.empty())
+    for (const steg_module *const *s = supported_stegs; *s; s++)
+      stegs.push_back((*s)->name);
+
+  log_set_method(LOG_METHOD_STDERR, 0);
+  log_set_min_severity("warn");
+  init_crypto();
+
+  printf("{\"bytes\": %lu, \"max_data\": %lu, \"seed\": %lu,\n"
+         " \"results\": [", (unsigned long)o.bytes,
+         (unsigned long)o.max_data, (unsigned long)o.seed);
+  fflush(stdout);
+
+  if (!bench_each_steg(stegs, run_steg, &o))
+    return 1;
+  printf("]}\n");
+
+  free_crypto();
+  return 0;
+}
@@ -0,0 +1,145 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "bench_util.h"
+#include "connections.h"
+#include "protocol.h"
+
+#include <algorithm>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <event2/event.h>
+
+using std::string;
+using std::vector;
+
+bool bench_count_allocs;
+uint64_t bench_allocs;
+
+/* On glibc, malloc and friends can be replaced by the program; count
+   the calls, and pass them on to the real allocator. */
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+
+extern "C" void *
+malloc(size_t n) __THROW
+{
+  if (bench_count_allocs)
+    bench_allocs++;
+  return __libc_malloc(n);
+}
+
+extern "C" void *
+calloc(size_t n, size_t m) __THROW
+{
+  if (bench_count_allocs)
+    bench_allocs++;
+  return __libc_calloc(n, m);
+}
+
+extern "C" void *
+realloc(void *p, size_t n) __THROW
+{
+  if (bench_count_allocs)
+    bench_allocs++;
+  return __libc_realloc(p, n);
+}
+#endif
+
+double
+bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void
+bench_close(conn_t *conn, config_t *cfg)
+{
+  if (conn->circuit())
+    conn->circuit()->close();
+  conn->close();
+  event_base_loop(cfg->base, EVLOOP_NONBLOCK);
+  delete cfg;
+}
+
+void
+bench_json_add(string &out, const char *fmt, ...)
+{
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof buf, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    out.append(buf, std::min((size_t)n, sizeof buf - 1));
+}
+
+bool
+bench_parse_size(const char *s, size_t *out)
+{
+  char *end;
+  unsigned long long v = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+  if (*end || end == s)
+    return false;
+  *out = v;
+  return true;
+}
+
+bool
+bench_each_steg(const vector<const char *> &stegs,
+                string (*run)(const char *, size_t, void *), void *arg)
+{
+  // Each child writes its result to us through a pipe.
+  for (size_t i = 0; i < stegs.size(); i++) {
+    int fds[2];
+    if (pipe(fds)) {
+      perror("pipe");
+      return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      return false;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      string r = run(stegs[i], i, arg);
+      if (write(fds[1], r.data(), r.size()) != (ssize_t)r.size())
+        _exit(1);
+      _exit(0);
+    }
+
+    close(fds[1]);
+    string r;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof buf)) > 0)
+      r.append(buf, n);
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (r.empty()) {
+      r = "{\"steg\": \"";
+      r += stegs[i];
+      r += "\", \"error\": \"benchmark process failed\"}";
+    }
+    printf("%s\n  %s", i ? "," : "", r.c_str());
+    fflush(stdout);
+  }
+  return true;
+}
@@ -0,0 +1,107 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+/* Pieces shared by the benchmark programs.  These are run from the
+   top of the source tree; steg modules that need traces (http,
+   embed) read them from traces/ as usual. */
+
+#include "connections.h"
+
+#include <string>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+struct config_t;
+
+/** Seconds by the monotonic clock, from an arbitrary starting point. */
+double bench_now(void);
+
+/** Socket bufferevents only let libevent fill their input and empty
+    their output.  A benchmark that moves data in and out of BEV's
+    buffers itself is standing in for libevent; this lets it. */
+inline void
+bench_unfreeze(struct bufferevent *bev)
+{
+  evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+  evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+}
+
+/** Close CONN, and its circuit if it has one, and then delete CFG,
+    which they were made from.  The closes are finished off by
+    deferred callbacks that still refer to CFG, so this runs CFG's
+    event loop once to let them happen first. */
+void bench_close(conn_t *conn, config_t *cfg);
+
+/** Append what printf would make of FMT and the rest to OUT, up to
+    255 bytes of it. */
+void bench_json_add(std::string &out, const char *fmt, ...) ATTR_PRINTF_2;
+
+/** Parse S as a count of bytes, optionally followed by k, M or G
+    (powers of 1024), into *OUT.  Returns false if it is not one. */
+bool bench_parse_size(const char *s, size_t *out);
+
+/** Call RUN(STEGS[i], i, ARG) for each module named in STEGS, each in
+    a child process of its own, so that none of them sees another's
+    leftover state, and print what it returns (a JSON object) as the
+    next element of an array on standard output; the caller prints
+    the brackets.  A child that returns nothing is reported as an
+    object with an "error" key.  Returns false if a child could not
+    be started. */
+bool bench_each_steg(const std::vector<const char *> &stegs,
+                     std::string (*run)(const char *, size_t, void *),
+                     void *arg);
+
+/** Heap allocations (calls to malloc, calloc and realloc) made while
+    bench_count_allocs is set.  Counting needs glibc, whose allocator
+    can be replaced; elsewhere BENCH_HAVE_ALLOC_COUNT is 0 and the
+    count stays at zero. */
+extern bool bench_count_allocs;
+extern uint64_t bench_allocs;
+
+#ifdef __GLIBC__
+#define BENCH_HAVE_ALLOC_COUNT 1
+#else
+#define BENCH_HAVE_ALLOC_COUNT 0
+#endif
+
+/** A connection that goes nowhere, for driving a steg module (or
+    anything else that wants a conn_t) directly: the caller moves data
+    in and out of its buffers, and can see what was asked of it.  It
+    is defined entirely here so that unit tests can use it too. */
+struct bench_conn : conn_t
+{
+  bool ceased;                // cease_transmission has been called
+  bool must_send;             // transmit_soon or transmit_now has been
+                              // called since the caller last cleared it
+
+  bench_conn() : ceased(false), must_send(false) {}
+  explicit bench_conn(struct event_base *base)
+    : ceased(false), must_send(false)
+  { attach(base); }
+
+  /** Give the connection its (socketless) buffers, if it was made
+      without them. */
+  void attach(struct event_base *base)
+  {
+    buffer = bufferevent_socket_new(base, -1, 0);
+    peername = xstrdup("127.0.0.1:80");
+    bench_unfreeze(buffer);
+  }
+
+  int maybe_open_upstream() { return 0; }
+  int handshake() { return 0; }
+  int recv() { return 0; }
+  int recv_eof() { return 0; }
+  void expect_close() {}
+  void cease_transmission() { ceased = true; }
+  void transmit_soon(unsigned long) { must_send = true; }
+  void transmit_now() { must_send = true; }
+};
+
+#endif
@@ -124,12 +124,15 @@ class Stegotorus(subprocess.Popen):
         return report
 
 # As above, but for the 'tltester' test helper rather than for
-# stegotorus itself.
+# stegotorus itself.  In load-generation mode (-m in extra_args)
+# there is no timeline; pass None.
 class Tltester(subprocess.Popen):
     def __init__(self, timeline, extra_args=(), **kwargs):
         argv = ["./tltester"]
         argv.extend(extra_args)
 
+        if timeline is None:
+            timeline = os.devnull
         subprocess.Popen.__init__(self, argv,
                                   stdin=open(timeline, "rU"),
                                   stdout=subprocess.PIPE,
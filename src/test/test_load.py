@@ -0,0 +1,60 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Integration tests for stegotorus - load tests.
+#
+# These tests use the load-generation mode of the 'tltester' utility
+# to push traffic through several connections at once, and check that
+# all of it arrives intact.  The throughput and latency report is
+# printed for information; it is not checked.
+
+import json
+
+from unittest import TestCase
+from itestlib import Stegotorus, Tltester
+
+class LoadTest(TestCase):
+
+    def doTest(self, label, st_args, load_args):
+        st = Stegotorus(st_args)
+        tester = Tltester(None, load_args +
+                          ("127.0.0.1:4999", "127.0.0.1:5001"))
+        errors = ""
+        try:
+            report = json.loads(tester.check_completion(label + " tester"))
+            print "\n%s: %s" % (label, json.dumps(report, sort_keys=True))
+            if report["errors"] != 0:
+                errors += "%s: %d errors\n" % (label, report["errors"])
+
+        except AssertionError, e:
+            errors += e.message
+        except Exception, e:
+            errors += repr(e)
+
+        errors += st.check_completion(label + " proxy", errors != "")
+
+        if errors != "":
+            self.fail("\n" + errors)
+
+    chop_nosteg = ("chop", "server", "127.0.0.1:5001",
+                   "127.0.0.1:5010", "nosteg",
+                   "chop", "client", "127.0.0.1:4999",
+                   "127.0.0.1:5010", "nosteg")
+
+    def test_null_bulk(self):
+        self.doTest("null bulk",
+           ("null", "server", "127.0.0.1:5000", "127.0.0.1:5001",
+            "null", "client", "127.0.0.1:4999", "127.0.0.1:5000"),
+           ("-m", "bulk", "-c", "8", "-b", "1M", "-t", "4"))
+
+    def test_chop_nosteg_bulk(self):
+        self.doTest("chop nosteg bulk", self.chop_nosteg,
+           ("-m", "bulk", "-c", "8", "-b", "256K", "-t", "4"))
+
+    def test_chop_nosteg_echo(self):
+        self.doTest("chop nosteg echo", self.chop_nosteg,
+           ("-m", "echo", "-c", "8", "-n", "20", "-s", "100", "-t", "4"))
+
+if __name__ == '__main__':
+    from unittest import main
+    main()
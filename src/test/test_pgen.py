@@ -0,0 +1,139 @@
+# Copyright 2012 SRI International
+# See LICENSE for other credits and copying information
+
+# Integration tests for stegotorus - trace generation.
+#
+# These tests write a small packet capture, run 'pgen_pcap' over it,
+# and check which HTTP messages make it into the traces.  pgen_pcap
+# is only built when libpcap is available; without it they are
+# skipped.
+
+import os
+import shutil
+import struct
+import subprocess
+import tempfile
+
+from unittest import TestCase
+
+# TCP flags.
+FIN = 0x01
+SYN = 0x02
+RST = 0x04
+PSH = 0x08
+ACK = 0x10
+
+# One Ethernet frame carrying an IPv4 TCP segment.  Checksums are
+# left at zero; pgen_pcap does not look at them.
+def packet(src, dst, sport, dport, seq, ack, flags, data=""):
+    tcp = struct.pack("!HHIIBBHHH", sport, dport, seq, ack,
+                      5 << 4, flags, 65535, 0, 0)
+    ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 40 + len(data),
+                     0, 0, 64, 6, 0, src, dst)
+    return "\0" * 12 + "\x08\x00" + ip + tcp + data
+
+def write_pcap(fname, packets):
+    f = open(fname, "wb")
+    f.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+    for i, p in enumerate(packets):
+        f.write(struct.pack("<IIII", i, 0, len(p), len(p)))
+        f.write(p)
+    f.close()
+
+def request(n):
+    return "GET /%d HTTP/1.1\r\nHost: example.com\r\n\r\n" % n
+
+def response(n):
+    body = "response body number %d\n" % n
+    return ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\n\r\n%s" % (len(body), body))
+
+# One HTTP exchange on its own client port.  'ending' says how the
+# connection finishes after the client has sent its request:
+#   "ack":     the server responds, the client acknowledges the
+#              response, and both sides send FIN;
+#   "fin":     the client sends FIN, and the server responds with the
+#              response and its own FIN in a single segment;
+#   "rst":     the server responds, then resets the connection.
+def exchange(n, ending):
+    cli, srv = "\x0a\x00\x00\x01", "\xc0\xa8\x01\x01"
+    cport, sport = 10000 + n, 80
+    cs, ss = 1000, 5000
+    req, resp = request(n), response(n)
+
+    pkts = [packet(cli, srv, cport, sport, cs, 0, SYN),
+            packet(srv, cli, sport, cport, ss, cs + 1, SYN|ACK)]
+    cs += 1
+    ss += 1
+    pkts.append(packet(cli, srv, cport, sport, cs, ss, PSH|ACK, req))
+    cs += len(req)
+
+    if ending == "ack":
+        pkts.append(packet(srv, cli, sport, cport, ss, cs, PSH|ACK, resp))
+        ss += len(resp)
+        pkts.append(packet(cli, srv, cport, sport, cs, ss, ACK))
+        pkts.append(packet(cli, srv, cport, sport, cs, ss, FIN|ACK))
+        pkts.append(packet(srv, cli, sport, cport, ss, cs + 1, FIN|ACK))
+    elif ending == "fin":
+        pkts.append(packet(cli, srv, cport, sport, cs, ss, FIN|ACK))
+        pkts.append(packet(srv, cli, sport, cport, ss, cs + 1,
+                           PSH|FIN|ACK, resp))
+    elif ending == "rst":
+        pkts.append(packet(srv, cli, sport, cport, ss, cs, PSH|ACK, resp))
+        ss += len(resp)
+        pkts.append(packet(srv, cli, sport, cport, ss, cs, RST|ACK))
+    return pkts
+
+class PgenPcapTest(TestCase):
+
+    def setUp(self):
+        self.pgen = os.path.abspath("pgen_pcap")
+        if not os.path.exists(self.pgen):
+            self.skipTest("pgen_pcap was not built")
+        self.dir = tempfile.mkdtemp(prefix="st-pgen-")
+        os.mkdir(os.path.join(self.dir, "traces"))
+
+    def tearDown(self):
+        if hasattr(self, "dir"):
+            shutil.rmtree(self.dir)
+
+    def runPgen(self, packets):
+        capfile = os.path.join(self.dir, "test.pcap")
+        write_pcap(capfile, packets)
+        p = subprocess.Popen((self.pgen, "-r", capfile, "tcp port 80"),
+                             cwd=self.dir,
+                             stdout=subprocess.PIPE,
+                             stderr=subprocess.PIPE,
+                             close_fds=True)
+        (out, err) = p.communicate()
+        self.assertEqual(p.returncode, 0,
+                         "pgen_pcap exited with status %d:\n%s"
+                         % (p.returncode, err))
+        traces = {}
+        for side in ("client", "server"):
+            f = open(os.path.join(self.dir, "traces", side + ".out"), "rb")
+            traces[side] = f.read()
+            f.close()
+        return traces
+
+    # Every response must be recorded however its connection ends,
+    # including when the response travels with the server's FIN.
+    def test_connection_endings(self):
+        endings = ("ack", "fin", "rst")
+        packets = []
+        for n, ending in enumerate(endings):
+            packets.extend(exchange(n, ending))
+        traces = self.runPgen(packets)
+
+        errors = ""
+        for n, ending in enumerate(endings):
+            if request(n) not in traces["client"]:
+                errors += "request lost (ending %s)\n" % ending
+            if response(n) not in traces["server"]:
+                errors += "response lost (ending %s)\n" % ending
+        if errors != "":
+            self.fail("\n" + errors)
+
+if __name__ == '__main__':
+    from unittest import main
+    main()
@@ -119,6 +119,75 @@ class SocksTest(TestCase):
                          "\x05\x01\x00\x01\x7f\x00\x00\x01\x13\x88",
                          "\x05\x05\x00\x01\x7f\x00\x00\x01\x13\x88" ])
 
+class OptimisticSocksTest(TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.client = Stegotorus("null", "socks", "--socks-optimistic",
+                                "127.0.0.1:4998")
+
+    @classmethod
+    def tearDownClass(cls):
+        dmsg = cls.client.check_completion("optimistic socks client")
+        if dmsg != "":
+            if ("exit code:" in dmsg
+                or "killed:" in dmsg
+                or "stdout:" in dmsg):
+                raise AssertionError(dmsg)
+
+            pruned = re.sub(r"\n[^\n]+Connection refused\n", "\n", dmsg)
+            if Stegotorus.severe_error_re.search(pruned):
+                raise AssertionError(dmsg)
+
+    def setUp(self):
+        self.channel = socket.create_connection(("127.0.0.1", 4998))
+        self.channel.settimeout(1.0)
+        self.channel.sendall("\x05\x01\x00")
+        self.assertEqual(self.channel.recv(2), "\x05\x00")
+
+    def tearDown(self):
+        self.channel.close()
+
+    def test_socks5_optimistic_data(self):
+        # The request and the first data go out together, and the
+        # reply comes back whether or not the connection is made yet.
+        target = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        target.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        target.bind(("127.0.0.1", 5001))
+        target.listen(1)
+        target.settimeout(1.0)
+        try:
+            self.channel.sendall("\x05\x01\x00\x01\x7f\x00\x00\x01\x13\x89"
+                                 "hello")
+            self.assertEqual(self.channel.recv(10),
+                             "\x05\x00\x00\x01\x7f\x00\x00\x01\x13\x89")
+            (peer, addr) = target.accept()
+            peer.settimeout(1.0)
+            got = ""
+            while len(got) < 5:
+                more = peer.recv(4096)
+                if more == "": break
+                got += more
+            self.assertEqual(got, "hello")
+            peer.sendall("world")
+            self.assertEqual(self.channel.recv(4096), "world")
+            peer.close()
+        finally:
+            target.close()
+
+    def test_socks5_optimistic_conn_refused(self):
+        # The client is told it is connected; when the connection is
+        # refused, all that can be done is to drop it.
+        self.channel.sendall("\x05\x01\x00\x01\x7f\x00\x00\x01\x13\x88")
+        self.assertEqual(self.channel.recv(10),
+                         "\x05\x00\x00\x01\x7f\x00\x00\x01\x13\x88")
+        got = ""
+        try:
+            got = self.channel.recv(4096)
+        except socket.error, e:
+            if e.errno != ECONNRESET: raise
+        self.assertEqual(got, "")
+
 if __name__ == '__main__':
     from unittest import main
     main()
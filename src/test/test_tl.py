@@ -11,6 +11,9 @@
 
 import os
 import os.path
+import signal
+import tempfile
+import time
 
 from unittest import TestCase, TestSuite
 from itestlib import Stegotorus, Tltester, diff
@@ -44,6 +47,43 @@ class TimelineTest(object):
         if errors != "":
             self.fail("\n" + errors)
 
+    # Run the timeline through a proxy configured from a file, then
+    # rewrite the file, have the proxy reload it, and run the timeline
+    # again over the new configuration.
+    def doReloadTest(self, label, before, after):
+        fd, conffile = tempfile.mkstemp(".conf", "st-")
+        os.write(fd, before)
+        os.close(fd)
+        st = Stegotorus("--config=" + conffile)
+        errors = ""
+        try:
+            for config in (before, after):
+                if config is after:
+                    f = open(conffile, "w")
+                    f.write(after)
+                    f.close()
+                    st.send_signal(signal.SIGHUP)
+                    time.sleep(0.2)
+                tester = Tltester(self.scriptFile,
+                                  ("127.0.0.1:4999", "127.0.0.1:5001"))
+                testtl = tester.check_completion(label + " tester")
+                if testtl != self.reftl:
+                    errors += diff("errors in transfer:", self.reftl, testtl)
+
+        except AssertionError, e:
+            errors += e.message
+        except Exception, e:
+            errors += repr(e)
+        finally:
+            os.unlink(conffile)
+
+        errors += st.check_completion(label + " proxy", errors != "")
+        if "configuration reloaded" not in st.errput:
+            errors += label + " proxy did not reload its configuration\n"
+
+        if errors != "":
+            self.fail("\n" + errors)
+
     def test_null(self):
         self.doTest("null",
            ("null", "server", "127.0.0.1:5000", "127.0.0.1:5001",
@@ -81,6 +121,40 @@ class TimelineTest(object):
             "127.0.0.1:5010","nosteg_rr","127.0.0.1:5011","nosteg_rr",
             ))
 
+    def test_chop_nosteg_rr_turns(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg_rr:turns=8,request=1024,response=4096,delay=10",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg_rr:turns=8,request=1024,response=4096,delay=10",
+            ))
+
+    # Request and response sizes beyond the largest block chop can
+    # send are cut down to that block size.
+    def test_chop_nosteg_rr_oversize(self):
+        self.doTest("chop",
+           ("chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg_rr:turns=2,request=200000,response=200000",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg_rr:turns=2,request=200000,response=200000",
+            ))
+
+    # The new settings must be compatible with the old ones, since
+    # circuits from the first run may still be closing when the proxy
+    # reloads.
+    def test_chop_reload(self):
+        self.doReloadTest("chop",
+           "# before\n"
+           "chop server 127.0.0.1:5001\n"
+           "  127.0.0.1:5010 nosteg_rr:turns=4\n"
+           "chop client 127.0.0.1:4999\n"
+           "  127.0.0.1:5010 nosteg_rr:turns=4\n",
+           "# after\n"
+           "chop server 127.0.0.1:5001\n"
+           "  127.0.0.1:5010 nosteg_rr:turns=4,response=2048,delay=10\n"
+           "chop client --dial-best=1 127.0.0.1:4999  # one target\n"
+           "  127.0.0.1:5010 nosteg_rr:turns=4,request=512,delay=10\n")
+
     # buggy, disabled
     #def test_embed(self):
     #    self.doTest("chop",
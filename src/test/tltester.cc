@@ -10,6 +10,10 @@
 #include <event2/listener.h>
 
 #include <errno.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <vector>
 
 #ifdef _WIN32
 # undef near
@@ -22,6 +26,8 @@
    (the "near" socket).  Then it writes data to both of them as
    directed by the script on standard input.  Whatever it gets back,
    it records in a similar format and writes to standard output.
+   (Given -m, it instead pushes bulk or echo traffic through many
+   connections at once; see "Load generation" below.)
 
    The input script format is very, very simple (since we have to
    parse it in C :) It's line-oriented.  The first character on a
@@ -591,17 +597,526 @@ init_sockets_external(tstate *st, const char *near, const char *far)
   }
 }
 
+/* Load generation.
+
+   With -m, tltester ignores standard input.  Instead it opens -c near
+   connections at once (and accepts as many on the far socket) and
+   pushes traffic through all of them:
+
+   -m bulk   Each near connection sends -b bytes and then EOF.  The far
+             end of each connection, once it has seen that EOF, sends
+             back as many bytes as it received, then EOF.  The time each
+             connection takes, from connect to the last byte back, is
+             recorded.
+   -m echo   Each near connection sends -n messages of -s bytes, one
+             at a time.  The far end echoes everything it receives.
+             The round trip time of each message is recorded.
+
+   All data is a fixed pseudorandom pattern, and both ends check
+   that what they receive matches it.  At the end, a one-line JSON
+   report of aggregate throughput (both directions, all connections)
+   and the distribution of the recorded times goes to standard output;
+   any errors go to standard error, and the exit status is 1. */
+
+#define LOAD_PATTERN_LEN 65536
+#define LOAD_FILL_HIGH (128 * 1024)
+
+enum load_mode { LOAD_BULK, LOAD_ECHO };
+
+struct lstate;
+
+struct lconn
+{
+  lstate *ls;
+  struct bufferevent *bev;
+  bool near;
+  uint64_t to_send;        /* bytes not yet queued */
+  uint64_t sent;           /* pattern offset of the next byte queued */
+  uint64_t received;       /* pattern offset of the next byte expected */
+  unsigned long msgs_left;
+  struct timeval started;
+  bool want_eof : 1;
+  bool sent_eof : 1;
+  bool rcvd_eof : 1;
+  bool done     : 1;
+};
+
+struct lstate
+{
+  struct event_base *base;
+  struct evconnlistener *listener;
+  struct event *timeout;
+  enum load_mode mode;
+  unsigned int nconns;
+  uint64_t bulk_bytes;
+  unsigned long messages;
+  size_t msg_size;
+
+  std::vector<lconn *> conns;
+  std::vector<double> times;     /* milliseconds */
+  unsigned int accepted;
+  unsigned int finished;
+  unsigned long errors;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  struct timeval started;
+};
+
+static uint8_t load_pattern[2 * LOAD_PATTERN_LEN];
+
+static double
+ms_since(const struct timeval *t0)
+{
+  struct timeval now, d;
+  evutil_gettimeofday(&now, 0);
+  evutil_timersub(&now, t0, &d);
+  return d.tv_sec * 1e3 + d.tv_usec * 1e-3;
+}
+
+static void
+load_error(lconn *c, const char *what)
+{
+  lstate *ls = c->ls;
+  fprintf(stderr, "%s connection %lu: %s\n", c->near ? "near" : "far",
+          (unsigned long)(std::find(ls->conns.begin(), ls->conns.end(), c)
+                          - ls->conns.begin()), what);
+  ls->errors++;
+}
+
+static void load_finish_conn(lconn *c);
+
+static void
+load_fill(lconn *c)
+{
+  struct evbuffer *out = bufferevent_get_output(c->bev);
+  while (c->to_send > 0 && evbuffer_get_length(out) < LOAD_FILL_HIGH) {
+    size_t off = c->sent % LOAD_PATTERN_LEN;
+    size_t n = LOAD_PATTERN_LEN;
+    if (n > c->to_send)
+      n = c->to_send;
+    evbuffer_add(out, load_pattern + off, n);
+    c->to_send -= n;
+    c->sent += n;
+    c->ls->bytes_sent += n;
+  }
+
+  if (c->want_eof && !c->sent_eof && c->to_send == 0 &&
+      evbuffer_get_length(out) == 0) {
+    evutil_socket_t fd = bufferevent_getfd(c->bev);
+    bufferevent_disable(c->bev, EV_WRITE);
+    c->sent_eof = true;
+    if (fd != -1 && shutdown(fd, SHUT_WR) &&
+        EVUTIL_SOCKET_ERROR() != ENOTCONN)
+      load_error(c, evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    if (c->rcvd_eof)
+      load_finish_conn(c);
+  }
+}
+
+/* Check the first N bytes of IN against the pattern, without removing
+   them.  Returns false on a mismatch. */
+static bool
+load_check(lconn *c, struct evbuffer *in, size_t n)
+{
+  struct evbuffer_iovec v[16];
+  struct evbuffer_ptr pos;
+  uint64_t off = c->received;
+
+  evbuffer_ptr_set(in, &pos, 0, EVBUFFER_PTR_SET);
+  while (n > 0) {
+    int nv = evbuffer_peek(in, n, &pos, v, 16);
+    size_t got = 0;
+    for (int i = 0; i < nv && got < n; i++) {
+      size_t len = v[i].iov_len;
+      if (len > n - got)
+        len = n - got;
+      for (size_t done = 0; done < len; ) {
+        size_t p = (off + got + done) % LOAD_PATTERN_LEN;
+        size_t k = len - done;
+        if (k > LOAD_PATTERN_LEN - p)
+          k = LOAD_PATTERN_LEN - p;
+        if (memcmp((uint8_t *)v[i].iov_base + done, load_pattern + p, k))
+          return false;
+        done += k;
+      }
+      got += len;
+    }
+    if (got == 0)
+      break;
+    n -= got;
+    evbuffer_ptr_set(in, &pos, got, EVBUFFER_PTR_ADD);
+  }
+  return true;
+}
+
+static void
+load_start_message(lconn *c)
+{
+  evutil_gettimeofday(&c->started, 0);
+  c->to_send = c->ls->msg_size;
+  load_fill(c);
+}
+
+static void
+load_finish_conn(lconn *c)
+{
+  lstate *ls = c->ls;
+  if (c->done)
+    return;
+  c->done = true;
+
+  if (c->near && ls->mode == LOAD_BULK) {
+    if (c->received != ls->bulk_bytes)
+      load_error(c, "short transfer");
+    ls->times.push_back(ms_since(&c->started));
+  }
+
+  if (++ls->finished == 2 * ls->nconns)
+    event_base_loopexit(ls->base, 0);
+}
+
+static void
+load_read_cb(struct bufferevent *bev, void *arg)
+{
+  lconn *c = (lconn *)arg;
+  lstate *ls = c->ls;
+  struct evbuffer *in = bufferevent_get_input(bev);
+  size_t n = evbuffer_get_length(in);
+
+  if (!load_check(c, in, n)) {
+    load_error(c, "data corrupted");
+    evbuffer_drain(in, n);
+    c->received += n;
+    return;
+  }
+  c->received += n;
+  ls->bytes_received += n;
+
+  if (!c->near && ls->mode == LOAD_ECHO) {
+    c->to_send += n;
+    evbuffer_drain(in, n);
+    load_fill(c);
+    return;
+  }
+  evbuffer_drain(in, n);
+
+  if (c->near && ls->mode == LOAD_ECHO && c->received == c->sent &&
+      c->to_send == 0 && c->msgs_left > 0) {
+    ls->times.push_back(ms_since(&c->started));
+    if (--c->msgs_left > 0)
+      load_start_message(c);
+    else {
+      c->want_eof = true;
+      load_fill(c);
+    }
+  }
+}
+
+static void
+load_write_cb(struct bufferevent *, void *arg)
+{
+  load_fill((lconn *)arg);
+}
+
+static void
+load_event_cb(struct bufferevent *, short what, void *arg)
+{
+  lconn *c = (lconn *)arg;
+  lstate *ls = c->ls;
+
+  if (what & BEV_EVENT_CONNECTED)
+    return;
+
+  if (what & BEV_EVENT_ERROR) {
+    load_error(c, evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    c->sent_eof = true;
+  } else if (what & BEV_EVENT_EOF) {
+    if (c->near && ls->mode == LOAD_ECHO && c->msgs_left > 0)
+      load_error(c, "EOF before all messages were echoed");
+    if (!c->near) {
+      // bulk: now send back as much as we got; echo: just finish up
+      if (ls->mode == LOAD_BULK)
+        c->to_send = c->received;
+      c->want_eof = true;
+      load_fill(c);
+    }
+  }
+
+  c->rcvd_eof = true;
+  bufferevent_disable(c->bev, EV_READ);
+  if (c->sent_eof)
+    load_finish_conn(c);
+}
+
+static lconn *
+load_new_conn(lstate *ls, struct bufferevent *bev, bool near)
+{
+  lconn *c = (lconn *)xzalloc(sizeof(lconn));
+  c->ls = ls;
+  c->bev = bev;
+  c->near = near;
+  evutil_gettimeofday(&c->started, 0);
+  ls->conns.push_back(c);
+
+  bufferevent_setcb(bev, load_read_cb, load_write_cb, load_event_cb, c);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+  if (near) {
+    if (ls->mode == LOAD_BULK) {
+      c->to_send = ls->bulk_bytes;
+      c->want_eof = true;
+      load_fill(c);
+    } else {
+      c->msgs_left = ls->messages;
+      load_start_message(c);
+    }
+  }
+  return c;
+}
+
+static void
+load_accept_cb(struct evconnlistener *, evutil_socket_t fd,
+               struct sockaddr *, int, void *arg)
+{
+  lstate *ls = (lstate *)arg;
+  struct bufferevent *bev =
+    bufferevent_socket_new(ls->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    fprintf(stderr, "creating socket buffer: %s\n", strerror(errno));
+    evutil_closesocket(fd);
+    ls->errors++;
+    return;
+  }
+  load_new_conn(ls, bev, false);
+  if (++ls->accepted == ls->nconns) {
+    evconnlistener_free(ls->listener);
+    ls->listener = 0;
+  }
+}
+
+static void
+load_timeout_cb(evutil_socket_t, short, void *arg)
+{
+  lstate *ls = (lstate *)arg;
+  fprintf(stderr, "timed out with %u of %u connections finished\n",
+          ls->finished, 2 * ls->nconns);
+  ls->errors++;
+  event_base_loopexit(ls->base, 0);
+}
+
+static void
+load_setup_internal(lstate *ls)
+{
+  for (unsigned int i = 0; i < ls->nconns; i++) {
+    evutil_socket_t pair[2];
+#ifdef AF_LOCAL
+    int rv = evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, pair);
+#else
+    int rv = evutil_socketpair(AF_INET, SOCK_STREAM, 0, pair);
+#endif
+    if (rv == -1 ||
+        evutil_make_socket_nonblocking(pair[0]) ||
+        evutil_make_socket_nonblocking(pair[1])) {
+      fprintf(stderr, "socketpair: %s\n",
+              evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      exit(1);
+    }
+    struct bufferevent *near =
+      bufferevent_socket_new(ls->base, pair[0], BEV_OPT_CLOSE_ON_FREE);
+    struct bufferevent *far =
+      bufferevent_socket_new(ls->base, pair[1], BEV_OPT_CLOSE_ON_FREE);
+    if (!near || !far) {
+      fprintf(stderr, "creating socket buffers: %s\n", strerror(errno));
+      exit(1);
+    }
+    load_new_conn(ls, far, false);
+    load_new_conn(ls, near, true);
+  }
+}
+
+static void
+load_setup_external(lstate *ls, const char *near, const char *far)
+{
+  /* As for scripts, the far socket must be listening before the near
+     connections are made. */
+  struct evutil_addrinfo *near_addr =
+    resolve_address_port(near, 1, 0, "5000");
+  struct evutil_addrinfo *far_addr =
+    resolve_address_port(far, 1, 1, "5001");
+
+  if (!near_addr || !far_addr)
+    exit(2); /* diagnostic already printed */
+
+  ls->listener = evconnlistener_new_bind(ls->base, load_accept_cb, ls,
+                                         LEV_OPT_CLOSE_ON_FREE|
+                                         LEV_OPT_REUSEABLE, -1,
+                                         far_addr->ai_addr,
+                                         far_addr->ai_addrlen);
+  if (!ls->listener) {
+    fprintf(stderr, "listen(%s): %s\n", far,
+            evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    exit(1);
+  }
+
+  for (unsigned int i = 0; i < ls->nconns; i++) {
+    struct bufferevent *bev =
+      bufferevent_socket_new(ls->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev || bufferevent_socket_connect(bev, near_addr->ai_addr,
+                                           near_addr->ai_addrlen)) {
+      fprintf(stderr, "connect(%s): %s\n", near,
+              evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      exit(1);
+    }
+    load_new_conn(ls, bev, true);
+  }
+
+  evutil_freeaddrinfo(near_addr);
+  evutil_freeaddrinfo(far_addr);
+}
+
+static double
+load_percentile(const std::vector<double> &v, double q)
+{
+  size_t i = (size_t)(q * v.size());
+  return v[i < v.size() ? i : v.size() - 1];
+}
+
+static int
+run_load(lstate *ls, unsigned int timeout, const char *near, const char *far)
+{
+  struct timeval tv = { (time_t)timeout, 0 };
+  uint32_t x = 0x2545f491;
+
+  for (size_t i = 0; i < LOAD_PATTERN_LEN; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    load_pattern[i] = load_pattern[i + LOAD_PATTERN_LEN] = x >> 24;
+  }
+
+  ls->timeout = evtimer_new(ls->base, load_timeout_cb, ls);
+  evtimer_add(ls->timeout, &tv);
+  evutil_gettimeofday(&ls->started, 0);
+
+  if (near)
+    load_setup_external(ls, near, far);
+  else
+    load_setup_internal(ls);
+
+  event_base_dispatch(ls->base);
+
+  double secs = ms_since(&ls->started) / 1e3;
+  std::sort(ls->times.begin(), ls->times.end());
+
+  printf("{\"mode\": \"%s\", \"connections\": %u, \"seconds\": %.4f, "
+         "\"bytes_sent\": %lu, \"bytes_received\": %lu, "
+         "\"mb_per_s\": %.3f, \"errors\": %lu",
+         ls->mode == LOAD_BULK ? "bulk" : "echo", ls->nconns, secs,
+         (unsigned long)ls->bytes_sent, (unsigned long)ls->bytes_received,
+         ls->bytes_received / secs / 1e6, ls->errors);
+  if (!ls->times.empty())
+    printf(", \"%s_ms\": {\"count\": %lu, \"min\": %.3f, \"p50\": %.3f, "
+           "\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+           ls->mode == LOAD_BULK ? "transfer" : "rtt",
+           (unsigned long)ls->times.size(), ls->times.front(),
+           load_percentile(ls->times, 0.5), load_percentile(ls->times, 0.9),
+           load_percentile(ls->times, 0.99), ls->times.back());
+  printf("}\n");
+
+  for (size_t i = 0; i < ls->conns.size(); i++) {
+    bufferevent_free(ls->conns[i]->bev);
+    free(ls->conns[i]);
+  }
+  if (ls->listener)
+    evconnlistener_free(ls->listener);
+  event_free(ls->timeout);
+  event_base_free(ls->base);
+
+  return ls->errors ? 1 : 0;
+}
+
+static void ATTR_NORETURN
+usage(const char *argv0)
+{
+  const char *name = strrchr(argv0, '/');
+  name = name ? name+1 : argv0;
+  fprintf(stderr,
+          "usage: %s [near-addr far-addr]\n"
+          "       %s -m bulk|echo [-c conns] [-b bytes] [-n msgs] [-s size]\n"
+          "           [-t timeout] [near-addr far-addr]\n", name, name);
+  exit(2);
+}
+
+static unsigned long
+parse_count(const char *argv0, const char *arg)
+{
+  char *end;
+  unsigned long v = strtoul(arg, &end, 10);
+  if (end == arg)
+    usage(argv0);
+  if (*end == 'k' || *end == 'K')
+    v *= 1024, end++;
+  else if (*end == 'm' || *end == 'M')
+    v *= 1024 * 1024, end++;
+  if (*end)
+    usage(argv0);
+  return v;
+}
+
 int
 main(int argc, char **argv)
 {
   tstate st;
   memset(&st, 0, sizeof(tstate));
 
-  if (argc != 1 && argc != 3) {
-    char *name = strrchr(argv[0], '/');
-    name = name ? name+1 : argv[0];
-    fprintf(stderr, "usage: %s [near-addr far-addr]\n", name);
-    return 2;
+  lstate ls;
+  bool load = false;
+  unsigned int timeout = 60;
+  int opt;
+
+  ls.listener = 0;
+  ls.timeout = 0;
+  ls.mode = LOAD_BULK;
+  ls.nconns = 1;
+  ls.bulk_bytes = 1024 * 1024;
+  ls.messages = 100;
+  ls.msg_size = 64;
+  ls.accepted = ls.finished = 0;
+  ls.errors = 0;
+  ls.bytes_sent = ls.bytes_received = 0;
+
+  while ((opt = getopt(argc, argv, "m:c:b:n:s:t:")) != -1) {
+    switch (opt) {
+    case 'm':
+      load = true;
+      if (!strcmp(optarg, "bulk"))
+        ls.mode = LOAD_BULK;
+      else if (!strcmp(optarg, "echo"))
+        ls.mode = LOAD_ECHO;
+      else
+        usage(argv[0]);
+      break;
+    case 'c': ls.nconns = parse_count(argv[0], optarg); break;
+    case 'b': ls.bulk_bytes = parse_count(argv[0], optarg); break;
+    case 'n': ls.messages = parse_count(argv[0], optarg); break;
+    case 's': ls.msg_size = parse_count(argv[0], optarg); break;
+    case 't': timeout = parse_count(argv[0], optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if ((argc - optind != 0 && argc - optind != 2) ||
+      ls.nconns == 0 || ls.messages == 0 || ls.msg_size == 0)
+    usage(argv[0]);
+
+  if (load) {
+    ls.base = event_base_new();
+    if (!ls.base) {
+      fprintf(stderr, "creating event base: %s\n", strerror(errno));
+      return 1;
+    }
+    if (argc - optind == 2)
+      return run_load(&ls, timeout, argv[optind], argv[optind+1]);
+    return run_load(&ls, timeout, 0, 0);
   }
 
   st.script = stdin;
@@ -622,10 +1137,10 @@ main(int argc, char **argv)
     return 1;
   }
 
-  if (argc == 1)
+  if (argc == optind)
     init_sockets_internal(&st);
   else
-    init_sockets_external(&st, argv[1], argv[2]);
+    init_sockets_external(&st, argv[optind], argv[optind+1]);
 
   bufferevent_setcb(st.near,
                     socket_read_cb, socket_drain_cb, socket_event_cb, &st);
@@ -0,0 +1,148 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../protocol/chop_health.h"
+
+using std::vector;
+
+static void
+test_chop_health_cost(void *)
+{
+  target_health h;
+  char buf[256];
+  h.resize(3);
+
+  // never tried: cheapest of all
+  tt_assert(h[0].cost() == 0);
+
+  // connects quickly and moves data fast
+  h.connected(0, 10);
+  h.closed(0, 65536, 100);
+  tt_uint_op(h[0].attempts, ==, 1);
+  tt_assert(h[0].connect_ms == 10);
+  tt_assert(h[0].goodput == 655360);
+  tt_assert(h[0].cost() > 109 && h[0].cost() < 111);
+
+  // too little data to judge goodput by
+  h.connected(1, 10);
+  h.closed(1, HEALTH_MIN_BYTES - 1, 1000);
+  tt_uint_op(h[1].samples, ==, 0);
+  tt_assert(h[1].goodput == 0);
+  tt_uint_op(h[1].bytes, ==, HEALTH_MIN_BYTES - 1);
+
+  // failures scale the cost up, but never without bound
+  tt_assert(h[1].cost() == 10);
+  h.failed(1);
+  tt_assert(h[1].fail_rate == HEALTH_ALPHA);
+  tt_assert(h[1].cost() > 13.3 && h[1].cost() < 13.4);
+  h.failed(2);
+  tt_assert(h[2].fail_rate == 1);
+  tt_assert(h[2].cost() > HEALTH_UNREACHABLE_MS * 19.9);
+  tt_assert(h[2].cost() < HEALTH_UNREACHABLE_MS * 20.1);
+
+  // recovery brings the failure rate back down
+  for (int i = 0; i < 20; i++)
+    h.connected(2, 10);
+  tt_assert(h[2].fail_rate < 0.01);
+  tt_assert(h[2].connect_ms == 10);
+
+  h.format(0, buf, sizeof buf);
+  tt_assert(!strncmp(buf, "1 connections, 0 failed", 23));
+
+ end:;
+}
+
+static void
+test_chop_health_select(void *)
+{
+  target_health h;
+  vector<size_t> out;
+  h.resize(4);
+
+  // k == 0, or k at least the number of targets, means all of them
+  h.select(0, out);
+  tt_uint_op(out.size(), ==, 4);
+  out.clear();
+  h.select(4, out);
+  tt_uint_op(out.size(), ==, 4);
+  tt_uint_op(out[3], ==, 3);
+  out.clear();
+
+  // Targets 1 and 2 are known; 1 is faster.  0 and 3 have never been
+  // tried, so they are cheapest; the one of them not chosen is probed.
+  h.connected(1, 5);
+  h.connected(2, 500);
+  h.select(1, out);
+  tt_uint_op(out.size(), ==, 2);
+  tt_uint_op(out[0], ==, 0);
+  tt_uint_op(out[1], ==, 3);
+  out.clear();
+
+  // Once everything has been tried, the best k are chosen, and no
+  // others except every HEALTH_PROBE_EVERY selections.
+  h.connected(0, 50);
+  h.failed(3);
+  h.select(2, out);
+  tt_uint_op(out[0], ==, 1);
+  tt_uint_op(out[1], ==, 0);
+
+  {
+    int probes = 0;
+    for (int i = 0; i < HEALTH_PROBE_EVERY * 2; i++) {
+      out.clear();
+      h.select(2, out);
+      tt_uint_op(out[0], ==, 1);
+      tt_uint_op(out[1], ==, 0);
+      if (out.size() == 3) {
+        probes++;
+        // the probe goes to whichever of the rest waited longest
+        tt_uint_op(out[2], ==, probes == 1 ? 2 : 3);
+      }
+    }
+    tt_int_op(probes, ==, 2);
+  }
+
+ end:;
+}
+
+static void
+test_chop_health_recover(void *)
+{
+  target_health h;
+  vector<size_t> out;
+  h.resize(2);
+
+  // Target 0 starts out better, then keeps failing; selection moves
+  // over to target 1, and back again once target 0 recovers.
+  h.connected(0, 10);
+  h.connected(1, 100);
+  h.select(1, out);
+  tt_uint_op(out[0], ==, 0);
+
+  for (int i = 0; i < 10; i++)
+    h.failed(0);
+  out.clear();
+  h.select(1, out);
+  tt_uint_op(out[0], ==, 1);
+
+  for (int i = 0; i < 8; i++)
+    h.connected(0, 10);
+  out.clear();
+  h.select(1, out);
+  tt_uint_op(out[0], ==, 0);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_chop_health_##name, 0, 0, 0 }
+
+struct testcase_t chop_health_tests[] = {
+  T(cost),
+  T(select),
+  T(recover),
+  END_OF_TESTCASES
+};
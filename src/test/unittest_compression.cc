@@ -425,6 +425,24 @@ test_decompress_gzip(void *)
  end:;
 }
 
+/* An output buffer that is too small, and input that stops short, are
+   told apart: only the first is worth retrying with more space. */
+static void
+test_decompress_short(void *)
+{
+  uint8_t obuf[1024];
+  for (const zlib_testvec *t = testvecs; t->text; t++) {
+    if (t->tlen == 0)
+      continue;
+    tt_int_op(decompress(t->zlibbed, t->zlen, obuf, t->tlen - 1), ==, -2);
+    tt_int_op(decompress(t->gzipped, t->glen, obuf, t->tlen - 1), ==, -2);
+    tt_int_op(decompress(t->zlibbed, t->zlen - 1, obuf, sizeof obuf), ==, -1);
+    tt_int_op(decompress(t->gzipped, t->glen / 2, obuf, sizeof obuf), ==, -1);
+  }
+
+ end:;
+}
+
 #define T(name) \
   { #name, test_##name, 0, 0, 0 }
 
@@ -433,5 +451,6 @@ struct testcase_t zlib_tests[] = {
   T(decompress_zlib),
   T(compress_gzip),
   T(decompress_gzip),
+  T(decompress_short),
   END_OF_TESTCASES
 };
@@ -0,0 +1,220 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "connections.h"
+#include "dnscache.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/event.h>
+
+namespace {
+  /* A DNS server, on a local UDP port, that knows one name. */
+  struct fake_dns
+  {
+    struct event_base *base;
+    struct evdns_base *dns;
+    struct evdns_server_port *port;
+    evutil_socket_t sock;
+    uint32_t addr;          // answer for a.example, host byte order
+    int ttl;
+    int queries;
+
+    fake_dns()
+      : base(0), dns(0), port(0), sock(-1), addr(0x0a000001), ttl(3600),
+        queries(0) {}
+
+    static void answer(struct evdns_server_request *req, void *arg)
+    {
+      fake_dns *f = (fake_dns *)arg;
+      int err = DNS_ERR_NOTEXIST;
+      for (int i = 0; i < req->nquestions; i++) {
+        struct evdns_server_question *q = req->questions[i];
+        f->queries++;
+        // evdns randomizes the case of the names it asks for
+        if (evutil_ascii_strcasecmp(q->name, "a.example"))
+          continue;
+        err = DNS_ERR_NONE;
+        if (q->type == EVDNS_TYPE_A) {
+          uint32_t a = htonl(f->addr);
+          evdns_server_request_add_a_reply(req, q->name, 1, &a, f->ttl);
+        }
+      }
+      evdns_server_request_respond(req, err);
+    }
+
+    bool setup()
+    {
+      struct sockaddr_in sin;
+      ev_socklen_t slen = sizeof sin;
+      char buf[64];
+
+      base = event_base_new();
+      if (!base || event_base_priority_init(base, 2))
+        return false;
+      conn_global_init(base);
+
+      sock = socket(AF_INET, SOCK_DGRAM, 0);
+      memset(&sin, 0, sizeof sin);
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (sock < 0 || bind(sock, (struct sockaddr *)&sin, sizeof sin) ||
+          getsockname(sock, (struct sockaddr *)&sin, &slen))
+        return false;
+      evutil_make_socket_nonblocking(sock);
+      port = evdns_add_server_port_with_base(base, sock, 0, answer, this);
+
+      dns = evdns_base_new(base, 0);
+      xsnprintf(buf, sizeof buf, "127.0.0.1:%u", ntohs(sin.sin_port));
+      return port && dns && !evdns_base_nameserver_ip_add(dns, buf);
+    }
+
+    /* Run the event loop for MS milliseconds. */
+    void run(int ms)
+    {
+      struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+      event_base_loopexit(base, &tv);
+      event_base_dispatch(base);
+    }
+
+    /* Run the event loop until the server has had N queries, and the
+       answers have been delivered, or for at most two seconds. */
+    bool wait_queries(int n)
+    {
+      for (int i = 0; i < 200 && queries < n; i++)
+        run(10);
+      run(50);
+      return queries >= n;
+    }
+
+    void teardown()
+    {
+      if (dns)
+        evdns_base_free(dns, 0);
+      if (port)
+        evdns_close_server_port(port);
+      if (sock >= 0)
+        evutil_closesocket(sock);
+      if (base) {
+        conn_start_shutdown(0);
+        event_base_dispatch(base);
+        event_base_free(base);
+      }
+    }
+  };
+}
+
+static uint32_t
+addr_of(const struct sockaddr_storage &ss)
+{
+  return ntohl(((const struct sockaddr_in *)&ss)->sin_addr.s_addr);
+}
+
+static void
+test_dnscache_lookup(void *)
+{
+  fake_dns f;
+  dns_cache *c = 0;
+  struct sockaddr_storage ss;
+  socklen_t len;
+
+  tt_assert(f.setup());
+  c = new dns_cache(f.dns);
+
+  // numeric addresses need no resolution
+  tt_assert(c->get("192.0.2.7", 80, AF_UNSPEC, &ss, &len));
+  tt_uint_op(addr_of(ss), ==, 0xc0000207);
+  tt_int_op(ntohs(((struct sockaddr_in *)&ss)->sin_port), ==, 80);
+  tt_uint_op(c->size(), ==, 0);
+
+  // the first lookup of a name misses, and starts resolving it
+  tt_assert(!c->get("a.example", 80, AF_UNSPEC, &ss, &len));
+  tt_uint_op(c->misses, ==, 1);
+  tt_uint_op(c->size(), ==, 1);
+  tt_assert(f.wait_queries(1));
+
+  // once it has been resolved, lookups are answered from the cache
+  for (int i = 0; i < 3; i++) {
+    tt_assert(c->get("a.example", 443, AF_UNSPEC, &ss, &len));
+    tt_uint_op(addr_of(ss), ==, 0x0a000001);
+    tt_int_op(ntohs(((struct sockaddr_in *)&ss)->sin_port), ==, 443);
+    tt_int_op(len, ==, sizeof(struct sockaddr_in));
+  }
+  tt_uint_op(c->hits, ==, 3);
+  tt_assert(!c->get("a.example", 443, AF_INET6, &ss, &len));
+  tt_int_op(f.queries, ==, 1);
+
+  // a name that does not exist is tried as IPv4 and IPv6, then fails
+  tt_assert(!c->get("b.example", 80, AF_UNSPEC, &ss, &len));
+  tt_assert(f.wait_queries(3));
+  tt_uint_op(c->failures, ==, 1);
+  tt_assert(!c->get("b.example", 80, AF_UNSPEC, &ss, &len));
+  tt_int_op(f.queries, ==, 3);
+
+ end:
+  delete c;
+  f.teardown();
+}
+
+static void
+test_dnscache_refresh(void *)
+{
+  fake_dns f;
+  dns_cache *c = 0;
+  struct sockaddr_storage ss;
+  socklen_t len;
+  struct evutil_addrinfo *cur = 0, *ai = 0;
+
+  tt_assert(f.setup());
+  c = new dns_cache(f.dns, 0);
+  f.ttl = 1;
+
+  cur = resolve_address_port("10.0.0.1:5000", 1, 0, NULL);
+  tt_assert(cur);
+  tt_assert(!c->refresh("a.example", cur));
+  tt_assert(f.wait_queries(1));
+  tt_assert(!c->refresh("a.example", cur));
+
+  // The name moves; it is resolved again, in the background, before
+  // its TTL is up, because it has been used.
+  f.addr = 0x0a000002;
+  tt_assert(f.wait_queries(2));
+  tt_assert(c->get("a.example", 80, AF_INET, &ss, &len));
+  tt_uint_op(addr_of(ss), ==, 0x0a000002);
+
+  ai = c->refresh("a.example", cur);
+  tt_assert(ai);
+  tt_uint_op(ntohl(((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr),
+             ==, 0x0a000002);
+  tt_int_op(ntohs(((struct sockaddr_in *)ai->ai_addr)->sin_port), ==, 5000);
+  tt_assert(!c->refresh("a.example", ai));
+
+  // Once it stops being used, it is dropped rather than refreshed.
+  tt_assert(f.wait_queries(3));
+  f.run(1000);
+  tt_uint_op(c->size(), ==, 0);
+  tt_int_op(f.queries, ==, 3);
+
+ end:
+  if (cur)
+    evutil_freeaddrinfo(cur);
+  if (ai)
+    evutil_freeaddrinfo(ai);
+  delete c;
+  f.teardown();
+}
+
+#define T(name) \
+  { #name, test_dnscache_##name, 0, 0, 0 }
+
+struct testcase_t dnscache_tests[] = {
+  T(lookup),
+  T(refresh),
+  END_OF_TESTCASES
+};
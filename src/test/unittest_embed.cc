@@ -0,0 +1,156 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../steg/embed_trace.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+static const char text_traces[] =
+  "3\n"
+  "2  100 0  -1400 25\n"
+  "1\n-32767 7\n"
+  "4  60 0\n-1500 3\n-1500 0\n32767 1000\n";
+
+static void
+write_file(const char *fname, const void *data, size_t len)
+{
+  FILE *f = fopen(fname, "wb");
+  log_assert(f);
+  log_assert(fwrite(data, 1, len, f) == len);
+  log_assert(!fclose(f));
+}
+
+static void
+test_embed_formats(void *)
+{
+  char txt[] = "/tmp/st-embed-txt-XXXXXX";
+  char bin[] = "/tmp/st-embed-bin-XXXXXX";
+  static const int sizes[] = { 100, -1400, -32767, 60, -1500, -1500, 32767 };
+  static const int times[] = { 0, 25, 7, 0, 3, 0, 1000 };
+  embed_traces a, b;
+  int fd;
+
+  fd = mkstemp(txt);
+  tt_assert(fd != -1);
+  close(fd);
+  fd = mkstemp(bin);
+  tt_assert(fd != -1);
+  close(fd);
+
+  write_file(txt, text_traces, sizeof text_traces - 1);
+  tt_int_op(a.load_text(txt), ==, 0);
+  tt_uint_op(a.num_traces, ==, 3);
+  tt_uint_op(a.num_pkts, ==, 7);
+  tt_uint_op(a.trace_len(0), ==, 2);
+  tt_uint_op(a.trace_len(1), ==, 1);
+  tt_uint_op(a.trace_len(2), ==, 4);
+  tt_uint_op(a.offsets[2], ==, 3);
+  for (int i = 0; i < 7; i++) {
+    tt_int_op(a.sizes[i], ==, sizes[i]);
+    tt_int_op(a.times[i], ==, times[i]);
+  }
+
+  // what is saved loads back the same
+  tt_int_op(a.save(bin), ==, 0);
+  tt_int_op(b.load(bin), ==, 0);
+  tt_uint_op(b.num_traces, ==, a.num_traces);
+  tt_uint_op(b.num_pkts, ==, a.num_pkts);
+  tt_mem_op(b.offsets, ==, a.offsets, 4 * sizeof(uint32_t));
+  tt_mem_op(b.sizes, ==, a.sizes, 7 * sizeof(int16_t));
+  tt_mem_op(b.times, ==, a.times, 7 * sizeof(int32_t));
+
+  // a missing binary file is distinguishable from a bad one
+  tt_int_op(b.load("/nonexistent/embed.bin"), ==, -1);
+  tt_int_op(errno, ==, ENOENT);
+  tt_uint_op(b.num_traces, ==, 0);
+  write_file(bin, text_traces, sizeof text_traces - 1);
+  tt_int_op(b.load(bin), ==, -1);
+  tt_int_op(errno, !=, ENOENT);
+
+ end:
+  unlink(txt);
+  unlink(bin);
+}
+
+static void
+test_embed_malformed(void *)
+{
+  static const char *const bad_text[] = {
+    "",
+    "0\n",
+    "2\n1 100 0\n",
+    "1\n0\n",
+    "1\n2 100 0 200\n",
+    "1\n1 40000 0\n",
+    "1\n1 -32768 0\n",
+    "1\n1 100 -5\n",
+    "1\n1 100 x\n",
+  };
+  char fname[] = "/tmp/st-embed-XXXXXX";
+  embed_traces t;
+  static const int16_t pkt_sizes[2] = { 100, -100 };
+  uint32_t image[4 + 3 + 2 + 1];
+  size_t i;
+  int fd;
+
+  fd = mkstemp(fname);
+  tt_assert(fd != -1);
+  close(fd);
+
+  for (i = 0; i < sizeof bad_text / sizeof bad_text[0]; i++) {
+    write_file(fname, bad_text[i], strlen(bad_text[i]));
+    tt_int_op(t.load_text(fname), ==, -1);
+  }
+
+  // two traces of one packet each
+  image[0] = EMBED_TRACE_MAGIC;
+  image[1] = EMBED_TRACE_VERSION;
+  image[2] = 2;
+  image[3] = 2;
+  image[4] = 0;
+  image[5] = 1;
+  image[6] = 2;
+  image[7] = 10;
+  image[8] = 20;
+  memcpy(&image[9], pkt_sizes, sizeof pkt_sizes);
+  write_file(fname, image, sizeof image);
+  tt_int_op(t.load(fname), ==, 0);
+  tt_int_op(t.sizes[1], ==, -100);
+
+  // truncated
+  write_file(fname, image, sizeof image - 2);
+  tt_int_op(t.load(fname), ==, -1);
+
+  // an empty trace
+  image[5] = 0;
+  write_file(fname, image, sizeof image);
+  tt_int_op(t.load(fname), ==, -1);
+  image[5] = 1;
+
+  // offsets past the end
+  image[6] = 3;
+  write_file(fname, image, sizeof image);
+  tt_int_op(t.load(fname), ==, -1);
+  image[6] = 2;
+
+  // wrong byte order
+  image[0] = 0x454d4254;
+  write_file(fname, image, sizeof image);
+  tt_int_op(t.load(fname), ==, -1);
+
+ end:
+  unlink(fname);
+}
+
+#define T(name) \
+  { #name, test_embed_##name, 0, 0, 0 }
+
+struct testcase_t embed_tests[] = {
+  T(formats),
+  T(malformed),
+  END_OF_TESTCASES
+};
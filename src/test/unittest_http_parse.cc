@@ -0,0 +1,151 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../steg/http_parse.h"
+
+#include <event2/buffer.h>
+
+static const char request[] =
+  "GET /a/b/c.swf HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "Accept: */*\r\n"
+  "Cookie: a=AAAA;b=BBBB\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+static const char response[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Server: Apache\r\n"
+  "Content-Length: 10\r\n"
+  "Content-Type: application/x-shockwave-flash\r\n"
+  "Connection: close\r\n"
+  "\r\n"
+  "0123456789";
+
+static void
+test_http_parse_request(void *)
+{
+  struct evbuffer *buf = evbuffer_new();
+  http_parser parser;
+
+  evbuffer_add(buf, request, sizeof request - 1);
+  tt_int_op(parser.parse(buf), ==, 1);
+  tt_uint_op(parser.header_len, ==, sizeof request - 1);
+  tt_uint_op(parser.message_len(), ==, sizeof request - 1);
+  tt_uint_op(parser.first_line_len, ==, sizeof "GET /a/b/c.swf HTTP/1.1" - 1);
+  tt_int_op(parser.content_length, ==, -1);
+  tt_assert(parser.keep_alive);
+  tt_uint_op(parser.cookie_len, ==, sizeof "a=AAAA;b=BBBB" - 1);
+  tt_mem_op(request + parser.cookie_off, ==, "a=AAAA;b=BBBB",
+            parser.cookie_len);
+
+ end:
+  evbuffer_free(buf);
+}
+
+/* Feeding a response a byte at a time, in several buffer chains,
+   gets the same result as feeding it all at once. */
+static void
+test_http_parse_bytewise(void *)
+{
+  struct evbuffer *buf = evbuffer_new();
+  http_parser parser;
+  size_t hlen = strstr(response, "\r\n\r\n") + 4 - response;
+  size_t i;
+
+  for (i = 0; i < hlen - 1; i++) {
+    evbuffer_add(buf, response + i, 1);
+    tt_int_op(parser.parse(buf), ==, 0);
+  }
+  evbuffer_add(buf, response + i, sizeof response - 1 - i);
+  tt_int_op(parser.parse(buf), ==, 1);
+  tt_uint_op(parser.header_len, ==, hlen);
+  tt_int_op(parser.content_length, ==, 10);
+  tt_uint_op(parser.message_len(), ==, sizeof response - 1);
+  tt_assert(!parser.keep_alive);
+  tt_uint_op(parser.cookie_len, ==, 0);
+
+  // and it stays complete until reset
+  tt_int_op(parser.parse(buf), ==, 1);
+
+ end:
+  evbuffer_free(buf);
+}
+
+/* Several messages back to back, parsed one after another. */
+static void
+test_http_parse_pipelined(void *)
+{
+  struct evbuffer *buf = evbuffer_new();
+  http_parser parser;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    evbuffer_add(buf, response, sizeof response - 1);
+
+  for (i = 0; i < 3; i++) {
+    tt_int_op(parser.parse(buf), ==, 1);
+    tt_uint_op(parser.message_len(), ==, sizeof response - 1);
+    evbuffer_drain(buf, parser.message_len());
+    parser.reset();
+  }
+  tt_int_op(parser.parse(buf), ==, 0);
+
+ end:
+  evbuffer_free(buf);
+}
+
+static void
+test_http_parse_malformed(void *)
+{
+  static const char *const bad[] = {
+    "\r\nHTTP/1.1 200 OK\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 12x\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: \r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 99999999999999999999999\r\n\r\n",
+  };
+  struct evbuffer *buf = evbuffer_new();
+  http_parser parser;
+  size_t i;
+
+  for (i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+    parser.reset();
+    evbuffer_add(buf, bad[i], strlen(bad[i]));
+    tt_int_op(parser.parse(buf), ==, -1);
+  }
+
+  // An HTTP/1.0 response without a Connection header does not
+  // keep the connection open.
+  evbuffer_drain(buf, evbuffer_get_length(buf));
+  parser.reset();
+  evbuffer_add_printf(buf, "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n");
+  tt_int_op(parser.parse(buf), ==, 1);
+  tt_assert(!parser.keep_alive);
+  tt_int_op(parser.content_length, ==, 0);
+
+  // A header that never ends is eventually rejected.
+  evbuffer_drain(buf, evbuffer_get_length(buf));
+  parser.reset();
+  evbuffer_add_printf(buf, "HTTP/1.1 200 OK\r\n");
+  for (i = 0; i < HTTP_MAX_HEADER_SIZE / 16; i++)
+    evbuffer_add_printf(buf, "X-Padding: abc\r\n");
+  tt_int_op(parser.parse(buf), ==, -1);
+
+ end:
+  evbuffer_free(buf);
+}
+
+#define T(name) \
+  { #name, test_http_parse_##name, 0, 0, 0 }
+
+struct testcase_t http_parse_tests[] = {
+  T(request),
+  T(bytewise),
+  T(pipelined),
+  T(malformed),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,96 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../steg/payloads.h"
+#include "../steg/http_resp.h"
+
+#include <time.h>
+
+static void
+test_http_resp_date(void *)
+{
+  static const time_t times[] = {
+    0, 1, 86399, 86400, 784111777, 951782400, 951868800, 1330473600,
+    1356998399, 2147483647
+  };
+  char want[64], got[HTTP_DATE_LEN + 1];
+  time_t t;
+
+  for (size_t i = 0; i < sizeof times / sizeof times[0]; i++) {
+    struct tm *tm = gmtime(&times[i]);
+    strftime(want, sizeof want, "%a, %d %b %Y %H:%M:%S GMT", tm);
+    http_date_render(got, times[i]);
+    got[HTTP_DATE_LEN] = '\0';
+    tt_str_op(got, ==, want);
+  }
+
+  // and a day's worth of seconds from a random starting point
+  t = 1000000000 + rand() % 1000000000;
+  for (int i = 0; i < 86400; i += 7) {
+    time_t u = t + i;
+    strftime(want, sizeof want, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&u));
+    http_date_render(got, u);
+    got[HTTP_DATE_LEN] = '\0';
+    tt_str_op(got, ==, want);
+  }
+
+ end:;
+}
+
+static void
+test_http_resp_header(void *)
+{
+  char buf[MAX_RESP_HDR_SIZE], date[64];
+  time_t now;
+  int i, n;
+
+  for (i = 0; i < 200; i++) {
+    int gzip = i & 1, keep_alive = i & 2, length = rand() % 2000000;
+    const char *ctype = (i & 4) ? "application/pdf" : "text/x-unusual";
+
+    n = gen_response_header(ctype, gzip, keep_alive, length,
+                            buf, sizeof buf);
+    tt_int_op(n, >, 0);
+    tt_int_op((int)strlen(buf), ==, n);
+    tt_assert(!strncmp(buf, "HTTP/1.1 200 OK\r\nDate: ", 23));
+    tt_assert(!strcmp(buf + n - 4, "\r\n\r\n"));
+    tt_int_op(find_content_length(buf, n), ==, length);
+    tt_assert(strstr(buf, ctype));
+    tt_assert(!gzip == !strstr(buf, "Content-Encoding: gzip\r\n"));
+    tt_assert(!keep_alive ==
+              !strstr(buf, "\r\nConnection: Keep-Alive\r\n\r\n"));
+    tt_assert(!!keep_alive == !strstr(buf, "\r\nConnection: close\r\n\r\n"));
+  }
+
+  // the date is the current one, give or take the second it may
+  // have ticked over in
+  http_date_refresh(0);
+  now = time(0);
+  n = gen_response_header("text/html", 0, 1, 0, buf, sizeof buf);
+  tt_int_op(n, >, 0);
+  strftime(date, sizeof date, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+           gmtime(&now));
+  if (!strstr(buf, date)) {
+    now--;
+    strftime(date, sizeof date, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+             gmtime(&now));
+    tt_assert(strstr(buf, date));
+  }
+
+  // too small a buffer is refused
+  tt_int_op(gen_response_header("text/html", 0, 1, 0, buf, 40), ==, -1);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_http_resp_##name, 0, 0, 0 }
+
+struct testcase_t http_resp_tests[] = {
+  T(date),
+  T(header),
+  END_OF_TESTCASES
+};
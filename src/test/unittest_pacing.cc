@@ -0,0 +1,149 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "connections.h"
+#include "bench_util.h"
+#include "../steg/pacing.h"
+
+#include <event2/event.h>
+
+static void
+test_pacing_histogram(void *)
+{
+  static const long errs[] = { -1, 0, 0, 1, 2, 3, 7, 8, 1023, 1024, 99999 };
+  static const unsigned long want[PACE_HIST_BUCKETS] = {
+    3, 1, 2, 1, 1, 0, 0, 0, 0, 0, 1, 2
+  };
+  pace_histogram h;
+  char buf[512];
+
+  for (size_t i = 0; i < sizeof errs / sizeof errs[0]; i++)
+    h.add(errs[i]);
+
+  tt_uint_op(h.count, ==, 11);
+  tt_uint_op(h.early, ==, 1);
+  tt_uint_op(h.max, ==, 99999);
+  tt_uint_op(h.total, ==, 0+0+1+2+3+7+8+1023+1024+99999);
+  for (unsigned int b = 0; b < PACE_HIST_BUCKETS; b++)
+    tt_uint_op(h.buckets[b], ==, want[b]);
+
+  h.format(buf, sizeof buf);
+  tt_assert(!strncmp(buf, "11 packets, 1 early, mean ", 26));
+  tt_assert(strstr(buf, " <1:3 <2:1 <4:2 <8:1 "));
+  tt_assert(strstr(buf, " <1024:1 >=1024:2"));
+
+  // a short buffer is not overrun
+  h.format(buf, 20);
+  tt_int_op(strlen(buf), ==, 19);
+
+  h.clear();
+  tt_uint_op(h.count, ==, 0);
+  tt_uint_op(h.buckets[0], ==, 0);
+
+ end:;
+}
+
+namespace {
+  struct pace_conn : bench_conn
+  {
+    pacer *p;
+    pace_slot slot;
+    uint64_t want;        // when it should have been called, or 0
+    long fired_late;      // how late it was, in milliseconds
+    int nfired;
+    int again;            // how many more times to reschedule
+    unsigned long gap;
+
+    pace_conn() : p(0), want(0), fired_late(0), nfired(0), again(0), gap(0)
+    { slot.conn = this; }
+
+    void start(struct event_base *base, pacer *pc, unsigned long delay)
+    {
+      attach(base);
+      p = pc;
+      want = pacer::now() + delay;
+      p->schedule(&slot, want);
+    }
+
+    void transmit_now()
+    {
+      fired_late = (long)(int64_t)(pacer::now() - want);
+      nfired++;
+      p->sent(want);
+      if (again > 0) {
+        again--;
+        // successive deadlines count from when the last was due, so
+        // lateness does not accumulate
+        want += gap;
+        p->schedule(&slot, want);
+      }
+    }
+  };
+}
+
+static void
+test_pacing_schedule(void *)
+{
+  const int N = 50;
+  struct event_base *base = event_base_new();
+  struct timeval stop = { 0, 600000 };
+  pacer *p = 0;
+  pace_conn *conns = 0;
+  int i;
+
+  tt_int_op(event_base_priority_init(base, 2), ==, 0);
+  conn_global_init(base);
+  p = new pacer;
+  conns = new pace_conn[N];
+
+  // Deadlines over the next 300 ms, several at a time.
+  for (i = 0; i < N; i++)
+    conns[i].start(base, p, (i % 10) * 30);
+
+  // Rescheduling replaces the old deadline; cancelling removes it.
+  conns[1].want = pacer::now() + 45;
+  p->schedule(&conns[1].slot, conns[1].want);
+  p->cancel(&conns[2].slot);
+  tt_assert(!conns[2].slot.pending());
+  tt_assert(conns[3].slot.pending());
+
+  // A connection may schedule its next packet when it sends.
+  conns[4].again = 5;
+  conns[4].gap = 20;
+
+  event_base_loopexit(base, &stop);
+  event_base_dispatch(base);
+
+  for (i = 0; i < N; i++) {
+    tt_int_op(conns[i].nfired, ==, i == 2 ? 0 : i == 4 ? 6 : 1);
+    tt_assert(!conns[i].slot.pending());
+    if (i == 2)
+      continue;
+    tt_int_op(conns[i].fired_late, >=, -PACE_BATCH_MS);
+    tt_int_op(conns[i].fired_late, <=, 50);
+  }
+
+  // All of the connections due at the same time were sent together.
+  tt_uint_op(p->fired, ==, N - 1 + 5);
+  tt_uint_op(p->wakeups, <, p->fired / 2);
+  tt_uint_op(p->errors.count, ==, p->fired);
+
+ end:
+  delete[] conns;
+  delete p;
+  conn_start_shutdown(0);
+  event_base_dispatch(base);
+  event_base_free(base);
+}
+
+#define T(name) \
+  { #name, test_pacing_##name, 0, 0, 0 }
+
+struct testcase_t pacing_tests[] = {
+  T(histogram),
+  T(schedule),
+  END_OF_TESTCASES
+};
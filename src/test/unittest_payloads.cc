@@ -0,0 +1,105 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../steg/payloads.h"
+
+static void
+test_payloads_uri_type(void *)
+{
+  static const struct { const char *line; int type; } cases[] = {
+    { "GET /a/b/c.swf HTTP/1.1", HTTP_CONTENT_SWF },
+    { "GET /x.SWF?y=1 HTTP/1.1", HTTP_CONTENT_SWF },
+    { "GET /a.b/c.pdf HTTP/1.1", HTTP_CONTENT_PDF },
+    { "GET /lib/jquery.js HTTP/1.1", HTTP_CONTENT_JAVASCRIPT },
+    { "GET /index.jsp HTTP/1.1", HTTP_CONTENT_HTML },
+    { "GET /index.html HTTP/1.1", HTTP_CONTENT_HTML },
+    { "GET /dir/ HTTP/1.1", HTTP_CONTENT_HTML },
+    { "POST /form HTTP/1.1", HTTP_CONTENT_HTML },
+    { "GET /a/b.png HTTP/1.1", -1 },
+    { "GET a.swf HTTP/1.1", -1 },
+    { "GET /a.swf", -1 },
+    { "PUT /a.swf HTTP/1.1", -1 },
+  };
+
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+    tt_int_op(find_uri_type(cases[i].line, strlen(cases[i].line)), ==,
+              cases[i].type);
+  }
+
+  // only the request line is looked at
+  tt_int_op(find_uri_type("GET /a.swf HTTP/1.1", 8), ==, -1);
+
+ end:;
+}
+
+static void
+test_payloads_client_pool(void *)
+{
+  static const char *const reqs[] = {
+    "GET /a/movie.swf HTTP/1.1\r\nHost: x\r\nAccept: */*\r\n"
+    "Cookie: c=d\r\nConnection: keep-alive\r\n\r\n",
+    "GET /a/doc.pdf HTTP/1.1\r\nHost: x\r\n\r\n",
+    "GET /a/pic.png HTTP/1.1\r\nHost: x\r\n\r\n",
+    "GET /a/movie2.swf HTTP/1.1\r\nReferer: y\r\n\r\n",
+    "GET /a/broken.swf HTTP/1.1\r\nHost: x\r\n",
+  };
+  const int nreqs = sizeof reqs / sizeof reqs[0];
+  payloads *pl = new payloads;
+  const request_template *t;
+  int i;
+
+  for (i = 0; i < nreqs; i++) {
+    pl->payloads[i] = xstrdup(reqs[i]);
+    pl->payload_hdrs[i].ptype = TYPE_HTTP_REQUEST;
+    pl->payload_hdrs[i].length = strlen(reqs[i]);
+  }
+  pl->payload_count = nreqs;
+
+  tt_int_op(init_client_payload_pool(*pl, HTTP_MSG_BUF_SIZE,
+                                     TYPE_HTTP_REQUEST), ==, 3);
+  tt_int_op(pl->reqTypeCount[HTTP_CONTENT_SWF], ==, 2);
+  tt_int_op(pl->reqTypeCount[HTTP_CONTENT_PDF], ==, 1);
+  tt_int_op(pl->reqTypeCount[HTTP_CONTENT_HTML], ==, 0);
+
+  tt_assert(!find_client_payload(*pl, HTTP_CONTENT_HTML));
+
+  t = find_client_payload(*pl, HTTP_CONTENT_PDF);
+  tt_assert(t);
+  tt_int_op(t->uri_type, ==, HTTP_CONTENT_PDF);
+  tt_int_op(t->line_len, ==, (int)strlen("GET /a/doc.pdf HTTP/1.1"));
+  tt_int_op(t->hdr_len, ==, t->line_len + 2);
+
+  for (i = 0; i < 20; i++) {
+    t = find_client_payload(*pl, HTTP_CONTENT_SWF);
+    tt_assert(t);
+    tt_int_op(t->uri_type, ==, HTTP_CONTENT_SWF);
+    tt_assert(!strstr(t->hdr, "Host:"));
+    tt_assert(!strstr(t->hdr, "Cookie:"));
+    tt_assert(!strstr(t->hdr, "Connection:"));
+    tt_assert(!strstr(t->hdr, "Referer:"));
+    tt_int_op((int)strlen(t->hdr), ==, t->hdr_len);
+    if (t->hdr_len > t->line_len + 2)
+      tt_str_op(t->hdr + t->line_len, ==, "\r\nAccept: */*\r\n");
+
+    t = find_client_payload(*pl, -1);
+    tt_assert(t);
+    tt_int_op(t->uri_type, !=, HTTP_CONTENT_HTML);
+  }
+
+ end:
+  for (i = 0; i < pl->payload_count; i++)
+    free(pl->payloads[i]);
+  delete pl;
+}
+
+#define T(name) \
+  { #name, test_payloads_##name, 0, 0, 0 }
+
+struct testcase_t payloads_tests[] = {
+  T(uri_type),
+  T(client_pool),
+  END_OF_TESTCASES
+};
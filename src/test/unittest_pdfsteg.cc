@@ -5,6 +5,8 @@
 #include "util.h"
 #include "unittest.h"
 #include "../steg/pdfSteg.h"
+#include "../steg/payloads.h"
+#include "../compression.h"
 
 static void
 test_pdf_add_remove_delimiters(void *)
@@ -71,11 +73,380 @@ test_pdf_wrap_unwrap(void *)
  end:;
 }
 
+/* A template with streams of assorted sizes, including some too small
+   to hold anything, and both kinds of end-of-line after "stream". */
+static size_t
+make_multistream_pdf(char *buf, size_t bufsize)
+{
+  static const int lengths[] = { 700, 0, 1, 3, 1500, 2, 40, 2200, 900, -1 };
+  size_t n;
+  int i;
+
+  n = xsnprintf(buf, bufsize, "%%PDF-1.5\n%%\xA0\xA1\xA2\xA3\n");
+  for (i = 0; lengths[i] >= 0; i++) {
+    n += xsnprintf(buf + n, bufsize - n,
+                   "%d 0 obj <</Length %d>>\nstream%s",
+                   i + 1, lengths[i], i % 2 ? "\r\n" : "\n");
+    log_assert(n + lengths[i] < bufsize);
+    memset(buf + n, 'x', lengths[i]);
+    n += lengths[i];
+    n += xsnprintf(buf + n, bufsize - n, "\nendstream\nendobj\n");
+  }
+  n += xsnprintf(buf + n, bufsize - n, "trailer\n<<>>\n%%%%EOF\n");
+  return n;
+}
+
+static void
+test_pdf_wrap_multistream(void *)
+{
+  char pdf[8192], out[16384], orig[8192], data[8192];
+  size_t plen, room, cap, i;
+  ssize_t rv;
+
+  plen = make_multistream_pdf(pdf, sizeof pdf);
+  room = pdf_stream_room(pdf, plen);
+  tt_int_op(room, >, 4000);
+  tt_int_op(room, <, 6000);
+
+  // the most incompressible data that fits, by the same reckoning
+  // capacityPDF uses
+  for (cap = room; compress_bound(cap, c_format_zlib) > room; cap--)
+    ;
+  for (i = 0; i < cap; i++)
+    data[i] = (char)rand();
+
+  // data that fits is spread across the streams without changing the
+  // size of the document or anything outside the streams
+  rv = pdf_wrap(data, cap, pdf, plen, out, sizeof out);
+  tt_int_op(rv, ==, plen);
+  tt_mem_op(out, ==, pdf, 40);
+  tt_mem_op(out + plen - 30, ==, pdf + plen - 30, 30);
+
+  rv = pdf_unwrap(out, plen, orig, sizeof orig);
+  tt_int_op(rv, ==, cap);
+  tt_mem_op(orig, ==, data, cap);
+
+  // a little data only touches the first stream
+  rv = pdf_wrap(data, 100, pdf, plen, out, sizeof out);
+  tt_int_op(rv, ==, plen);
+  rv = pdf_unwrap(out, plen, orig, sizeof orig);
+  tt_int_op(rv, ==, 100);
+  tt_mem_op(orig, ==, data, 100);
+
+  // data that doesn't fit overflows into the last stream
+  for (i = 0; i < sizeof data; i++)
+    data[i] = (char)rand();
+  rv = pdf_wrap(data, sizeof data, pdf, plen, out, sizeof out);
+  tt_int_op(rv, >, plen);
+  rv = pdf_unwrap(out, rv, orig, sizeof orig);
+  tt_int_op(rv, ==, sizeof data);
+  tt_mem_op(orig, ==, data, sizeof data);
+
+  // and the receiver says when it needs more room
+  rv = pdf_wrap(data, 1000, pdf, plen, out, sizeof out);
+  tt_int_op(rv, ==, plen);
+  rv = pdf_unwrap(out, plen, orig, 999);
+  tt_int_op(rv, ==, -2);
+
+  // but not when the document is cut short: more room would not help
+  rv = pdf_wrap(data, cap, pdf, plen, out, sizeof out);
+  tt_int_op(rv, ==, plen);
+  rv = pdf_unwrap(out, plen / 2, orig, sizeof orig);
+  tt_int_op(rv, ==, -1);
+
+ end:;
+}
+
+/* Reference implementations: the original byte-at-a-time versions of
+   the delimiter and search helpers, which the optimized versions must
+   agree with. */
+
+static ssize_t
+ref_add_delimiter(const char *inbuf, size_t inbuflen,
+                  char *outbuf, size_t outbuflen,
+                  const char delimiter1, const char delimiter2)
+{
+  size_t cnt;
+  const char *ibp;
+  char ic, rc;
+
+  cnt = 0;
+  ibp = inbuf;
+  while (size_t(ibp-inbuf) < inbuflen && cnt < outbuflen-2) {
+    ic = *ibp++;
+    if (ic != delimiter1) {
+      outbuf[cnt++] = ic;
+    } else {
+      outbuf[cnt++] = delimiter1;
+      outbuf[cnt++] = delimiter1;
+    }
+  }
+
+  if (cnt >= outbuflen-2)
+    return -1;
+
+  outbuf[cnt++] = delimiter1;
+  rc = (char) (rand() % 256);
+  if (rc != delimiter1) {
+    outbuf[cnt++] = rc;
+  } else {
+    outbuf[cnt++] = delimiter2;
+  }
+  return cnt;
+}
+
+static ssize_t
+ref_remove_delimiter(const char *inbuf, size_t inbuflen,
+                     char *outbuf, size_t outbuflen,
+                     char delimiter1, bool *endFlag, bool *escape)
+{
+  size_t cnt;
+  const char *ibp;
+  char ic1, ic2;
+
+  cnt = 0;
+  *endFlag = false;
+  ibp = inbuf;
+
+  if (*escape) {
+    ic1 = *ibp;
+    if (ic1 == delimiter1) {
+      outbuf[cnt++] = ic1; ibp++;
+    } else {
+      *endFlag = 1;
+      return 0;
+    }
+  }
+
+  *escape = false;
+  while (size_t(ibp-inbuf+1) < inbuflen && cnt < outbuflen) {
+    ic1 = *ibp++;
+    if (ic1 != delimiter1) {
+      outbuf[cnt++] = ic1;
+    } else {
+      ic2 = *ibp;
+      if (ic2 == delimiter1) {
+        outbuf[cnt++] = delimiter1; ibp++;
+      } else {
+        *endFlag = true;
+        return cnt;
+      }
+    }
+  }
+
+  if (size_t(ibp-inbuf) == inbuflen)
+    return cnt;
+
+  ic1 = *ibp;
+  if (ic1 != delimiter1) {
+    outbuf[cnt++] = ic1;
+  } else {
+    *escape = true;
+  }
+
+  return cnt;
+}
+
+static const char *
+ref_strInBinary(const char *pattern, unsigned int patternLen,
+                const char *blob, unsigned int blobLen)
+{
+  const char *cp = blob;
+
+  while (1) {
+    if (blob+blobLen-cp < (int) patternLen) break;
+    if (*cp == pattern[0] && memcmp(cp, pattern, patternLen) == 0)
+      return cp;
+    cp++;
+  }
+  return NULL;
+}
+
+static const char *
+ref_strInBinaryRewind(const char *pattern, unsigned int patternLen,
+                      const char *blob, unsigned int blobLen)
+{
+  const char *cp;
+
+  if (patternLen < 1 || blobLen < 1) return 0;
+  cp = blob + blobLen - 1;
+  while (cp >= blob) {
+    if (cp - (patternLen-1) < blob) break;
+    if (*cp == pattern[patternLen-1] &&
+        memcmp(cp-(patternLen-1), pattern, patternLen-1) == 0)
+      return cp-(patternLen-1);
+    cp--;
+  }
+  return NULL;
+}
+
+/* Fill BUF with LEN chars drawn mostly from ALPHABET, so that the
+   interesting chars turn up often; one in eight is an arbitrary byte. */
+static void
+fill_random(char *buf, size_t len, const char *alphabet)
+{
+  size_t alen = strlen(alphabet);
+  for (size_t i = 0; i < len; i++) {
+    if (rand() % 8 == 0)
+      buf[i] = (char)(rand() % 256);
+    else
+      buf[i] = alphabet[rand() % alen];
+  }
+}
+
+#define DIFF_ITERATIONS 2000
+#define DIFF_MAXLEN 300
+
+static void
+test_pdf_add_delimiter_differential(void *)
+{
+  char in[DIFF_MAXLEN];
+  char out1[2*DIFF_MAXLEN + 16];
+  char out2[2*DIFF_MAXLEN + 16];
+  int i;
+
+  srand(1);
+  for (i = 0; i < DIFF_ITERATIONS; i++) {
+    size_t inlen = rand() % DIFF_MAXLEN;
+    size_t outlen = 3 + rand() % (2*inlen + 8);
+    unsigned int seed = rand();
+    ssize_t r1, r2;
+
+    fill_random(in, inlen, "??.ab");
+
+    srand(seed);
+    r1 = ref_add_delimiter(in, inlen, out1, outlen, '?', '.');
+    srand(seed);
+    r2 = pdf_add_delimiter(in, inlen, out2, outlen, '?', '.');
+
+    tt_int_op(r2, ==, r1);
+    if (r1 > 0)
+      tt_mem_op(out2, ==, out1, r1);
+  }
+
+ end:;
+}
+
+static void
+test_pdf_remove_delimiter_differential(void *)
+{
+  char in[DIFF_MAXLEN];
+  char out1[DIFF_MAXLEN + 1];
+  char out2[DIFF_MAXLEN + 1];
+  int i;
+
+  srand(2);
+  for (i = 0; i < DIFF_ITERATIONS; i++) {
+    size_t inlen = 1 + rand() % (DIFF_MAXLEN - 1);
+    bool escape1 = rand() % 4 == 0, escape2 = escape1;
+    bool end1, end2;
+    ssize_t r1, r2;
+
+    fill_random(in, inlen, "??.ab");
+
+    // the output can never be longer than the input
+    r1 = ref_remove_delimiter(in, inlen, out1, inlen, '?', &end1, &escape1);
+    r2 = pdf_remove_delimiter(in, inlen, out2, inlen, '?', &end2, &escape2);
+
+    tt_int_op(r2, ==, r1);
+    tt_bool_op(end2, ==, end1);
+    tt_bool_op(escape2, ==, escape1);
+    if (r1 > 0)
+      tt_mem_op(out2, ==, out1, r1);
+  }
+
+ end:;
+}
+
+static void
+test_pdf_delimiter_split_roundtrip(void *)
+{
+  char in[DIFF_MAXLEN];
+  char enc[2*DIFF_MAXLEN + 16];
+  char dec[2*DIFF_MAXLEN + 16];
+  int i;
+
+  srand(3);
+  for (i = 0; i < DIFF_ITERATIONS; i++) {
+    size_t inlen = rand() % DIFF_MAXLEN;
+    ssize_t elen, d1, d2;
+    size_t split;
+    bool end = false, escape = false;
+
+    fill_random(in, inlen, "???ab");
+    elen = pdf_add_delimiter(in, inlen, enc, sizeof enc, '?', '.');
+    tt_int_op(elen, >=, 2);
+
+    // decode in two pieces, as when the data spans two stream objects
+    split = 1 + rand() % (elen - 1);
+    d1 = pdf_remove_delimiter(enc, split, dec, sizeof dec, '?',
+                              &end, &escape);
+    tt_int_op(d1, >=, 0);
+    if (end) {
+      tt_int_op(d1, ==, inlen);
+    } else {
+      d2 = pdf_remove_delimiter(enc + split, elen - split, dec + d1,
+                                sizeof dec - d1, '?', &end, &escape);
+      tt_int_op(d2, >=, 0);
+      tt_bool_op(end, ==, true);
+      tt_int_op(d1 + d2, ==, inlen);
+    }
+    tt_mem_op(dec, ==, in, inlen);
+  }
+
+ end:;
+}
+
+static void
+test_pdf_search_differential(void *)
+{
+  const char *const patterns[] = {
+    "stream", "endstream", " obj", "s", "ss", "m\n"
+  };
+  const size_t npatterns = sizeof patterns / sizeof patterns[0];
+  char blob[DIFF_MAXLEN];
+  char pat[4];
+  size_t j;
+  int i;
+
+  srand(4);
+  for (i = 0; i < DIFF_ITERATIONS; i++) {
+    unsigned int blen = rand() % DIFF_MAXLEN;
+    fill_random(blob, blen, "streamd obj\n");
+
+    // each fixed pattern, then one random short pattern
+    for (j = 0; j <= npatterns; j++) {
+      const char *p;
+      unsigned int plen;
+      if (j < npatterns) {
+        p = patterns[j];
+        plen = strlen(p);
+      } else {
+        plen = 1 + rand() % sizeof pat;
+        fill_random(pat, plen, "stream");
+        p = pat;
+      }
+
+      tt_ptr_op(strInBinary(p, plen, blob, blen), ==,
+                ref_strInBinary(p, plen, blob, blen));
+      tt_ptr_op(strInBinaryRewind(p, plen, blob, blen), ==,
+                ref_strInBinaryRewind(p, plen, blob, blen));
+    }
+  }
+
+ end:;
+}
+
 #define T(name) \
   { #name, test_pdf_##name, 0, 0, 0 }
 
 struct testcase_t pdf_tests[] = {
   T(add_remove_delimiters),
+  T(add_delimiter_differential),
+  T(remove_delimiter_differential),
+  T(delimiter_split_roundtrip),
+  T(search_differential),
   T(wrap_unwrap),
+  T(wrap_multistream),
   END_OF_TESTCASES
 };
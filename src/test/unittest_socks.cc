@@ -562,6 +562,8 @@ test_socks_socks4_request_reply(void *data)
   tt_mem_op(rep1+2, ==, "\x1c\xbd",2);
   /* check address */
   tt_mem_op(rep1+2+2, ==, "\x7f\x00\x00\x01", 4);
+  /* the SOCKS phase is over, as for socks5 */
+  tt_int_op(socks_state_get_status(s->state), ==, ST_SENT_REPLY);
 
   /* emptying dest buffer before next test  */
   buffer_len = evbuffer_get_length(s->dest);
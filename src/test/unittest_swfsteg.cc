@@ -0,0 +1,120 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "../steg/payloads.h"
+#include "../steg/swfSteg.h"
+#include "../steg/http_resp.h"
+
+#include <event2/buffer.h>
+
+/* Make an HTTP response carrying an SWF "file" of SWFLEN bytes, with
+   an 8-byte header and contents that are either incompressible or
+   very compressible. */
+static char *
+make_swf_template(size_t swflen, bool compressible, int *len)
+{
+  static const char hdr[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/x-shockwave-flash\r\n"
+    "Content-Length: %lu\r\n"
+    "\r\n";
+  char *buf = (char *)xmalloc(sizeof hdr + 24 + swflen);
+  size_t n = xsnprintf(buf, sizeof hdr + 24, hdr, (unsigned long)swflen);
+
+  memcpy(buf + n, "CWS\t", 4);
+  memset(buf + n + 4, 0, 4);
+  for (size_t i = 8; i < swflen; i++)
+    buf[n + i] = compressible ? (char)(i / 1024) : (char)rand();
+  buf[n + swflen] = '\0';
+  *len = n + swflen;
+  return buf;
+}
+
+static void
+test_swf_capacity_and_roundtrip(void *)
+{
+  static const struct { size_t swflen; bool compressible; } templates[] = {
+    { 20000, false },
+    { 20000, true },
+    { 150000, true },
+  };
+  const size_t ntemplates = sizeof templates / sizeof templates[0];
+
+  payloads *pl = new payloads;
+  struct evbuffer *source = evbuffer_new();
+  struct evbuffer *dest = evbuffer_new();
+  http_scratch scratch;
+  char *data = 0, *out = 0;
+  size_t i, cap;
+
+  for (i = 0; i < ntemplates; i++) {
+    pl->payloads[i] = make_swf_template(templates[i].swflen,
+                                        templates[i].compressible,
+                                        &pl->payload_hdrs[i].length);
+    pl->payload_hdrs[i].ptype = TYPE_HTTP_RESPONSE;
+  }
+  pl->payload_count = ntemplates;
+
+  tt_int_op(init_SWF_payload_pool(*pl, HTTP_TEMPLATE_MAX_SIZE,
+                                  TYPE_HTTP_RESPONSE, SWF_MIN_AVAIL_SIZE),
+            ==, 1);
+  tt_int_op(pl->typePayloadCount[HTTP_CONTENT_SWF], ==, ntemplates);
+
+  // The incompressible template has to spend about 3000 bytes on the
+  // parts of itself that it keeps; the compressible ones, not much.
+  tt_int_op(pl->typePayloadCap[HTTP_CONTENT_SWF][0], >, 20000 - 3200);
+  tt_int_op(pl->typePayloadCap[HTTP_CONTENT_SWF][0], <, 20000 - 3000);
+  tt_int_op(pl->typePayloadCap[HTTP_CONTENT_SWF][1], >, 20000 - 400);
+  tt_int_op(pl->typePayloadCap[HTTP_CONTENT_SWF][2], >, 150000 - 400);
+  tt_int_op(pl->max_SWF_capacity, ==,
+            pl->typePayloadCap[HTTP_CONTENT_SWF][2]);
+
+  // Filling a template to just under its capacity with incompressible
+  // data makes a response no bigger than the template.
+  cap = pl->max_SWF_capacity - 1;
+  data = (char *)xmalloc(cap);
+  out = (char *)xmalloc(cap);
+  for (i = 0; i < cap; i++)
+    data[i] = (char)rand();
+
+  evbuffer_add(source, data, cap);
+  tt_int_op(swf_wrap(*pl, source, cap, dest, true, scratch), >, 0);
+
+  {
+    size_t rlen = evbuffer_get_length(dest);
+    char *resp = (char *)evbuffer_pullup(dest, rlen);
+    char *body = strstr(resp, "\r\n\r\n") + 4;
+    int blen = rlen - (body - resp);
+
+    tt_int_op(blen, <=, (int)templates[2].swflen);
+    tt_int_op(blen, >, (int)templates[2].swflen - 1000);
+    tt_int_op(find_content_length(resp, body - resp), ==, blen);
+
+    // too small an output buffer is reported as such
+    tt_int_op(swf_unwrap(body, blen, out, cap - 1), ==, -2);
+    // but a response cut short is an error, however much room there is
+    tt_int_op(swf_unwrap(body, blen / 2, out, cap), ==, -1);
+    tt_int_op(swf_unwrap(body, blen, out, cap), ==, (int)cap);
+    tt_mem_op(out, ==, data, cap);
+  }
+
+ end:
+  free(data);
+  free(out);
+  evbuffer_free(source);
+  evbuffer_free(dest);
+  for (i = 0; i < (size_t)pl->payload_count; i++)
+    free(pl->payloads[i]);
+  delete pl;
+}
+
+#define T(name) \
+  { #name, test_swf_##name, 0, 0, 0 }
+
+struct testcase_t swf_tests[] = {
+  T(capacity_and_roundtrip),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,174 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "connections.h"
+
+#include <event2/event.h>
+
+/* The wheel is driven from a clock the test moves by hand, so that
+   the results do not depend on how busy the machine is. */
+static uint64_t fake_ms;
+
+static uint64_t
+fake_clock(void)
+{
+  return fake_ms;
+}
+
+/* Move the clock forward to MS, a millisecond at a time, running
+   timers as the event loop would. */
+static void
+advance_to(uint64_t ms)
+{
+  while (fake_ms < ms) {
+    fake_ms++;
+    conn_run_timers();
+  }
+}
+
+namespace {
+  struct timer_probe
+  {
+    conn_timer timer;
+    uint64_t armed;
+    unsigned long delay;
+    long fired_after;     // milliseconds, or -1 if not fired
+    int nfired;
+    timer_probe *rearm;   // another timer to re-arm from the callback
+  };
+}
+
+static void
+probe_cb(void *arg)
+{
+  timer_probe *p = (timer_probe *)arg;
+  p->fired_after = (long)(fake_ms - p->armed);
+  p->nfired++;
+  if (p->rearm) {
+    p->rearm->armed = fake_ms;
+    p->rearm->timer.arm(p->rearm->delay);
+    p->rearm = 0;
+  }
+}
+
+static void
+arm_probe(timer_probe *p, unsigned long delay)
+{
+  p->delay = delay;
+  p->fired_after = -1;
+  p->nfired = 0;
+  p->rearm = 0;
+  p->timer.set(probe_cb, p);
+  p->armed = fake_ms;
+  p->timer.arm(delay);
+}
+
+static void
+test_timers_wheel(void *)
+{
+  const int N = 200;
+  struct event_base *base = event_base_new();
+  timer_probe *probes = new timer_probe[N];
+  int i;
+
+  tt_int_op(event_base_priority_init(base, 2), ==, 0);
+  conn_global_init(base);
+  fake_ms = 1000003;
+  conn_set_clock(fake_clock);
+  tt_uint_op(conn_clock_ms(), ==, 1000003);
+
+  // Deadlines spread over the first two levels of the wheel, some of
+  // them due at once.
+  for (i = 0; i < N; i++)
+    arm_probe(&probes[i], i % 10 == 0 ? 0 : rand() % 1200);
+
+  // A callback may arm another timer.
+  arm_probe(&probes[5], 200);
+  probes[5].rearm = &probes[6];
+  probes[6].timer.disarm();
+  probes[6].delay = 300;
+
+  // Re-arming replaces the old deadline; disarming cancels it.
+  arm_probe(&probes[1], 1000);
+  arm_probe(&probes[2], 5);
+  advance_to(fake_ms + 3);
+  probes[2].timer.arm(700);
+  probes[2].armed = fake_ms;
+  probes[2].delay = 700;
+  probes[3].timer.disarm();
+  tt_assert(!probes[3].timer.pending());
+  tt_assert(probes[4].timer.pending());
+
+  advance_to(fake_ms + 1500);
+
+  // Every timer fires no earlier than asked, and at most two ticks
+  // later.
+  for (i = 0; i < N; i++) {
+    if (i == 3) {
+      tt_int_op(probes[i].nfired, ==, 0);
+      continue;
+    }
+    tt_int_op(probes[i].nfired, ==, 1);
+    tt_assert(!probes[i].timer.pending());
+    tt_int_op(probes[i].fired_after, >=, (long)probes[i].delay);
+    tt_int_op(probes[i].fired_after, <=,
+              (long)probes[i].delay + 2 * CONN_TIMER_TICK_MS);
+  }
+
+ end:
+  for (i = 0; i < N; i++)
+    probes[i].timer.disarm();
+  conn_set_clock(NULL);
+  delete[] probes;
+  conn_start_shutdown(0);
+  event_base_dispatch(base);
+  event_base_free(base);
+}
+
+static void
+test_timers_jump(void *)
+{
+  struct event_base *base = event_base_new();
+  timer_probe near, far;
+
+  tt_int_op(event_base_priority_init(base, 2), ==, 0);
+  conn_global_init(base);
+  fake_ms = 5000;
+  conn_set_clock(fake_clock);
+
+  // When the clock moves a long way at once, everything that has come
+  // due fires, and nothing else.
+  arm_probe(&near, 100);
+  arm_probe(&far, 60000);
+  fake_ms += 30000;
+  conn_run_timers();
+  tt_int_op(near.nfired, ==, 1);
+  tt_int_op(far.nfired, ==, 0);
+  tt_assert(far.timer.pending());
+
+  fake_ms += 30000;
+  conn_run_timers();
+  tt_int_op(far.nfired, ==, 0);
+  advance_to(fake_ms + 2 * CONN_TIMER_TICK_MS);
+  tt_int_op(far.nfired, ==, 1);
+
+ end:
+  near.timer.disarm();
+  far.timer.disarm();
+  conn_set_clock(NULL);
+  conn_start_shutdown(0);
+  event_base_dispatch(base);
+  event_base_free(base);
+}
+
+#define T(name) \
+  { #name, test_timers_##name, 0, 0, 0 }
+
+struct testcase_t timers_tests[] = {
+  T(wheel),
+  T(jump),
+  END_OF_TESTCASES
+};